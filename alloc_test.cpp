@@ -0,0 +1,119 @@
+//
+// Created by ayanami on 12/24/24.
+//
+
+#include "alloc_test.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+using std::vector;
+using std::string;
+using fmt::format;
+
+// 整个测试程序的operator new都会经过这里, 只计数, 不改变分配行为
+namespace {
+std::atomic<size_t> allocations{0};
+}
+
+void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if(auto p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size) {
+    return ::operator new(size);
+}
+void operator delete(void* p) noexcept {
+    std::free(p);
+}
+void operator delete[](void* p) noexcept {
+    std::free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+    std::free(p);
+}
+void operator delete[](void* p, size_t) noexcept {
+    std::free(p);
+}
+
+namespace {
+// 循环体: 变量都已经存在之后, LET/IF/GOTO只在std::any的内部缓冲里读写int
+const vector<string> numeric_loop = {
+    "10 LET I = 0",
+    "20 LET SUM = 0",
+    "30 LET SUM = SUM + 2 ** (I MOD 10) - 1",
+    "40 LET I = I + 1",
+    "50 IF I < 100000 THEN 30",
+    "60 END",
+};
+constexpr int loop_line = 40;
+constexpr int rounds = 200;
+
+std::shared_ptr<Interpreter> newInterpreter() {
+    auto tokenizer = std::make_shared<Token::Tokenizer>();
+    auto parser = std::make_shared<Parser>(tokenizer);
+    auto env = std::make_shared<Env>(std::make_shared<SymbolTable>());
+    auto interpreter = std::make_shared<Interpreter>(parser, env, ProgramMode::NORMAL);
+    interpreter->reload(numeric_loop);
+    interpreter->setASTOutput(false);
+    interpreter->addBreakpoint(loop_line);
+    return interpreter;
+}
+
+// 每次interpret()在断点处停下, 正好执行一轮循环: 50 IF, 30 LET, 40 LET
+size_t allocationsPerRounds(Interpreter& interpreter) {
+    // 预热: 第一轮插入变量, 第二轮走一遍IF的跳转
+    interpreter.interpret();
+    interpreter.interpret();
+    const auto before = allocations.load();
+    for(int i = 0; i < rounds; ++i) {
+        interpreter.interpret();
+    }
+    return allocations.load() - before;
+}
+}
+
+void alloc_test::initTestCase() {
+}
+
+void alloc_test::testCounter() {
+    const auto before = allocations.load();
+    auto p = std::make_unique<string>(64, 'x');
+    QVERIFY2(allocations.load() > before, "operator new is not replaced");
+}
+
+void alloc_test::testTreeWalkerNoAlloc() {
+    auto interpreter = newInterpreter();
+    QVERIFY(interpreter->getEngine() == EngineKind::TreeWalker);
+    const auto allocs = allocationsPerRounds(*interpreter);
+    QVERIFY2(allocs == 0, format("tree walker allocated {} times in {} rounds", allocs, rounds).c_str());
+    const auto statements = interpreter->getCounters().statements;
+    QVERIFY(statements == 4 + 3 * (rounds + 1));
+    QVERIFY(interpreter->getEnv()->symbol_table->get<int>("I") == rounds + 2);
+}
+
+void alloc_test::testFlatNoAlloc() {
+    auto interpreter = newInterpreter();
+    interpreter->setEngine(EngineKind::Flat);
+    QVERIFY(interpreter->getEngine() == EngineKind::Flat);
+    const auto allocs = allocationsPerRounds(*interpreter);
+    QVERIFY2(allocs == 0, format("flat engine allocated {} times in {} rounds", allocs, rounds).c_str());
+    QVERIFY(interpreter->getEnv()->symbol_table->get<int>("I") == rounds + 2);
+}
+
+void alloc_test::testClosureNoAlloc() {
+    auto interpreter = newInterpreter();
+    interpreter->setEngine(EngineKind::Closure);
+    QVERIFY(interpreter->getEngine() == EngineKind::Closure);
+    const auto allocs = allocationsPerRounds(*interpreter);
+    QVERIFY2(allocs == 0, format("closure engine allocated {} times in {} rounds", allocs, rounds).c_str());
+    QVERIFY(interpreter->getEnv()->symbol_table->get<int>("I") == rounds + 2);
+}
+
+void alloc_test::cleanupTestCase() {
+}
@@ -0,0 +1,26 @@
+//
+// Created by ayanami on 12/24/24.
+//
+#pragma once
+#ifndef ALLOC_TEST_H
+#define ALLOC_TEST_H
+
+#include <QTest>
+#include <QObject>
+
+// 替换了全局operator new来计数, 检查数值语句在预热之后不分配内存
+class alloc_test: public QObject{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void testCounter();
+    void testTreeWalkerNoAlloc();
+    void testFlatNoAlloc();
+    void testClosureNoAlloc();
+    void cleanupTestCase();
+};
+
+
+
+#endif //ALLOC_TEST_H
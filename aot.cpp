@@ -0,0 +1,635 @@
+//
+// Created by ayanami on 12/28/24.
+//
+
+#include "aot.h"
+#include <set>
+#include <sstream>
+#include <fmt/format.h>
+
+namespace aot {
+using Token::TokenType;
+
+namespace {
+
+// 生成的源文件自带的运行时, 语义对照interpreter.h中的tryBinOp/evalBinOp/evalCond/inputVar
+const char* const RUNTIME = R"CPP(#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <typeinfo>
+
+namespace {
+
+struct BasicError {
+    std::string message;
+};
+[[noreturn]] void fail(std::string message) {
+    throw BasicError{std::move(message)};
+}
+int undefinedVar(const char* name) {
+    fail(std::string("var ") + name + " not found");
+}
+
+enum class Kind { None, Int, Double, String };
+struct Value {
+    Kind kind = Kind::None;
+    int i = 0;
+    double d = 0;
+    std::string s;
+};
+Value intValue(int i) {
+    Value v;
+    v.kind = Kind::Int;
+    v.i = i;
+    return v;
+}
+Value doubleValue(double d) {
+    Value v;
+    v.kind = Kind::Double;
+    v.d = d;
+    return v;
+}
+Value stringValue(std::string s) {
+    Value v;
+    v.kind = Kind::String;
+    v.s = std::move(s);
+    return v;
+}
+const Value& load(const Value& v, const char* name) {
+    if(v.kind == Kind::None) {
+        undefinedVar(name);
+    }
+    return v;
+}
+const char* typeName(Kind kind) {
+    switch(kind) {
+    case Kind::Int:
+        return typeid(int).name();
+    case Kind::Double:
+        return typeid(double).name();
+    default:
+        return typeid(std::string).name();
+    }
+}
+
+// 和fmt::format("{}", double)一致: 最短表示, 指数在[-4, 16)之间时不用科学计数法
+std::string formatDouble(double v) {
+    char buf[64];
+    auto res = std::to_chars(buf, buf + sizeof(buf), v, std::chars_format::scientific);
+    std::string sci(buf, res.ptr);
+    auto e = sci.find('e');
+    if(e == std::string::npos) {
+        return sci; // inf, nan
+    }
+    std::string sign;
+    std::string mantissa = sci.substr(0, e);
+    if(mantissa[0] == '-') {
+        sign = "-";
+        mantissa.erase(0, 1);
+    }
+    std::string digits;
+    for(const char c: mantissa) {
+        if(c != '.') {
+            digits += c;
+        }
+    }
+    const int exp = std::stoi(sci.substr(e + 1));
+    if(exp >= -4 && exp < 16) {
+        if(exp < 0) {
+            return sign + "0." + std::string(-exp - 1, '0') + digits;
+        }
+        if(digits.size() <= static_cast<size_t>(exp) + 1) {
+            return sign + digits + std::string(exp + 1 - digits.size(), '0');
+        }
+        return sign + digits.substr(0, exp + 1) + "." + digits.substr(exp + 1);
+    }
+    std::string out = sign + digits.substr(0, 1);
+    if(digits.size() > 1) {
+        out += "." + digits.substr(1);
+    }
+    const int abs_exp = exp < 0 ? -exp : exp;
+    out += exp < 0 ? "e-" : "e+";
+    if(abs_exp < 10) {
+        out += "0";
+    }
+    return out + std::to_string(abs_exp);
+}
+
+// 整数运算按补码回绕, 和解释器在x86-64上的结果一致
+int iadd(int a, int b) {
+    return static_cast<int>(static_cast<unsigned>(a) + static_cast<unsigned>(b));
+}
+int isub(int a, int b) {
+    return static_cast<int>(static_cast<unsigned>(a) - static_cast<unsigned>(b));
+}
+int imul(int a, int b) {
+    return static_cast<int>(static_cast<unsigned>(a) * static_cast<unsigned>(b));
+}
+int ineg(int a) {
+    return static_cast<int>(0u - static_cast<unsigned>(a));
+}
+int idiv(int a, int b) {
+    if(b == 0) {
+        fail("Division by zero");
+    }
+    return a / b;
+}
+// BASIC: 结果的符号和除数相同
+int imod(int a, int b) {
+    if(b == 0) {
+        fail("MOD by zero");
+    }
+    const int bias = std::abs(b);
+    int m = a % b;
+    if(m > 0 && b < 0) {
+        m -= bias;
+    } else if(m < 0 && b > 0) {
+        m += bias;
+    }
+    return m;
+}
+int ipow(int a, int b) {
+    return static_cast<int>(std::pow(a, b));
+}
+
+enum class Op { Add, Sub, Mul, Div, Mod, Pow, Gt, Lt, Ge, Le, Eq, Ne };
+double dop(Op op, const char* name, double l, double r) {
+    switch(op) {
+    case Op::Add: return l + r;
+    case Op::Sub: return l - r;
+    case Op::Mul: return l * r;
+    case Op::Div:
+        if(r == 0) {
+            fail("Division by zero");
+        }
+        return l / r;
+    case Op::Pow: return std::pow(l, r);
+    case Op::Gt: return l > r ? 1 : 0;
+    case Op::Lt: return l < r ? 1 : 0;
+    case Op::Ge: return l >= r ? 1 : 0;
+    case Op::Le: return l <= r ? 1 : 0;
+    case Op::Eq: return l == r ? 1 : 0;
+    case Op::Ne: return l != r ? 1 : 0;
+    default:
+        fail(std::string("Invalid binary operator ") + name);
+    }
+}
+int iop(Op op, int l, int r) {
+    switch(op) {
+    case Op::Add: return iadd(l, r);
+    case Op::Sub: return isub(l, r);
+    case Op::Mul: return imul(l, r);
+    case Op::Div: return idiv(l, r);
+    case Op::Mod: return imod(l, r);
+    case Op::Pow: return ipow(l, r);
+    case Op::Gt: return l > r ? 1 : 0;
+    case Op::Lt: return l < r ? 1 : 0;
+    case Op::Ge: return l >= r ? 1 : 0;
+    case Op::Le: return l <= r ? 1 : 0;
+    case Op::Eq: return l == r ? 1 : 0;
+    default: return l != r ? 1 : 0;
+    }
+}
+Value binOp(Op op, const char* name, const Value& l, const Value& r) {
+    if(l.kind != r.kind) {
+        fail(std::string("BinOpNode: type unmatched: ") + typeName(l.kind) + " and " + typeName(r.kind));
+    }
+    switch(l.kind) {
+    case Kind::Int:
+        return intValue(iop(op, l.i, r.i));
+    case Kind::Double:
+        return doubleValue(dop(op, name, l.d, r.d));
+    default:
+        fail(std::string("evalWithAny: Unsupport type ") + typeid(std::string).name());
+    }
+}
+Value unaryOp(bool neg, const char* name, const Value& v) {
+    switch(v.kind) {
+    case Kind::Int:
+        return intValue(neg ? ineg(v.i) : v.i);
+    case Kind::Double:
+        return doubleValue(neg ? -v.d : v.d);
+    default:
+        fail(std::string("UnaryOpNode: Invalid unary operator ") + name);
+    }
+}
+bool truthy(const Value& v) {
+    switch(v.kind) {
+    case Kind::Int:
+        return v.i != 0;
+    case Kind::Double:
+        fail("bad any_cast");
+    default:
+        return !v.s.empty();
+    }
+}
+
+void print(int i) {
+    std::cout << i;
+}
+void print(const Value& v) {
+    switch(v.kind) {
+    case Kind::Int:
+        std::cout << v.i;
+        return;
+    case Kind::Double:
+        std::cout << formatDouble(v.d);
+        return;
+    default:
+        std::cout << v.s;
+    }
+}
+// 和tryStr2Number一致: 先按int解析, 再按double, 都不是完整的数字时是字符串
+Value input() {
+    std::string in = "undefined";
+    std::cin >> in;
+    const char* begin = in.c_str();
+    char* end = nullptr;
+    errno = 0;
+    const long l = std::strtol(begin, &end, 10);
+    if(end != begin) {
+        if(errno == ERANGE || l < INT_MIN || l > INT_MAX) {
+            return stringValue(in);
+        }
+        if(end == begin + in.size()) {
+            return intValue(static_cast<int>(l));
+        }
+    }
+    errno = 0;
+    const double d = std::strtod(begin, &end);
+    if(end == begin || errno == ERANGE || end != begin + in.size()) {
+        return stringValue(in);
+    }
+    return doubleValue(d);
+}
+
+void dump(const char* name, bool defined, int v) {
+    if(defined) {
+        std::fprintf(stderr, "key: %s, value: %d\n", name, v);
+    }
+}
+void dump(const char* name, const Value& v) {
+    switch(v.kind) {
+    case Kind::None:
+        return;
+    case Kind::Int:
+        std::fprintf(stderr, "key: %s, value: %d\n", name, v.i);
+        return;
+    case Kind::Double:
+        std::fprintf(stderr, "key: %s, value: %s\n", name, formatDouble(v.d).c_str());
+        return;
+    default:
+        std::fprintf(stderr, "key: %s, value: %s\n", name, v.s.c_str());
+    }
+}
+
+} // namespace
+)CPP";
+
+const char* opName(TokenType op) {
+    switch(op) {
+    case TokenType::OP_ADD: return "Op::Add";
+    case TokenType::OP_SUB: return "Op::Sub";
+    case TokenType::OP_MUL: return "Op::Mul";
+    case TokenType::OP_DIV: return "Op::Div";
+    case TokenType::OP_MOD: return "Op::Mod";
+    case TokenType::OP_POW: return "Op::Pow";
+    case TokenType::OP_GT: return "Op::Gt";
+    case TokenType::OP_LT: return "Op::Lt";
+    case TokenType::OP_GE: return "Op::Ge";
+    case TokenType::OP_LE: return "Op::Le";
+    case TokenType::OP_EQ: return "Op::Eq";
+    case TokenType::OP_NE: return "Op::Ne";
+    default:
+        throw std::runtime_error(fmt::format("transpile: unsupported operator {}", Token::tk2Str(op)));
+    }
+}
+
+// int运算直接写成表达式, 需要检查的(除零)调用运行时
+string intOp(TokenType op, const string& l, const string& r) {
+    switch(op) {
+    case TokenType::OP_ADD: return fmt::format("iadd({}, {})", l, r);
+    case TokenType::OP_SUB: return fmt::format("isub({}, {})", l, r);
+    case TokenType::OP_MUL: return fmt::format("imul({}, {})", l, r);
+    case TokenType::OP_DIV: return fmt::format("idiv({}, {})", l, r);
+    case TokenType::OP_MOD: return fmt::format("imod({}, {})", l, r);
+    case TokenType::OP_POW: return fmt::format("ipow({}, {})", l, r);
+    case TokenType::OP_GT: return fmt::format("({} > {} ? 1 : 0)", l, r);
+    case TokenType::OP_LT: return fmt::format("({} < {} ? 1 : 0)", l, r);
+    case TokenType::OP_GE: return fmt::format("({} >= {} ? 1 : 0)", l, r);
+    case TokenType::OP_LE: return fmt::format("({} <= {} ? 1 : 0)", l, r);
+    case TokenType::OP_EQ: return fmt::format("({} == {} ? 1 : 0)", l, r);
+    case TokenType::OP_NE: return fmt::format("({} != {} ? 1 : 0)", l, r);
+    default:
+        throw std::runtime_error(fmt::format("transpile: unsupported operator {}", Token::tk2Str(op)));
+    }
+}
+
+string quote(const string& s) {
+    string out = "\"";
+    for(const char c: s) {
+        const auto u = static_cast<unsigned char>(c);
+        if(c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if(u < 0x20 || u >= 0x7F) {
+            out += fmt::format("\\{:03o}", u);
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+ASTNode* unwrap(ASTNode* node) {
+    if(node->type() == ASTNodeType::FusedStmt) {
+        return static_cast<FusedStmtNode*>(node)->getOriginal();
+    }
+    return node;
+}
+
+VarType exprType(ASTNode* node, const std::map<string, VarType>& types) {
+    switch(node->type()) {
+    case ASTNodeType::Num:
+        return std::any_cast<int>(&node->getValRef()) != nullptr ? VarType::Int : VarType::Dynamic;
+    case ASTNodeType::Var: {
+        auto it = types.find(static_cast<VarNode*>(node)->getName());
+        return it == types.end() ? VarType::Dynamic : it->second;
+    }
+    case ASTNodeType::UnaryOp:
+        return exprType(static_cast<UnaryOpNode*>(node)->getExpr(), types);
+    case ASTNodeType::BinOp: {
+        auto bin = static_cast<BinOpNode*>(node);
+        return exprType(bin->getLeft(), types) == VarType::Int && exprType(bin->getRight(), types) == VarType::Int
+            ? VarType::Int : VarType::Dynamic;
+    }
+    default:
+        return VarType::Dynamic;
+    }
+}
+
+void collectVars(ASTNode* node, std::map<string, VarType>& types) {
+    switch(node->type()) {
+    case ASTNodeType::Var:
+        types.emplace(static_cast<VarNode*>(node)->getName(), VarType::Dynamic);
+        return;
+    case ASTNodeType::UnaryOp:
+        collectVars(static_cast<UnaryOpNode*>(node)->getExpr(), types);
+        return;
+    case ASTNodeType::BinOp:
+        collectVars(static_cast<BinOpNode*>(node)->getLeft(), types);
+        collectVars(static_cast<BinOpNode*>(node)->getRight(), types);
+        return;
+    case ASTNodeType::AssignStmt:
+        collectVars(static_cast<AssignStmtNode*>(node)->getRight(), types);
+        return;
+    case ASTNodeType::IFStmt:
+        collectVars(static_cast<IFStmtNode*>(node)->getCond(), types);
+        return;
+    case ASTNodeType::PrintStmt:
+        collectVars(static_cast<PrintStmtNode*>(node)->getExpr(), types);
+        return;
+    case ASTNodeType::InputStmt:
+        types[static_cast<InputStmtNode*>(node)->getVar()->getName()] = VarType::Dynamic;
+        return;
+    default:
+        return;
+    }
+}
+
+class Emitter {
+    const std::map<int, ASTNode*>& stmts;
+    const std::map<string, VarType>& types;
+    std::ostringstream os;
+    int temps = 0;
+    using Operand = struct Operand {
+        string name;
+        VarType type;
+    };
+
+    Operand temp(VarType type, const string& init) {
+        Operand o{fmt::format("t{}", temps++), type};
+        if(type == VarType::Int) {
+            os << fmt::format("        const int {} = {};\n", o.name, init);
+        } else {
+            os << fmt::format("        const Value& {} = {};\n", o.name, init);
+        }
+        return o;
+    }
+    static string asValue(const Operand& o) {
+        return o.type == VarType::Int ? fmt::format("intValue({})", o.name) : o.name;
+    }
+    // 求值顺序和Interpreter::visit_BinOp一致(右结合的运算符先算右边), 出错时报告的是同一个错误
+    Operand expr(ASTNode* node) {
+        switch(node->type()) {
+        case ASTNodeType::Num: {
+            const auto& v = node->getValRef();
+            if(auto i = std::any_cast<int>(&v)) {
+                return temp(VarType::Int, std::to_string(*i));
+            }
+            return temp(VarType::Dynamic, fmt::format("doubleValue({})", std::any_cast<double>(v)));
+        }
+        case ASTNodeType::String:
+            return temp(VarType::Dynamic, fmt::format("stringValue({})",
+                                                      quote(static_cast<StringNode*>(node)->getString())));
+        case ASTNodeType::Var: {
+            const auto& name = static_cast<VarNode*>(node)->getName();
+            if(types.at(name) == VarType::Int) {
+                return temp(VarType::Int, fmt::format("d_{0} ? v_{0} : undefinedVar(\"{0}\")", name));
+            }
+            return temp(VarType::Dynamic, fmt::format("load(v_{0}, \"{0}\")", name));
+        }
+        case ASTNodeType::UnaryOp: {
+            auto unary = static_cast<UnaryOpNode*>(node);
+            const bool neg = unary->getOp() == TokenType::OP_SUB;
+            auto e = expr(unary->getExpr());
+            if(e.type == VarType::Int) {
+                return neg ? temp(VarType::Int, fmt::format("ineg({})", e.name)) : e;
+            }
+            return temp(VarType::Dynamic, fmt::format("unaryOp({}, {}, {})", neg, quote(Token::tk2Str(unary->getOp())),
+                                                      e.name));
+        }
+        case ASTNodeType::BinOp: {
+            auto bin = static_cast<BinOpNode*>(node);
+            Operand l;
+            Operand r;
+            if(Token::isRightAssociative(bin->getOp())) {
+                r = expr(bin->getRight());
+                l = expr(bin->getLeft());
+            } else {
+                l = expr(bin->getLeft());
+                r = expr(bin->getRight());
+            }
+            if(l.type == VarType::Int && r.type == VarType::Int) {
+                return temp(VarType::Int, intOp(bin->getOp(), l.name, r.name));
+            }
+            return temp(VarType::Dynamic, fmt::format("binOp({}, {}, {}, {})", opName(bin->getOp()),
+                                                      quote(Token::tk2Str(bin->getOp())), asValue(l), asValue(r)));
+        }
+        default:
+            throw std::runtime_error(fmt::format("transpile: unsupported expression node {}", ast2Str(node->type())));
+        }
+    }
+    // 跳到不存在的行: 和解释器一样在跳转之后报错
+    string jump(int line) const {
+        if(stmts.contains(line)) {
+            return fmt::format("goto L{};", line);
+        }
+        return fmt::format("fail(\"line {} no exist\");", line);
+    }
+    void stmt(ASTNode* node) {
+        node = unwrap(node);
+        switch(node->type()) {
+        case ASTNodeType::AssignStmt: {
+            auto assign = static_cast<AssignStmtNode*>(node);
+            const auto& name = assign->getLeft()->getName();
+            auto e = expr(assign->getRight());
+            if(types.at(name) == VarType::Int) {
+                os << fmt::format("        v_{0} = {1};\n        d_{0} = true;\n", name, e.name);
+            } else {
+                os << fmt::format("        v_{} = {};\n", name, asValue(e));
+            }
+            return;
+        }
+        case ASTNodeType::IFStmt: {
+            auto branch = static_cast<IFStmtNode*>(node);
+            auto cond = expr(branch->getCond());
+            os << fmt::format("        if({}) {{\n            {}\n        }}\n",
+                              cond.type == VarType::Int ? cond.name + " != 0" : "truthy(" + cond.name + ")",
+                              jump(branch->getNext()));
+            return;
+        }
+        case ASTNodeType::GOTOStmt:
+            os << "        " << jump(static_cast<GOTOStmtNode*>(node)->getLineNo()) << "\n";
+            return;
+        case ASTNodeType::EndStmt:
+            os << "        goto done;\n";
+            return;
+        case ASTNodeType::PrintStmt: {
+            auto e = expr(static_cast<PrintStmtNode*>(node)->getExpr());
+            os << fmt::format("        print({});\n", e.name);
+            return;
+        }
+        case ASTNodeType::InputStmt:
+            os << fmt::format("        v_{} = input();\n", static_cast<InputStmtNode*>(node)->getVar()->getName());
+            return;
+        case ASTNodeType::RemStmt:
+            return;
+        default: {
+            // 单独的表达式: 求值(可能出错), 丢弃结果
+            auto e = expr(node);
+            os << fmt::format("        (void){};\n", e.name);
+            return;
+        }
+        }
+    }
+    std::set<int> jumpTargets() const {
+        std::set<int> targets;
+        for(const auto& [line, stmt]: stmts) {
+            auto node = unwrap(stmt);
+            if(node->type() == ASTNodeType::GOTOStmt) {
+                targets.insert(static_cast<GOTOStmtNode*>(node)->getLineNo());
+            } else if(node->type() == ASTNodeType::IFStmt) {
+                targets.insert(static_cast<IFStmtNode*>(node)->getNext());
+            }
+        }
+        return targets;
+    }
+public:
+    Emitter(const std::map<int, ASTNode*>& stmts, const std::map<string, VarType>& types):
+    stmts(stmts), types(types) {}
+    string run(const string& source_name) {
+        os << "// Generated by qbasic-aot from " << source_name << ". Do not edit.\n";
+        os << RUNTIME << "\n";
+        os << "int main() {\n";
+        for(const auto& [name, type]: types) {
+            if(type == VarType::Int) {
+                os << fmt::format("    int v_{0} = 0;\n    bool d_{0} = false;\n", name);
+            } else {
+                os << fmt::format("    Value v_{};\n", name);
+            }
+        }
+        os << "    int status = 0;\n";
+        os << "    try {\n";
+        const auto targets = jumpTargets();
+        for(const auto& [line, node]: stmts) {
+            if(targets.contains(line)) {
+                os << fmt::format("    L{}: {{\n", line);
+            } else {
+                os << fmt::format("    /* {} */ {{\n", line);
+            }
+            stmt(node);
+            os << "    }\n";
+        }
+        os << "    } catch (const BasicError& e) {\n";
+        os << "        std::cout.flush();\n";
+        os << "        std::fprintf(stderr, \"%s\\n\", e.message.c_str());\n";
+        os << "        status = 1;\n";
+        os << "    }\n";
+        os << "done:\n";
+        os << "    std::cout.flush();\n";
+        os << "    if(std::getenv(\"QBASIC_AOT_DUMP_VARS\") != nullptr) {\n";
+        for(const auto& [name, type]: types) {
+            if(type == VarType::Int) {
+                os << fmt::format("        dump(\"{0}\", d_{0}, v_{0});\n", name);
+            } else {
+                os << fmt::format("        dump(\"{0}\", v_{0});\n", name);
+            }
+        }
+        os << "    }\n";
+        os << "    return status;\n";
+        os << "}\n";
+        return os.str();
+    }
+};
+
+} // namespace
+
+std::map<string, VarType> inferTypes(const std::map<int, ASTNode*>& stmts) {
+    std::map<string, VarType> types;
+    for(const auto& [line, stmt]: stmts) {
+        collectVars(unwrap(stmt), types);
+    }
+    // 乐观地假设被LET赋值的变量都是int, 反复去掉赋值不是int表达式的变量直到不动点
+    std::set<string> inputs;
+    for(const auto& [line, stmt]: stmts) {
+        auto node = unwrap(stmt);
+        if(node->type() == ASTNodeType::InputStmt) {
+            inputs.insert(static_cast<InputStmtNode*>(node)->getVar()->getName());
+        } else if(node->type() == ASTNodeType::AssignStmt) {
+            types[static_cast<AssignStmtNode*>(node)->getLeft()->getName()] = VarType::Int;
+        }
+    }
+    for(const auto& name: inputs) {
+        types[name] = VarType::Dynamic;
+    }
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(const auto& [line, stmt]: stmts) {
+            auto node = unwrap(stmt);
+            if(node->type() != ASTNodeType::AssignStmt) {
+                continue;
+            }
+            auto assign = static_cast<AssignStmtNode*>(node);
+            auto& type = types[assign->getLeft()->getName()];
+            if(type == VarType::Int && exprType(assign->getRight(), types) != VarType::Int) {
+                type = VarType::Dynamic;
+                changed = true;
+            }
+        }
+    }
+    return types;
+}
+
+string transpile(const std::map<int, ASTNode*>& stmts, const string& source_name) {
+    const auto types = inferTypes(stmts);
+    return Emitter(stmts, types).run(source_name);
+}
+
+} // namespace aot
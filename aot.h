@@ -0,0 +1,34 @@
+//
+// Created by ayanami on 12/28/24.
+//
+// 提前编译: 把解析好的程序翻译成一个独立的C++源文件, 再交给系统编译器(qbasic-aot)
+// - 行号是标签, GOTO/IF THEN 是goto
+// - 只会被赋int值的变量是int局部变量, 其余用带类型标签的Value
+// - 运算和错误信息与tryBinOp/evalBinOp一致(BASIC MOD的符号, 整数除法, 除零)
+// - 运行时错误写到stderr, 退出码为1; 设置环境变量QBASIC_AOT_DUMP_VARS时退出前把变量按
+//   SymbolTable::getRepl的格式写到stderr, 用于和解释器对照
+//
+#pragma once
+#ifndef AOT_H
+#define AOT_H
+
+#include <map>
+#include <string>
+#include "parser.h"
+
+namespace aot {
+
+enum class VarType {
+    Int,
+    Dynamic,
+};
+
+// 每个出现过的变量的类型: 所有LET都是int表达式时为Int, INPUT和其他情况为Dynamic
+std::map<string, VarType> inferTypes(const std::map<int, ASTNode*>& stmts);
+
+// throws: std::runtime_error 遇到不支持的节点
+string transpile(const std::map<int, ASTNode*>& stmts, const string& source_name);
+
+} // namespace aot
+
+#endif // AOT_H
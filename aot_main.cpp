@@ -0,0 +1,131 @@
+//
+// Created by ayanami on 12/28/24.
+//
+// qbasic-aot: 把.bas翻译成独立的C++源文件, 可以直接用系统编译器编译并运行
+//
+// usage: qbasic-aot FILE.bas [--out FILE.cpp] [--build EXE] [--run] [--cxx COMPILER] [--cxxflags FLAGS]
+//   默认输出到FILE.cpp; --build 编译成EXE; --run 编译(默认放在临时目录)后运行, 退出码是程序的退出码
+//
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "aot.h"
+#include "bench.h"
+
+using std::string;
+
+namespace {
+void usage() {
+    fmt::print(stderr, "usage: qbasic-aot FILE.bas [--out FILE.cpp] [--build EXE] [--run]\n"
+                       "                  [--cxx COMPILER] [--cxxflags FLAGS]\n");
+}
+
+using Options = struct Options {
+    string source;
+    string out;
+    string exe;
+    bool run = false;
+    string cxx = "c++";
+    string cxxflags = "-std=c++20 -O2";
+};
+
+bool parseArgs(int argc, char* argv[], Options& opt) {
+    for(int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        auto next = [&]() -> string {
+            if(i + 1 >= argc) {
+                throw std::runtime_error("missing value for " + arg);
+            }
+            return argv[++i];
+        };
+        if(arg == "--out") {
+            opt.out = next();
+        } else if(arg == "--build") {
+            opt.exe = next();
+        } else if(arg == "--run") {
+            opt.run = true;
+        } else if(arg == "--cxx") {
+            opt.cxx = next();
+        } else if(arg == "--cxxflags") {
+            opt.cxxflags = next();
+        } else if(opt.source.empty() && !arg.starts_with("--")) {
+            opt.source = arg;
+        } else {
+            return false;
+        }
+    }
+    return !opt.source.empty();
+}
+
+int exitCode(int status) {
+    if(status == -1) {
+        return 1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    try {
+        if(!parseArgs(argc, argv, opt)) {
+            usage();
+            return 2;
+        }
+    } catch (std::exception& e) {
+        fmt::print(stderr, "{}\n", e.what());
+        usage();
+        return 2;
+    }
+    const std::filesystem::path source(opt.source);
+    if(opt.out.empty()) {
+        opt.out = std::filesystem::path(source).replace_extension(".cpp").string();
+    }
+    const bool temp_exe = opt.run && opt.exe.empty();
+    if(temp_exe) {
+        opt.exe = (std::filesystem::temp_directory_path() /
+            fmt::format("qbasic-aot-{}-{}", source.stem().string(), getpid())).string();
+    }
+
+    string code;
+    try {
+        auto tokenizer = std::make_shared<Token::Tokenizer>();
+        Parser parser(tokenizer);
+        {
+            // tokenizer的调试输出不能混进--run时程序的输出
+            bench::StdoutSilencer silence;
+            parser.reload(source);
+        }
+        code = aot::transpile(parser.getStmts(), source.filename().string());
+    } catch (std::exception& e) {
+        fmt::print(stderr, "{}: {}\n", opt.source, e.what());
+        return 1;
+    }
+    {
+        std::ofstream ofs(opt.out);
+        if(!ofs.is_open()) {
+            fmt::print(stderr, "Failed to open file: {}\n", opt.out);
+            return 1;
+        }
+        ofs << code;
+    }
+    if(opt.exe.empty()) {
+        return 0;
+    }
+    auto cmd = fmt::format("{} {} -o '{}' '{}'", opt.cxx, opt.cxxflags, opt.exe, opt.out);
+    if(auto status = exitCode(std::system(cmd.c_str())); status != 0) {
+        fmt::print(stderr, "Failed to build: {}\n", cmd);
+        return status;
+    }
+    if(!opt.run) {
+        return 0;
+    }
+    // 程序直接继承stdin/stdout/stderr
+    auto status = exitCode(std::system(fmt::format("'{}'", opt.exe).c_str()));
+    if(temp_exe) {
+        std::filesystem::remove(opt.exe);
+    }
+    return status;
+}
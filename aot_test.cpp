@@ -0,0 +1,175 @@
+//
+// Created by ayanami on 12/28/24.
+//
+
+#include "aot_test.h"
+#include <fstream>
+#include <regex>
+#include <unistd.h>
+#include "tokenizer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "aot.h"
+#include "engine_test_util.h"
+using std::vector;
+using std::string;
+using fmt::format;
+using namespace engine_test;
+
+namespace {
+string readAll(const std::filesystem::path& path) {
+    std::ifstream ifs(path);
+    return {std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>()};
+}
+
+using AotResult = struct AotResult {
+    int status = 0;
+    string output;
+    string err;
+    vector<string> vars;
+};
+
+// 翻译, 用系统编译器编译, 运行; 变量由QBASIC_AOT_DUMP_VARS输出到stderr
+AotResult buildAndRun(const std::map<int, ASTNode*>& stmts, const string& name, const string& input) {
+    auto dir = std::filesystem::temp_directory_path() / format("qbasic_aot_test_{}", getpid());
+    std::filesystem::create_directories(dir);
+    auto src = dir / (name + ".cpp");
+    auto exe = dir / name;
+    {
+        std::ofstream ofs(src);
+        ofs << aot::transpile(stmts, name);
+    }
+    std::ofstream(dir / "input.txt") << input;
+    AotResult res;
+    auto build = format("c++ -std=c++20 -O0 -w -o '{}' '{}'", exe.string(), src.string());
+    if(std::system(build.c_str()) != 0) {
+        res.status = -1;
+        res.err = "failed to build " + src.string();
+        return res;
+    }
+    auto cmd = format("QBASIC_AOT_DUMP_VARS=1 '{}' < '{}' > '{}' 2> '{}'", exe.string(), (dir / "input.txt").string(),
+                      (dir / "stdout.txt").string(), (dir / "stderr.txt").string());
+    res.status = WEXITSTATUS(std::system(cmd.c_str()));
+    res.output = readAll(dir / "stdout.txt");
+    std::istringstream err(readAll(dir / "stderr.txt"));
+    for(string line; std::getline(err, line);) {
+        if(line.starts_with("key: ")) {
+            res.vars.push_back(line);
+        } else {
+            res.err += line;
+        }
+    }
+    std::ranges::sort(res.vars);
+    std::filesystem::remove_all(dir);
+    return res;
+}
+
+// DEV模式下的调试输出混在程序输出里, 去掉后剩下PRINT的内容
+string programOutput(const string& captured) {
+    static const std::regex debug(R"((\[DEBUG\]|Failed to interpret stmt:)[^\n]*\n)");
+    return std::regex_replace(captured, debug, "");
+}
+
+void check(Interpreter& interpreter, const string& name, const string& input) {
+    interpreter.setASTOutput(false);
+    auto actual = buildAndRun(interpreter.getParser()->getStmts(), name, input);
+    auto expected = run(interpreter, input);
+    auto expected_err = interpreter.getStatus().err_msg.value_or("");
+    auto expected_output = programOutput(expected.output);
+    QVERIFY2(actual.status != -1, actual.err.c_str());
+    QVERIFY2(actual.output == expected_output, format("{}: output\n  tree [{}]\n  aot [{}]", name,
+        expected_output, actual.output).c_str());
+    QVERIFY2(actual.err == expected_err, format("{}: error\n  tree [{}]\n  aot [{}]", name,
+        expected_err, actual.err).c_str());
+    QVERIFY2(actual.status == (expected_err.empty() ? 0 : 1), name.c_str());
+    QVERIFY2(actual.vars == expected.vars, format("{}: vars\n  tree [{}]\n  aot [{}]", name,
+        fmt::join(expected.vars.begin(), expected.vars.end(), ", "),
+        fmt::join(actual.vars.begin(), actual.vars.end(), ", ")).c_str());
+}
+}
+
+void aot_test::initTestCase() {
+    qDebug() <<"Init test case\n";
+}
+
+void aot_test::testInference() {
+    auto tokenizer = std::make_shared<Token::Tokenizer>();
+    Parser parser(tokenizer);
+    parser.reload(vector<string>{
+        "10 LET I = 0",
+        "20 LET S = \"s\"",
+        "30 INPUT N",
+        "40 LET M = N * 2",
+        "50 LET J = I + 1",
+        "60 LET K = J MOD 3 - -I",
+        "70 LET J = M",
+        "80 PRINT U",
+    });
+    auto types = aot::inferTypes(parser.getStmts());
+    QVERIFY(types.at("I") == aot::VarType::Int);
+    QVERIFY(types.at("S") == aot::VarType::Dynamic);
+    QVERIFY(types.at("N") == aot::VarType::Dynamic);
+    QVERIFY(types.at("M") == aot::VarType::Dynamic);
+    // J = M 使J变成Dynamic, 依赖J的K也跟着变
+    QVERIFY(types.at("J") == aot::VarType::Dynamic);
+    QVERIFY(types.at("K") == aot::VarType::Dynamic);
+    QVERIFY(types.at("U") == aot::VarType::Dynamic);
+    auto code = aot::transpile(parser.getStmts(), "inference");
+    QVERIFY(code.find("int v_I = 0;") != string::npos);
+    QVERIFY(code.find("Value v_J;") != string::npos);
+}
+
+void aot_test::testMatchesTreeWalker() {
+    if(std::system("c++ --version > /dev/null 2>&1") != 0) {
+        QSKIP("no system C++ compiler");
+    }
+    const std::map<string, string> inputs = {
+        {"sum_of_1ton.bas", "10\n"},
+        {"sum_of_two.bas", "7\n5\n"},
+        {"factorial.bas", "6\n"},
+        {"even_or_odd.bas", "7\n"},
+        {"is_prime.bas", "67\n"},
+        {"hard1.bas", "100\n"},
+        {"hard2.bas", "100\n"},
+    };
+    for(const auto& entry: std::filesystem::directory_iterator("./programs")) {
+        if(entry.path().extension() != ".bas") {
+            continue;
+        }
+        auto interpreter = newInterpreter();
+        try {
+            CoutCapture capture;
+            interpreter->loadFile(entry.path());
+        } catch (std::exception&) {
+            continue; // 解析失败的程序
+        }
+        auto input_it = inputs.find(entry.path().filename().string());
+        check(*interpreter, entry.path().stem().string(), input_it == inputs.end() ? "" : input_it->second);
+    }
+
+    const vector<std::pair<vector<string>, string>> programs = {
+        {{"10 LET A = -7", "20 PRINT A MOD 3", "30 PRINT 7 MOD -3", "40 PRINT A MOD -3", "50 PRINT A / 2",
+          "60 PRINT 2 ** 3 ** 2", "70 PRINT -A * (A - 1) >= 12"}, ""},
+        {{"10 LET A = 1 / 0"}, ""},
+        {{"10 LET A = 0", "20 PRINT 5", "30 LET B = 7 MOD A"}, ""},
+        {{"10 LET S = \"a\"", "20 LET T = S + \"b\""}, ""},
+        {{"10 LET S = \"a\"", "20 LET T = S + 1"}, ""},
+        {{"10 LET S = \"a\"", "20 LET T = -S"}, ""},
+        {{"10 LET S = \"\"", "20 IF S THEN 50", "30 LET S = \"x\"", "40 GOTO 20", "50 PRINT S"}, ""},
+        {{"10 PRINT UNKNOWN + 1"}, ""},
+        {{"10 LET A = 1", "20 GOTO 100"}, ""},
+        {{"10 LET A = 2", "20 2 * A", "30 2 + UNKNOWN"}, ""},
+        {{"10 INPUT D", "20 PRINT D * 2", "30 PRINT D / 0.5", "40 IF D THEN 10"}, "2.5\n"},
+        {{"10 INPUT D", "20 INPUT E", "30 PRINT D MOD E"}, "0.0001\n1e20\n"},
+        {{"10 INPUT W", "20 INPUT X", "30 PRINT W", "40 PRINT X", "50 END", "60 PRINT 1"}, "word 99999999999\n"},
+    };
+    int i = 0;
+    for(const auto& [lines, input]: programs) {
+        auto interpreter = newInterpreter();
+        interpreter->loadProgram(Token::programFromlines(lines));
+        check(*interpreter, format("snippet_{}", i++), input);
+    }
+}
+
+void aot_test::cleanupTestCase() {
+}
@@ -0,0 +1,23 @@
+//
+// Created by ayanami on 12/28/24.
+//
+#pragma once
+#ifndef AOT_TEST_H
+#define AOT_TEST_H
+
+#include <QTest>
+#include <QObject>
+
+class aot_test: public QObject{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void testInference();
+    void testMatchesTreeWalker();
+    void cleanupTestCase();
+};
+
+
+
+#endif //AOT_TEST_H
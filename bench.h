@@ -0,0 +1,229 @@
+//
+// Created by ayanami on 12/20/24.
+//
+// benchmark 公共工具: 计时, 统计, 结果/基线的JSON读写
+// 只依赖标准库和POSIX, 离线可用
+//
+#pragma once
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <fmt/core.h>
+
+namespace bench {
+using Clock = std::chrono::steady_clock;
+
+using Stats = struct Stats {
+    size_t samples = 0;
+    double median_us = 0;
+    double p99_us = 0;
+    double mean_us = 0;
+    double min_us = 0;
+};
+
+// nearest-rank percentile, samples must be sorted
+inline double percentile(const std::vector<double>& sorted, double p) {
+    if(sorted.empty()) {
+        return 0;
+    }
+    auto rank = static_cast<size_t>(p / 100.0 * static_cast<double>(sorted.size()) + 0.999999);
+    rank = std::clamp<size_t>(rank, 1, sorted.size());
+    return sorted[rank - 1];
+}
+
+inline Stats summarize(std::vector<double> samples_us) {
+    Stats s;
+    s.samples = samples_us.size();
+    if(samples_us.empty()) {
+        return s;
+    }
+    std::ranges::sort(samples_us);
+    double sum = 0;
+    for(const auto v: samples_us) {
+        sum += v;
+    }
+    const size_t n = samples_us.size();
+    s.median_us = n % 2 == 1 ? samples_us[n / 2] : (samples_us[n / 2 - 1] + samples_us[n / 2]) / 2;
+    s.p99_us = percentile(samples_us, 99);
+    s.mean_us = sum / static_cast<double>(n);
+    s.min_us = samples_us.front();
+    return s;
+}
+
+template<typename F>
+double timeUs(F&& f) {
+    const auto start = Clock::now();
+    f();
+    const auto end = Clock::now();
+    return std::chrono::duration<double, std::micro>(end - start).count();
+}
+
+template<typename F>
+Stats measure(size_t warmup, size_t iterations, F&& f) {
+    for(size_t i = 0; i < warmup; ++i) {
+        f();
+    }
+    std::vector<double> samples;
+    samples.reserve(iterations);
+    for(size_t i = 0; i < iterations; ++i) {
+        samples.push_back(timeUs(f));
+    }
+    return summarize(std::move(samples));
+}
+
+// 防止编译器把被测的计算优化掉
+template<typename T>
+inline void doNotOptimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// 解释器和tokenizer会往stdout打很多调试信息, 计时期间把fd 1重定向到/dev/null
+class StdoutSilencer {
+    int saved_fd = -1;
+public:
+    explicit StdoutSilencer(bool enable = true) {
+        if(!enable) {
+            return;
+        }
+        std::cout.flush();
+        std::fflush(stdout);
+        saved_fd = dup(STDOUT_FILENO);
+        int null_fd = open("/dev/null", O_WRONLY);
+        if(saved_fd < 0 || null_fd < 0) {
+            if(null_fd >= 0) {
+                close(null_fd);
+            }
+            return;
+        }
+        dup2(null_fd, STDOUT_FILENO);
+        close(null_fd);
+    }
+    ~StdoutSilencer() {
+        if(saved_fd < 0) {
+            return;
+        }
+        std::cout.flush();
+        std::fflush(stdout);
+        dup2(saved_fd, STDOUT_FILENO);
+        close(saved_fd);
+    }
+    StdoutSilencer(const StdoutSilencer&) = delete;
+    StdoutSilencer& operator=(const StdoutSilencer&) = delete;
+};
+
+using Result = struct Result {
+    std::string name; // "<workload>/<phase>"
+    Stats stats;
+    size_t items = 0; // 每个样本处理的元素数(token/节点/操作), 0表示不适用
+};
+
+inline std::string jsonEscape(const std::string& s) {
+    std::string res;
+    for(const auto c: s) {
+        if(c == '"' || c == '\\') {
+            res += '\\';
+        }
+        res += c;
+    }
+    return res;
+}
+
+#ifndef QBASIC_BUILD_TYPE
+#define QBASIC_BUILD_TYPE "unknown"
+#endif
+
+inline void writeJson(std::ostream& os, const std::vector<Result>& results, size_t iterations) {
+    os << "{\n";
+    os << "  \"version\": 1,\n";
+    os << "  \"build_type\": \"" << jsonEscape(QBASIC_BUILD_TYPE) << "\",\n";
+    os << "  \"unit\": \"us\",\n";
+    os << fmt::format("  \"iterations\": {},\n", iterations);
+    os << "  \"results\": {\n";
+    for(size_t i = 0; i < results.size(); ++i) {
+        const auto& [name, s, items] = results[i];
+        std::string per_item;
+        if(items > 0) {
+            per_item = fmt::format(", \"items\": {}, \"ns_per_item\": {:.3f}",
+                                   items, s.median_us * 1000 / static_cast<double>(items));
+        }
+        os << fmt::format("    \"{}\": {{\"median_us\": {:.3f}, \"p99_us\": {:.3f}, "
+                          "\"mean_us\": {:.3f}, \"min_us\": {:.3f}, \"samples\": {}{}}}{}\n",
+                          jsonEscape(name), s.median_us, s.p99_us, s.mean_us, s.min_us, s.samples,
+                          per_item, i + 1 == results.size() ? "" : ",");
+    }
+    os << "  }\n";
+    os << "}\n";
+}
+
+// 只认writeJson写出的格式: name -> median_us
+inline std::map<std::string, double> readBaseline(const std::string& path) {
+    std::map<std::string, double> baseline;
+    std::ifstream ifs(path);
+    if(!ifs.is_open()) {
+        return baseline;
+    }
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    const std::string text = ss.str();
+    static const std::regex entry_re(R"re("([^"]+)"\s*:\s*\{\s*"median_us"\s*:\s*([-+0-9.eE]+))re");
+    for(auto it = std::sregex_iterator(text.begin(), text.end(), entry_re);
+        it != std::sregex_iterator(); ++it) {
+        baseline[(*it)[1].str()] = std::stod((*it)[2].str());
+    }
+    return baseline;
+}
+
+// 基线和当前构建的build type不同时, 比较结果没有意义
+inline std::string readBaselineBuildType(const std::string& path) {
+    std::ifstream ifs(path);
+    std::string line;
+    static const std::regex build_type_re(R"re("build_type"\s*:\s*"([^"]*)")re");
+    while(std::getline(ifs, line)) {
+        std::smatch m;
+        if(std::regex_search(line, m, build_type_re)) {
+            return m[1].str();
+        }
+    }
+    return {};
+}
+
+using Regression = struct Regression {
+    std::string name;
+    double baseline_us;
+    double current_us;
+    double ratio; // current / baseline - 1
+};
+
+// threshold: 0.25 表示比基线慢25%以上算回退; 低于min_us的项噪声太大, 不比较
+inline std::vector<Regression> compare(const std::vector<Result>& results,
+                                       const std::map<std::string, double>& baseline,
+                                       double threshold, double min_us) {
+    std::vector<Regression> regressions;
+    for(const auto& [name, s, items]: results) {
+        auto it = baseline.find(name);
+        if(it == baseline.end() || it->second < min_us) {
+            continue;
+        }
+        double ratio = s.median_us / it->second - 1;
+        if(ratio > threshold) {
+            regressions.push_back({name, it->second, s.median_us, ratio});
+        }
+    }
+    return regressions;
+}
+
+} // namespace bench
+
+#endif // BENCH_H
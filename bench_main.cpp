@@ -0,0 +1,333 @@
+//
+// Created by ayanami on 12/20/24.
+//
+// qbasic_bench: 端到端benchmark
+// 对programs/下的每个程序(以及放大输入规模的变体, qbasic_gen生成的大程序), 分别测量
+// load(读文件) / tokenize / parse / execute 四个阶段, 报告中位数和p99,
+// 并和基线JSON比较
+//
+// usage: qbasic_bench [--iterations N] [--warmup N] [--filter STR]
+//                     [--programs DIR] [--out FILE] [--engine tree|flat|closure|jit|tiered|optimized]
+//                     [--baseline FILE] [--threshold RATIO] [--min-us US]
+//                     [--update-baseline] [-O0|-O1|-O2] [--passes LIST] [--dump-after LIST] [--pass-stats]
+//   -O0是树解释器, -O1/-O2用优化引擎(opt::levelOptions); --passes只执行逗号分隔的这些pass;
+//   --dump-after把这些pass(或者build, all)之后的中间表示输出到stderr; --pass-stats报告每个pass的耗时和改动数量
+//
+#include <filesystem>
+#include <fstream>
+#include "bench.h"
+#include "interpreter.h"
+#include "workload_gen.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+using Workload = struct Workload {
+    string name;
+    string file;  // relative to --programs
+    string input; // scripted INPUT, one value per line
+    std::optional<workload::GenOptions> gen{}; // 有值时不读文件, 用生成器生成程序
+};
+
+const vector<Workload> workloads = {
+    {"fib", "fib.bas", ""},
+    {"default", "default.bas", ""},
+    {"loop1", "loop1.bas", ""},
+    {"loop2", "loop2.bas", ""},
+    {"mod1", "mod1.bas", ""},
+    {"mod2", "mod2.bas", ""},
+    {"simple1", "simple1.bas", ""},
+    {"simple2", "simple2.bas", ""},
+    {"unsorted", "unsorted.bas", "7\n"},
+    {"even_or_odd", "even_or_odd.bas", "8\n"},
+    {"sum_of_two", "sum_of_two.bas", "3\n4\n"},
+    {"sum_of_1ton", "sum_of_1ton.bas", "10\n"},
+    {"factorial", "factorial.bas", "10\n"},
+    {"is_prime", "is_prime.bas", "97\n"},
+    {"hard1", "hard1.bas", "100\n"},
+    {"hard2", "hard2.bas", "100\n"},
+    // scaled variants: 同一程序, 放大输入
+    {"sum_of_1ton_x1k", "sum_of_1ton.bas", "1000\n"},
+    {"sum_of_1ton_x50k", "sum_of_1ton.bas", "50000\n"},
+    {"is_prime_104729", "is_prime.bas", "104729\n"},
+    {"hard1_1e6", "hard1.bas", "1000000\n"},
+    // generated: 行数, 行号稀疏度, 表达式深度, 变量数各自放大
+    {"gen_1k", "", "", workload::GenOptions{.seed = 1, .lines = 1000}},
+    {"gen_5k_sparse", "", "", workload::GenOptions{.seed = 2, .lines = 5000, .max_line_no = Token::MAX_LINE_NO - 1,
+                                                   .goto_density = 0.2, .loop_density = 0}},
+    {"gen_deep", "", "", workload::GenOptions{.seed = 3, .lines = 100, .expr_depth = 8}},
+    {"gen_vars_2k", "", "", workload::GenOptions{.seed = 4, .lines = 3000, .vars = 2000}},
+    {"gen_loops", "", "", workload::GenOptions{.seed = 5, .lines = 200, .loop_density = 0.3,
+                                               .loop_trips = 100}},
+};
+
+using Options = struct Options {
+    size_t iterations = 20;
+    size_t warmup = 3;
+    string filter;
+    string programs = "./programs";
+    string out;
+    string baseline;
+    double threshold = 0.25;
+    double min_us = 5;
+    bool update_baseline = false;
+    EngineKind engine = EngineKind::TreeWalker; // flat/closure/jit/optimized的编译时间计入parse阶段
+    opt::Options opt_options{};
+    bool pass_stats = false;
+};
+
+void usage() {
+    fmt::print(stderr, "usage: qbasic_bench [--iterations N] [--warmup N] [--filter STR] [--programs DIR]\n"
+                       "                    [--out FILE] [--engine tree|flat|closure|jit|tiered|optimized]\n"
+                       "                    [--baseline FILE] [--threshold RATIO]\n"
+                       "                    [--min-us US] [--update-baseline]\n"
+                       "                    [-O0|-O1|-O2] [--passes LIST] [--dump-after LIST] [--pass-stats]\n");
+}
+
+bool parseArgs(int argc, char* argv[], Options& opt) {
+    for(int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        auto next = [&]() -> string {
+            if(i + 1 >= argc) {
+                throw std::runtime_error("missing value for " + arg);
+            }
+            return argv[++i];
+        };
+        if(arg == "--iterations") {
+            opt.iterations = std::stoul(next());
+        } else if(arg == "--warmup") {
+            opt.warmup = std::stoul(next());
+        } else if(arg == "--filter") {
+            opt.filter = next();
+        } else if(arg == "--programs") {
+            opt.programs = next();
+        } else if(arg == "--out") {
+            opt.out = next();
+        } else if(arg == "--baseline") {
+            opt.baseline = next();
+        } else if(arg == "--threshold") {
+            opt.threshold = std::stod(next());
+        } else if(arg == "--min-us") {
+            opt.min_us = std::stod(next());
+        } else if(arg == "--update-baseline") {
+            opt.update_baseline = true;
+        } else if(auto level = opt::parseLevel(arg); level && arg.starts_with("-O")) {
+            auto dump_after = std::move(opt.opt_options.dump_after);
+            opt.opt_options = opt::levelOptions(*level);
+            opt.opt_options.dump_after = std::move(dump_after);
+            opt.engine = *level == 0 ? EngineKind::TreeWalker : EngineKind::Optimized;
+        } else if(arg == "--passes") {
+            auto dump_after = std::move(opt.opt_options.dump_after);
+            opt.opt_options = opt::passOptions(next());
+            opt.opt_options.dump_after = std::move(dump_after);
+            opt.engine = EngineKind::Optimized;
+        } else if(arg == "--dump-after") {
+            opt.opt_options.dump_after = opt::parseDumpAfter(next());
+        } else if(arg == "--pass-stats") {
+            opt.pass_stats = true;
+        } else if(arg == "--engine") {
+            auto engine = next();
+            if(engine == "tree") {
+                opt.engine = EngineKind::TreeWalker;
+            } else if(engine == "flat") {
+                opt.engine = EngineKind::Flat;
+            } else if(engine == "closure") {
+                opt.engine = EngineKind::Closure;
+            } else if(engine == "jit") {
+                opt.engine = EngineKind::Jit;
+            } else if(engine == "tiered") {
+                opt.engine = EngineKind::Tiered;
+            } else if(engine == "optimized") {
+                opt.engine = EngineKind::Optimized;
+            } else {
+                throw std::runtime_error("unknown engine " + engine);
+            }
+        } else {
+            return false;
+        }
+    }
+    return opt.iterations > 0;
+}
+
+vector<string> readLines(const std::filesystem::path& path) {
+    std::ifstream ifs(path);
+    if(!ifs.is_open()) {
+        throw std::runtime_error("Failed to open file: " + path.string());
+    }
+    vector<string> lines;
+    string line;
+    while(std::getline(ifs, line)) {
+        lines.push_back(line);
+    }
+    return lines;
+}
+
+using PhaseSamples = struct PhaseSamples {
+    vector<double> load, tokenize, parse, execute;
+    // 优化引擎: 每个pass的耗时(每次运行的pass相同)和最后一次运行的改动数量, 中间表示
+    vector<std::pair<string, vector<double>>> passes;
+    vector<size_t> changes;
+    vector<opt::PassDump> dumps;
+};
+
+// 跑一次完整流程, 返回false表示程序运行出错
+// generated: 生成好的源码行, 这时load阶段只包括programFromlines
+bool runOnce(const Workload& w, const Options& opt, const vector<string>* generated, PhaseSamples* samples) {
+    auto tokenizer = std::make_shared<Token::Tokenizer>();
+    auto parser = std::make_shared<Parser>(tokenizer);
+    auto env = std::make_shared<Env>(std::make_shared<SymbolTable>());
+    auto interpreter = std::make_shared<Interpreter>(parser, env, ProgramMode::DEV);
+
+    Token::BasicProgram program;
+    double load = bench::timeUs([&] {
+        program = Token::programFromlines(generated ? *generated
+                                                    : readLines(std::filesystem::path(opt.programs) / w.file));
+    });
+    double tokenize = bench::timeUs([&] {
+        tokenizer->reload(std::move(program));
+    });
+    double parse = bench::timeUs([&] {
+        parser->parseProgram();
+        interpreter->setOptOptions(opt.opt_options);
+        if(opt.engine != EngineKind::TreeWalker) {
+            interpreter->setEngine(opt.engine);
+        }
+    });
+    std::cin.clear();
+    interpreter->input(w.input);
+    double execute = bench::timeUs([&] {
+        try {
+            interpreter->interpret();
+        } catch (std::exception&) {
+            // err_msg is checked below
+        }
+    });
+    if(interpreter->getStatus().err_msg.has_value()) {
+        return false;
+    }
+    if(samples) {
+        samples->load.push_back(load);
+        samples->tokenize.push_back(tokenize);
+        samples->parse.push_back(parse);
+        samples->execute.push_back(execute);
+        if(auto optimized = interpreter->getOptimized()) {
+            const auto& runs = optimized->passRuns();
+            samples->passes.resize(runs.size());
+            samples->changes.resize(runs.size());
+            for(size_t i = 0; i < runs.size(); ++i) {
+                samples->passes[i].first = runs[i].name;
+                samples->passes[i].second.push_back(runs[i].us);
+                samples->changes[i] = runs[i].changes;
+            }
+            samples->dumps = optimized->passDumps();
+        }
+    }
+    return true;
+}
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    try {
+        if(!parseArgs(argc, argv, opt)) {
+            usage();
+            return 2;
+        }
+    } catch (std::exception& e) {
+        fmt::print(stderr, "{}\n", e.what());
+        usage();
+        return 2;
+    }
+
+    vector<bench::Result> results;
+    bool failed = false;
+    for(const auto& w: workloads) {
+        if(!opt.filter.empty() && w.name.find(opt.filter) == string::npos) {
+            continue;
+        }
+        PhaseSamples samples;
+        bool ok = true;
+        {
+            bench::StdoutSilencer silence;
+            try {
+                vector<string> generated;
+                if(w.gen) {
+                    generated = workload::generate(w.gen.value()).lines;
+                }
+                const auto* src = w.gen ? &generated : nullptr;
+                for(size_t i = 0; i < opt.warmup && ok; ++i) {
+                    ok = runOnce(w, opt, src, nullptr);
+                }
+                for(size_t i = 0; i < opt.iterations && ok; ++i) {
+                    ok = runOnce(w, opt, src, &samples);
+                }
+            } catch (std::exception& e) {
+                ok = false;
+            }
+        }
+        if(!ok) {
+            fmt::print(stderr, "[bench] {}: program failed, skipped\n", w.name);
+            failed = true;
+            continue;
+        }
+        results.push_back({w.name + "/load", bench::summarize(samples.load)});
+        results.push_back({w.name + "/tokenize", bench::summarize(samples.tokenize)});
+        results.push_back({w.name + "/parse", bench::summarize(samples.parse)});
+        results.push_back({w.name + "/execute", bench::summarize(samples.execute)});
+        for(const auto& [after, lines]: samples.dumps) {
+            fmt::print(stderr, "[bench] {}: IR after {}\n", w.name, after);
+            for(const auto& line: lines) {
+                fmt::print(stderr, "{}\n", line);
+            }
+        }
+        if(opt.pass_stats) {
+            for(size_t i = 0; i < samples.passes.size(); ++i) {
+                const auto& [name, us] = samples.passes[i];
+                results.push_back({w.name + "/pass/" + name, bench::summarize(us)});
+                fmt::print(stderr, "[bench] {}: pass {} made {} changes\n", w.name, name, samples.changes[i]);
+            }
+        }
+    }
+
+    fmt::print("{:<32} {:>12} {:>12}\n", "benchmark", "median(us)", "p99(us)");
+    for(const auto& [name, s, items]: results) {
+        fmt::print("{:<32} {:>12.2f} {:>12.2f}\n", name, s.median_us, s.p99_us);
+    }
+
+    if(!opt.out.empty()) {
+        std::ofstream ofs(opt.out);
+        bench::writeJson(ofs, results, opt.iterations);
+    }
+    if(opt.update_baseline) {
+        if(opt.baseline.empty()) {
+            fmt::print(stderr, "--update-baseline requires --baseline FILE\n");
+            return 2;
+        }
+        std::ofstream ofs(opt.baseline);
+        bench::writeJson(ofs, results, opt.iterations);
+        fmt::print("baseline written to {}\n", opt.baseline);
+        return failed ? 1 : 0;
+    }
+    if(!opt.baseline.empty()) {
+        auto baseline = bench::readBaseline(opt.baseline);
+        if(baseline.empty()) {
+            fmt::print(stderr, "no baseline entries in {}\n", opt.baseline);
+            return 2;
+        }
+        auto baseline_build = bench::readBaselineBuildType(opt.baseline);
+        if(baseline_build != QBASIC_BUILD_TYPE) {
+            fmt::print(stderr, "[bench] warning: baseline built as '{}', current build is '{}'\n",
+                       baseline_build, QBASIC_BUILD_TYPE);
+        }
+        auto regressions = bench::compare(results, baseline, opt.threshold, opt.min_us);
+        for(const auto& [name, base, cur, ratio]: regressions) {
+            fmt::print("REGRESSION {}: {:.2f}us -> {:.2f}us (+{:.1f}%)\n", name, base, cur, ratio * 100);
+        }
+        fmt::print("{} regression(s) over {:.0f}% threshold\n", regressions.size(), opt.threshold * 100);
+        if(!regressions.empty()) {
+            return 1;
+        }
+    }
+    return failed ? 1 : 0;
+}
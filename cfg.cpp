@@ -0,0 +1,332 @@
+//
+// Created by ayanami on 12/31/24.
+//
+
+#include "cfg.h"
+#include <algorithm>
+#include "optimizer.h"
+#include <set>
+#include <fmt/format.h>
+
+namespace cfg {
+
+namespace {
+
+ASTNode* unwrap(ASTNode* stmt) {
+    if(stmt->type() == ASTNodeType::FusedStmt) {
+        return static_cast<FusedStmtNode*>(stmt)->getOriginal();
+    }
+    return stmt;
+}
+
+// 跳转目标, 不是跳转语句时返回nullopt
+std::optional<int> jumpTarget(ASTNode* stmt) {
+    switch(stmt->type()) {
+    case ASTNodeType::GOTOStmt:
+        return static_cast<GOTOStmtNode*>(stmt)->getLineNo();
+    case ASTNodeType::IFStmt:
+        return static_cast<IFStmtNode*>(stmt)->getNext();
+    default:
+        return std::nullopt;
+    }
+}
+
+bool endsBlock(ASTNode* stmt) {
+    const auto type = stmt->type();
+    return type == ASTNodeType::GOTOStmt || type == ASTNodeType::IFStmt || type == ASTNodeType::EndStmt;
+}
+
+} // namespace
+
+Graph Graph::build(const std::map<int, ASTNode*>& stmts) {
+    Graph graph;
+    if(stmts.empty()) {
+        return graph;
+    }
+    std::set<int> leaders{stmts.begin()->first};
+    for(auto it = stmts.begin(); it != stmts.end(); ++it) {
+        auto stmt = unwrap(it->second);
+        if(auto target = jumpTarget(stmt); target && stmts.contains(*target)) {
+            leaders.insert(*target);
+        }
+        if(endsBlock(stmt) && std::next(it) != stmts.end()) {
+            leaders.insert(std::next(it)->first);
+        }
+    }
+    for(const auto& [line, stmt]: stmts) {
+        if(leaders.contains(line)) {
+            graph.blocks.emplace_back();
+        }
+        graph.blocks.back().lines.push_back(line);
+        graph.line_block[line] = graph.blocks.size() - 1;
+    }
+    graph.link(stmts);
+    graph.computeDominators();
+    graph.findLoops();
+    return graph;
+}
+
+void Graph::link(const std::map<int, ASTNode*>& stmts) {
+    for(size_t b = 0; b < blocks.size(); ++b) {
+        auto& block = blocks[b];
+        const int last = block.lines.back();
+        auto stmt = unwrap(stmts.at(last));
+        std::set<size_t> succs;
+        bool falls_through = stmt->type() != ASTNodeType::EndStmt && stmt->type() != ASTNodeType::GOTOStmt;
+        if(auto target = jumpTarget(stmt)) {
+            if(*target == last) {
+                falls_through = true; // 跳到自己: interpret_SingleStep当作没有跳转
+            } else if(auto it = line_block.find(*target); it != line_block.end()) {
+                succs.insert(it->second);
+            } else {
+                invalid_jumps.push_back({last, *target});
+            }
+        }
+        if(falls_through) {
+            if(b + 1 < blocks.size()) {
+                succs.insert(b + 1);
+            } else {
+                block.exits = true;
+            }
+        }
+        if(stmt->type() == ASTNodeType::EndStmt) {
+            block.exits = true;
+        }
+        block.succs.assign(succs.begin(), succs.end());
+    }
+    connect();
+}
+
+Graph Graph::build(const opt::Program& program) {
+    Graph graph;
+    const auto& stmts = program.getStmts();
+    if(stmts.empty()) {
+        return graph;
+    }
+    auto successors = [&](size_t i) {
+        std::vector<size_t> res;
+        for(const auto s: {stmts[i].next, stmts[i].jump}) {
+            if(s != opt::NO_STMT) {
+                res.push_back(s);
+            }
+        }
+        return res;
+    };
+    std::vector<size_t> pred_count(stmts.size(), 0);
+    for(size_t i = 0; i < stmts.size(); ++i) {
+        for(const auto s: successors(i)) {
+            pred_count[s]++;
+        }
+    }
+    // i+1和i在同一块: i只会顺序执行到紧跟着的i+1, 而且i+1只能从i到达
+    auto continues = [&](size_t i) {
+        const auto type = stmts[i].node->type();
+        return type != ASTNodeType::IFStmt && type != ASTNodeType::GOTOStmt && type != ASTNodeType::EndStmt &&
+               stmts[i].next == i + 1 && pred_count[i + 1] == 1;
+    };
+    for(size_t i = 0; i < stmts.size(); ++i) {
+        if(i == 0 || !continues(i - 1)) {
+            graph.blocks.emplace_back();
+        }
+        graph.blocks.back().lines.push_back(static_cast<int>(i));
+        graph.line_block[static_cast<int>(i)] = graph.blocks.size() - 1;
+    }
+    for(auto& block: graph.blocks) {
+        const auto last = static_cast<size_t>(block.lines.back());
+        const auto& stmt = stmts[last];
+        const auto type = stmt.node->type();
+        std::set<size_t> succs;
+        for(const auto s: successors(last)) {
+            succs.insert(graph.line_block.at(static_cast<int>(s)));
+        }
+        if(stmt.invalid_jump) {
+            graph.invalid_jumps.push_back({stmt.line, stmt.target});
+        }
+        // 顺序执行或者跳转到程序末尾
+        const bool ends = type == ASTNodeType::EndStmt ||
+                          (type != ASTNodeType::GOTOStmt && stmt.next == opt::NO_STMT) ||
+                          ((type == ASTNodeType::GOTOStmt || type == ASTNodeType::IFStmt) &&
+                           stmt.jump == opt::NO_STMT && !stmt.invalid_jump);
+        block.exits = ends;
+        block.succs.assign(succs.begin(), succs.end());
+    }
+    graph.connect();
+    graph.computeDominators();
+    graph.findLoops();
+    return graph;
+}
+
+void Graph::connect() {
+    for(size_t b = 0; b < blocks.size(); ++b) {
+        for(const auto s: blocks[b].succs) {
+            blocks[s].preds.push_back(b);
+        }
+    }
+}
+
+void Graph::computeDominators() {
+    // 从入口做DFS得到逆后序
+    std::vector<size_t> postorder;
+    std::vector<std::pair<size_t, size_t>> stack{{0, 0}};
+    blocks[0].reachable = true;
+    while(!stack.empty()) {
+        auto& [b, next] = stack.back();
+        if(next < blocks[b].succs.size()) {
+            const auto s = blocks[b].succs[next++];
+            if(!blocks[s].reachable) {
+                blocks[s].reachable = true;
+                stack.emplace_back(s, 0);
+            }
+            continue;
+        }
+        postorder.push_back(b);
+        stack.pop_back();
+    }
+    std::vector<size_t> order(blocks.size(), 0); // 后序编号
+    for(size_t i = 0; i < postorder.size(); ++i) {
+        order[postorder[i]] = i;
+    }
+    auto intersect = [&](size_t a, size_t b) {
+        while(a != b) {
+            while(order[a] < order[b]) {
+                a = blocks[a].idom;
+            }
+            while(order[b] < order[a]) {
+                b = blocks[b].idom;
+            }
+        }
+        return a;
+    };
+    blocks[0].idom = 0;
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(auto it = postorder.rbegin(); it != postorder.rend(); ++it) {
+            const auto b = *it;
+            if(b == 0) {
+                continue;
+            }
+            size_t idom = NO_BLOCK;
+            for(const auto p: blocks[b].preds) {
+                if(blocks[p].idom == NO_BLOCK) {
+                    continue; // 还没处理或者不可达
+                }
+                idom = idom == NO_BLOCK ? p : intersect(p, idom);
+            }
+            if(blocks[b].idom != idom) {
+                blocks[b].idom = idom;
+                changed = true;
+            }
+        }
+    }
+    blocks[0].idom = NO_BLOCK;
+    for(const auto& block: blocks) {
+        if(!block.reachable) {
+            unreachable.insert(unreachable.end(), block.lines.begin(), block.lines.end());
+        }
+    }
+}
+
+void Graph::findLoops() {
+    std::map<size_t, size_t> by_header;
+    for(size_t b = 0; b < blocks.size(); ++b) {
+        for(const auto s: blocks[b].succs) {
+            if(!blocks[b].reachable || !dominates(s, b)) {
+                continue;
+            }
+            auto [it, inserted] = by_header.emplace(s, loops.size());
+            if(inserted) {
+                loops.push_back(Loop{.header = s});
+            }
+            loops[it->second].latches.push_back(b);
+        }
+    }
+    for(auto& loop: loops) {
+        // 从回边的来源逆着边走到header
+        std::set<size_t> body{loop.header};
+        std::vector<size_t> work(loop.latches.begin(), loop.latches.end());
+        while(!work.empty()) {
+            const auto b = work.back();
+            work.pop_back();
+            if(!body.insert(b).second) {
+                continue;
+            }
+            for(const auto p: blocks[b].preds) {
+                if(blocks[p].reachable) {
+                    work.push_back(p);
+                }
+            }
+        }
+        loop.blocks.assign(body.begin(), body.end());
+    }
+    // 外层循环更大: 按大小从大到小处理, 最后写入的是最内层
+    std::vector<size_t> by_size(loops.size());
+    for(size_t i = 0; i < loops.size(); ++i) {
+        by_size[i] = i;
+    }
+    std::ranges::stable_sort(by_size, [&](size_t a, size_t b) {
+        return loops[a].blocks.size() > loops[b].blocks.size();
+    });
+    for(const auto l: by_size) {
+        auto& loop = loops[l];
+        for(const auto b: loop.blocks) {
+            if(blocks[b].loop != NO_BLOCK && loop.parent == NO_BLOCK && blocks[b].loop != l) {
+                loop.parent = blocks[b].loop;
+                loop.depth = loops[loop.parent].depth + 1;
+            }
+            blocks[b].loop = l;
+        }
+    }
+}
+
+size_t Graph::blockOf(int line_no) const {
+    auto it = line_block.find(line_no);
+    return it == line_block.end() ? NO_BLOCK : it->second;
+}
+
+bool Graph::dominates(size_t a, size_t b) const {
+    if(!blocks[a].reachable || !blocks[b].reachable) {
+        return false;
+    }
+    while(b != NO_BLOCK) {
+        if(a == b) {
+            return true;
+        }
+        b = blocks[b].idom;
+    }
+    return false;
+}
+
+int Graph::loopDepth(int line_no) const {
+    const auto b = blockOf(line_no);
+    if(b == NO_BLOCK || blocks[b].loop == NO_BLOCK) {
+        return 0;
+    }
+    return loops[blocks[b].loop].depth;
+}
+
+std::vector<std::string> Graph::dump() const {
+    std::vector<std::string> res;
+    for(size_t b = 0; b < blocks.size(); ++b) {
+        const auto& block = blocks[b];
+        auto line = fmt::format("B{} [{}-{}] ->", b, block.lines.front(), block.lines.back());
+        for(const auto s: block.succs) {
+            line += fmt::format(" B{}", s);
+        }
+        if(block.exits) {
+            line += " exit";
+        }
+        if(!block.reachable) {
+            line += " unreachable";
+        } else if(block.idom != NO_BLOCK) {
+            line += fmt::format(" idom B{}", block.idom);
+        }
+        if(block.loop != NO_BLOCK) {
+            line += fmt::format(" loop L{}", block.loop);
+        }
+        res.push_back(line);
+    }
+    return res;
+}
+
+} // namespace cfg
@@ -0,0 +1,95 @@
+//
+// Created by ayanami on 12/31/24.
+//
+// 控制流图: 把按行号排列的语句切成基本块, 给优化和各个编译层做分析
+// - 块的首行: 第一行, 跳转目标, GOTO/IF/END的下一行
+// - 边: GOTO到目标, IF到目标和下一行, 其余语句到下一行; END和最后一行之后没有后继(exits)
+// - 和interpret_SingleStep一致, 跳到自己所在的行等于没有跳转, 执行下一行
+// - 跳到不存在的行是invalidJumps(), 这条边不存在(运行时在这里报错)
+// - 支配树: Cooper-Harvey-Kennedy迭代算法, 只对从入口可达的块
+// - 循环: 回边(目标支配来源)确定的自然循环, 同一个header的回边合成一个循环, 按包含关系嵌套
+// - 也可以由优化引擎的程序(opt::Program)构建, 这时块里是语句下标, 边是语句的next/jump
+//
+#pragma once
+#ifndef CFG_H
+#define CFG_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include "parser.h"
+
+namespace opt {
+class Program;
+}
+
+namespace cfg {
+
+constexpr size_t NO_BLOCK = SIZE_MAX;
+
+using Block = struct Block {
+    std::vector<int> lines;
+    std::vector<size_t> succs; // 去重, 按块的顺序
+    std::vector<size_t> preds;
+    bool exits = false;        // END, 或者最后一行执行完以后程序结束
+    bool reachable = false;
+    size_t idom = NO_BLOCK;    // 入口和不可达的块没有
+    size_t loop = NO_BLOCK;    // 所在的最内层循环
+};
+
+using Loop = struct Loop {
+    size_t header = NO_BLOCK;
+    std::vector<size_t> latches; // 回边的来源
+    std::vector<size_t> blocks;  // 包括header, 升序
+    size_t parent = NO_BLOCK;    // 直接包含它的循环
+    int depth = 1;
+};
+
+using InvalidJump = struct InvalidJump {
+    int line;
+    int target;
+    bool operator==(const InvalidJump&) const = default;
+};
+
+class Graph {
+    std::vector<Block> blocks;
+    std::map<int, size_t> line_block;
+    std::vector<Loop> loops;
+    std::vector<int> unreachable;
+    std::vector<InvalidJump> invalid_jumps;
+    void link(const std::map<int, ASTNode*>& stmts);
+    void connect();
+    void computeDominators();
+    void findLoops();
+public:
+    static Graph build(const std::map<int, ASTNode*>& stmts);
+    // Block::lines和blockOf()用语句下标代替行号, 入口必须是第0条语句; invalidJumps()里仍是源码行号
+    static Graph build(const opt::Program& program);
+    [[nodiscard]] const std::vector<Block>& getBlocks() const {
+        return blocks;
+    }
+    [[nodiscard]] const std::vector<Loop>& getLoops() const {
+        return loops;
+    }
+    // 从第一行到不了的行, 升序
+    [[nodiscard]] const std::vector<int>& unreachableLines() const {
+        return unreachable;
+    }
+    // 目标行不存在的GOTO/IF, 按行号
+    [[nodiscard]] const std::vector<InvalidJump>& invalidJumps() const {
+        return invalid_jumps;
+    }
+    // 行不存在时返回NO_BLOCK
+    [[nodiscard]] size_t blockOf(int line_no) const;
+    // a支配b: 从入口到b的每条路径都经过a; 不可达的块不被任何块支配
+    [[nodiscard]] bool dominates(size_t a, size_t b) const;
+    // 行所在的循环层数, 不在循环里是0
+    [[nodiscard]] int loopDepth(int line_no) const;
+    // 每块一行: "B1 [17-18] -> B2 B5 idom B0 loop L0"
+    [[nodiscard]] std::vector<std::string> dump() const;
+};
+
+} // namespace cfg
+
+#endif // CFG_H
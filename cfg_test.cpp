@@ -0,0 +1,145 @@
+//
+// Created by ayanami on 12/31/24.
+//
+
+#include "cfg_test.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "cfg.h"
+#include "engine_test_util.h"
+using std::vector;
+using std::string;
+using fmt::format;
+using namespace engine_test;
+
+namespace {
+cfg::Graph build(Parser& parser, const vector<string>& lines) {
+    parser.reload(lines);
+    return cfg::Graph::build(parser.getStmts());
+}
+
+string joined(const vector<string>& lines) {
+    return fmt::format("{}", fmt::join(lines.begin(), lines.end(), "\n"));
+}
+}
+
+void cfg_test::initTestCase() {
+    qDebug() <<"Init test case\n";
+}
+
+void cfg_test::testBlocks() {
+    Parser parser(std::make_shared<Token::Tokenizer>());
+    {
+        CoutCapture capture;
+        parser.reload(std::filesystem::path("./programs/hard1.bas"));
+    }
+    auto graph = cfg::Graph::build(parser.getStmts());
+    const vector<string> expected = {
+        "B0 [3-16] -> B1",
+        "B1 [17-18] -> B2 B5 idom B0 loop L0",
+        "B2 [20-20] -> B3 B6 idom B1 loop L0",
+        "B3 [22-22] -> B4 B6 idom B2 loop L0",
+        "B4 [25-50] -> B1 idom B3 loop L0",
+        "B5 [2019-2021] -> exit idom B1",
+        "B6 [11199-11199] -> exit idom B2",
+    };
+    QVERIFY2(graph.dump() == expected, joined(graph.dump()).c_str());
+    // 50 GOTO 17 是回边, 循环是17-50
+    QCOMPARE(graph.getLoops().size(), size_t{1});
+    const auto& loop = graph.getLoops().front();
+    QCOMPARE(loop.header, graph.blockOf(17));
+    QCOMPARE(loop.latches, vector<size_t>{graph.blockOf(50)});
+    QCOMPARE(loop.blocks, (vector<size_t>{1, 2, 3, 4}));
+    QCOMPARE(graph.loopDepth(25), 1);
+    QCOMPARE(graph.loopDepth(9), 0);
+    QCOMPARE(graph.loopDepth(11199), 0);
+    QVERIFY(graph.dominates(graph.blockOf(17), graph.blockOf(44)));
+    QVERIFY(!graph.dominates(graph.blockOf(20), graph.blockOf(2020)));
+    QVERIFY(graph.unreachableLines().empty());
+    QVERIFY(graph.invalidJumps().empty());
+    QCOMPARE(graph.blockOf(4), cfg::NO_BLOCK);
+}
+
+void cfg_test::testNestedLoops() {
+    Parser parser(std::make_shared<Token::Tokenizer>());
+    auto graph = build(parser, {
+        "10 LET I = 0",
+        "20 LET J = 0",
+        "30 LET J = J + 1",
+        "40 IF J < 3 THEN 30",
+        "50 LET I = I + 1",
+        "60 IF I < 3 THEN 20",
+        "70 LET K = 0",
+        "80 LET K = K + 1",
+        "90 IF K < 5 THEN 80",
+        "100 END",
+    });
+    QCOMPARE(graph.getLoops().size(), size_t{3});
+    QCOMPARE(graph.loopDepth(10), 0);
+    QCOMPARE(graph.loopDepth(20), 1);
+    QCOMPARE(graph.loopDepth(30), 2);
+    QCOMPARE(graph.loopDepth(40), 2);
+    QCOMPARE(graph.loopDepth(50), 1);
+    QCOMPARE(graph.loopDepth(80), 1);
+    QCOMPARE(graph.loopDepth(100), 0);
+    const auto& loops = graph.getLoops();
+    const auto inner = loops[graph.getBlocks()[graph.blockOf(30)].loop];
+    const auto outer = loops[graph.getBlocks()[graph.blockOf(20)].loop];
+    QCOMPARE(inner.header, graph.blockOf(30));
+    QCOMPARE(outer.header, graph.blockOf(20));
+    QCOMPARE(loops[inner.parent].header, outer.header);
+    QCOMPARE(outer.parent, cfg::NO_BLOCK);
+    QCOMPARE(loops[graph.getBlocks()[graph.blockOf(80)].loop].parent, cfg::NO_BLOCK);
+    QVERIFY(graph.getBlocks()[graph.blockOf(100)].exits);
+}
+
+void cfg_test::testUnreachable() {
+    Parser parser(std::make_shared<Token::Tokenizer>());
+    auto graph = build(parser, {
+        "10 GOTO 40",
+        "20 PRINT 1",
+        "30 PRINT 2",
+        "40 IF 1 THEN 60",
+        "50 END",
+        "60 LET A = 1",
+        "70 GOTO 70",
+        "80 END",
+        "90 PRINT 3",
+    });
+    QCOMPARE(graph.unreachableLines(), (vector<int>{20, 30, 90}));
+    // 跳到自己等于执行下一行(和interpret_SingleStep一致), 所以80可达, 70不是循环
+    QVERIFY(graph.getBlocks()[graph.blockOf(80)].reachable);
+    QVERIFY(graph.getLoops().empty());
+    QVERIFY(!graph.dominates(graph.blockOf(20), graph.blockOf(20)));
+}
+
+void cfg_test::testInvalidJumps() {
+    const vector<string> lines = {"10 LET A = 1", "20 IF A THEN 25", "30 GOTO 100", "40 END"};
+    Parser parser(std::make_shared<Token::Tokenizer>());
+    auto graph = build(parser, lines);
+    QCOMPARE(graph.invalidJumps(), (vector<cfg::InvalidJump>{{20, 25}, {30, 100}}));
+    // 不存在的边不算: 30之后没有后继, 40不可达
+    QCOMPARE(graph.unreachableLines(), vector<int>{40});
+
+    // 默认运行到跳转时才报错
+    auto interpreter = newInterpreter();
+    interpreter->loadProgram(Token::programFromlines(lines));
+    auto res = run(*interpreter, "");
+    QVERIFY2(res.err.find("line 25 no exist") != string::npos, res.err.c_str());
+
+    // 加载时检查: 直接拒绝
+    interpreter = newInterpreter();
+    interpreter->setJumpCheck(true);
+    string err;
+    try {
+        interpreter->loadProgram(Token::programFromlines(lines));
+    } catch (std::exception& e) {
+        err = e.what();
+    }
+    QCOMPARE(err, string("Invalid jump at line 20: line 25 no exist"));
+    interpreter->loadProgram(Token::programFromlines({"10 LET A = 1", "20 IF A THEN 10"}));
+}
+
+void cfg_test::cleanupTestCase() {
+}
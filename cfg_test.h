@@ -0,0 +1,25 @@
+//
+// Created by ayanami on 12/31/24.
+//
+#pragma once
+#ifndef CFG_TEST_H
+#define CFG_TEST_H
+
+#include <QTest>
+#include <QObject>
+
+class cfg_test: public QObject{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void testBlocks();
+    void testNestedLoops();
+    void testUnreachable();
+    void testInvalidJumps();
+    void cleanupTestCase();
+};
+
+
+
+#endif //CFG_TEST_H
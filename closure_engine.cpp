@@ -0,0 +1,600 @@
+//
+// Created by ayanami on 12/25/24.
+//
+
+#include "closure_engine.h"
+#include <bit>
+#include <climits>
+#include <type_traits>
+#include <typeinfo>
+#include "interpreter.h"
+
+namespace closure {
+using Token::TokenType;
+
+namespace {
+// 和std::any::type().name()一致, 用于错误信息
+const char* typeName(ValueKind kind) {
+    switch(kind) {
+    case ValueKind::Int:
+        return typeid(int).name();
+    case ValueKind::Double:
+        return typeid(double).name();
+    default:
+        return typeid(string).name();
+    }
+}
+
+// 借用std::any里的值, 不支持的类型返回false
+bool load(const std::any& a, Value& out) {
+    if(auto i = std::any_cast<int>(&a)) {
+        out.kind = ValueKind::Int;
+        out.i = *i;
+        return true;
+    }
+    if(auto d = std::any_cast<double>(&a)) {
+        out.kind = ValueKind::Double;
+        out.d = *d;
+        return true;
+    }
+    if(auto s = std::any_cast<string>(&a)) {
+        out.kind = ValueKind::String;
+        out.s = s;
+        return true;
+    }
+    return false;
+}
+
+std::any toAny(const Value& v) {
+    switch(v.kind) {
+    case ValueKind::Int:
+        return v.i;
+    case ValueKind::Double:
+        return v.d;
+    default:
+        return *v.s;
+    }
+}
+
+Value numValue(ASTNode* node) {
+    Value v;
+    const auto& num = node->getValRef();
+    if(auto i = std::any_cast<int>(&num)) {
+        v.kind = ValueKind::Int;
+        v.i = *i;
+    } else {
+        v.kind = ValueKind::Double;
+        v.d = std::any_cast<double>(num);
+    }
+    return v;
+}
+
+template<TokenType Op>
+using OpConst = std::integral_constant<TokenType, Op>;
+
+// 除以正的常数d(d >= 2, 不是2的幂)换成乘法: x / d == floor(x * magic / 2^shift) + (x < 0),
+// magic和shift按Hacker's Delight 10-1计算, 对所有int的结果都和x / d一样
+using DivMagic = struct DivMagic {
+    int64_t magic = 0;
+    int shift = 0;
+};
+
+DivMagic divMagic(int d) {
+    constexpr uint32_t two31 = 0x80000000u;
+    const auto ad = static_cast<uint32_t>(d);
+    const uint32_t anc = two31 - 1 - two31 % ad;
+    int p = 31;
+    uint32_t q1 = two31 / anc, r1 = two31 - q1 * anc;
+    uint32_t q2 = two31 / ad, r2 = two31 - q2 * ad;
+    uint32_t delta = 0;
+    do {
+        p++;
+        q1 *= 2;
+        r1 *= 2;
+        if(r1 >= anc) {
+            q1++;
+            r1 -= anc;
+        }
+        q2 *= 2;
+        r2 *= 2;
+        if(r2 >= ad) {
+            q2++;
+            r2 -= ad;
+        }
+        delta = ad - r2;
+    } while(q1 < delta || (q1 == delta && r1 == 0));
+    return {static_cast<int64_t>(q2) + 1, p};
+}
+
+int divide(int x, const DivMagic& m) {
+    return static_cast<int>((m.magic * x) >> m.shift) + (x < 0 ? 1 : 0);
+}
+
+constexpr int MAX_POW_CHAIN = 64; // 更大的指数只有|x| <= 1时不溢出, 不值得特化
+} // namespace
+
+// 子表达式: 数字字面量直接内联成常量, 其余是子闭包
+using Operand = struct Operand {
+    ExprFn fn;
+    bool is_const = false;
+    bool is_var = false; // 父节点借用变量的值时计入var_reads
+    Value constant{};
+};
+
+// 每个闭包做的事情和Interpreter对应的visit_XXX完全一样, 包括PerfCounters:
+// 进入节点时countNode(先序), 子节点都求值成功后父节点再借用它们的值(var_reads, eval_allocations)
+class Compiler {
+    std::shared_ptr<Program> program = std::make_shared<Program>();
+    std::map<string, VarSlot*, std::less<>> slot_of;
+    const Facts& facts;
+
+    static PerfCounters& counters(Frame& f) {
+        return f.interpreter.status.counters;
+    }
+    static ProgramStatus& status(Frame& f) {
+        return f.interpreter.status;
+    }
+
+    VarSlot* slot(const string& name) {
+        if(auto it = slot_of.find(name); it != slot_of.end()) {
+            return it->second;
+        }
+        auto& s = program->vars.emplace_back();
+        s.name = name;
+        slot_of.emplace(name, &s);
+        return &s;
+    }
+
+    static bool eval(Frame& f, const Operand& o, Value& out) {
+        if(o.is_const) {
+            counters(f).countNode(ASTNodeType::Num);
+            out = o.constant;
+            return true;
+        }
+        return o.fn(f, out);
+    }
+    // Interpreter::borrowNodeVal
+    static void borrowed(Frame& f, const Operand& o, const Value& v) {
+        auto& c = counters(f);
+        if(o.is_var) {
+            c.var_reads++;
+        }
+        if(v.kind == ValueKind::String) {
+            c.eval_allocations++;
+        }
+    }
+    // Interpreter::visit_Expr + borrowNodeVal: 语句使用的整个表达式
+    static bool consume(Frame& f, const Operand& o, bool is_string, Value& out) {
+        if(!eval(f, o, out)) {
+            return false;
+        }
+        if(is_string) {
+            counters(f).eval_allocations++; // 顶层字符串的值会被复制一次
+        }
+        borrowed(f, o, out);
+        return true;
+    }
+
+    // 和Interpreter::evalBinOp的检查顺序一致; OpT是OpConst时运算符是编译期常量
+    template<typename OpT>
+    static bool binary(Frame& f, const Value& l, const Value& r, OpT op, Value& out) {
+        if(l.kind != r.kind) {
+            f.interpreter.fail(ErrorKind::TypeMismatch, fmt::format("BinOpNode: type unmatched: {} and {}",
+                                                                    typeName(l.kind), typeName(r.kind)));
+            return false;
+        }
+        auto err = ErrorKind::Ok;
+        switch(l.kind) {
+        case ValueKind::Int:
+            out.kind = ValueKind::Int;
+            err = tryBinOp<int>(l.i, r.i, op, out.i);
+            break;
+        case ValueKind::Double:
+            out.kind = ValueKind::Double;
+            err = tryBinOp<double>(l.d, r.d, op, out.d);
+            break;
+        case ValueKind::String:
+            // 和evalBinWithAny<std::string>一致, 字符串不支持运算
+            f.interpreter.fail(ErrorKind::TypeMismatch,
+                               fmt::format("evalWithAny: Unsupport type {}", typeid(std::string).name()));
+            return false;
+        }
+        if(err != ErrorKind::Ok) {
+            f.interpreter.fail(err, binOpErrorMessage(err, op));
+            return false;
+        }
+        return true;
+    }
+    template<typename OpT>
+    static ExprFn binOp(Operand l, Operand r, OpT op) {
+        return [l = std::move(l), r = std::move(r), op](Frame& f, Value& out) {
+            counters(f).countNode(ASTNodeType::BinOp);
+            Value lv, rv;
+            // 右结合的运算符先算右边
+            const bool ok = Token::isRightAssociative(op) ? eval(f, r, rv) && eval(f, l, lv)
+                                                          : eval(f, l, lv) && eval(f, r, rv);
+            if(!ok) {
+                return false;
+            }
+            borrowed(f, l, lv);
+            borrowed(f, r, rv);
+            return binary(f, lv, rv, op, out);
+        };
+    }
+    // 特化的int运算: 两边都是int时直接算fn, 结果(包括溢出)和tryBinOp完全一样;
+    // 否则走binary()报同样的错. 求值顺序和计数器和binOp一样
+    template<typename Fn>
+    static ExprFn intOp(Operand l, Operand r, TokenType op, Fn fn) {
+        return [l = std::move(l), r = std::move(r), op, fn](Frame& f, Value& out) {
+            counters(f).countNode(ASTNodeType::BinOp);
+            Value lv, rv;
+            const bool ok = Token::isRightAssociative(op) ? eval(f, r, rv) && eval(f, l, lv)
+                                                          : eval(f, l, lv) && eval(f, r, rv);
+            if(!ok) {
+                return false;
+            }
+            borrowed(f, l, lv);
+            borrowed(f, r, rv);
+            if(lv.kind != ValueKind::Int || rv.kind != ValueKind::Int) {
+                return binary(f, lv, rv, op, out);
+            }
+            out.kind = ValueKind::Int;
+            out.i = fn(lv.i, rv.i);
+            return true;
+        };
+    }
+    // x ** c换成乘法链, x / c和x MOD c(c > 0)换成移位/掩码或者乘法; 不能特化时返回空
+    static ExprFn constRight(const Operand& l, const Operand& r, TokenType op) {
+        const int c = r.constant.i;
+        switch(op) {
+        case TokenType::OP_POW:
+            if(c < 0 || c > MAX_POW_CHAIN) {
+                return {};
+            }
+            return intOp(l, r, op, [c](int x, int) {
+                int64_t p = 1;
+                for(int k = 0; k < c; ++k) {
+                    p *= x;
+                    if(p > INT_MAX || p < INT_MIN) {
+                        // std::pow的结果转换成int不是回绕, 溢出时用原来的算法
+                        int out = 0;
+                        tryBinOp<int>(x, c, TokenType::OP_POW, out);
+                        return out;
+                    }
+                }
+                return static_cast<int>(p);
+            });
+        case TokenType::OP_DIV:
+        case TokenType::OP_MOD: {
+            if(c <= 0) {
+                return {};
+            }
+            if(std::has_single_bit(static_cast<unsigned>(c))) {
+                const int mask = c - 1;
+                if(op == TokenType::OP_MOD) {
+                    // 除数为正时BASIC MOD的结果在[0, c)里, 就是补码的低位
+                    return intOp(l, r, op, [mask](int x, int) { return x & mask; });
+                }
+                // 向零取整: 负数先加上c - 1再算术右移
+                const int shift = std::countr_zero(static_cast<unsigned>(c));
+                return intOp(l, r, op, [mask, shift](int x, int) { return (x + ((x >> 31) & mask)) >> shift; });
+            }
+            const auto magic = divMagic(c);
+            if(op == TokenType::OP_DIV) {
+                return intOp(l, r, op, [magic](int x, int) { return divide(x, magic); });
+            }
+            return intOp(l, r, op, [magic, c](int x, int) {
+                const int m = x - divide(x, magic) * c;
+                return m < 0 ? m + c : m;
+            });
+        }
+        default:
+            return {};
+        }
+    }
+    // 值域分析证明不需要的检查: 除零, MOD的符号修正, 幂的溢出; 没有可用的事实时返回空
+    ExprFn proven(BinOpNode* node, const Operand& l, const Operand& r) const {
+        const auto op = node->getOp();
+        if(op == TokenType::OP_POW && r.is_const && r.constant.kind == ValueKind::Int && facts.no_overflow.contains(node)) {
+            return intOp(l, r, op, [c = r.constant.i](int x, int) {
+                int p = 1;
+                for(int k = 0; k < c; ++k) {
+                    p *= x;
+                }
+                return p;
+            });
+        }
+        // 常数除数由constRight处理
+        if(r.is_const || !facts.nonzero_divisor.contains(node)) {
+            return {};
+        }
+        if(op == TokenType::OP_DIV) {
+            return intOp(l, r, op, [](int x, int y) { return x / y; });
+        }
+        if(op != TokenType::OP_MOD) {
+            return {};
+        }
+        if(facts.non_negative.contains(node)) {
+            return intOp(l, r, op, [](int x, int y) { return x % y; });
+        }
+        return intOp(l, r, op, [](int x, int y) {
+            const int m = x % y;
+            return (m > 0 && y < 0) || (m < 0 && y > 0) ? m + y : m;
+        });
+    }
+    template<typename OpT>
+    static ExprFn unaryOp(Operand e, OpT op) {
+        return [e = std::move(e), op](Frame& f, Value& out) {
+            counters(f).countNode(ASTNodeType::UnaryOp);
+            Value v;
+            if(!eval(f, e, v)) {
+                return false;
+            }
+            borrowed(f, e, v);
+            auto err = ErrorKind::Ok;
+            switch(v.kind) {
+            case ValueKind::Int:
+                out.kind = ValueKind::Int;
+                err = tryUnaryOp<int>(v.i, op, out.i);
+                break;
+            case ValueKind::Double:
+                out.kind = ValueKind::Double;
+                err = tryUnaryOp<double>(v.d, op, out.d);
+                break;
+            default:
+                err = ErrorKind::TypeMismatch;
+                break;
+            }
+            if(err != ErrorKind::Ok) {
+                f.interpreter.fail(err, err == ErrorKind::TypeMismatch
+                    ? fmt::format("UnaryOpNode: Invalid unary operator {}", tk2Str(op))
+                    : fmt::format("Invalid unary operator {}", tk2Str(op)));
+                return false;
+            }
+            return true;
+        };
+    }
+
+    Operand operand(ASTNode* node) {
+        Operand o;
+        if(node->type() == ASTNodeType::Num) {
+            o.is_const = true;
+            o.constant = numValue(node);
+            return o;
+        }
+        o.is_var = node->type() == ASTNodeType::Var;
+        o.fn = expr(node);
+        return o;
+    }
+
+    ExprFn binOp(BinOpNode* node) {
+        if(node->getLeft() == nullptr || node->getRight() == nullptr) {
+            return [](Frame& f, Value&) {
+                counters(f).countNode(ASTNodeType::BinOp);
+                f.interpreter.fail(ErrorKind::Internal, "BinOpNode: left or right is nullptr");
+                return false;
+            };
+        }
+        auto l = operand(node->getLeft());
+        auto r = operand(node->getRight());
+        if(auto fn = proven(node, l, r)) {
+            return fn;
+        }
+        if(r.is_const && r.constant.kind == ValueKind::Int) {
+            if(auto fn = constRight(l, r, node->getOp())) {
+                return fn;
+            }
+        }
+        switch(node->getOp()) {
+        case TokenType::OP_ADD:
+            return binOp(std::move(l), std::move(r), OpConst<TokenType::OP_ADD>{});
+        case TokenType::OP_SUB:
+            return binOp(std::move(l), std::move(r), OpConst<TokenType::OP_SUB>{});
+        case TokenType::OP_MUL:
+            return binOp(std::move(l), std::move(r), OpConst<TokenType::OP_MUL>{});
+        case TokenType::OP_DIV:
+            return binOp(std::move(l), std::move(r), OpConst<TokenType::OP_DIV>{});
+        case TokenType::OP_MOD:
+            return binOp(std::move(l), std::move(r), OpConst<TokenType::OP_MOD>{});
+        case TokenType::OP_POW:
+            return binOp(std::move(l), std::move(r), OpConst<TokenType::OP_POW>{});
+        case TokenType::OP_GT:
+            return binOp(std::move(l), std::move(r), OpConst<TokenType::OP_GT>{});
+        case TokenType::OP_LT:
+            return binOp(std::move(l), std::move(r), OpConst<TokenType::OP_LT>{});
+        case TokenType::OP_GE:
+            return binOp(std::move(l), std::move(r), OpConst<TokenType::OP_GE>{});
+        case TokenType::OP_LE:
+            return binOp(std::move(l), std::move(r), OpConst<TokenType::OP_LE>{});
+        case TokenType::OP_EQ:
+            return binOp(std::move(l), std::move(r), OpConst<TokenType::OP_EQ>{});
+        case TokenType::OP_NE:
+            return binOp(std::move(l), std::move(r), OpConst<TokenType::OP_NE>{});
+        default:
+            // 不合法的运算符在运行时报错, 和树解释器一样
+            return binOp(std::move(l), std::move(r), node->getOp());
+        }
+    }
+
+    ExprFn unaryOp(UnaryOpNode* node) {
+        auto e = operand(node->getExpr());
+        switch(node->getOp()) {
+        case TokenType::OP_ADD:
+            return unaryOp(std::move(e), OpConst<TokenType::OP_ADD>{});
+        case TokenType::OP_SUB:
+            return unaryOp(std::move(e), OpConst<TokenType::OP_SUB>{});
+        default:
+            return unaryOp(std::move(e), node->getOp());
+        }
+    }
+
+    ExprFn expr(ASTNode* node) {
+        switch(node->type()) {
+        case ASTNodeType::Num:
+            return [v = numValue(node)](Frame& f, Value& out) {
+                counters(f).countNode(ASTNodeType::Num);
+                out = v;
+                return true;
+            };
+        case ASTNodeType::String:
+            return [s = static_cast<StringNode*>(node)->getString()](Frame& f, Value& out) {
+                counters(f).countNode(ASTNodeType::String);
+                out.kind = ValueKind::String;
+                out.s = &s;
+                return true;
+            };
+        case ASTNodeType::Var:
+            return [var = slot(static_cast<VarNode*>(node)->getName())](Frame& f, Value& out) {
+                counters(f).countNode(ASTNodeType::Var);
+                auto v = var->resolve(f.table);
+                if(v == nullptr) {
+                    f.interpreter.fail(ErrorKind::UndefinedVar, fmt::format("var {} not found", var->name));
+                    return false;
+                }
+                if(!load(*v, out)) {
+                    f.interpreter.fail(ErrorKind::Internal, fmt::format("var {} has unsupported type {}",
+                                                                        var->name, v->type().name()));
+                    return false;
+                }
+                return true;
+            };
+        case ASTNodeType::UnaryOp:
+            return unaryOp(static_cast<UnaryOpNode*>(node));
+        case ASTNodeType::BinOp:
+            return binOp(static_cast<BinOpNode*>(node));
+        default:
+            throw std::runtime_error(fmt::format("compile: unsupported expression node {}", ast2Str(node->type())));
+        }
+    }
+
+    StmtFn stmt(ASTNode* node) {
+        if(node->type() == ASTNodeType::FusedStmt) {
+            // 融合节点是树解释器的快速路径, 这里按原来的语句编译
+            node = static_cast<FusedStmtNode*>(node)->getOriginal();
+        }
+        switch(node->type()) {
+        case ASTNodeType::AssignStmt: {
+            auto assign = static_cast<AssignStmtNode*>(node);
+            auto right = assign->getRight();
+            return [e = operand(right), is_string = right->type() == ASTNodeType::String,
+                    var = slot(assign->getLeft()->getName())](Frame& f) {
+                auto& c = counters(f);
+                c.countNode(ASTNodeType::AssignStmt);
+                Value v;
+                if(!consume(f, e, is_string, v)) {
+                    return;
+                }
+                c.var_writes++;
+                // 先复制出来: LET A = A 时v借用的就是A的存储
+                auto value = toAny(v);
+                if(auto p = var->resolve(f.table)) {
+                    *p = std::move(value);
+                } else {
+                    f.table.set(var->name, value);
+                    c.symbol_insertions++;
+                }
+            };
+        }
+        case ASTNodeType::GOTOStmt:
+            return [line = static_cast<GOTOStmtNode*>(node)->getLineNo()](Frame& f) {
+                counters(f).countNode(ASTNodeType::GOTOStmt);
+                status(f).next_line = line;
+            };
+        case ASTNodeType::EndStmt:
+            return [](Frame& f) {
+                counters(f).countNode(ASTNodeType::EndStmt);
+                status(f).running = false;
+            };
+        case ASTNodeType::PrintStmt: {
+            auto expr = static_cast<PrintStmtNode*>(node)->getExpr();
+            return [e = operand(expr), is_string = expr->type() == ASTNodeType::String](Frame& f) {
+                counters(f).countNode(ASTNodeType::PrintStmt);
+                Value v;
+                if(!consume(f, e, is_string, v)) {
+                    return;
+                }
+                // Interpreter::printValue
+                switch(v.kind) {
+                case ValueKind::Int:
+                    f.interpreter.output(fmt::format("{}", v.i));
+                    break;
+                case ValueKind::Double:
+                    f.interpreter.output(fmt::format("{}", v.d));
+                    break;
+                case ValueKind::String:
+                    f.interpreter.output(fmt::format("{}", *v.s));
+                    break;
+                }
+            };
+        }
+        case ASTNodeType::InputStmt:
+            return [name = static_cast<InputStmtNode*>(node)->getVar()->getName()](Frame& f) {
+                counters(f).countNode(ASTNodeType::InputStmt);
+                f.interpreter.inputVar(name);
+            };
+        case ASTNodeType::IFStmt: {
+            auto if_stmt = static_cast<IFStmtNode*>(node);
+            auto cond = if_stmt->getCond();
+            return [e = operand(cond), is_string = cond->type() == ASTNodeType::String,
+                    next = if_stmt->getNext()](Frame& f) {
+                counters(f).countNode(ASTNodeType::IFStmt);
+                Value v;
+                if(!consume(f, e, is_string, v)) {
+                    return;
+                }
+                // Interpreter::evalCond
+                bool jump = false;
+                switch(v.kind) {
+                case ValueKind::Int:
+                    jump = v.i != 0;
+                    break;
+                case ValueKind::Double:
+                    f.interpreter.fail(ErrorKind::TypeMismatch, "bad any_cast");
+                    return;
+                case ValueKind::String:
+                    jump = !v.s->empty();
+                    break;
+                }
+                if(jump) {
+                    status(f).next_line = next;
+                }
+            };
+        }
+        case ASTNodeType::RemStmt:
+            return [](Frame& f) {
+                counters(f).countNode(ASTNodeType::RemStmt);
+            };
+        default:
+            // 单独的表达式行: 只求值, 结果不被使用
+            return [e = operand(node)](Frame& f) {
+                Value v;
+                eval(f, e, v);
+            };
+        }
+    }
+
+public:
+    explicit Compiler(const Facts& facts): facts(facts) {}
+
+    std::shared_ptr<Program> run(const std::map<int, ASTNode*>& ast) {
+        for(const auto& [line_no, node]: ast) {
+            if(node == nullptr) {
+                throw std::runtime_error(fmt::format("compile: line {} has no statement", line_no));
+            }
+            program->stmts.emplace(line_no, stmt(node));
+        }
+        if(!program->stmts.empty() && program->stmts.begin()->first == 0 &&
+           program->stmts.rbegin()->first == static_cast<int>(program->stmts.size()) - 1) {
+            for(const auto& [index, fn]: program->stmts) {
+                program->dense.push_back(&fn);
+            }
+        }
+        return program;
+    }
+};
+
+std::shared_ptr<Program> compile(const std::map<int, ASTNode*>& ast, const Facts& facts) {
+    return Compiler(facts).run(ast);
+}
+
+} // namespace closure
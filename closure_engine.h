@@ -0,0 +1,112 @@
+//
+// Created by ayanami on 12/25/24.
+//
+// 闭包编译: 加载时把每条语句的AST转换成嵌套的可调用对象, 运行时不再遍历AST
+// - 运算符在编译期确定: 每个运算符是一个单独实例化的闭包, 求值时没有doBinOp里的switch
+// - 类型检查是Value::kind的整数比较, 不经过std::any和evalBinWithAny
+// - 变量绑定到SymbolTable里值的地址, 只在表被清空/替换(generation变化)后重新查找
+// 语义(包括错误信息和PerfCounters)和树解释器逐条一致, 由closure_test对比
+//
+#pragma once
+#ifndef CLOSURE_ENGINE_H
+#define CLOSURE_ENGINE_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include "parser.h"
+
+class Interpreter;
+
+namespace closure {
+
+enum class ValueKind: uint8_t {
+    Int,
+    Double,
+    String,
+};
+// 闭包之间传递的值: 数值不装箱; 字符串只会来自字面量和变量, 借用它们的存储
+using Value = struct Value {
+    ValueKind kind = ValueKind::Int;
+    int i = 0;
+    double d = 0;
+    const string* s = nullptr;
+};
+
+// 变量名绑定到SymbolTable中值的地址
+using VarSlot = struct VarSlot {
+    string name;
+    uint64_t generation = 0;
+    std::any* value = nullptr;
+
+    // 变量不存在时返回nullptr
+    std::any* resolve(SymbolTable& table) {
+        if(value != nullptr && generation == table.getGeneration()) {
+            return value;
+        }
+        value = table.find(name);
+        generation = table.getGeneration();
+        return value;
+    }
+};
+
+using Frame = struct Frame {
+    Interpreter& interpreter;
+    SymbolTable& table;
+};
+// 出错时已经调用过Interpreter::fail(), 返回false
+using ExprFn = std::function<bool(Frame&, Value&)>;
+using StmtFn = std::function<void(Frame&)>;
+
+class Program {
+    std::map<int, StmtFn> stmts;
+    std::vector<const StmtFn*> dense; // 键正好是0..n-1时(优化引擎按语句下标编译)直接按下标找, 否则为空
+    std::deque<VarSlot> vars; // 闭包里保存的是地址, deque扩容时不移动元素
+    friend class Compiler;
+public:
+    // 执行line_no对应的语句, 行不存在时返回false
+    bool run(Frame& frame, int line_no) const {
+        if(!dense.empty()) {
+            if(line_no < 0 || static_cast<size_t>(line_no) >= dense.size()) {
+                return false;
+            }
+            (*dense[line_no])(frame);
+            return true;
+        }
+        auto it = stmts.find(line_no);
+        if(it == stmts.end()) {
+            return false;
+        }
+        it->second(frame);
+        return true;
+    }
+    [[nodiscard]] size_t size() const {
+        return stmts.size();
+    }
+    [[nodiscard]] size_t varCount() const {
+        return vars.size();
+    }
+};
+
+// 编译期可以访问Interpreter的内部状态(计数器, next_line), 生成的闭包也一样
+class Compiler;
+
+// 静态分析(opt_range.cpp)证明了不需要的运行时检查, 按BinOp节点记录;
+// 编译出的闭包仍然检查操作数是不是int, 不是时走通用的路径
+using Facts = struct Facts {
+    std::set<const ASTNode*> nonzero_divisor; // DIV/MOD不检查除零
+    std::set<const ASTNode*> non_negative;    // MOD两边都 >= 0(除数 > 0), 不做符号修正
+    std::set<const ASTNode*> no_overflow;     // 常数的幂不超出int, 乘法链不检查溢出
+};
+
+// throws: std::runtime_error 遇到不支持的节点
+std::shared_ptr<Program> compile(const std::map<int, ASTNode*>& ast, const Facts& facts = {});
+
+} // namespace closure
+
+#endif // CLOSURE_ENGINE_H
@@ -0,0 +1,166 @@
+//
+// Created by ayanami on 12/25/24.
+//
+
+#include "closure_test.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "closure_engine.h"
+#include "workload_gen.h"
+#include "engine_test_util.h"
+using std::vector;
+using std::string;
+using fmt::format;
+using namespace engine_test;
+
+void closure_test::initTestCase() {
+    qDebug() <<"Init test case\n";
+}
+
+void closure_test::testMatchesTreeWalker() {
+    vector<std::pair<string, string>> files = {
+        {"./programs/fib.bas", ""},
+        {"./programs/default.bas", ""},
+        {"./programs/sum_of_1ton.bas", "10\n"},
+        {"./programs/sum_of_two.bas", "7\n5\n"},
+        {"./programs/factorial.bas", "6\n"},
+        {"./programs/even_or_odd.bas", "7\n"},
+        {"./programs/is_prime.bas", "67\n"},
+        {"./programs/hard1.bas", "100\n"},
+        {"./programs/hard2.bas", "100\n"},
+        {"./programs/loop1.bas", ""},
+        {"./programs/mod1.bas", ""},
+        {"./programs/mod2.bas", ""},
+        {"./programs/1.bas", ""},
+        {"./programs/2.bas", ""},
+    };
+    for(const auto& [file, input]: files) {
+        auto tree = newInterpreter();
+        tree->loadFile(file);
+        auto closures = newInterpreter();
+        closures->loadFile(file);
+        closures->setEngine(EngineKind::Closure);
+        QVERIFY(closures->getEngine() == EngineKind::Closure);
+        auto expected = run(*tree, input);
+        auto actual = run(*closures, input);
+        QVERIFY2(same(expected, actual), format("{}:\n  tree {}\n  closure {}", file,
+            describe(expected), describe(actual)).c_str());
+    }
+    vector<workload::GenOptions> cases = {
+        {.seed = 21, .lines = 200, .vars = 20},
+        {.seed = 22, .lines = 200, .expr_depth = 6, .vars = 5},
+        {.seed = 23, .lines = 300, .goto_density = 0.3},
+        {.seed = 24, .lines = 200, .loop_density = 0.2, .loop_trips = 15},
+    };
+    for(const auto& opt: cases) {
+        auto program = workload::generate(opt);
+        auto expected = runLines(program.lines, EngineKind::TreeWalker);
+        auto actual = runLines(program.lines, EngineKind::Closure);
+        QVERIFY2(expected.err.empty(), expected.err.c_str());
+        QVERIFY2(same(expected, actual), format("seed {}:\n  tree {}\n  closure {}", opt.seed,
+            describe(expected), describe(actual)).c_str());
+    }
+}
+
+void closure_test::testErrors() {
+    vector<vector<string>> programs = {
+        {"10 LET A = 1", "20 GOTO 100", "30 END"},
+        {"10 LET S = \"a\"", "20 LET T = S + \"b\""},
+        {"10 LET S = \"a\"", "20 LET T = S + 1"},
+        {"10 LET S = \"a\"", "20 LET T = -S"},
+        {"10 LET S = \"a\"", "20 LET S = S", "30 PRINT S", "40 IF S THEN 60", "50 END", "60 PRINT \"b\""},
+        {"10 LET X = \"x\"", "20 IF X THEN 40", "30 END", "40 PRINT 1"},
+        {"10 PRINT UNKNOWN + 1"},
+        {"10 LET A = 1", "20 PRINT (A + 2) * -(3 - B) + A ** 2 ** C"},
+        {"10 LET A = 1", "20 PRINT A + 2 ** (3 * B) ** 2"},
+        {"10 LET A = 1 / 0"},
+        {"10 LET A = 7 MOD (3 - 3)"},
+        {"10 LET A = 2", "20 2 * A", "30 2 + UNKNOWN", "40 END"},
+    };
+    for(const auto& lines: programs) {
+        auto expected = runLines(lines, EngineKind::TreeWalker);
+        auto actual = runLines(lines, EngineKind::Closure);
+        QVERIFY2(same(expected, actual), format("{}:\n  tree {}\n  closure {}", lines.back(),
+            describe(expected), describe(actual)).c_str());
+    }
+}
+
+// 闭包里缓存了变量在SymbolTable中的地址, 表被清空或者换掉以后必须重新查找
+void closure_test::testRebind() {
+    auto interpreter = newInterpreter();
+    interpreter->loadProgram(Token::programFromlines({"10 LET A = 1", "20 LET A = A + 1", "30 LET B = A * 10"}));
+    interpreter->setEngine(EngineKind::Closure);
+    QVERIFY(run(*interpreter, "").err.empty());
+    QVERIFY(interpreter->getEnv()->symbol_table->get<int>("B") == 20);
+
+    interpreter->reset(true);
+    QVERIFY(interpreter->getEnv()->symbol_table->getRepl().empty());
+    QVERIFY(run(*interpreter, "").err.empty());
+    QVERIFY(interpreter->getEnv()->symbol_table->get<int>("B") == 20);
+
+    auto old_env = interpreter->getEnv();
+    interpreter->setEnv(interpreter->copyEnv());
+    old_env->symbol_table->set<int>("A", 50);
+    interpreter->resetStatusOnly();
+    QVERIFY(run(*interpreter, "").err.empty());
+    QVERIFY(interpreter->getEnv()->symbol_table->get<int>("A") == 2);
+    QVERIFY(old_env->symbol_table->get<int>("A") == 50);
+    QVERIFY(old_env->symbol_table->get<int>("B") == 20);
+
+    // 变量的类型改变时原地覆盖
+    interpreter->reload(vector<string>{"10 LET A = 1", "20 LET A = \"s\"", "30 LET A = 2.5 / 2"});
+    QVERIFY(interpreter->getEngine() == EngineKind::TreeWalker);
+    interpreter->setEngine(EngineKind::Closure);
+    auto expected = runLines({"10 LET A = 1", "20 LET A = \"s\"", "30 LET A = 2.5 / 2"}, EngineKind::TreeWalker);
+    auto actual = run(*interpreter, "");
+    QVERIFY2(same(expected, actual), format("\n  tree {}\n  closure {}", describe(expected),
+        describe(actual)).c_str());
+}
+
+void closure_test::testEngineSwitch() {
+    auto interpreter = newInterpreter();
+    interpreter->loadFile("./programs/factorial.bas");
+    interpreter->setEngine(EngineKind::Closure);
+    QVERIFY(interpreter->getEngine() == EngineKind::Closure);
+    interpreter->setEngine(EngineKind::Flat);
+    QVERIFY(interpreter->getEngine() == EngineKind::Flat);
+    interpreter->setEngine(EngineKind::Closure);
+    QVERIFY(interpreter->getEngine() == EngineKind::Closure);
+    QVERIFY(run(*interpreter, "5\n").err.empty());
+    QVERIFY(interpreter->getEnv()->symbol_table->get<int>("fact") == 120);
+
+    // 源码没变: 复用解析结果, 也保留闭包
+    interpreter->loadFile("./programs/factorial.bas");
+    QVERIFY(interpreter->getEngine() == EngineKind::Closure);
+    QVERIFY(run(*interpreter, "4\n").err.empty());
+    QVERIFY(interpreter->getEnv()->symbol_table->get<int>("fact") == 24);
+
+    interpreter->setEngine(EngineKind::TreeWalker);
+    QVERIFY(interpreter->getEngine() == EngineKind::TreeWalker);
+    interpreter->setEngine(EngineKind::Closure);
+    interpreter->loadProgram(Token::programFromlines({"10 PRINT 1"}));
+    QVERIFY(interpreter->getEngine() == EngineKind::TreeWalker);
+
+    // 从mmap的镜像切换: 重新parse再编译
+    auto src = std::filesystem::temp_directory_path() / format("qbasic_closure_test_{}.bas", getpid());
+    std::filesystem::copy_file("./programs/fib.bas", src, std::filesystem::copy_options::overwrite_existing);
+    auto first = newInterpreter();
+    first->setImageCache(true);
+    first->loadFile(src);
+    auto expected = run(*first, "");
+    auto mapped = newInterpreter();
+    mapped->setImageCache(true);
+    mapped->loadFile(src);
+    QVERIFY(mapped->getCompiled()->isMapped());
+    mapped->setEngine(EngineKind::Closure);
+    QVERIFY(mapped->getEngine() == EngineKind::Closure);
+    auto actual = run(*mapped, "");
+    std::filesystem::remove(src);
+    std::filesystem::remove(qbc::imagePathFor(src));
+    QVERIFY2(same(expected, actual), format("\n  flat {}\n  closure {}", describe(expected),
+        describe(actual)).c_str());
+}
+
+void closure_test::cleanupTestCase() {
+}
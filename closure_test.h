@@ -0,0 +1,25 @@
+//
+// Created by ayanami on 12/25/24.
+//
+#pragma once
+#ifndef CLOSURE_TEST_H
+#define CLOSURE_TEST_H
+
+#include <QTest>
+#include <QObject>
+
+class closure_test: public QObject{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void testMatchesTreeWalker();
+    void testErrors();
+    void testRebind();
+    void testEngineSwitch();
+    void cleanupTestCase();
+};
+
+
+
+#endif //CLOSURE_TEST_H
@@ -43,10 +43,35 @@ void CmdExecutor::runCmd(Command cmd, const std::vector<std::string>& argv) {
     }
 
 }
+// 重新加载程序后引擎回到树解释器, 按CHANGE_MODE的优化设置重新选择
+void CmdExecutor::applyEngine() {
+    if(optimize) {
+        interpreter->setOptOptions(opt_options);
+        interpreter->setEngine(EngineKind::Optimized);
+    }
+}
 void CmdExecutor::handleCmdChangeMode(const vector<std::string>& argv) {
+    if(argv.size() == 2 && argv[0] == "PASSES") {
+        auto dump_after = std::move(opt_options.dump_after);
+        opt_options = opt::passOptions(argv[1]);
+        opt_options.dump_after = std::move(dump_after);
+        optimize = true;
+        return;
+    }
+    if(argv.size() == 2 && argv[0] == "DUMP_AFTER") {
+        opt_options.dump_after = opt::parseDumpAfter(argv[1]);
+        return;
+    }
     if (argv.size() != 1) {
         throw std::runtime_error("Invalid arguments");
     }
+    if(auto level = opt::parseLevel(argv[0])) {
+        auto dump_after = std::move(opt_options.dump_after);
+        opt_options = opt::levelOptions(*level);
+        opt_options.dump_after = std::move(dump_after);
+        optimize = *level > 0;
+        return;
+    }
     static std::set<std::string> modes = {"DEBUG", "NORMAL", "DEV"};
     if (modes.find(argv[0]) == modes.end()) {
             throw std::runtime_error("Invalid mode");
@@ -68,12 +93,14 @@ void CmdExecutor::handleCmdLoad(const vector<std::string>& argv) {
     }
     choosed_file = argv[0];
     interpreter->loadFile(choosed_file, mode);
+    applyEngine();
 }
 void CmdExecutor::handleCmdDebug(const vector<std::string>& argv) {
     try {
         mode = ProgramMode::DEBUG;
         interpreter->setMode(ProgramMode::DEBUG);
         interpreter->reload();
+        applyEngine();
     } catch (std::exception& e) {
         print("Failed to debug program: {}\n", e.what());
         emit sendError(QString::fromStdString(e.what()));
@@ -84,6 +111,7 @@ void CmdExecutor::handleCmdRun(const vector<std::string>& argv) {
     try {
         interpreter->setMode(mode);
         interpreter->reload();
+        applyEngine();
         interpreter->interpret();
     } catch (std::exception& e) {
         print("Failed to run program: {}\n", e.what());
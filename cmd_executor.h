@@ -14,7 +14,8 @@
 
 
 enum class Command {
-    CHANGE_MODE, // change mode + mode name "DEBUG" "NORMAL" "DEV"
+    CHANGE_MODE, // change mode + mode name "DEBUG" "NORMAL" "DEV";
+                 // 优化: "O0"(树解释器) "O1" "O2", "PASSES dead_code,licm,..." "DUMP_AFTER licm,...|all|none"
     LOAD,
     RUN,
     STOP,
@@ -108,6 +109,10 @@ private:
     std::shared_ptr<Env> env;
     std::filesystem::path choosed_file {};
     ProgramMode mode = ProgramMode::NORMAL;
+    // CHANGE_MODE O1/O2/PASSES选择优化引擎, O0回到树解释器; 在之后LOAD/RUN/DEBUG加载的程序上生效
+    bool optimize = false;
+    opt::Options opt_options = opt::levelOptions(0);
+    void applyEngine();
 signals:
     void sendOutput(QString outputs);
     void sendError(QString error);
@@ -170,6 +175,7 @@ public:
         env = std::make_shared<Env>(symbol_table);
         parser = std::make_shared<Parser>(tokenizer);
         interpreter = std::make_shared<Interpreter>(parser, env);
+        interpreter->setImageCache(true); // LOAD/RUN 复用 .qbc 镜像
         auto oneLineTokenizer = std::make_shared<Token::Tokenizer>();
         auto oneLineParser = std::make_shared<Parser>(oneLineTokenizer);
         auto oneLineEnv = std::make_shared<Env>(symbol_table);
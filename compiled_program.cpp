@@ -0,0 +1,422 @@
+//
+// Created by ayanami on 12/23/24.
+//
+
+#include "compiled_program.h"
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+#include "parser.h"
+
+namespace qbc {
+using Token::TokenType;
+namespace {
+constexpr size_t ALIGN = 8;
+
+size_t alignUp(size_t n) {
+    return (n + ALIGN - 1) / ALIGN * ALIGN;
+}
+
+bool sectionFits(uint64_t size, uint32_t offset, uint32_t count, size_t elem, size_t align) {
+    return offset % align == 0 && static_cast<uint64_t>(offset) + static_cast<uint64_t>(count) * elem <= size;
+}
+
+bool validToken(uint8_t tk) {
+    return tk < static_cast<uint8_t>(TokenType::UNKNOWN);
+}
+
+bool needsExpr(StmtKind kind) {
+    return kind == StmtKind::Assign || kind == StmtKind::Print || kind == StmtKind::If || kind == StmtKind::Expr;
+}
+
+class Compiler {
+    std::vector<StmtRecord> stmts;
+    std::vector<Instr> code;
+    std::vector<Constant> consts;
+    std::vector<StrRef> names;
+    std::string pool;
+    std::unordered_map<string, uint32_t> name_ids;
+
+    StrRef intern(const string& s) {
+        StrRef ref{static_cast<uint32_t>(pool.size()), static_cast<uint32_t>(s.size())};
+        pool += s;
+        return ref;
+    }
+    uint32_t nameId(const string& name) {
+        auto it = name_ids.find(name);
+        if(it != name_ids.end()) {
+            return it->second;
+        }
+        auto id = static_cast<uint32_t>(names.size());
+        names.push_back(intern(name));
+        name_ids.emplace(name, id);
+        return id;
+    }
+    uint32_t addConst(Constant c) {
+        consts.push_back(c);
+        return static_cast<uint32_t>(consts.size() - 1);
+    }
+    uint32_t stringConst(const string& s) {
+        return addConst({.kind = ConstKind::String, .str = intern(s)});
+    }
+    void emit(OpCode op, TokenType tk = TokenType::UNKNOWN, uint32_t operand = 0, uint8_t flags = 0) {
+        code.push_back({op, static_cast<uint8_t>(tk), flags, 0, operand});
+    }
+
+    // 和Interpreter::visit_BinOp的求值顺序一致: 右结合的运算符先算右边
+    void emitExpr(ASTNode* node) {
+        switch(node->type()) {
+        case ASTNodeType::Num: {
+            auto v = node->getVal();
+            if(util::ConvAny<int>(v)) {
+                emit(OpCode::PushConst, TokenType::UNKNOWN, addConst({.kind = ConstKind::Int, .i = std::any_cast<int>(v)}));
+            } else {
+                emit(OpCode::PushConst, TokenType::UNKNOWN,
+                     addConst({.kind = ConstKind::Double, .d = std::any_cast<double>(v)}));
+            }
+            return;
+        }
+        case ASTNodeType::String:
+            emit(OpCode::PushConst, TokenType::UNKNOWN, stringConst(dynamic_cast<StringNode*>(node)->getString()));
+            return;
+        case ASTNodeType::Var:
+            emit(OpCode::LoadVar, TokenType::UNKNOWN, nameId(dynamic_cast<VarNode*>(node)->getName()));
+            return;
+        case ASTNodeType::UnaryOp: {
+            auto unary = dynamic_cast<UnaryOpNode*>(node);
+            emitExpr(unary->getExpr());
+            emit(OpCode::Unary, unary->getOp());
+            return;
+        }
+        case ASTNodeType::BinOp: {
+            auto bin = dynamic_cast<BinOpNode*>(node);
+            if(Token::isRightAssociative(bin->getOp())) {
+                emitExpr(bin->getRight());
+                emitExpr(bin->getLeft());
+                emit(OpCode::Binary, bin->getOp(), 0, SWAPPED);
+            } else {
+                emitExpr(bin->getLeft());
+                emitExpr(bin->getRight());
+                emit(OpCode::Binary, bin->getOp());
+            }
+            return;
+        }
+        default:
+            throw std::runtime_error(fmt::format("compile: unsupported expression node {}", ast2Str(node->type())));
+        }
+    }
+
+    void compileStmt(int line_no, ASTNode* node) {
+        StmtRecord rec{};
+        rec.line_no = line_no;
+        rec.target_line = 0;
+        rec.target_index = NO_TARGET;
+        auto begin = static_cast<uint32_t>(code.size());
+        if(node->type() == ASTNodeType::FusedStmt) {
+            // 融合节点是树解释器的快速路径, 这里按原来的语句编译
+            node = static_cast<FusedStmtNode*>(node)->getOriginal();
+        }
+        switch(node->type()) {
+        case ASTNodeType::AssignStmt: {
+            auto assign = dynamic_cast<AssignStmtNode*>(node);
+            rec.kind = StmtKind::Assign;
+            rec.var = nameId(assign->getLeft()->getName());
+            emitExpr(assign->getRight());
+            break;
+        }
+        case ASTNodeType::GOTOStmt:
+            rec.kind = StmtKind::Goto;
+            rec.target_line = dynamic_cast<GOTOStmtNode*>(node)->getLineNo();
+            break;
+        case ASTNodeType::EndStmt:
+            rec.kind = StmtKind::End;
+            break;
+        case ASTNodeType::PrintStmt:
+            rec.kind = StmtKind::Print;
+            emitExpr(dynamic_cast<PrintStmtNode*>(node)->getExpr());
+            break;
+        case ASTNodeType::InputStmt:
+            rec.kind = StmtKind::Input;
+            rec.var = nameId(dynamic_cast<InputStmtNode*>(node)->getVar()->getName());
+            break;
+        case ASTNodeType::IFStmt: {
+            auto if_stmt = dynamic_cast<IFStmtNode*>(node);
+            rec.kind = StmtKind::If;
+            rec.target_line = if_stmt->getNext();
+            emitExpr(if_stmt->getCond());
+            break;
+        }
+        case ASTNodeType::RemStmt:
+            rec.kind = StmtKind::Rem;
+            rec.text = stringConst(dynamic_cast<RemStmtNode*>(node)->getComment());
+            break;
+        default:
+            rec.kind = StmtKind::Expr;
+            emitExpr(node);
+            break;
+        }
+        rec.code_begin = begin;
+        rec.code_len = static_cast<uint32_t>(code.size()) - begin;
+        stmts.push_back(rec);
+    }
+
+    template<typename T>
+    static void put(std::vector<std::byte>& out, size_t offset, const std::vector<T>& items) {
+        if(!items.empty()) {
+            std::memcpy(out.data() + offset, items.data(), items.size() * sizeof(T));
+        }
+    }
+
+public:
+    std::vector<std::byte> run(const std::map<int, ASTNode*>& ast, uint64_t source_hash) {
+        for(const auto& [line_no, node]: ast) {
+            if(node == nullptr) {
+                throw std::runtime_error(fmt::format("compile: line {} has no statement", line_no));
+            }
+            compileStmt(line_no, node);
+        }
+        // 跳转目标在编译期解析成下标, 目标行不存在的保持NO_TARGET
+        for(auto& rec: stmts) {
+            if(rec.kind != StmtKind::Goto && rec.kind != StmtKind::If) {
+                continue;
+            }
+            auto it = ast.find(rec.target_line);
+            if(it != ast.end()) {
+                rec.target_index = static_cast<int32_t>(std::distance(ast.begin(), it));
+            }
+        }
+
+        Header h{};
+        h.magic = MAGIC;
+        h.version = FORMAT_VERSION;
+        h.source_hash = source_hash;
+        size_t offset = alignUp(sizeof(Header));
+        auto place = [&](uint32_t& off, uint32_t& count, size_t n, size_t elem) {
+            off = static_cast<uint32_t>(offset);
+            count = static_cast<uint32_t>(n);
+            offset = alignUp(offset + n * elem);
+        };
+        place(h.stmt_offset, h.stmt_count, stmts.size(), sizeof(StmtRecord));
+        place(h.code_offset, h.code_count, code.size(), sizeof(Instr));
+        place(h.const_offset, h.const_count, consts.size(), sizeof(Constant));
+        place(h.name_offset, h.name_count, names.size(), sizeof(StrRef));
+        place(h.string_offset, h.string_bytes, pool.size(), 1);
+        h.total_size = offset;
+
+        std::vector<std::byte> out(offset);
+        std::memcpy(out.data(), &h, sizeof(Header));
+        put(out, h.stmt_offset, stmts);
+        put(out, h.code_offset, code);
+        put(out, h.const_offset, consts);
+        put(out, h.name_offset, names);
+        if(!pool.empty()) {
+            std::memcpy(out.data() + h.string_offset, pool.data(), pool.size());
+        }
+        return out;
+    }
+};
+
+void tabbedExpr(const ProgramView& view, std::span<const Instr> code, std::vector<std::vector<string>>& st) {
+    auto consts = view.constants();
+    for(const auto& ins: code) {
+        switch(ins.op) {
+        case OpCode::PushConst: {
+            const auto& c = consts[ins.operand];
+            if(c.kind == ConstKind::Int) {
+                st.push_back({std::to_string(c.i)});
+            } else if(c.kind == ConstKind::Double) {
+                st.push_back({std::to_string(c.d)});
+            } else {
+                st.push_back({string(view.str(c.str))});
+            }
+            break;
+        }
+        case OpCode::LoadVar:
+            st.push_back({string(view.name(ins.operand))});
+            break;
+        case OpCode::Unary: {
+            vector<string> res{Token::tk2Str(static_cast<TokenType>(ins.tk))};
+            for(const auto& s: st.back()) {
+                res.push_back("\t" + s);
+            }
+            st.back() = std::move(res);
+            break;
+        }
+        case OpCode::Binary: {
+            auto top = std::move(st.back());
+            st.pop_back();
+            auto below = std::move(st.back());
+            auto& left = ins.flags & SWAPPED ? top : below;
+            auto& right = ins.flags & SWAPPED ? below : top;
+            vector<string> res{Token::tk2Str(static_cast<TokenType>(ins.tk))};
+            for(const auto& s: left) {
+                res.push_back("\t" + s);
+            }
+            for(const auto& s: right) {
+                res.push_back("\t" + s);
+            }
+            st.back() = std::move(res);
+            break;
+        }
+        }
+    }
+}
+} // namespace
+
+std::optional<std::string> ProgramView::validate(const void* data, size_t size) {
+    if(data == nullptr || size < sizeof(Header)) {
+        return "image too small";
+    }
+    if(reinterpret_cast<uintptr_t>(data) % ALIGN != 0) {
+        return "image is not aligned";
+    }
+    ProgramView view(data, size);
+    const auto& h = view.header();
+    if(h.magic != MAGIC) {
+        return "bad magic";
+    }
+    if(h.version != FORMAT_VERSION) {
+        return fmt::format("format version {} != {}", h.version, FORMAT_VERSION);
+    }
+    if(h.total_size != size) {
+        return fmt::format("size {} != {}", size, h.total_size);
+    }
+    if(!sectionFits(size, h.stmt_offset, h.stmt_count, sizeof(StmtRecord), ALIGN) ||
+       !sectionFits(size, h.code_offset, h.code_count, sizeof(Instr), ALIGN) ||
+       !sectionFits(size, h.const_offset, h.const_count, sizeof(Constant), ALIGN) ||
+       !sectionFits(size, h.name_offset, h.name_count, sizeof(StrRef), ALIGN) ||
+       !sectionFits(size, h.string_offset, h.string_bytes, 1, 1)) {
+        return "section out of range";
+    }
+    auto refFits = [&](const StrRef& ref) {
+        return static_cast<uint64_t>(ref.offset) + ref.size <= h.string_bytes;
+    };
+    for(const auto& c: view.constants()) {
+        if(c.kind > ConstKind::String || (c.kind == ConstKind::String && !refFits(c.str))) {
+            return "bad constant";
+        }
+    }
+    for(const auto& ref: view.section<StrRef>(h.name_offset, h.name_count)) {
+        if(!refFits(ref)) {
+            return "bad name";
+        }
+    }
+    auto code = view.section<Instr>(h.code_offset, h.code_count);
+    auto stmts = view.stmts();
+    for(size_t i = 0; i < stmts.size(); ++i) {
+        const auto& rec = stmts[i];
+        if(rec.kind > StmtKind::Expr || (i > 0 && stmts[i - 1].line_no >= rec.line_no)) {
+            return fmt::format("bad statement {}", i);
+        }
+        if((rec.kind == StmtKind::Assign || rec.kind == StmtKind::Input) && rec.var >= h.name_count) {
+            return fmt::format("bad variable in statement {}", i);
+        }
+        if(rec.kind == StmtKind::Rem &&
+           (rec.text >= h.const_count || view.constants()[rec.text].kind != ConstKind::String)) {
+            return fmt::format("bad comment in statement {}", i);
+        }
+        if(rec.target_index != NO_TARGET &&
+           (rec.target_index < 0 || static_cast<size_t>(rec.target_index) >= stmts.size() ||
+            stmts[rec.target_index].line_no != rec.target_line)) {
+            return fmt::format("bad jump target in statement {}", i);
+        }
+        if(static_cast<uint64_t>(rec.code_begin) + rec.code_len > code.size()) {
+            return fmt::format("bad code range in statement {}", i);
+        }
+        // 执行时不再检查栈深度, 这里保证每段字节码正好留下一个值
+        int depth = 0;
+        for(const auto& ins: code.subspan(rec.code_begin, rec.code_len)) {
+            switch(ins.op) {
+            case OpCode::PushConst:
+                if(ins.operand >= h.const_count) {
+                    return fmt::format("bad constant in statement {}", i);
+                }
+                depth++;
+                break;
+            case OpCode::LoadVar:
+                if(ins.operand >= h.name_count) {
+                    return fmt::format("bad variable in statement {}", i);
+                }
+                depth++;
+                break;
+            case OpCode::Unary:
+                if(depth < 1 || !validToken(ins.tk)) {
+                    return fmt::format("bad unary op in statement {}", i);
+                }
+                break;
+            case OpCode::Binary:
+                if(depth < 2 || !validToken(ins.tk)) {
+                    return fmt::format("bad binary op in statement {}", i);
+                }
+                depth--;
+                break;
+            default:
+                return fmt::format("bad opcode in statement {}", i);
+            }
+        }
+        if(depth != (needsExpr(rec.kind) ? 1 : 0)) {
+            return fmt::format("bad expression in statement {}", i);
+        }
+    }
+    return std::nullopt;
+}
+
+int32_t ProgramView::indexOf(int line_no) const {
+    auto s = stmts();
+    auto it = std::ranges::lower_bound(s, line_no, {}, &StmtRecord::line_no);
+    if(it == s.end() || it->line_no != line_no) {
+        return NO_TARGET;
+    }
+    return static_cast<int32_t>(it - s.begin());
+}
+
+std::vector<std::byte> compileProgram(const std::map<int, ASTNode*>& stmts, uint64_t source_hash) {
+    return Compiler().run(stmts, source_hash);
+}
+
+std::vector<std::string> tabbedString(const ProgramView& view, size_t index) {
+    const auto& rec = view.stmts()[index];
+    std::vector<std::vector<string>> st;
+    tabbedExpr(view, view.code(rec), st);
+    auto indent = [](vector<string>& res, const vector<string>& sub) {
+        for(const auto& s: sub) {
+            res.push_back("\t" + s);
+        }
+    };
+    vector<string> res;
+    switch(rec.kind) {
+    case StmtKind::Assign:
+        res.push_back("LET =");
+        res.push_back("\t" + string(view.name(rec.var)));
+        indent(res, st.back());
+        break;
+    case StmtKind::Goto:
+        res = {"GOTO", "\t" + std::to_string(rec.target_line)};
+        break;
+    case StmtKind::End:
+        res = {"END"};
+        break;
+    case StmtKind::Print:
+        res.push_back("PRINT");
+        indent(res, st.back());
+        break;
+    case StmtKind::Input:
+        res = {"INPUT", "\t" + string(view.name(rec.var))};
+        break;
+    case StmtKind::If:
+        res.push_back("IF THEN");
+        indent(res, st.back());
+        res.push_back("\t" + std::to_string(rec.target_line));
+        break;
+    case StmtKind::Rem:
+        res = {"REM", "\t" + string(view.str(view.constants()[rec.text].str))};
+        break;
+    case StmtKind::Expr:
+        res = std::move(st.back());
+        break;
+    }
+    return res;
+}
+
+} // namespace qbc
@@ -0,0 +1,173 @@
+//
+// Created by ayanami on 12/23/24.
+//
+// 编译后的程序(.qbc的内容): 所有数据放在一块连续的字节里, 只有POD和下标/偏移(没有指针),
+// 所以可以原样写进文件, 再mmap回来直接执行, 不需要反序列化成堆上的AST
+//
+// layout (本机字节序, 每段8字节对齐):
+//   Header
+//   StmtRecord[stmt_count]   语句表, 按行号排序, 同时也是行号 -> 语句的映射
+//   Instr[code_count]        表达式字节码, 后缀序, 每条语句引用其中一段
+//   Constant[const_count]    常量池
+//   StrRef[name_count]       变量名表
+//   char[string_bytes]       字符串池(变量名, 字符串常量, REM注释)
+//
+// ATTENTION: Instr/StmtRecord里直接存了TokenType的值, 改动TokenType的顺序要升级FORMAT_VERSION
+//
+#pragma once
+#ifndef COMPILED_PROGRAM_H
+#define COMPILED_PROGRAM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+class ASTNode;
+
+namespace qbc {
+constexpr uint32_t MAGIC = 0x31434251; // "QBC1"
+constexpr uint32_t FORMAT_VERSION = 1;
+constexpr int32_t NO_TARGET = -1;
+
+enum class OpCode: uint8_t {
+    PushConst, // operand: 常量下标
+    LoadVar,   // operand: 变量名下标
+    Unary,     // tk: 运算符
+    Binary,    // tk: 运算符, flags & SWAPPED: 右操作数先求值(右结合), 栈顶是左操作数
+};
+constexpr uint8_t SWAPPED = 1;
+
+enum class StmtKind: uint8_t {
+    Assign,
+    Goto,
+    End,
+    Print,
+    Input,
+    If,
+    Rem,
+    Expr, // 单独一个表达式的行, 只求值
+};
+
+enum class ConstKind: uint8_t {
+    Int,
+    Double,
+    String,
+};
+
+using Header = struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_hash;
+    uint64_t total_size;
+    uint32_t stmt_count;
+    uint32_t stmt_offset;
+    uint32_t code_count;
+    uint32_t code_offset;
+    uint32_t const_count;
+    uint32_t const_offset;
+    uint32_t name_count;
+    uint32_t name_offset;
+    uint32_t string_bytes;
+    uint32_t string_offset;
+};
+
+using StmtRecord = struct StmtRecord {
+    int32_t line_no;
+    StmtKind kind;
+    uint8_t reserved[3];
+    int32_t target_line;  // Goto / If
+    int32_t target_index; // 目标行在语句表中的下标, 行不存在时为NO_TARGET(运行到才报错, 和树解释器一致)
+    uint32_t var;         // Assign / Input: 变量名下标
+    uint32_t code_begin;  // Assign / Print / If / Expr: 表达式字节码
+    uint32_t code_len;
+    uint32_t text;        // Rem: 注释在常量池中的下标
+};
+
+using Instr = struct Instr {
+    OpCode op;
+    uint8_t tk;
+    uint8_t flags;
+    uint8_t reserved;
+    uint32_t operand;
+};
+
+using StrRef = struct StrRef {
+    uint32_t offset;
+    uint32_t size;
+};
+
+using Constant = struct Constant {
+    ConstKind kind;
+    uint8_t reserved[3];
+    int32_t i;
+    double d;
+    StrRef str;
+};
+
+static_assert(std::is_trivially_copyable_v<Header> && sizeof(Header) == 64);
+static_assert(std::is_trivially_copyable_v<StmtRecord> && sizeof(StmtRecord) == 32);
+static_assert(std::is_trivially_copyable_v<Instr> && sizeof(Instr) == 8);
+static_assert(std::is_trivially_copyable_v<Constant> && sizeof(Constant) == 24);
+
+// 不拥有内存, 只是按Header解释一块字节, 可以指向堆上的buffer或者mmap的文件
+class ProgramView {
+    const std::byte* base = nullptr;
+    size_t size = 0;
+    template<typename T>
+    std::span<const T> section(uint32_t offset, uint32_t count) const {
+        return {reinterpret_cast<const T*>(base + offset), count};
+    }
+public:
+    ProgramView() = default;
+    // data 必须已经通过validate
+    ProgramView(const void* data, size_t size): base(static_cast<const std::byte*>(data)), size(size) {}
+    // 检查magic/version和所有的偏移, 下标, 不合法时返回原因
+    static std::optional<std::string> validate(const void* data, size_t size);
+
+    [[nodiscard]] bool empty() const {
+        return base == nullptr || header().stmt_count == 0;
+    }
+    [[nodiscard]] const Header& header() const {
+        return *reinterpret_cast<const Header*>(base);
+    }
+    [[nodiscard]] std::span<const std::byte> bytes() const {
+        return {base, size};
+    }
+    [[nodiscard]] std::span<const StmtRecord> stmts() const {
+        return section<StmtRecord>(header().stmt_offset, header().stmt_count);
+    }
+    [[nodiscard]] std::span<const Instr> code(const StmtRecord& stmt) const {
+        return section<Instr>(header().code_offset, header().code_count).subspan(stmt.code_begin, stmt.code_len);
+    }
+    [[nodiscard]] std::span<const Constant> constants() const {
+        return section<Constant>(header().const_offset, header().const_count);
+    }
+    [[nodiscard]] std::string_view str(const StrRef& ref) const {
+        return {reinterpret_cast<const char*>(base + header().string_offset + ref.offset), ref.size};
+    }
+    [[nodiscard]] std::string_view name(uint32_t index) const {
+        return str(section<StrRef>(header().name_offset, header().name_count)[index]);
+    }
+    [[nodiscard]] uint32_t nameCount() const {
+        return header().name_count;
+    }
+    // 行号 -> 语句下标, 二分查找, 不存在返回NO_TARGET
+    [[nodiscard]] int32_t indexOf(int line_no) const;
+};
+
+// 把Parser解析出的AST编译成一块完整的镜像
+// throws: std::runtime_error 遇到不支持的节点
+std::vector<std::byte> compileProgram(const std::map<int, ASTNode*>& stmts, uint64_t source_hash);
+
+// 和ASTNode::toTabbedString的输出完全一致, 用于AST窗口和调试输出
+std::vector<std::string> tabbedString(const ProgramView& view, size_t index);
+
+} // namespace qbc
+
+#endif // COMPILED_PROGRAM_H
@@ -0,0 +1,89 @@
+//
+// Created by ayanami on 12/25/24.
+//
+// 引擎对比测试(image_test, closure_test)共用: 用DEV模式跑一遍程序, 收集输出/错误/计数器/变量
+//
+#pragma once
+#ifndef ENGINE_TEST_UTIL_H
+#define ENGINE_TEST_UTIL_H
+
+#include <algorithm>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <fmt/format.h>
+#include "interpreter.h"
+
+namespace engine_test {
+using std::string;
+using std::vector;
+
+// DEV模式下程序输出和AST都写到std::cout, 截下来比较
+class CoutCapture {
+    std::ostringstream oss;
+    std::streambuf* origin;
+public:
+    CoutCapture(): origin(std::cout.rdbuf(oss.rdbuf())) {}
+    ~CoutCapture() {
+        std::cout.rdbuf(origin);
+    }
+    string str() const {
+        return oss.str();
+    }
+};
+
+using RunResult = struct RunResult {
+    string err;
+    string output;
+    vector<string> counters;
+    vector<string> vars;
+};
+
+inline std::shared_ptr<Interpreter> newInterpreter() {
+    auto tokenizer = std::make_shared<Token::Tokenizer>();
+    auto parser = std::make_shared<Parser>(tokenizer);
+    auto env = std::make_shared<Env>(std::make_shared<SymbolTable>());
+    return std::make_shared<Interpreter>(parser, env, ProgramMode::DEV);
+}
+
+inline RunResult run(Interpreter& interpreter, const string& input) {
+    RunResult res;
+    std::cin.clear();
+    interpreter.input(input);
+    {
+        CoutCapture capture;
+        try {
+            interpreter.interpret();
+        } catch (std::exception& e) {
+            res.err = e.what();
+        }
+        res.output = capture.str();
+    }
+    res.err += interpreter.getStatus().err_msg.value_or("");
+    res.counters = interpreter.getCounters().getRepl();
+    res.vars = interpreter.getEnv()->getRepl();
+    std::ranges::sort(res.vars);
+    return res;
+}
+
+inline RunResult runLines(const vector<string>& lines, EngineKind engine, const string& input = "") {
+    auto interpreter = newInterpreter();
+    interpreter->loadProgram(Token::programFromlines(lines));
+    interpreter->setEngine(engine);
+    return run(*interpreter, input);
+}
+
+inline bool same(const RunResult& a, const RunResult& b) {
+    return a.err == b.err && a.output == b.output && a.counters == b.counters && a.vars == b.vars;
+}
+
+inline string describe(const RunResult& r) {
+    return fmt::format("err: [{}] output: [{}] counters: [{}] vars: [{}]", r.err, r.output,
+        fmt::join(r.counters.begin(), r.counters.end(), ", "), fmt::join(r.vars.begin(), r.vars.end(), ", "));
+}
+
+} // namespace engine_test
+
+#endif // ENGINE_TEST_UTIL_H
@@ -0,0 +1,98 @@
+//
+// Created by ayanami on 12/26/24.
+//
+
+#include "fusion.h"
+
+namespace fusion {
+namespace {
+
+bool isFusedArith(Token::TokenType op) {
+    // 不包括/ MOD ^: 除零和pow的语义留给原来的树
+    return op == Token::TokenType::OP_ADD || op == Token::TokenType::OP_SUB ||
+        op == Token::TokenType::OP_MUL;
+}
+bool isFusedCmp(Token::TokenType op) {
+    switch(op) {
+    case Token::TokenType::OP_LT:
+    case Token::TokenType::OP_GT:
+    case Token::TokenType::OP_LE:
+    case Token::TokenType::OP_GE:
+    case Token::TokenType::OP_EQ:
+    case Token::TokenType::OP_NE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Y op Z / Y op c 的操作数
+using Operands = struct Operands {
+    string left;
+    string right;
+    int constant = 0;
+};
+// 左边是变量, 右边是变量或者int常数
+std::optional<Operands> matchOperands(BinOpNode* bin) {
+    auto l = bin->getLeft();
+    auto r = bin->getRight();
+    if(l->type() != ASTNodeType::Var) {
+        return std::nullopt;
+    }
+    Operands res;
+    res.left = static_cast<VarNode*>(l)->getName();
+    if(r->type() == ASTNodeType::Var) {
+        res.right = static_cast<VarNode*>(r)->getName();
+        return res;
+    }
+    if(r->type() == ASTNodeType::Num) {
+        if(auto c = std::any_cast<int>(&r->getValRef())) {
+            res.constant = *c;
+            return res;
+        }
+    }
+    return std::nullopt;
+}
+
+} // namespace
+
+ASTNode* fuse(ASTNode* stmt) {
+    if(stmt->type() == ASTNodeType::AssignStmt) {
+        auto assign = static_cast<AssignStmtNode*>(stmt);
+        if(assign->getRight()->type() != ASTNodeType::BinOp) {
+            return stmt;
+        }
+        auto bin = static_cast<BinOpNode*>(assign->getRight());
+        if(!isFusedArith(bin->getOp())) {
+            return stmt;
+        }
+        if(auto ops = matchOperands(bin)) {
+            return new FusedStmtNode(assign, bin->getOp(), std::move(ops->left), std::move(ops->right), ops->constant);
+        }
+    } else if(stmt->type() == ASTNodeType::IFStmt) {
+        auto branch = static_cast<IFStmtNode*>(stmt);
+        if(branch->getCond()->type() != ASTNodeType::BinOp) {
+            return stmt;
+        }
+        auto bin = static_cast<BinOpNode*>(branch->getCond());
+        if(!isFusedCmp(bin->getOp())) {
+            return stmt;
+        }
+        if(auto ops = matchOperands(bin)) {
+            return new FusedStmtNode(branch, bin->getOp(), std::move(ops->left), std::move(ops->right), ops->constant);
+        }
+    }
+    return stmt;
+}
+
+ASTNode* unfuse(ASTNode* stmt) {
+    if(stmt->type() != ASTNodeType::FusedStmt) {
+        return stmt;
+    }
+    auto fused = static_cast<FusedStmtNode*>(stmt);
+    auto original = fused->release();
+    delete fused;
+    return original;
+}
+
+} // namespace fusion
@@ -0,0 +1,24 @@
+//
+// Created by ayanami on 12/26/24.
+//
+// 语句融合: parse之后识别常见形状的语句, 替换成FusedStmtNode(parser.h)
+// 循环里执行最多的几种语句 LET X = X + 1, LET SUM = SUM + I, IF X < N THEN 100
+// 在树解释器里要分派4~5个节点并且每个节点都写一次std::any, 融合后一次分派直接算出结果
+// GOTO n 本来就只有一个节点, 不需要融合
+//
+#pragma once
+#ifndef FUSION_H
+#define FUSION_H
+
+#include "parser.h"
+
+namespace fusion {
+
+// 形状匹配时返回接管了stmt的融合节点, 否则原样返回stmt
+ASTNode* fuse(ASTNode* stmt);
+// 融合节点返回原来的语句并释放融合节点, 否则原样返回stmt
+ASTNode* unfuse(ASTNode* stmt);
+
+} // namespace fusion
+
+#endif // FUSION_H
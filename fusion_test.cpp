@@ -0,0 +1,154 @@
+//
+// Created by ayanami on 12/26/24.
+//
+
+#include "fusion_test.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "fusion.h"
+#include "workload_gen.h"
+#include "engine_test_util.h"
+using std::vector;
+using std::string;
+using fmt::format;
+using namespace engine_test;
+
+namespace {
+RunResult runFused(const vector<string>& lines, bool fused, const string& input = "") {
+    auto interpreter = newInterpreter();
+    interpreter->setFusion(fused);
+    interpreter->loadProgram(Token::programFromlines(lines));
+    return run(*interpreter, input);
+}
+}
+
+void fusion_test::initTestCase() {
+    qDebug() <<"Init test case\n";
+}
+
+void fusion_test::testShapes() {
+    auto tokenizer = std::make_shared<Token::Tokenizer>();
+    auto parser = std::make_shared<Parser>(tokenizer);
+    parser->reload(vector<string>{
+        "10 LET X = X + 1",
+        "20 LET SUM = SUM + I",
+        "30 IF X < N THEN 100",
+        "40 IF I != 10 THEN 20",
+        "50 LET X = 1 + X",
+        "60 LET X = X / 2",
+        "70 LET X = X + \"s\"",
+        "80 IF X THEN 10",
+        "90 LET X = X + Y * 2",
+        "100 GOTO 10",
+    });
+    vector<vector<string>> tabbed;
+    for(const auto& [line, stmt]: parser->getStmts()) {
+        tabbed.push_back(stmt->toTabbedString());
+    }
+    parser->setFusion(true);
+    const auto& stmts = parser->getStmts();
+    for(const int line: {10, 20, 30, 40}) {
+        QVERIFY2(stmts.at(line)->type() == ASTNodeType::FusedStmt, format("line {}", line).c_str());
+    }
+    for(const int line: {50, 60, 70, 80, 90, 100}) {
+        QVERIFY2(stmts.at(line)->type() != ASTNodeType::FusedStmt, format("line {}", line).c_str());
+    }
+    auto inc = static_cast<FusedStmtNode*>(stmts.at(10));
+    QVERIFY(inc->getKind() == FusedKind::Assign);
+    QVERIFY(inc->getTarget() == "X" && inc->getLeftVar() == "X");
+    QVERIFY(!inc->rightIsVar() && inc->getConstant() == 1);
+    auto branch = static_cast<FusedStmtNode*>(stmts.at(30));
+    QVERIFY(branch->getKind() == FusedKind::Branch);
+    QVERIFY(branch->getNext() == 100 && branch->getRightVar() == "N");
+    QVERIFY(branch->getOp() == Token::TokenType::OP_LT);
+
+    // 显示的仍然是原来的树
+    size_t i = 0;
+    for(const auto& [line, stmt]: stmts) {
+        QVERIFY2(stmt->toTabbedString() == tabbed[i++], format("line {}", line).c_str());
+    }
+    // 已经融合的语句不会再包一层
+    QVERIFY(fusion::fuse(stmts.at(10)) == stmts.at(10));
+}
+
+void fusion_test::testMatchesTreeWalker() {
+    vector<std::pair<string, string>> files = {
+        {"./programs/fib.bas", ""},
+        {"./programs/sum_of_1ton.bas", "10\n"},
+        {"./programs/factorial.bas", "6\n"},
+        {"./programs/is_prime.bas", "67\n"},
+        {"./programs/hard1.bas", "100\n"},
+        {"./programs/hard2.bas", "100\n"},
+        {"./programs/loop1.bas", ""},
+        {"./programs/mod1.bas", ""},
+    };
+    for(const auto& [file, input]: files) {
+        auto tree = newInterpreter();
+        tree->loadFile(file);
+        auto fused = newInterpreter();
+        fused->setFusion(true);
+        fused->loadFile(file);
+        auto expected = run(*tree, input);
+        auto actual = run(*fused, input);
+        QVERIFY2(same(expected, actual), format("{}:\n  tree {}\n  fused {}", file,
+            describe(expected), describe(actual)).c_str());
+    }
+    vector<workload::GenOptions> cases = {
+        {.seed = 31, .lines = 200, .vars = 20},
+        {.seed = 32, .lines = 300, .goto_density = 0.3},
+        {.seed = 33, .lines = 200, .loop_density = 0.2, .loop_trips = 15},
+    };
+    for(const auto& opt: cases) {
+        auto program = workload::generate(opt);
+        auto expected = runFused(program.lines, false);
+        auto actual = runFused(program.lines, true);
+        QVERIFY2(expected.err.empty(), expected.err.c_str());
+        QVERIFY2(same(expected, actual), format("seed {}:\n  tree {}\n  fused {}", opt.seed,
+            describe(expected), describe(actual)).c_str());
+    }
+}
+
+// 操作数不是int或者变量不存在: 回退到原来的语句, 错误信息和计数器不变
+void fusion_test::testFallback() {
+    vector<vector<string>> programs = {
+        {"10 LET X = X + 1"},
+        {"10 LET A = 1", "20 IF A < B THEN 10"},
+        {"10 LET S = \"a\"", "20 LET S = S + 1"},
+        {"10 LET S = \"a\"", "20 LET T = \"b\"", "30 IF S = T THEN 10"},
+        {"10 LET S = \"a\"", "20 LET T = S * S"},
+        {"10 LET I = 0", "20 LET I = I + 1", "30 IF I < 5 THEN 20", "40 PRINT I"},
+    };
+    for(const auto& lines: programs) {
+        auto expected = runFused(lines, false);
+        auto actual = runFused(lines, true);
+        QVERIFY2(same(expected, actual), format("{}:\n  tree {}\n  fused {}", lines.back(),
+            describe(expected), describe(actual)).c_str());
+    }
+}
+
+void fusion_test::testToggle() {
+    auto interpreter = newInterpreter();
+    interpreter->loadProgram(Token::programFromlines({"10 LET A = 0", "20 LET A = A + 3", "30 IF A < 9 THEN 20"}));
+    interpreter->setFusion(true);
+    QVERIFY(interpreter->getParser()->getStmts().at(20)->type() == ASTNodeType::FusedStmt);
+    QVERIFY(run(*interpreter, "").err.empty());
+    QVERIFY(interpreter->getEnv()->symbol_table->get<int>("A") == 9);
+
+    // 其他引擎按原来的语句编译
+    interpreter->setEngine(EngineKind::Flat);
+    interpreter->setEngine(EngineKind::Closure);
+    QVERIFY(interpreter->getEngine() == EngineKind::Closure);
+    interpreter->reset(true);
+    QVERIFY(run(*interpreter, "").err.empty());
+    QVERIFY(interpreter->getEnv()->symbol_table->get<int>("A") == 9);
+
+    // 重新解析后仍然融合, 关闭后还原
+    interpreter->reload(vector<string>{"10 LET B = 1", "20 LET B = B * 2"});
+    QVERIFY(interpreter->getParser()->getStmts().at(20)->type() == ASTNodeType::FusedStmt);
+    interpreter->setFusion(false);
+    QVERIFY(interpreter->getParser()->getStmts().at(20)->type() == ASTNodeType::AssignStmt);
+}
+
+void fusion_test::cleanupTestCase() {
+}
@@ -0,0 +1,25 @@
+//
+// Created by ayanami on 12/26/24.
+//
+#pragma once
+#ifndef FUSION_TEST_H
+#define FUSION_TEST_H
+
+#include <QTest>
+#include <QObject>
+
+class fusion_test: public QObject{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void testShapes();
+    void testMatchesTreeWalker();
+    void testFallback();
+    void testToggle();
+    void cleanupTestCase();
+};
+
+
+
+#endif //FUSION_TEST_H
@@ -0,0 +1,106 @@
+//
+// Created by ayanami on 12/22/24.
+//
+// qbasic_gen: 生成合成BASIC程序, 写到stdout或者--out文件
+//
+// usage: qbasic_gen [--seed N] [--lines N] [--max-line-no N] [--depth N] [--vars N]
+//                   [--goto-density P] [--loop-density P] [--loop-body N] [--loop-trips N]
+//                   [--print-density P] [--out FILE] [--expect FILE]
+//
+#include <fstream>
+#include <iostream>
+#include "workload_gen.h"
+
+using std::string;
+
+namespace {
+void usage() {
+    fmt::print(stderr, "usage: qbasic_gen [--seed N] [--lines N] [--max-line-no N] [--depth N] [--vars N]\n"
+                       "                  [--goto-density P] [--loop-density P] [--loop-body N] [--loop-trips N]\n"
+                       "                  [--print-density P] [--out FILE] [--expect FILE]\n");
+}
+
+bool parseArgs(int argc, char* argv[], workload::GenOptions& opt, string& out, string& expect) {
+    for(int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        auto next = [&]() -> string {
+            if(i + 1 >= argc) {
+                throw std::runtime_error("missing value for " + arg);
+            }
+            return argv[++i];
+        };
+        if(arg == "--seed") {
+            opt.seed = std::stoull(next());
+        } else if(arg == "--lines") {
+            opt.lines = std::stoul(next());
+        } else if(arg == "--max-line-no") {
+            opt.max_line_no = std::stoi(next());
+        } else if(arg == "--depth") {
+            opt.expr_depth = std::stoul(next());
+        } else if(arg == "--vars") {
+            opt.vars = std::stoul(next());
+        } else if(arg == "--goto-density") {
+            opt.goto_density = std::stod(next());
+        } else if(arg == "--loop-density") {
+            opt.loop_density = std::stod(next());
+        } else if(arg == "--loop-body") {
+            opt.loop_body = std::stoul(next());
+        } else if(arg == "--loop-trips") {
+            opt.loop_trips = std::stoi(next());
+        } else if(arg == "--print-density") {
+            opt.print_density = std::stod(next());
+        } else if(arg == "--out") {
+            out = next();
+        } else if(arg == "--expect") {
+            expect = next();
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+} // namespace
+
+int main(int argc, char* argv[]) {
+    workload::GenOptions opt;
+    string out;
+    string expect;
+    workload::GeneratedProgram program;
+    try {
+        if(!parseArgs(argc, argv, opt, out, expect)) {
+            usage();
+            return 2;
+        }
+        program = workload::generate(opt);
+    } catch (std::exception& e) {
+        fmt::print(stderr, "{}\n", e.what());
+        usage();
+        return 2;
+    }
+
+    std::ofstream ofs;
+    if(!out.empty()) {
+        ofs.open(out);
+        if(!ofs.is_open()) {
+            fmt::print(stderr, "Failed to open file: {}\n", out);
+            return 1;
+        }
+    }
+    std::ostream& os = out.empty() ? std::cout : ofs;
+    for(const auto& line: program.lines) {
+        os << line << '\n';
+    }
+    // 期望的输出(每条PRINT一行)和变量终值, 给其他实现做对照
+    if(!expect.empty()) {
+        std::ofstream eos(expect);
+        for(const auto& o: program.expected_output) {
+            eos << o << '\n';
+        }
+        for(const auto& [name, value]: program.expected_vars) {
+            eos << name << " = " << value << '\n';
+        }
+    }
+    fmt::print(stderr, "{} lines, {} statements executed, {} outputs\n", program.lines.size(),
+               program.executed_statements, program.expected_output.size());
+    return 0;
+}
@@ -0,0 +1,244 @@
+//
+// Created by ayanami on 12/23/24.
+//
+
+#include "image_test.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "compiled_program.h"
+#include "program_image.h"
+#include "workload_gen.h"
+#include "engine_test_util.h"
+#include <fstream>
+using std::vector;
+using std::string;
+using fmt::format;
+using namespace engine_test;
+
+namespace {
+std::filesystem::path tmp_dir;
+} // namespace
+
+void image_test::initTestCase() {
+    qDebug() <<"Init test case\n";
+    tmp_dir = std::filesystem::temp_directory_path() / format("qbasic_image_test_{}", getpid());
+    std::filesystem::create_directories(tmp_dir);
+}
+
+void image_test::testTabbedString() {
+    vector<string> lines = {
+        "10 REM hello world",
+        "20 LET A = 1 + 2 * 3",
+        "30 B = -A ** 2 ** 2",
+        "40 PRINT \"str\"",
+        "50 INPUT C",
+        "60 IF A > (B MOD 7) THEN 80",
+        "70 GOTO 90",
+        "80 2.5 / 3",
+        "90 END",
+    };
+    auto interpreter = newInterpreter();
+    interpreter->loadProgram(Token::programFromlines(lines));
+    auto stmts = interpreter->getParser()->getStmts();
+    auto bytes = qbc::compileProgram(stmts, 0);
+    auto program = qbc::CompiledProgram::fromBuffer(std::move(bytes));
+    const auto& view = program->view();
+    QVERIFY(view.stmts().size() == stmts.size());
+    size_t index = 0;
+    for(const auto& [line_no, stmt]: stmts) {
+        QVERIFY(view.stmts()[index].line_no == line_no);
+        auto expected = stmt->toTabbedString();
+        auto actual = qbc::tabbedString(view, index);
+        QVERIFY2(expected == actual, format("line {}: expect [{}] != actual [{}]", line_no,
+            fmt::join(expected.begin(), expected.end(), "|"), fmt::join(actual.begin(), actual.end(), "|")).c_str());
+        ++index;
+    }
+}
+
+void image_test::testFlatMatchesTreeWalker() {
+    vector<std::pair<string, string>> files = {
+        {"./programs/fib.bas", ""},
+        {"./programs/default.bas", ""},
+        {"./programs/sum_of_1ton.bas", "10\n"},
+        {"./programs/sum_of_two.bas", "7\n5\n"},
+        {"./programs/factorial.bas", "6\n"},
+        {"./programs/even_or_odd.bas", "7\n"},
+        {"./programs/is_prime.bas", "67\n"},
+        {"./programs/hard1.bas", "100\n"},
+        {"./programs/hard2.bas", "100\n"},
+        {"./programs/loop1.bas", ""},
+        {"./programs/mod1.bas", ""},
+        {"./programs/mod2.bas", ""},
+        {"./programs/1.bas", ""},
+        {"./programs/2.bas", ""},
+    };
+    for(const auto& [file, input]: files) {
+        auto tree = newInterpreter();
+        tree->loadFile(file);
+        auto flat = newInterpreter();
+        flat->loadFile(file);
+        flat->setEngine(EngineKind::Flat);
+        QVERIFY(flat->getEngine() == EngineKind::Flat);
+        auto expected = run(*tree, input);
+        auto actual = run(*flat, input);
+        QVERIFY2(same(expected, actual), format("{}:\n  tree {}\n  flat {}", file,
+            describe(expected), describe(actual)).c_str());
+    }
+    vector<workload::GenOptions> cases = {
+        {.seed = 11, .lines = 200, .vars = 20},
+        {.seed = 12, .lines = 200, .expr_depth = 6, .vars = 5},
+        {.seed = 13, .lines = 300, .goto_density = 0.3},
+        {.seed = 14, .lines = 200, .loop_density = 0.2, .loop_trips = 15},
+    };
+    for(const auto& opt: cases) {
+        auto program = workload::generate(opt);
+        auto expected = runLines(program.lines, EngineKind::TreeWalker);
+        auto actual = runLines(program.lines, EngineKind::Flat);
+        QVERIFY2(expected.err.empty(), expected.err.c_str());
+        QVERIFY2(same(expected, actual), format("seed {}:\n  tree {}\n  flat {}", opt.seed,
+            describe(expected), describe(actual)).c_str());
+    }
+}
+
+void image_test::testFlatErrors() {
+    vector<vector<string>> programs = {
+        {"10 LET A = 1", "20 GOTO 100", "30 END"},
+        {"10 LET S = \"a\"", "20 LET T = S + \"b\""},
+        {"10 LET X = \"x\"", "20 IF X THEN 40", "30 END", "40 PRINT 1"},
+        {"10 PRINT UNKNOWN + 1"},
+        {"10 LET A = 1", "20 PRINT (A + 2) * -(3 - B) + A ** 2 ** C"},
+        {"10 LET A = 1", "20 PRINT A + 2 ** (3 * B) ** 2"},
+        {"10 LET A = 1 / 0"},
+    };
+    for(const auto& lines: programs) {
+        auto expected = runLines(lines, EngineKind::TreeWalker);
+        auto actual = runLines(lines, EngineKind::Flat);
+        QVERIFY2(same(expected, actual), format("{}:\n  tree {}\n  flat {}", lines.back(),
+            describe(expected), describe(actual)).c_str());
+    }
+}
+
+void image_test::testImageFile() {
+    auto src = tmp_dir / "factorial.bas";
+    std::filesystem::copy_file("./programs/factorial.bas", src,
+        std::filesystem::copy_options::overwrite_existing);
+    auto image = qbc::imagePathFor(src);
+    std::filesystem::remove(image);
+
+    auto first = newInterpreter();
+    first->setImageCache(true);
+    first->loadFile(src);
+    QVERIFY(first->getEngine() == EngineKind::Flat);
+    QVERIFY(!first->getCompiled()->isMapped());
+    QVERIFY2(std::filesystem::exists(image), "image not written");
+    auto expected = run(*first, "5\n");
+    QVERIFY(first->getEnv()->symbol_table->get<int>("fact") == 120);
+
+    // 第二次加载直接映射镜像, 不再parse
+    auto second = newInterpreter();
+    second->setImageCache(true);
+    second->loadFile(src);
+    QVERIFY(second->getCompiled()->isMapped());
+    QVERIFY(second->getParser()->getStmts().empty());
+    auto actual = run(*second, "5\n");
+    QVERIFY2(same(expected, actual), format("\n  first {}\n  second {}", describe(expected),
+        describe(actual)).c_str());
+
+    // reload也走镜像
+    second->reload();
+    QVERIFY(second->getCompiled()->isMapped());
+    QVERIFY(run(*second, "4\n").err.empty());
+    QVERIFY(second->getEnv()->symbol_table->get<int>("fact") == 24);
+
+    // 切回树解释器时重新parse
+    second->setEngine(EngineKind::TreeWalker);
+    QVERIFY(second->getEngine() == EngineKind::TreeWalker);
+    QVERIFY(!second->getParser()->getStmts().empty());
+    second->reset(true);
+    QVERIFY(run(*second, "3\n").err.empty());
+    QVERIFY(second->getEnv()->symbol_table->get<int>("fact") == 6);
+
+    // 源码改动后hash不匹配, 重新编译
+    {
+        std::ofstream ofs(src, std::ios::app);
+        ofs << "\n190 PRINT 42";
+    }
+    auto third = newInterpreter();
+    third->setImageCache(true);
+    third->loadFile(src);
+    QVERIFY(!third->getCompiled()->isMapped());
+    QVERIFY(third->getCompiled()->view().stmts().back().line_no == 190);
+    auto fourth = newInterpreter();
+    fourth->setImageCache(true);
+    fourth->loadFile(src);
+    QVERIFY(fourth->getCompiled()->isMapped());
+}
+
+void image_test::testImageFallback() {
+    auto src = tmp_dir / "fib.bas";
+    std::filesystem::copy_file("./programs/fib.bas", src,
+        std::filesystem::copy_options::overwrite_existing);
+    auto image = qbc::imagePathFor(src);
+    auto text = qbc::readSource(src);
+    auto hash = qbc::hashSource(text);
+    std::filesystem::remove(image);
+    QVERIFY(qbc::CompiledProgram::mapFile(image, hash) == nullptr);
+
+    auto interpreter = newInterpreter();
+    interpreter->setImageCache(true);
+    interpreter->loadFile(src);
+    QVERIFY(qbc::CompiledProgram::mapFile(image, hash) != nullptr);
+    QVERIFY(qbc::CompiledProgram::mapFile(image, hash + 1) == nullptr);
+    auto good = qbc::readSource(image);
+    auto half = reinterpret_cast<const std::byte*>(good.data());
+    QVERIFY_EXCEPTION_THROWN(qbc::CompiledProgram::fromBuffer(vector<std::byte>(half, half + good.size() / 2)),
+        std::runtime_error);
+
+    auto corrupt = [&](const std::function<void(string&)>& f) {
+        auto bytes = good;
+        f(bytes);
+        std::ofstream ofs(image, std::ios::binary | std::ios::trunc);
+        ofs << bytes;
+    };
+    vector<std::function<void(string&)>> corruptions = {
+        [](string& b) { b.resize(b.size() / 2); },                  // 截断
+        [](string& b) { b[0] ^= 0x7f; },                            // magic
+        [](string& b) { b[offsetof(qbc::Header, version)]++; },     // 版本
+        [](string& b) {                                             // 跳转目标越界
+            auto& h = *reinterpret_cast<qbc::Header*>(b.data());
+            auto* stmts = reinterpret_cast<qbc::StmtRecord*>(b.data() + h.stmt_offset);
+            for(uint32_t i = 0; i < h.stmt_count; ++i) {
+                if(stmts[i].kind == qbc::StmtKind::Goto) {
+                    stmts[i].target_index = static_cast<int32_t>(h.stmt_count);
+                }
+            }
+        },
+        [](string& b) {                                             // 字节码变量下标越界
+            auto& h = *reinterpret_cast<qbc::Header*>(b.data());
+            auto* code = reinterpret_cast<qbc::Instr*>(b.data() + h.code_offset);
+            for(uint32_t i = 0; i < h.code_count; ++i) {
+                if(code[i].op == qbc::OpCode::LoadVar) {
+                    code[i].operand = h.name_count;
+                }
+            }
+        },
+    };
+    for(size_t i = 0; i < corruptions.size(); ++i) {
+        corrupt(corruptions[i]);
+        QVERIFY2(qbc::CompiledProgram::mapFile(image, hash) == nullptr, format("corruption {}", i).c_str());
+        // 加载时回退到重新编译, 并覆盖坏掉的镜像
+        auto fallback = newInterpreter();
+        fallback->setImageCache(true);
+        fallback->loadFile(src);
+        QVERIFY(!fallback->getCompiled()->isMapped());
+        QVERIFY(run(*fallback, "").err.empty());
+        QVERIFY(fallback->getEnv()->symbol_table->get<int>("n1") > 10000);
+        QVERIFY(qbc::CompiledProgram::mapFile(image, hash) != nullptr);
+    }
+}
+
+void image_test::cleanupTestCase() {
+    std::error_code ec;
+    std::filesystem::remove_all(tmp_dir, ec);
+}
@@ -0,0 +1,26 @@
+//
+// Created by ayanami on 12/23/24.
+//
+#pragma once
+#ifndef IMAGE_TEST_H
+#define IMAGE_TEST_H
+
+#include <QTest>
+#include <QObject>
+
+class image_test: public QObject{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void testTabbedString();
+    void testFlatMatchesTreeWalker();
+    void testFlatErrors();
+    void testImageFile();
+    void testImageFallback();
+    void cleanupTestCase();
+};
+
+
+
+#endif //IMAGE_TEST_H
@@ -7,6 +7,8 @@
 #include "parser.h"
 #include "util.h"
 #include "interpreter.h"
+#include "workload_gen.h"
+#include <fstream>
 using std::vector;
 using std::string;
 using fmt::format;
@@ -151,6 +153,188 @@ void interpret_test::testIO() {
 
     QVERIFY2(interpreter->getEnv()->symbol_table->get<int>("res") == 6, "Failed to evaluate assignment");
 }
+void interpret_test::testCounters() {
+    vector<string> lines = {
+        "10 LET A = 1",
+        "20 LET B = A + 2",
+        "30 PRINT B",
+        "40 INPUT C",
+        "50 END",
+    };
+    auto interpreter = buildInterpreter(lines);
+    interpreter->addBreakpoint(20);
+    interpreter->input("7\n");
+    interpreter->interpret();
+    // 断点暂停时可读
+    auto paused = interpreter->getCounters();
+    QVERIFY2(paused.statements == 2, format("paused statements {}", paused.statements).c_str());
+    QVERIFY(paused.var_writes == 2);
+    QVERIFY(paused.output_bytes == 0);
+
+    interpreter->interpret();
+    const auto& counters = interpreter->getCounters();
+    QVERIFY2(counters.statements == 5, format("statements {}", counters.statements).c_str());
+    QVERIFY(counters.nodesOf(ASTNodeType::BinOp) == 1);
+    QVERIFY(counters.nodesOf(ASTNodeType::AssignStmt) == 2);
+    QVERIFY(counters.var_reads == 2);
+    QVERIFY(counters.var_writes == 3);
+    QVERIFY(counters.symbol_insertions == 3);
+    QVERIFY(counters.output_bytes == 1);
+    QVERIFY(counters.input_waits == 1);
+    QVERIFY(counters.exceptions == 0);
+
+    // 每次运行清零
+    interpreter->loadProgram(Token::programFromlines(lines));
+    QVERIFY(interpreter->getCounters().statements == 0);
+    QVERIFY(interpreter->getCounters().totalNodes() == 0);
+}
+// 压力测试: 生成的程序和生成器模拟执行的结果对照
+void interpret_test::testGeneratedPrograms() {
+    vector<workload::GenOptions> cases = {
+        {.seed = 1, .lines = 200, .vars = 20},
+        {.seed = 2, .lines = 300, .max_line_no = Token::MAX_LINE_NO - 1, .expr_depth = 6, .vars = 5},
+        {.seed = 3, .lines = 500, .vars = 200, .goto_density = 0.3},
+        {.seed = 4, .lines = 200, .expr_depth = 2, .vars = 8, .loop_density = 0.2, .loop_trips = 25},
+    };
+    for(const auto& opt: cases) {
+        auto program = workload::generate(opt);
+        auto interpreter = buildInterpreter(program.lines);
+        interpreter->setMode(ProgramMode::NORMAL);
+        interpreter->interpret();
+        auto status = interpreter->getStatus();
+        QVERIFY2(!status.err_msg.has_value(),
+            format("seed {}: {}", opt.seed, status.err_msg.value_or("")).c_str());
+        const auto& counters = interpreter->getCounters();
+        QVERIFY2(counters.statements == program.executed_statements,
+            format("seed {}: executed {} != expected {}", opt.seed, counters.statements,
+                program.executed_statements).c_str());
+        uint64_t output_bytes = 0;
+        for(const auto& o: program.expected_output) {
+            output_bytes += o.size();
+        }
+        QVERIFY(counters.output_bytes == output_bytes);
+        auto table = interpreter->getEnv()->symbol_table;
+        for(const auto& [name, value]: program.expected_vars) {
+            auto actual = table->get<int>(name);
+            QVERIFY2(actual == value, format("seed {}: {} expect {} != actual {}", opt.seed, name, value,
+                actual.value_or(-1)).c_str());
+        }
+    }
+}
+
+void interpret_test::testReloadCache() {
+    auto src = std::filesystem::temp_directory_path() / format("qbasic_reload_{}.bas", getpid());
+    std::filesystem::copy_file("./programs/factorial.bas", src, std::filesystem::copy_options::overwrite_existing);
+    for(const bool image_cache: {false, true}) {
+        auto interpreter = std::make_shared<Interpreter>(
+            std::make_shared<Parser>(std::make_shared<Token::Tokenizer>()),
+            std::make_shared<Env>(std::make_shared<SymbolTable>()));
+        interpreter->setImageCache(image_cache);
+        interpreter->loadFile(src);
+        QVERIFY(interpreter->getFrontEndRuns() == 1);
+        auto stmts = interpreter->getParser()->getStmts();
+        auto compiled = interpreter->getCompiled();
+        interpreter->input("5\n");
+        interpreter->interpret();
+        QVERIFY(interpreter->getEnv()->symbol_table->get<int>("fact") == 120);
+
+        // RUN/DEBUG: 源码没变, 只重置状态和变量
+        for(int n: {3, 4}) {
+            interpreter->reload();
+            QVERIFY(interpreter->getFrontEndRuns() == 1);
+            QVERIFY(interpreter->getParser()->getStmts() == stmts);
+            QVERIFY(interpreter->getCompiled() == compiled);
+            QVERIFY(interpreter->getEnv()->symbol_table->getRepl().empty());
+            QVERIFY(interpreter->getCounters().statements == 0);
+            std::cin.clear();
+            interpreter->input(format("{}\n", n));
+            interpreter->interpret();
+            QVERIFY(interpreter->getEnv()->symbol_table->get<int>("fact") == (n == 3 ? 6 : 24));
+        }
+
+        // 直接改过程序之后必须重新加载文件
+        interpreter->reload(vector<string>{"10 LET fact = 7"});
+        interpreter->reload();
+        QVERIFY(interpreter->getFrontEndRuns() == 2);
+
+        // 源码改动
+        {
+            std::ofstream ofs(src, std::ios::app);
+            ofs << "\n175 LET fact = fact + 1";
+        }
+        interpreter->reload();
+        QVERIFY(interpreter->getFrontEndRuns() == 3);
+        std::cin.clear();
+        interpreter->input("3\n");
+        interpreter->interpret();
+        QVERIFY(interpreter->getEnv()->symbol_table->get<int>("fact") == 7);
+        std::filesystem::copy_file("./programs/factorial.bas", src, std::filesystem::copy_options::overwrite_existing);
+        std::filesystem::remove(qbc::imagePathFor(src));
+    }
+    std::filesystem::remove(src);
+}
+
+void interpret_test::testRuntimeErrors() {
+    typedef struct TestError {
+        vector<string> lines;
+        ErrorKind kind;
+        int line_no;
+        string message;
+    } TestError;
+    vector<TestError> tests = {
+        {{"10 LET A = 1", "20 LET B = A / 0"}, ErrorKind::DivByZero, 20, "Division by zero"},
+        {{"10 LET A = 5 MOD (2 - 2)"}, ErrorKind::DivByZero, 10, "MOD by zero"},
+        {{"10 PRINT 1 + X * 2"}, ErrorKind::UndefinedVar, 10, "var X not found"},
+        {{"10 LET S = \"a\"", "20 LET T = S + \"b\""}, ErrorKind::TypeMismatch, 20, ""},
+        {{"10 LET A = 1", "20 IF A < \"b\" THEN 10"}, ErrorKind::TypeMismatch, 20, ""},
+        {{"10 GOTO 30", "20 END"}, ErrorKind::InvalidLine, 10, "line 30 no exist"},
+    };
+    for(const auto& t: tests) {
+        auto interpreter = buildInterpreter(t.lines);
+        std::optional<EvalError> thrown;
+        try {
+            interpreter->interpret();
+        } catch (InterpretError& e) {
+            thrown = e.error();
+            QVERIFY(e.what() == e.error().message);
+        }
+        QVERIFY2(thrown.has_value(), t.lines.back().c_str());
+        QVERIFY2(thrown->kind == t.kind && thrown->line_no == t.line_no,
+            format("{}: kind {} line {}", t.lines.back(), static_cast<int>(thrown->kind), thrown->line_no).c_str());
+        QVERIFY(t.message.empty() || thrown->message == t.message);
+        auto status = interpreter->getStatus();
+        QVERIFY(status.err_msg == thrown->message);
+        QVERIFY(status.error.has_value() && status.error->kind == t.kind);
+        QVERIFY(interpreter->getCounters().exceptions == 1);
+    }
+
+    // INPUT不是数字时按字符串保存, 不算错误
+    auto interpreter = buildInterpreter(vector<string>{"10 INPUT A", "20 INPUT B", "30 INPUT C"});
+    std::cin.clear();
+    interpreter->input("abc\n12\n1.5\n");
+    interpreter->interpret();
+    auto table = interpreter->getEnv()->symbol_table;
+    QVERIFY(table->get<string>("A") == "abc");
+    QVERIFY(table->get<int>("B") == 12);
+    QVERIFY(table->get<double>("C") == 1.5);
+    QVERIFY(interpreter->getCounters().exceptions == 0);
+    QVERIFY(!interpreter->getStatus().error.has_value());
+}
+void interpret_test::testStr2Number() {
+    QVERIFY(tryStr2Number("12") == NumType(12));
+    QVERIFY(tryStr2Number("-7") == NumType(-7));
+    QVERIFY(tryStr2Number(" 3") == NumType(3));
+    QVERIFY(tryStr2Number("1.5") == NumType(1.5));
+    QVERIFY(tryStr2Number("1e3") == NumType(1000.0));
+    QVERIFY(tryStr2Number("2147483647") == NumType(INT_MAX));
+    QVERIFY(!tryStr2Number("2147483648").has_value()); // std::stoi: out_of_range
+    QVERIFY(!tryStr2Number("").has_value());
+    QVERIFY(!tryStr2Number("abc").has_value());
+    QVERIFY(!tryStr2Number("12abc").has_value());
+    QVERIFY(!tryStr2Number("3 ").has_value());
+    QVERIFY(!tryStr2Number("1e999").has_value());
+    QVERIFY_EXCEPTION_THROWN(str2Number("abc"), std::runtime_error);
+}
 
 void interpret_test::testSumOfOneToN() {
     auto src = "./programs/sum_of_1ton.bas";
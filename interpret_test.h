@@ -19,6 +19,11 @@ private slots:
     void testEvalAssign();
     void testRunWithJmp();
     void testIO();
+    void testCounters();
+    void testGeneratedPrograms();
+    void testReloadCache();
+    void testRuntimeErrors();
+    void testStr2Number();
     void cleanupTestCase();
 
     // file test
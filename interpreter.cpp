@@ -9,44 +9,10 @@ void Interpreter::visit(ASTNode *root) {
     if(root == nullptr) {
         return;
     }
-    auto type = root->type();
-    // update var
-    if (type == ASTNodeType::Var) {
-        visit_Expr(root);
-    }
-    // const value node
-    if (belongsDataNode(root->type())) {
-        return;
-    }
-    switch (type) {
-    // stmt
-    case ASTNodeType::AssignStmt:
-        return visit_AssignStmtNode(dynamic_cast<AssignStmtNode *>(root));
-    case ASTNodeType::GOTOStmt:
-        return visit_GOTOStmtNode(dynamic_cast<GOTOStmtNode *>(root));
-    case ASTNodeType::EndStmt:
-        return visit_EndStmtNode(dynamic_cast<EndStmtNode *>(root));
-    case ASTNodeType::PrintStmt:
-        return visit_PrintStmtNode(dynamic_cast<PrintStmtNode *>(root));
-    case ASTNodeType::InputStmt:
-        return visit_InputStmtNode(dynamic_cast<InputStmtNode *>(root));
-    case ASTNodeType::IFStmt:
-        return visit_IFStmtNode(dynamic_cast<IFStmtNode *>(root));
-    case ASTNodeType::RemStmt:
-        return visit_RemStmtNode(dynamic_cast<RemStmtNode *>(root));
-    // expr op
-    case ASTNodeType::UnaryOp:
-        return visit_UnaryOp(dynamic_cast<UnaryOpNode *>(root));
-    case ASTNodeType::BinOp:
-        return visit_BinOp(dynamic_cast<BinOpNode *>(root));
-
-    default:
-        string s = fmt::format("Invalid visit node type. visit: {}\n", ast2Str(root->type()));
-        throw std::runtime_error(s);
-    }
+    root->accept(*this); // -> visit_XXX
 }
 void Interpreter::interpret() {
-    if(status.err_msg.has_value() || !parser || parser->getStmts().empty()) {
+    if(status.err_msg.has_value() || !parser || !hasProgram()) {
         print("Invalid status to interpret\n");
         return;
     }
@@ -56,7 +22,12 @@ void Interpreter::interpret() {
     }
     if(status.current_line == -1 && status.next_line == 0) {
         // start from the first line
-        status.next_line = parser->getStmts().begin()->first;
+        status.next_line = compiled ? compiled->view().stmts().front().line_no : parser->getStmts().begin()->first;
+        if(optimized) {
+            optimized_pc = optimized->getEntry();
+            const auto& stmts = optimized->getStmts();
+            status.next_line = optimized_pc < stmts.size() ? stmts[optimized_pc].line : -1;
+        }
     } else {
         status.current_line = status.next_line; // Example: Resume, and pass the current line
     }
@@ -66,20 +37,29 @@ void Interpreter::interpret() {
         print("Breakpoints: {}\n", line);
     }
     while(status.running && !status.err_msg.has_value() && status.next_line > 0 &&
-        !status.break_at(status.current_line)) {
+        !breakAt(status.current_line)) {
         interpret_SingleStep();
         print("[DEBUG] Current line: {}\n", status.current_line);
         if(status.mode == ProgramMode::DEV || status.mode == ProgramMode::DEBUG) {
             print("[DEBUG] Current line: {}\n", status.current_line);
             print("[DEBUG] AST:\n");
-            parser->printAST(status.current_line);
+            if(compiled) {
+                auto idx = compiled->view().indexOf(status.current_line);
+                if(idx != qbc::NO_TARGET) {
+                    for(const auto& s: qbc::tabbedString(compiled->view(), idx)) {
+                        print("{}\n", s);
+                    }
+                }
+            } else {
+                parser->printAST(status.current_line);
+            }
             print("[DEBUG] Env:\n");
             env->print();
             print("---\n");
         }
     }
     status.running = false;
-    if(status.break_at(status.current_line)) {
+    if(breakAt(status.current_line)) {
         print("[DEBUG] Break at line: {}\n", status.current_line);
     }
 }
@@ -93,7 +73,16 @@ void Interpreter::interpret() {
  * interpret: next line
  */
 void Interpreter::interpret_SingleStep() {
-    auto stmts = parser->getStmts();
+    if(compiled) {
+        interpretFlat_SingleStep();
+        return;
+    }
+    if(optimized) {
+        interpretOptimized_SingleStep();
+        return;
+    }
+    // 引用: 每一步复制整个map会为每一行分配节点
+    const auto& stmts = parser->getStmts();
     if(!status.running || status.err_msg.has_value() || stmts.empty()) {
         print("Invalid status to interpret\n");
         return;
@@ -101,26 +90,45 @@ void Interpreter::interpret_SingleStep() {
     if(!stmts.contains(status.next_line)) {
         print("Invalid current line: {}\n", status.next_line);
         status.err_msg = format("line {} no exist", status.next_line);
+        status.error = EvalError{ErrorKind::InvalidLine, status.next_line, status.err_msg.value()};
         return;
     }
-    auto normal_next_it = std::next(stmts.find(status.next_line));
     int origin_current = status.current_line;
+    eval_error.reset();
     try {
         status.current_line = status.next_line;
-        visit(stmts.at(status.next_line)); // might change next_line
+        status.counters.statements++;
+        if(closures) {
+            // 持有一份引用: INPUT等待时程序可能被重新加载
+            auto program = closures;
+            closure::Frame frame{*this, *env->symbol_table};
+            program->run(frame, status.next_line); // 行和stmts一一对应
+        } else if(jitted) {
+            auto program = jitted;
+            program->run(*this, status.next_line);
+        } else if(tiers) {
+            auto manager = tiers;
+            manager->step(*this, status.next_line);
+        } else {
+            visit(stmts.at(status.next_line)); // might change next_line
+        }
         // astOutput(stmts[status.next_line]->toString());
         // ATTETION: 可能在运行时被清除, 所以不能直接用stmts[status.next_line]
-        // at()会抛出异常
-        auto strs = stmts.at(status.next_line)->toTabbedString();
-        for(const auto& s: strs) {
-            astOutput(s);
+        auto shown = stmts.find(status.next_line);
+        if(!failed() && shown == stmts.end()) {
+            fail(ErrorKind::InvalidLine, format("line {} no exist", status.next_line));
+        }
+        if(!failed() && ast_output) {
+            for(const auto& s: shown->second->toTabbedString()) {
+                astOutput(s);
+            }
         }
     } catch (std::exception& e) {
-        print("Failed to interpret stmt: {}\n", e.what());
-        status.err_msg = e.what();
-        status.running = false;
-        status.current_line = origin_current; // recover
-        throw e; // pass to upper level
+        // 求值核心之外的异常(比如输入流), 同样在这里统一转换
+        fail(ErrorKind::Internal, e.what());
+    }
+    if(failed()) {
+        raiseError(origin_current); // pass to upper level
     }
     if(!status.running || status.err_msg.has_value()) {
         return;
@@ -132,10 +140,414 @@ void Interpreter::interpret_SingleStep() {
         return;
     }
 
+    // stmts是引用, 执行过程中可能被清除, 所以在这里才查找下一行
+    auto normal_next_it = stmts.upper_bound(status.current_line);
     if(normal_next_it == stmts.end()) {
         status.next_line = -1; // will end in next call
         return;
     }
     // normal next line
     status.next_line = normal_next_it->first;
-}
\ No newline at end of file
+}
+
+// 按下标执行opt::Program的一条语句; 状态转换和interpret_SingleStep一致, next_line是下一条语句的源码行
+void Interpreter::interpretOptimized_SingleStep() {
+    // 持有一份引用: INPUT等待时程序可能被重新加载
+    auto program = optimized;
+    const auto& stmts = program->getStmts();
+    if(!status.running || status.err_msg.has_value() || optimized_pc >= stmts.size()) {
+        print("Invalid status to interpret\n");
+        return;
+    }
+    int origin_current = status.current_line;
+    eval_error.reset();
+    size_t pc = optimized_pc;
+    try {
+        status.current_line = stmts[pc].line;
+        status.counters.statements++;
+        closure::Frame frame{*this, *env->symbol_table};
+        // 有断点或者调试时逐行执行: 所有赋值都执行, 也不越过GOTO, 变量和停下的行都和没有优化时一样
+        const bool stepwise = status.mode == ProgramMode::DEBUG || !status.breakpoints.empty();
+        const bool skip_dead = !stepwise;
+        // pass生成的语句(循环前置块等)和后面的源码语句算作一步
+        for(; stmts[pc].synthetic && !failed(); pc = stmts[pc].next) {
+            if(!(skip_dead && stmts[pc].dead_store)) {
+                program->getCode().run(frame, static_cast<int>(pc));
+            }
+        }
+        if(!stepwise && stmts[pc].counted && !failed()) {
+            pc = runCounted(*program, pc, frame);
+            status.current_line = stmts[pc].line;
+        }
+        const auto& stmt = stmts[pc];
+        // GOTO/IF的闭包跳转时写入目标行, 这里只用来判断是否跳转
+        constexpr int not_taken = INT_MIN;
+        status.next_line = not_taken;
+        if(!failed() && !(skip_dead && stmt.dead_store)) {
+            program->getCode().run(frame, static_cast<int>(pc));
+        }
+        if(status.next_line != not_taken && stmt.invalid_jump) {
+            fail(ErrorKind::InvalidLine, format("line {} no exist", stmt.target));
+        }
+        if(failed()) {
+            status.next_line = stmt.line;
+        } else {
+            pc = status.next_line == not_taken ? stmt.nextFor(stepwise) : stmt.jumpFor(stepwise);
+            status.next_line = pc < stmts.size() ? stmts[pc].line : -1;
+        }
+        if(!failed() && ast_output && pc < stmts.size()) {
+            // 显示源码中的语句
+            if(auto shown = parser->getStmts().find(status.next_line); shown != parser->getStmts().end()) {
+                for(const auto& s: shown->second->toTabbedString()) {
+                    astOutput(s);
+                }
+            }
+        }
+    } catch (std::exception& e) {
+        fail(ErrorKind::Internal, e.what());
+    }
+    if(failed()) {
+        raiseError(origin_current); // pass to upper level
+    }
+    optimized_pc = pc;
+}
+
+size_t Interpreter::runCounted(const opt::Program& program, size_t at, closure::Frame& frame) {
+    const auto& stmts = program.getStmts();
+    const auto& loop = *stmts[at].counted;
+    const auto trips = opt::tripCount(loop, frame.table);
+    if(!trips.has_value() || *trips == 0) {
+        return at;
+    }
+    if(loop.closed && opt::applyClosedForm(loop, frame.table, *trips)) {
+        status.counters.var_writes += loop.sums.size() + 1;
+        return at;
+    }
+    // 圈数已经确定: 只执行路径上的赋值, 不再求值出口测试, 也不经过GOTO
+    const auto first = loop.on_jump ? stmts[at].jump : stmts[at].next;
+    for(int64_t k = 0; k < *trips; ++k) {
+        for(auto pc = first; pc != at;) {
+            const auto& stmt = stmts[pc];
+            if(stmt.node->type() == ASTNodeType::GOTOStmt) {
+                pc = stmt.jump;
+                continue;
+            }
+            if(!stmt.dead_store) {
+                status.current_line = stmt.line; // 出错时的行号
+                program.getCode().run(frame, static_cast<int>(pc));
+                if(failed()) {
+                    return pc;
+                }
+            }
+            pc = stmt.next;
+        }
+    }
+    return at;
+}
+
+void Interpreter::raiseError(int origin_current) {
+    const auto& err = eval_error.value();
+    print("Failed to interpret stmt: {}\n", err.message);
+    status.counters.exceptions++;
+    status.err_msg = err.message;
+    status.error = err;
+    status.running = false;
+    status.current_line = origin_current; // recover
+    throw InterpretError(err);
+}
+
+void Interpreter::loadFile(const std::filesystem::path& file, ProgramMode m) {
+    reset(status.current_file == file);
+    setFile(file);
+    setMode(m);
+    auto text = qbc::readSource(file);
+    auto hash = qbc::hashSource(text);
+    if(loaded_hash == hash && hasProgram()) {
+        print("[cache] {}: unchanged, reuse parsed program\n", file.string());
+        return;
+    }
+    loaded_hash.reset();
+    dropCompiled();
+    front_end_runs++;
+    auto program = Token::programFromlines(qbc::splitLines(text));
+    if(image_cache) {
+        loadFileWithImage(file, std::move(program), hash);
+    } else {
+        parser->reload(std::move(program));
+    }
+    loaded_hash = hash;
+}
+
+void Interpreter::loadFileWithImage(const std::filesystem::path& file, Token::BasicProgram&& program, uint64_t hash) {
+    auto image_path = qbc::imagePathFor(file);
+    if(auto image = qbc::CompiledProgram::mapFile(image_path, hash)) {
+        // 命中: 不tokenize也不parse, 源码只用于显示
+        parser->setSource(std::move(program));
+        compiled = image;
+        return;
+    }
+    parser->reload(std::move(program));
+    compiled = qbc::CompiledProgram::fromBuffer(qbc::compileProgram(parser->getStmts(), hash));
+    if(!qbc::writeImage(image_path, compiled->view())) {
+        print("[image] failed to write {}\n", image_path.string());
+    }
+}
+
+void Interpreter::setEngine(EngineKind kind) {
+    if(kind != EngineKind::Tiered) {
+        tiers.reset();
+    } else if(!tiers) {
+        tiers = std::make_shared<tier::Manager>();
+    }
+    if(kind != EngineKind::Optimized) {
+        optimized.reset();
+    }
+    if(kind == EngineKind::Flat) {
+        closures.reset();
+        jitted.reset();
+        if(!compiled) {
+            compiled = qbc::CompiledProgram::fromBuffer(qbc::compileProgram(parser->getStmts(), 0));
+        }
+        return;
+    }
+    if(compiled && parser->getStmts().empty()) {
+        parser->reload(parser->getSortedSrc());
+    }
+    compiled.reset();
+    if(kind != EngineKind::Closure) {
+        closures.reset();
+    } else if(!closures) {
+        closures = closure::compile(parser->getStmts());
+    }
+    if(kind != EngineKind::Jit) {
+        jitted.reset();
+    } else if(!jitted) {
+        jitted = jit::compile(parser->getStmts());
+    }
+    if(kind == EngineKind::Optimized && !optimized) {
+        optimized = opt::optimize(parser->getStmts(), opt_options);
+        for(const auto& [after, lines]: optimized->passDumps()) {
+            print("[DEBUG] IR after {}:\n", after);
+            for(const auto& line: lines) {
+                print("{}\n", line);
+            }
+        }
+        if(status.mode == ProgramMode::DEV) {
+            for(const auto& run: optimized->passRuns()) {
+                print("[DEBUG] Pass {}: {} changes, {:.1f} us\n", run.name, run.changes, run.us);
+            }
+            for(const auto& check: optimized->removedChecks()) {
+                print("[DEBUG] Removed check: {}\n", check);
+            }
+        }
+    }
+}
+
+// 和interpret_SingleStep相同的状态转换, 只是语句来自编译好的镜像
+void Interpreter::interpretFlat_SingleStep() {
+    const auto& view = compiled->view();
+    if(!status.running || status.err_msg.has_value() || view.empty()) {
+        print("Invalid status to interpret\n");
+        return;
+    }
+    auto idx = view.indexOf(status.next_line);
+    if(idx == qbc::NO_TARGET) {
+        print("Invalid current line: {}\n", status.next_line);
+        status.err_msg = format("line {} no exist", status.next_line);
+        status.error = EvalError{ErrorKind::InvalidLine, status.next_line, status.err_msg.value()};
+        return;
+    }
+    int origin_current = status.current_line;
+    eval_error.reset();
+    try {
+        status.current_line = status.next_line;
+        status.counters.statements++;
+        execFlatStmt(view, view.stmts()[idx]); // might change next_line
+        // 和树解释器一致: 输出next_line所在语句的AST, 跳转到不存在的行时在这里报错
+        auto shown = view.indexOf(status.next_line);
+        if(!failed() && shown == qbc::NO_TARGET) {
+            fail(ErrorKind::InvalidLine, format("line {} no exist", status.next_line));
+        }
+        if(!failed() && ast_output) {
+            for(const auto& s: qbc::tabbedString(view, shown)) {
+                astOutput(s);
+            }
+        }
+    } catch (std::exception& e) {
+        fail(ErrorKind::Internal, e.what());
+    }
+    if(failed()) {
+        raiseError(origin_current); // pass to upper level
+    }
+    if(!status.running || status.err_msg.has_value()) {
+        return;
+    }
+    if(status.next_line != status.current_line) {
+        return;
+    }
+    if(static_cast<size_t>(idx) + 1 == view.stmts().size()) {
+        status.next_line = -1; // will end in next call
+        return;
+    }
+    status.next_line = view.stmts()[idx + 1].line_no;
+}
+
+void Interpreter::execFlatStmt(const qbc::ProgramView& view, const qbc::StmtRecord& stmt) {
+    switch(stmt.kind) {
+    case qbc::StmtKind::Assign: {
+        status.counters.countNode(ASTNodeType::AssignStmt);
+        auto v = evalFlatExpr(view, stmt, true);
+        if(!failed()) {
+            setVar(view.name(stmt.var), v);
+        }
+        return;
+    }
+    case qbc::StmtKind::Goto:
+        status.counters.countNode(ASTNodeType::GOTOStmt);
+        status.next_line = stmt.target_line;
+        return;
+    case qbc::StmtKind::End:
+        status.counters.countNode(ASTNodeType::EndStmt);
+        status.running = false;
+        return;
+    case qbc::StmtKind::Print: {
+        status.counters.countNode(ASTNodeType::PrintStmt);
+        auto v = evalFlatExpr(view, stmt, true);
+        if(!failed()) {
+            printValue(v);
+        }
+        return;
+    }
+    case qbc::StmtKind::Input:
+        status.counters.countNode(ASTNodeType::InputStmt);
+        inputVar(string(view.name(stmt.var)));
+        return;
+    case qbc::StmtKind::If: {
+        status.counters.countNode(ASTNodeType::IFStmt);
+        auto v = evalFlatExpr(view, stmt, true);
+        if(!failed() && evalCond(v)) {
+            status.next_line = stmt.target_line;
+        }
+        return;
+    }
+    case qbc::StmtKind::Rem:
+        status.counters.countNode(ASTNodeType::RemStmt);
+        return;
+    case qbc::StmtKind::Expr:
+        // 单独的表达式行: 只求值, 结果不被使用
+        evalFlatExpr(view, stmt, false);
+        return;
+    }
+}
+
+std::any Interpreter::consumeFlat(FlatValue& v) {
+    if(v.from_var) {
+        status.counters.var_reads++;
+    }
+    status.counters.countValue(v.value);
+    return std::move(v.value);
+}
+
+// 树解释器进入节点时就计数(先序), 字节码是后序的: 在code[pc]出错时, 包含它的外层运算符
+// 在树解释器里已经计过数, 这里补上, 保证出错时计数器也和树解释器一致
+void Interpreter::countPendingFlatNodes(std::span<const qbc::Instr> code, size_t pc, size_t depth) {
+    // 模拟code[pc]之后的栈, true表示这个值包含出错的节点
+    vector<bool> stack(depth, false);
+    if(code[pc].op == qbc::OpCode::Binary) {
+        stack.pop_back();
+    }
+    if(code[pc].op == qbc::OpCode::PushConst || code[pc].op == qbc::OpCode::LoadVar) {
+        stack.push_back(true);
+    } else {
+        stack.back() = true;
+    }
+    for(auto i = pc + 1; i < code.size(); ++i) {
+        switch(code[i].op) {
+        case qbc::OpCode::PushConst:
+        case qbc::OpCode::LoadVar:
+            stack.push_back(false);
+            break;
+        case qbc::OpCode::Unary:
+            if(stack.back()) {
+                status.counters.countNode(ASTNodeType::UnaryOp);
+            }
+            break;
+        case qbc::OpCode::Binary: {
+            bool top = stack.back();
+            stack.pop_back();
+            if(top || stack.back()) {
+                status.counters.countNode(ASTNodeType::BinOp);
+                stack.back() = true;
+            }
+            break;
+        }
+        }
+    }
+}
+
+// consume: 结果被语句使用(LET/PRINT/IF), 对应树解释器里的visit_Expr + getNodeVal
+std::any Interpreter::evalFlatExpr(const qbc::ProgramView& view, const qbc::StmtRecord& stmt, bool consume) {
+    auto code = view.code(stmt);
+    auto consts = view.constants();
+    flat_stack.clear();
+    for(size_t pc = 0; pc < code.size(); ++pc) {
+        const auto& ins = code[pc];
+        const auto depth = flat_stack.size();
+        switch(ins.op) {
+        case qbc::OpCode::PushConst: {
+            const auto& c = consts[ins.operand];
+            if(c.kind == qbc::ConstKind::Int) {
+                status.counters.countNode(ASTNodeType::Num);
+                flat_stack.push_back({c.i, false});
+            } else if(c.kind == qbc::ConstKind::Double) {
+                status.counters.countNode(ASTNodeType::Num);
+                flat_stack.push_back({c.d, false});
+            } else {
+                status.counters.countNode(ASTNodeType::String);
+                flat_stack.push_back({string(view.str(c.str)), false});
+            }
+            break;
+        }
+        case qbc::OpCode::LoadVar: {
+            status.counters.countNode(ASTNodeType::Var);
+            auto var_name = view.name(ins.operand);
+            auto v = env->symbol_table->find(var_name);
+            if(v == nullptr) {
+                fail(ErrorKind::UndefinedVar, fmt::format("var {} not found", var_name));
+                break;
+            }
+            flat_stack.push_back({*v, true});
+            break;
+        }
+        case qbc::OpCode::Unary: {
+            status.counters.countNode(ASTNodeType::UnaryOp);
+            auto operand = consumeFlat(flat_stack.back());
+            flat_stack.back() = {evalUnaryOp(operand, static_cast<Token::TokenType>(ins.tk)), false};
+            break;
+        }
+        case qbc::OpCode::Binary: {
+            status.counters.countNode(ASTNodeType::BinOp);
+            auto top = std::move(flat_stack.back());
+            flat_stack.pop_back();
+            auto& below = flat_stack.back();
+            const bool swapped = ins.flags & qbc::SWAPPED;
+            auto left_v = consumeFlat(swapped ? top : below);
+            auto right_v = consumeFlat(swapped ? below : top);
+            below = {evalBinOp(left_v, right_v, static_cast<Token::TokenType>(ins.tk)), false};
+            break;
+        }
+        }
+        if(failed()) {
+            countPendingFlatNodes(code, pc, depth);
+            return {};
+        }
+    }
+    auto& result = flat_stack.back();
+    if(!consume) {
+        return std::move(result.value);
+    }
+    if(code.size() == 1 && code[0].op == qbc::OpCode::PushConst && consts[code[0].operand].kind == qbc::ConstKind::String) {
+        status.counters.eval_allocations++; // visit_Expr的String分支
+    }
+    return consumeFlat(result);
+}
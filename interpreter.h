@@ -8,8 +8,14 @@
 
 #include <QEventLoop>
 #include <QObject>
+#include <array>
 #include <concepts>
 #include "parser.h"
+#include "program_image.h"
+#include "closure_engine.h"
+#include "jit.h"
+#include "tiered.h"
+#include "optimizer.h"
 using std::string;
 using std::vector;
 // using fmt::print;
@@ -24,14 +30,48 @@ T doBinOp(T left, T right, Token::TokenType op);
 template<typename T>
 T doUnaryOp(T expr, Token::TokenType op);
 
+/*
+ * 运行时错误的分类
+ * 求值核心(tryBinOp, Interpreter的visit/evalXXX, Flat执行器)不抛异常, 出错时记录EvalError并逐层返回,
+ * 只有API边界(interpret_SingleStep)把它转换成InterpretError抛出
+ */
+enum class ErrorKind {
+    Ok,
+    UndefinedVar,
+    TypeMismatch,
+    DivByZero,
+    InvalidOperator,
+    InvalidLine,
+    Internal,
+};
+using EvalError = struct EvalError {
+    ErrorKind kind = ErrorKind::Ok;
+    int line_no = -1; // 出错的语句
+    string message;
+};
+class InterpretError: public std::runtime_error {
+    EvalError err;
+public:
+    explicit InterpretError(EvalError e): std::runtime_error(e.message), err(std::move(e)) {}
+    [[nodiscard]] const EvalError& error() const {
+        return err;
+    }
+};
+inline string binOpErrorMessage(ErrorKind kind, Token::TokenType op) {
+    if(kind == ErrorKind::DivByZero) {
+        return op == Token::TokenType::OP_MOD ? "MOD by zero" : "Division by zero";
+    }
+    return fmt::format("Invalid binary operator {}", tk2Str(op));
+}
+
 template <Arithmetic T>
-T doBinOp(T left, T right, Token::TokenType op) {
+ErrorKind tryBinOp(T left, T right, Token::TokenType op, T& out) {
     Arithmetic auto bias = 0;
     Arithmetic auto mod = 0;
     if constexpr ( std::is_integral_v<T> ) {
         if (op == Token::TokenType::OP_MOD) {
             if (right == 0) {
-                throw std::runtime_error("MOD by zero");
+                return ErrorKind::DivByZero;
             }
             // HINT: basic mod is different from cpp
             // 5 % -3 = -1(basic, sign decided by b in a % b)
@@ -46,52 +86,84 @@ T doBinOp(T left, T right, Token::TokenType op) {
             else if (mod < 0 && right > 0) {
                 mod += bias;
             }
-            return mod;
+            out = mod;
+            return ErrorKind::Ok;
         }
     }
 
     switch (op) {
         case Token::TokenType::OP_ADD:
-            return left + right;
+            out = left + right;
+            break;
         case Token::TokenType::OP_SUB:
-            return left - right;
+            out = left - right;
+            break;
         case Token::TokenType::OP_MUL:
-            return left * right;
+            out = left * right;
+            break;
         case Token::TokenType::OP_DIV:
             if (right == 0) {
-                throw std::runtime_error("Division by zero");
+                return ErrorKind::DivByZero;
             }
-            return left / right;
-
+            out = left / right;
+            break;
         case Token::TokenType::OP_POW:
-            return static_cast<T>(std::pow(left, right));
+            out = static_cast<T>(std::pow(left, right));
+            break;
         case Token::TokenType::OP_GT:
-            return left > right ? 1 : 0;
+            out = left > right ? 1 : 0;
+            break;
         case Token::TokenType::OP_LT:
-            return left < right ? 1 : 0;
+            out = left < right ? 1 : 0;
+            break;
         case Token::TokenType::OP_GE:
-            return left >= right ? 1 : 0;
+            out = left >= right ? 1 : 0;
+            break;
         case Token::TokenType::OP_LE:
-            return left <= right ? 1 : 0;
+            out = left <= right ? 1 : 0;
+            break;
         case Token::TokenType::OP_EQ:
-            return left == right ? 1 : 0;
+            out = left == right ? 1 : 0;
+            break;
         case Token::TokenType::OP_NE:
-            return left != right ? 1 : 0;
+            out = left != right ? 1 : 0;
+            break;
         default:
-            throw std::runtime_error(fmt::format("Invalid binary operator {}", tk2Str(op)));
+            return ErrorKind::InvalidOperator;
+    }
+    return ErrorKind::Ok;
+}
+// throws: std::runtime_error
+template <Arithmetic T>
+T doBinOp(T left, T right, Token::TokenType op) {
+    T out{};
+    if(auto err = tryBinOp<T>(left, right, op, out); err != ErrorKind::Ok) {
+        throw std::runtime_error(binOpErrorMessage(err, op));
     }
+    return out;
 }
 
 template <Arithmetic T>
-T doUnaryOp(T expr, Token::TokenType op) {
+ErrorKind tryUnaryOp(T expr, Token::TokenType op, T& out) {
     switch (op) {
         case Token::TokenType::OP_ADD:
-            return expr;
+            out = expr;
+            return ErrorKind::Ok;
         case Token::TokenType::OP_SUB:
-            return -expr;
+            out = -expr;
+            return ErrorKind::Ok;
         default:
-            throw std::runtime_error(fmt::format("Invalid unary operator {}", tk2Str(op)));
+            return ErrorKind::InvalidOperator;
+    }
+}
+// throws: std::runtime_error
+template <Arithmetic T>
+T doUnaryOp(T expr, Token::TokenType op) {
+    T out{};
+    if(tryUnaryOp<T>(expr, op, out) != ErrorKind::Ok) {
+        throw std::runtime_error(fmt::format("Invalid unary operator {}", tk2Str(op)));
     }
+    return out;
 }
 template<typename T>
 concept String = std::is_same_v<std::remove_cv<T>, std::string>;
@@ -102,7 +174,7 @@ concept BasicData = Arithmetic<T> || String<T>;
 
 
 template<String T>
-T doBinOp(T left, T right, Token::TokenType op) {
+T doBinOp(const T& left, const T& right, Token::TokenType op) {
     switch (op) {
         case Token::TokenType::OP_ADD:
             return left + right;
@@ -124,7 +196,7 @@ T doBinOp(T left, T right, Token::TokenType op) {
 }
 
 template<typename T>
-T evalBinWithAny(std::any& left, std::any& right, Token::TokenType op) {
+T evalBinWithAny(const std::any& left, const std::any& right, Token::TokenType op) {
     if(left.type() != right.type()) {
         const string msg = fmt::format("evalWithAny: type unmatched: {} and {}",
                                        left.type().name(), right.type().name());
@@ -136,8 +208,9 @@ T evalBinWithAny(std::any& left, std::any& right, Token::TokenType op) {
         throw std::runtime_error(msg);
     }
     if constexpr ( BasicData<T> ) {
-        T l = std::any_cast<T>(left);
-        T r = std::any_cast<T>(right);
+        // 借用any里的值, 字符串不复制
+        const T& l = *std::any_cast<T>(&left);
+        const T& r = *std::any_cast<T>(&right);
         return doBinOp<T>(l, r, op);
     } else {
         const string msg = fmt::format("evalWithAny: Unsupport type {}", typeid(T).name());
@@ -145,7 +218,7 @@ T evalBinWithAny(std::any& left, std::any& right, Token::TokenType op) {
     }
 }
 template<typename T>
-T evalUnaryWithAny(std::any& expr, Token::TokenType op) {
+T evalUnaryWithAny(const std::any& expr, Token::TokenType op) {
     if(!util::ConvAny<T>(expr)) {
             const string msg = fmt::format("evalUnaryWithAny: operand type {} unmatched with specified type {}"
                                        , expr.type().name(), typeid(T).name());
@@ -181,6 +254,75 @@ enum class ProgramMode {
     DEBUG,
     DEV,
 };
+// TreeWalker: 直接遍历Parser的AST; Flat: 执行编译好的扁平镜像(qbc::ProgramView)
+// Closure: 执行由AST预先编译成的闭包(closure::Program)
+// Jit: int表达式执行由AST生成的x86-64代码(jit::Program), 其他语句回退到树解释器
+// Tiered: 从树解释器开始, 热区域编译成闭包和本机代码(tier::Manager)
+// Optimized: 复制AST后执行优化pass, 按语句下标执行编译成的闭包(opt::Program)
+enum class EngineKind {
+    TreeWalker,
+    Flat,
+    Closure,
+    Jit,
+    Tiered,
+    Optimized,
+};
+/*
+ * 运行时计数器, 用于比较不同执行引擎和定位性能回退
+ * 每次运行(ProgramStatus::reload)清零, 断点暂停时也可以读取
+ */
+using PerfCounters = struct PerfCounters {
+    uint64_t statements = 0;        // 执行的语句数
+    std::array<uint64_t, AST_NODE_TYPE_COUNT> nodes{}; // 按ASTNodeType统计的求值节点数
+    uint64_t var_reads = 0;
+    uint64_t var_writes = 0;
+    uint64_t symbol_insertions = 0; // SymbolTable中新插入的变量
+    // 求值过程中的堆分配: std::any的内部缓冲只放得下int/double,
+    // 其余(string)类型的值每装箱一次就要分配一次
+    uint64_t eval_allocations = 0;
+    uint64_t exceptions = 0;        // 抛到API边界的异常(InterpretError), 每个运行时错误一次
+    uint64_t output_bytes = 0;
+    uint64_t input_waits = 0;
+    void reset() {
+        *this = PerfCounters{};
+    }
+    void countNode(ASTNodeType type) {
+        nodes[static_cast<size_t>(type)]++;
+    }
+    [[nodiscard]] uint64_t nodesOf(ASTNodeType type) const {
+        return nodes[static_cast<size_t>(type)];
+    }
+    [[nodiscard]] uint64_t totalNodes() const {
+        uint64_t total = 0;
+        for(const auto n: nodes) {
+            total += n;
+        }
+        return total;
+    }
+    void countValue(const std::any& v) {
+        if(v.has_value() && !util::ConvAny<int>(v) && !util::ConvAny<double>(v)) {
+            eval_allocations++;
+        }
+    }
+    [[nodiscard]] vector<string> getRepl() const {
+        vector<string> res;
+        res.push_back(fmt::format("statements: {}", statements));
+        for(size_t i = 0; i < AST_NODE_TYPE_COUNT; ++i) {
+            if(nodes[i] == 0) {
+                continue;
+            }
+            res.push_back(fmt::format("nodes[{}]: {}", ast2Str(static_cast<ASTNodeType>(i)), nodes[i]));
+        }
+        res.push_back(fmt::format("var reads: {}", var_reads));
+        res.push_back(fmt::format("var writes: {}", var_writes));
+        res.push_back(fmt::format("symbol insertions: {}", symbol_insertions));
+        res.push_back(fmt::format("eval allocations: {}", eval_allocations));
+        res.push_back(fmt::format("exceptions: {}", exceptions));
+        res.push_back(fmt::format("output bytes: {}", output_bytes));
+        res.push_back(fmt::format("input waits: {}", input_waits));
+        return res;
+    }
+};
 using ProgramStatus = struct ProgramStatus {
     int current_line = -1;
     int next_line = 0;
@@ -188,13 +330,17 @@ using ProgramStatus = struct ProgramStatus {
     bool running = false;
     bool blocking = false;
     std::optional<std::string> err_msg;
+    std::optional<EvalError> error; // 和err_msg同时设置, 带错误分类和行号
     ProgramMode mode = ProgramMode::DEV;
     std::set<int> breakpoints;
+    PerfCounters counters;
     void reload() {
         current_line = -1;
         next_line = 0;
         running = false;
         err_msg = {};
+        error = {};
+        counters.reset();
     }
     void reset() {
         reload();
@@ -320,6 +466,59 @@ private:
     MockInputStream inputStream{};
     MockOutputStream outputStream{};
     MockOutputStream astStream{};
+    // Flat引擎: 编译好的程序, 可能是mmap的.qbc文件
+    std::shared_ptr<const qbc::CompiledProgram> compiled{};
+    bool image_cache = false;
+    // Closure引擎: 由parser的AST编译, 程序重新加载时丢弃
+    std::shared_ptr<const closure::Program> closures{};
+    friend class closure::Compiler;
+    // JIT引擎: 同样由parser的AST编译, 本机代码之外的语句由树解释器执行
+    std::shared_ptr<jit::Program> jitted{};
+    friend class jit::Program;
+    // 分层执行: 程序重新加载时只清空统计和区域, 引擎保持不变
+    std::shared_ptr<tier::Manager> tiers{};
+    friend class tier::Manager;
+    // 优化引擎: 由parser的AST复制并优化, 程序重新加载时丢弃; optimized_pc是下一步执行的语句
+    std::shared_ptr<const opt::Program> optimized{};
+    opt::Options opt_options{};
+    size_t optimized_pc = opt::NO_STMT;
+    // 每一步之后输出下一条语句的AST; 关闭后稳定状态的数值语句不分配内存
+    bool ast_output = true;
+    // 当前的parser/compiled对应status.current_file中hash为loaded_hash的源码;
+    // 直接修改程序(loadProgram, reload(lines))后为nullopt
+    std::optional<uint64_t> loaded_hash{};
+    uint64_t front_end_runs = 0;
+    using FlatValue = struct FlatValue {
+        std::any value;
+        bool from_var; // 变量的值在被使用时才计入var_reads, 和getNodeVal一致
+    };
+    vector<FlatValue> flat_stack;
+    void loadFileWithImage(const std::filesystem::path& file, Token::BasicProgram&& program, uint64_t hash);
+    void interpretFlat_SingleStep();
+    void interpretOptimized_SingleStep();
+    // 从计数循环(opt::Counted)的出口测试at快进到最后一次测试; 返回at, 循环体出错时返回出错的语句
+    size_t runCounted(const opt::Program& program, size_t at, closure::Frame& frame);
+    // 优化引擎删掉的行上的断点由后面仍然执行的行代表(opt::Program::breakAt)
+    [[nodiscard]] bool breakAt(int line_no) const {
+        return optimized ? optimized->breakAt(status.breakpoints, line_no) : status.break_at(line_no);
+    }
+    void execFlatStmt(const qbc::ProgramView& view, const qbc::StmtRecord& stmt);
+    std::any evalFlatExpr(const qbc::ProgramView& view, const qbc::StmtRecord& stmt, bool consume);
+    std::any consumeFlat(FlatValue& v);
+    void countPendingFlatNodes(std::span<const qbc::Instr> code, size_t pc, size_t depth);
+    // 当前语句的运行时错误, 由interpret_SingleStep检查并转换成异常
+    std::optional<EvalError> eval_error{};
+    [[noreturn]] void raiseError(int origin_current);
+    // 程序改变: 丢掉所有由旧程序编译出来的东西
+    void dropCompiled() {
+        compiled.reset();
+        closures.reset();
+        jitted.reset();
+        optimized.reset();
+        if(tiers) {
+            tiers->clear();
+        }
+    }
 public:
     explicit Interpreter(std::shared_ptr<Parser> p, std::shared_ptr<Env> e,
                          const ProgramMode mode = ProgramMode::DEV): parser(p), env(e) {
@@ -360,6 +559,7 @@ public:
     }
     template<Streamable T>
     void requireInput(T& var) {
+        status.counters.input_waits++;
         status.blocking = true;
         print("[DEBUG] waiting for input ...\n");
         if(status.mode == ProgramMode::DEV) {
@@ -371,6 +571,7 @@ public:
     }
     template<Streamable T>
     void output(T output) {
+        status.counters.output_bytes += fmt::formatted_size("{}", output);
         if(status.mode == ProgramMode::DEV) {
             std::cout << output;
         } else {
@@ -398,6 +599,12 @@ public:
     [[nodiscard]] ProgramStatus getStatus() const {
         return status;
     }
+    [[nodiscard]] const PerfCounters& getCounters() const {
+        return status.counters;
+    }
+    void resetCounters() {
+        status.counters.reset();
+    }
     void reset(bool status_reload = false) {
         // clear status
         // clear env
@@ -422,15 +629,13 @@ public:
     void setFile(std::filesystem::path file) {
         status.current_file = std::move(file);
     }
-    void loadFile(const std::filesystem::path &file, ProgramMode m = ProgramMode::DEV) {
-        reset(status.current_file == file);
-        setFile(file);
-        setMode(m);
-        parser->reload(file);
-    }
+    // 源码没有变化时(hash相同)复用已经解析/编译好的程序, 只重置ProgramStatus和Env
+    void loadFile(const std::filesystem::path &file, ProgramMode m = ProgramMode::DEV);
     void loadProgram(Token::BasicProgram&& program, ProgramMode m = ProgramMode::DEV) {
         reset();
         setMode(m);
+        dropCompiled();
+        loaded_hash.reset();
         parser->reload(std::move(program));
     }
     void reload() {
@@ -441,12 +646,95 @@ public:
     }
     void reload(const std::vector<std::string>& lines) {
         reset();
+        dropCompiled();
+        loaded_hash.reset();
         parser->reload(lines);
     }
     void reload(Token::BasicProgram p) {
         reset();
+        dropCompiled();
+        loaded_hash.reset();
         parser->reload(std::move(p));
     }
+    // 开启后loadFile会读写源文件旁边的.qbc镜像, 并使用Flat引擎
+    void setImageCache(bool enable) {
+        image_cache = enable;
+    }
+    [[nodiscard]] bool imageCacheEnabled() const {
+        return image_cache;
+    }
+    void setASTOutput(bool enable) {
+        ast_output = enable;
+    }
+    // 树解释器的语句融合(fusion.h), 作用于当前和之后解析的程序
+    void setFusion(bool enable) {
+        parser->setFusion(enable);
+        if(jitted) {
+            // JIT回退时执行的是parser里的语句节点, 融合会替换它们
+            jitted = jit::compile(parser->getStmts());
+        }
+        if(tiers) {
+            tiers->clear();
+        }
+    }
+    // 类型推导(type_infer.h): 树解释器对证明是int的表达式不检查类型, 默认开启
+    void setTypeInference(bool enable) {
+        parser->setTypeInference(enable);
+    }
+    // 加载时拒绝跳到不存在的行的程序(Parser::setJumpCheck), 作用于之后解析的程序
+    void setJumpCheck(bool enable) {
+        parser->setJumpCheck(enable);
+    }
+    [[nodiscard]] EngineKind getEngine() const {
+        if(compiled) {
+            return EngineKind::Flat;
+        }
+        if(optimized) {
+            return EngineKind::Optimized;
+        }
+        if(jitted) {
+            return EngineKind::Jit;
+        }
+        if(tiers) {
+            return EngineKind::Tiered;
+        }
+        return closures ? EngineKind::Closure : EngineKind::TreeWalker;
+    }
+    // Flat: 把当前的AST编译到内存中; TreeWalker/Closure: 丢掉编译结果, 必要时从源码重新解析,
+    // Closure再把AST编译成闭包, Jit编译成本机代码, Optimized优化后编译成闭包. 重新加载程序后回到TreeWalker(Flat镜像缓存除外),
+    // Tiered除外: 它本来就从树解释器开始
+    void setEngine(EngineKind kind);
+    [[nodiscard]] std::shared_ptr<const qbc::CompiledProgram> getCompiled() const {
+        return compiled;
+    }
+    [[nodiscard]] std::shared_ptr<const jit::Program> getJit() const {
+        return jitted;
+    }
+    [[nodiscard]] std::shared_ptr<const tier::Manager> getTiers() const {
+        return tiers;
+    }
+    [[nodiscard]] std::shared_ptr<const opt::Program> getOptimized() const {
+        return optimized;
+    }
+    // 作用于之后setEngine(EngineKind::Optimized)编译的程序
+    void setOptOptions(const opt::Options& options) {
+        opt_options = options;
+    }
+    [[nodiscard]] const opt::Options& getOptOptions() const {
+        return opt_options;
+    }
+    void setTierThresholds(tier::Thresholds t) {
+        if(tiers) {
+            tiers->setThresholds(t);
+        }
+    }
+    // tokenize + parse(以及编译/映射镜像)的次数, 源码不变时的RUN/DEBUG不会增加
+    [[nodiscard]] uint64_t getFrontEndRuns() const {
+        return front_end_runs;
+    }
+    [[nodiscard]] bool hasProgram() {
+        return compiled ? !compiled->view().empty() : !parser->getStmts().empty();
+    }
     void switchMode(ProgramMode m) {
         // 如果是自测，那debug模式还是自测
         this->reset(true);
@@ -454,6 +742,9 @@ public:
     }
     void addBreakpoint(int line) {
         status.add_breakpoint(line);
+        if(tiers) {
+            tiers->deoptimize(line);
+        }
     }
     void deleteBreakpoint(int line) {
         status.delete_breakpoint(line);
@@ -461,168 +752,370 @@ public:
     [[nodiscard]] auto getSortedSrc() const {
         return parser->getSortedSrc();
     }
+    // 记录第一个错误, 调用方随后检查failed()并返回
+    void fail(ErrorKind kind, string message) {
+        if(!eval_error.has_value()) {
+            eval_error = EvalError{kind, status.current_line, std::move(message)};
+        }
+    }
+    [[nodiscard]] bool failed() const {
+        return eval_error.has_value();
+    }
+    [[nodiscard]] const std::optional<EvalError>& getEvalError() const {
+        return eval_error;
+    }
 
+    /*
+     * 从ASTNode中借用值, 不复制
+     * 需要区分VarNode(值在Env里)和其他Node; 变量不存在时fail()并返回nullptr
+     * 指针在下一次setVar或者再次visit这个节点之前有效
+     */
+    const std::any* borrowNodeVal(ASTNode* node) {
+        const std::any* v = nullptr;
+        if(node->type() == ASTNodeType::Var) {
+            const auto& var_name = static_cast<VarNode*>(node)->getName();
+            v = env->symbol_table->find(var_name);
+            if(v == nullptr) {
+                fail(ErrorKind::UndefinedVar, fmt::format("var {} not found", var_name));
+                return nullptr;
+            }
+            status.counters.var_reads++;
+        } else {
+            v = &node->getValRef();
+        }
+        status.counters.countValue(*v);
+        return v;
+    }
     /*
      * 从ASTNode中获取值
      * 需要区分VarNode和其他Node
      */
     template<typename T>
     T getNodeVal(ASTNode* node) {
-        if(node->type() == ASTNodeType::Var) {
-            string var_name = dynamic_cast<VarNode*>(node)->getName();
-            auto v = env->symbol_table->get<T>(var_name);
-            if(!v.has_value()) {
-                throw std::runtime_error(fmt::format("var {} not found", var_name));
-            }
-            return v.value();
+        auto v = borrowNodeVal(node);
+        if(v == nullptr) {
+            return T{};
         }
         if constexpr (std::is_same_v<T, std::any>) {
-            return node->getVal(); // any_cast is exactly equal
+            return *v;
         } else {
-            return std::any_cast<T>(node->getVal());
+            return std::any_cast<T>(*v);
+        }
+    }
+    template<typename T>
+    void setVar(std::string_view var_name, const T& value) {
+        status.counters.var_writes++;
+        if(env->symbol_table->set<T>(var_name, value)) {
+            status.counters.symbol_insertions++;
+        }
+    }
+    /*
+     * 类型推导(type_infer.h)证明是Int的表达式: 不经过std::any, 运算时不检查类型
+     * 不产生副作用, 失败(变量不存在或者被外部换成了别的类型, 除零)时返回false,
+     * 由调用方按通用路径重新求值并报告错误; 成功时计数器和通用路径一致
+     */
+    bool tryIntExpr(ASTNode* node, int& out) {
+        if(node->getStaticType() != StaticType::Int) {
+            return false;
+        }
+        IntTally tally;
+        if(!evalIntExpr(node, out, tally)) {
+            return false;
+        }
+        auto& counters = status.counters;
+        counters.nodes[static_cast<size_t>(ASTNodeType::BinOp)] += tally.bin_ops;
+        counters.nodes[static_cast<size_t>(ASTNodeType::UnaryOp)] += tally.unary_ops;
+        counters.nodes[static_cast<size_t>(ASTNodeType::Num)] += tally.nums;
+        counters.nodes[static_cast<size_t>(ASTNodeType::Var)] += tally.vars;
+        counters.var_reads += tally.vars; // 每个变量节点被它的父节点(或者语句)读一次
+        return true;
+    }
+    using IntTally = struct IntTally {
+        uint32_t bin_ops = 0;
+        uint32_t unary_ops = 0;
+        uint32_t nums = 0;
+        uint32_t vars = 0;
+    };
+    // 子节点的求值顺序和visit_BinOp一致, 这样INT_MIN / -1这样的陷阱和通用路径在同一处发生
+    bool evalIntExpr(ASTNode* node, int& out, IntTally& tally) {
+        switch(node->type()) {
+        case ASTNodeType::Num:
+            tally.nums++;
+            out = *std::any_cast<int>(&node->getValRef());
+            return true;
+        case ASTNodeType::Var: {
+            tally.vars++;
+            auto v = env->symbol_table->find(static_cast<VarNode*>(node)->getName());
+            auto i = v == nullptr ? nullptr : std::any_cast<int>(v);
+            if(i == nullptr) {
+                return false;
+            }
+            out = *i;
+            return true;
+        }
+        case ASTNodeType::BinOp: {
+            tally.bin_ops++;
+            auto bin = static_cast<BinOpNode*>(node);
+            int left = 0;
+            int right = 0;
+            if(Token::isRightAssociative(bin->getOp())) {
+                if(!evalIntExpr(bin->getRight(), right, tally) || !evalIntExpr(bin->getLeft(), left, tally)) {
+                    return false;
+                }
+            } else if(!evalIntExpr(bin->getLeft(), left, tally) || !evalIntExpr(bin->getRight(), right, tally)) {
+                return false;
+            }
+            return tryBinOp<int>(left, right, bin->getOp(), out) == ErrorKind::Ok;
+        }
+        case ASTNodeType::UnaryOp: {
+            tally.unary_ops++;
+            auto unary = static_cast<UnaryOpNode*>(node);
+            int expr = 0;
+            return evalIntExpr(unary->getExpr(), expr, tally) &&
+                tryUnaryOp<int>(expr, unary->getOp(), out) == ErrorKind::Ok;
+        }
+        default:
+            return false;
         }
     }
-    void visit_BinOp(BinOpNode* node) {
+    void visit_BinOp(BinOpNode* node) override {
+        status.counters.countNode(ASTNodeType::BinOp);
         auto left_node = node->getLeft();
         auto right_node = node->getRight();
         if(left_node == nullptr || right_node == nullptr) {
-            throw std::runtime_error("BinOpNode: left or right is nullptr");
+            fail(ErrorKind::Internal, "BinOpNode: left or right is nullptr");
+            return;
         }
-        if (Token::isRightAssociative(node->getOp())) {
-            visit(right_node);
-            visit(left_node);
-        } else {
-            visit(left_node);
-            visit(right_node);
+        auto first = Token::isRightAssociative(node->getOp()) ? right_node : left_node;
+        visit(first);
+        if(failed()) {
+            return;
+        }
+        visit(first == left_node ? right_node : left_node);
+        if(failed()) {
+            return;
         }
 
-        auto left_v = getNodeVal<std::any>(left_node);
-        auto right_v = getNodeVal<std::any>(right_node);
-        std::optional<std::any> result;
+        auto left_v = borrowNodeVal(left_node);
+        auto right_v = borrowNodeVal(right_node);
+        if(failed()) {
+            return;
+        }
+        node->setValue(evalBinOp(*left_v, *right_v, node->getOp()));
+    }
+    // BinOp/UnaryOp/IF/PRINT/INPUT 的语义, 两个引擎共用
+    // 出错时fail()并返回空的std::any
+    std::any evalBinOp(const std::any& left_v, const std::any& right_v, Token::TokenType op) {
+        std::any result;
         if (left_v.type() != right_v.type()) {
-            const string msg = fmt::format("BinOpNode: type unmatched: {} and {}",
-                                           left_v.type().name(), right_v.type().name());
-            throw std::runtime_error(msg);
+            fail(ErrorKind::TypeMismatch, fmt::format("BinOpNode: type unmatched: {} and {}",
+                                                      left_v.type().name(), right_v.type().name()));
+            return result;
         }
-        if(util::ConvAny<int>(left_v)) {
-            result = evalBinWithAny<int>(left_v, right_v, node->getOp());
-        } else if(util::ConvAny<double>(left_v)) {
-            result = evalBinWithAny<double>(left_v, right_v, node->getOp());
+        auto err = ErrorKind::Ok;
+        if(auto l = std::any_cast<int>(&left_v)) {
+            int out = 0;
+            err = tryBinOp<int>(*l, std::any_cast<int>(right_v), op, out);
+            result = out;
+        } else if(auto d = std::any_cast<double>(&left_v)) {
+            double out = 0;
+            err = tryBinOp<double>(*d, std::any_cast<double>(right_v), op, out);
+            result = out;
         } else if(util::ConvAny<std::string>(left_v)) {
-            result = evalBinWithAny<std::string>(left_v, right_v, node->getOp());
+            // 和evalBinWithAny<std::string>一致: String concept不匹配std::string, 字符串不支持运算
+            fail(ErrorKind::TypeMismatch, fmt::format("evalWithAny: Unsupport type {}", typeid(std::string).name()));
+            return {};
         } else {
-            const string msg = fmt::format("BinOpNode: Invalid value type {}", ast2Str(node->type()));
-            throw std::runtime_error(msg);
+            fail(ErrorKind::TypeMismatch, fmt::format("BinOpNode: Invalid value type {}", ast2Str(ASTNodeType::BinOp)));
+            return {};
         }
-        node->setValue(result.value());
+        if(err != ErrorKind::Ok) {
+            fail(err, binOpErrorMessage(err, op));
+            return {};
+        }
+        status.counters.countValue(result);
+        return result;
     }
-    void visit_UnaryOp(UnaryOpNode* node) {
+    void visit_UnaryOp(UnaryOpNode* node) override {
+        status.counters.countNode(ASTNodeType::UnaryOp);
         auto op = node->getOp();
         auto expr_node = node->getExpr();
         visit(expr_node);
-        auto expr_v = getNodeVal<std::any>(expr_node);
-        std::optional<std::any> result;
-        if(util::ConvAny<int>(expr_v)) {
-            result = evalUnaryWithAny<int>(expr_v, op);
-        } else if(util::ConvAny<double>(expr_v)) {
-            result = evalUnaryWithAny<double>(expr_v, op);
+        if(failed()) {
+            return;
+        }
+        auto expr_v = borrowNodeVal(expr_node);
+        if(failed()) {
+            return;
+        }
+        node->setValue(evalUnaryOp(*expr_v, op));
+    }
+    std::any evalUnaryOp(const std::any& expr_v, Token::TokenType op) {
+        std::any result;
+        auto err = ErrorKind::Ok;
+        if(auto i = std::any_cast<int>(&expr_v)) {
+            int out = 0;
+            err = tryUnaryOp<int>(*i, op, out);
+            result = out;
+        } else if(auto d = std::any_cast<double>(&expr_v)) {
+            double out = 0;
+            err = tryUnaryOp<double>(*d, op, out);
+            result = out;
         } else {
-            string s = fmt::format("UnaryOpNode: Invalid unary operator {}", tk2Str(op));
-            throw std::runtime_error(s);
+            err = ErrorKind::TypeMismatch;
+        }
+        if(err != ErrorKind::Ok) {
+            fail(err, err == ErrorKind::TypeMismatch
+                ? fmt::format("UnaryOpNode: Invalid unary operator {}", tk2Str(op))
+                : fmt::format("Invalid unary operator {}", tk2Str(op)));
+            return {};
         }
-        node->setValue(result.value());
+        status.counters.countValue(result);
+        return result;
     }
+    void visit_NumNode(NumNode* node) override {
+        // 值在构造时已经存好
+        status.counters.countNode(ASTNodeType::Num);
+    }
+    void visit_StringNode(StringNode* node) override {
+        status.counters.countNode(ASTNodeType::String);
+    }
+    void visit_DataNode(DataNode* node) override {
+        status.counters.countNode(ASTNodeType::Data);
+    }
+    void visit_VarNode(VarNode* node) override {
+        status.counters.countNode(ASTNodeType::Var);
+        if(!env->symbol_table->contains(node->getName())) {
+            fail(ErrorKind::UndefinedVar, fmt::format("var {} not found", node->getName()));
+        }
+        // var never set value(lookup)
+    }
+    // 语句里的整个表达式
     void visit_Expr(ASTNode* node) {
         // node 要么是Op要么是Data
-        if (node->type() == ASTNodeType::BinOp) {
-            visit_BinOp(dynamic_cast<BinOpNode*>(node));
+        visit(node);
+        if(failed()) {
             return;
         }
-        if (node->type() == ASTNodeType::UnaryOp) {
-            visit_UnaryOp(dynamic_cast<UnaryOpNode*>(node));
+        switch(node->type()) {
+        case ASTNodeType::String:
+            status.counters.eval_allocations++; // 顶层字符串的值会被复制一次
             return;
-        }
-        if (node->type() == ASTNodeType::Num) {
-            node->setValue(dynamic_cast<NumNode*>(node)->getVal());
+        case ASTNodeType::Data:
+            fail(ErrorKind::Internal, fmt::format("Expr: Invalid type {}", ast2Str(node->type())));
+            return;
+        default:
             return;
         }
-        if (node->type() == ASTNodeType::Var) {
-            string var_name = dynamic_cast<VarNode*>(node)->getName();
-            auto v = env->symbol_table->get<std::any>(var_name);
-            if(!v.has_value()) {
-                throw std::runtime_error(fmt::format("var {} not found", var_name));
+    }
+    void visit_IFStmtNode(IFStmtNode* node) override {
+        status.counters.countNode(ASTNodeType::IFStmt);
+        auto cond = node->getCond();
+        if(int v = 0; tryIntExpr(cond, v)) {
+            if(v != 0) {
+                status.next_line = node->getNext();
             }
-            // var never set value(lookup)
             return;
         }
-        if (node->type() == ASTNodeType::String) {
-            node->setValue(dynamic_cast<StringNode*>(node)->getString());
+        visit_Expr(cond);
+        if(failed()) {
             return;
         }
-        string s = fmt::format("Expr: Invalid type {}", ast2Str(node->type()));
-        throw std::runtime_error(s);
-    }
-    void visit_IFStmtNode(IFStmtNode* node) {
-        auto cond = node->getCond();
-        visit_Expr(cond);
-        auto cond_v = getNodeVal<std::any>(cond);
-        bool cond_result;
-        if(cond_v.type() == typeid(int) || cond_v.type() == typeid(double)) {
-            cond_result = std::any_cast<int>(cond_v) != 0;
+        auto cond_v = borrowNodeVal(cond);
+        if(!failed() && evalCond(*cond_v)) {
+            status.next_line = node->getNext();
         }
-        else if(cond_v.type() == typeid(string)) {
-            cond_result = !std::any_cast<string>(cond_v).empty();
+    }
+    // 出错时fail()并返回false
+    bool evalCond(const std::any& cond_v) {
+        if(auto i = std::any_cast<int>(&cond_v)) {
+            return *i != 0;
         }
-        else {
-            string s = fmt::format("IFStmtNode: Invalid value type {}", ast2Str(node->type()));
-            throw std::runtime_error(s);
+        if(cond_v.type() == typeid(double)) {
+            // 保持原来的行为: double条件按int取值, 是一次失败的any_cast
+            fail(ErrorKind::TypeMismatch, "bad any_cast");
+            return false;
         }
-        if(cond_result) {
-            status.next_line = node->getNext();
+        if(auto str = std::any_cast<string>(&cond_v)) {
+            return !str->empty();
         }
+        fail(ErrorKind::TypeMismatch, fmt::format("IFStmtNode: Invalid value type {}", ast2Str(ASTNodeType::IFStmt)));
+        return false;
     }
-    void visit_AssignStmtNode(AssignStmtNode* node) {
+    void visit_AssignStmtNode(AssignStmtNode* node) override {
+        status.counters.countNode(ASTNodeType::AssignStmt);
         auto left = node->getLeft();
         auto right = node->getRight();
 
-        auto var_name = left->getName();
+        const auto& var_name = left->getName();
+        if(int v = 0; tryIntExpr(right, v)) {
+            node->setValue(v);
+            setVar(var_name, v);
+            return;
+        }
         visit_Expr(right);
-        auto right_v = getNodeVal<std::any>(right);
-        env->symbol_table->set(var_name, right_v);
-        node->setValue(right_v);
+        if(failed()) {
+            return;
+        }
+        auto right_v = borrowNodeVal(right);
+        if(failed()) {
+            return;
+        }
+        // LET A = A: right_v指向A在表中的值, 先复制到节点上再写回
+        node->setValue(*right_v);
+        setVar(var_name, node->getValRef());
     }
-    void visit_GOTOStmtNode(GOTOStmtNode* node) {
+    void visit_GOTOStmtNode(GOTOStmtNode* node) override {
+        status.counters.countNode(ASTNodeType::GOTOStmt);
         status.next_line = node->getLineNo();
         node->setValue(status.next_line);
     }
-    void visit_EndStmtNode(EndStmtNode* node) {
+    void visit_EndStmtNode(EndStmtNode* node) override {
+        status.counters.countNode(ASTNodeType::EndStmt);
         status.running = false;
     }
-    void visit_InputStmtNode(InputStmtNode* node) {
+    void visit_InputStmtNode(InputStmtNode* node) override {
+        status.counters.countNode(ASTNodeType::InputStmt);
+        node->setValue(inputVar(node->getVar()->getName()));
+    }
+    std::any inputVar(const string& var_name) {
         // 默认是string, 如果可以转换成数字就转换成数字
         string input = "undefined";
         requireInput(input);
         // HINT: INPUT n 定义n
-        try {
-            auto num = str2Number(input);
-            if(std::holds_alternative<int>(num)) {
-                int num_i = std::get<int>(num);
-                env->symbol_table->set<int>(node->getVar()->getName(), num_i);
-                node->setValue(num_i);
-            } else {
-                double num_d = std::get<double>(num);
-                env->symbol_table->set<double>(node->getVar()->getName(), num_d);
-                node->setValue(num_d);
-            }
-        } catch (std::exception& e) {
-            env->symbol_table->set<string>(node->getVar()->getName(), input);
-            node->setValue(input);
+        auto num = tryStr2Number(input);
+        if(!num.has_value()) {
+            setVar<string>(var_name, input);
+            status.counters.eval_allocations++;
+            return input;
         }
+        if(std::holds_alternative<int>(num.value())) {
+            int num_i = std::get<int>(num.value());
+            setVar<int>(var_name, num_i);
+            return num_i;
+        }
+        double num_d = std::get<double>(num.value());
+        setVar<double>(var_name, num_d);
+        return num_d;
     }
-    void visit_PrintStmtNode(PrintStmtNode* node) {
+    void visit_PrintStmtNode(PrintStmtNode* node) override {
+        status.counters.countNode(ASTNodeType::PrintStmt);
         auto expr = node->getExpr();
+        if(int v = 0; tryIntExpr(expr, v)) {
+            output(format("{}", v));
+            return;
+        }
         visit_Expr(expr);
-        auto expr_v = getNodeVal<std::any>(expr);
+        if(failed()) {
+            return;
+        }
+        auto expr_v = borrowNodeVal(expr);
+        if(failed()) {
+            return;
+        }
+        printValue(*expr_v);
+    }
+    void printValue(const std::any& expr_v) {
         if(expr_v.type() == typeid(int)) {
             output(format("{}", std::any_cast<int>(expr_v)));
         }
@@ -633,8 +1126,34 @@ public:
             output(fmt::format("{}", std::any_cast<string>(expr_v)));
         }
     }
-    void visit_RemStmtNode(RemStmtNode* node) {
-        // do nothing
+    void visit_RemStmtNode(RemStmtNode* node) override {
+        status.counters.countNode(ASTNodeType::RemStmt);
+    }
+    // 操作数都是int时一次算完; 变量不存在或者不是int时按原来的语句执行, 由它报告错误
+    // 计数器和执行原来的语句一致
+    void visit_FusedStmtNode(FusedStmtNode* node) override {
+        auto& table = *env->symbol_table;
+        auto l = std::any_cast<int>(table.find(node->getLeftVar()));
+        auto r = node->rightIsVar() ? std::any_cast<int>(table.find(node->getRightVar())) : nullptr;
+        if(l == nullptr || (node->rightIsVar() && r == nullptr)) {
+            visit(node->getOriginal());
+            return;
+        }
+        int out = 0;
+        // 融合的运算符只有+-*和比较, 不会出错
+        tryBinOp<int>(*l, r != nullptr ? *r : node->getConstant(), node->getOp(), out);
+
+        auto& counters = status.counters;
+        counters.countNode(node->getKind() == FusedKind::Assign ? ASTNodeType::AssignStmt : ASTNodeType::IFStmt);
+        counters.countNode(ASTNodeType::BinOp);
+        counters.countNode(ASTNodeType::Var);
+        counters.countNode(node->rightIsVar() ? ASTNodeType::Var : ASTNodeType::Num);
+        counters.var_reads += node->rightIsVar() ? 2 : 1;
+        if(node->getKind() == FusedKind::Assign) {
+            setVar(node->getTarget(), out);
+        } else if(out != 0) {
+            status.next_line = node->getNext();
+        }
     }
 
 };
@@ -0,0 +1,414 @@
+//
+// Created by ayanami on 12/27/24.
+//
+
+#include "jit.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "interpreter.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define QBASIC_JIT_X86_64 1
+#else
+#define QBASIC_JIT_X86_64 0
+#endif
+
+namespace jit {
+using Token::TokenType;
+
+CodeBuffer::CodeBuffer(const std::vector<uint8_t>& code): used(code.size()) {
+    const auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    mapped = (code.size() + page - 1) / page * page;
+    if(mapped == 0) {
+        mapped = page;
+    }
+    base = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(base == MAP_FAILED) {
+        base = nullptr;
+        throw std::runtime_error("jit: failed to map code buffer");
+    }
+    std::memcpy(base, code.data(), code.size());
+    if(mprotect(base, mapped, PROT_READ | PROT_EXEC) != 0) {
+        munmap(base, mapped);
+        base = nullptr;
+        throw std::runtime_error("jit: failed to make code buffer executable");
+    }
+}
+
+CodeBuffer::~CodeBuffer() {
+    if(base != nullptr) {
+        munmap(base, mapped);
+    }
+}
+
+bool Program::run(Interpreter& interpreter, int line_no) {
+    auto it = stmts.find(line_no);
+    if(it == stmts.end()) {
+        return false;
+    }
+    if(!runNative(interpreter, it->second)) {
+        // 没有本机代码, 变量不存在或者不是int, 除零: 由树解释器执行(包括报告错误)
+        interpreter.visit(it->second.node);
+    }
+    return true;
+}
+
+bool Program::runNative(Interpreter& interpreter, int line_no) {
+    auto it = stmts.find(line_no);
+    return it != stmts.end() && runNative(interpreter, it->second);
+}
+
+bool Program::runNative(Interpreter& interpreter, Stmt& stmt) {
+    if(stmt.fn == nullptr) {
+        return false;
+    }
+    auto& table = *interpreter.env->symbol_table;
+    std::array<int*, MAX_OPERANDS> operands{};
+    for(size_t i = 0; i < stmt.operands.size(); ++i) {
+        operands[i] = std::any_cast<int>(vars[stmt.operands[i]].resolve(table));
+        if(operands[i] == nullptr) {
+            bailout_count++;
+            return false;
+        }
+    }
+    int out = 0;
+    if(!stmt.fn(operands.data(), &out)) {
+        bailout_count++;
+        return false;
+    }
+    auto& counters = interpreter.status.counters;
+    for(const auto [type, n]: stmt.nodes) {
+        counters.nodes[static_cast<size_t>(type)] += n;
+    }
+    counters.var_reads += stmt.var_reads;
+    if(stmt.is_assign) {
+        interpreter.setVar(stmt.target, out);
+    } else if(out != 0) {
+        interpreter.status.next_line = stmt.next;
+    }
+    return true;
+}
+
+size_t Program::nativeCount() const {
+    size_t n = 0;
+    for(const auto& [line, stmt]: stmts) {
+        n += stmt.fn != nullptr ? 1 : 0;
+    }
+    return n;
+}
+
+bool available() {
+    return QBASIC_JIT_X86_64;
+}
+
+namespace {
+
+bool isSupportedBinOp(TokenType op) {
+    switch(op) {
+    case TokenType::OP_ADD:
+    case TokenType::OP_SUB:
+    case TokenType::OP_MUL:
+    case TokenType::OP_DIV:
+    case TokenType::OP_MOD:
+    case TokenType::OP_LT:
+    case TokenType::OP_GT:
+    case TokenType::OP_LE:
+    case TokenType::OP_GE:
+    case TokenType::OP_EQ:
+    case TokenType::OP_NE:
+        return true;
+    default:
+        return false; // ^ 走std::pow, 留给树解释器
+    }
+}
+
+// 只有int常数, 变量和上面的运算符
+bool isIntExpr(ASTNode* node) {
+    switch(node->type()) {
+    case ASTNodeType::Num:
+        return std::any_cast<int>(&node->getValRef()) != nullptr;
+    case ASTNodeType::Var:
+        return true;
+    case ASTNodeType::UnaryOp: {
+        auto unary = static_cast<UnaryOpNode*>(node);
+        return (unary->getOp() == TokenType::OP_ADD || unary->getOp() == TokenType::OP_SUB) &&
+            isIntExpr(unary->getExpr());
+    }
+    case ASTNodeType::BinOp: {
+        auto bin = static_cast<BinOpNode*>(node);
+        return isSupportedBinOp(bin->getOp()) && isIntExpr(bin->getLeft()) && isIntExpr(bin->getRight());
+    }
+    default:
+        return false;
+    }
+}
+
+// 只用到需要的几条指令; 表达式的值在eax, 临时值压栈
+// 参数: rdi = operands, rsi = out; r8保存入口的rsp, 回退时直接恢复
+class Assembler {
+    std::vector<uint8_t>& code;
+    std::vector<size_t> bailouts; // jcc rel32的位置, 跳到当前函数的回退出口
+public:
+    explicit Assembler(std::vector<uint8_t>& code): code(code) {}
+    void bytes(std::initializer_list<uint8_t> bs) {
+        code.insert(code.end(), bs);
+    }
+    void imm32(uint32_t v) {
+        for(int i = 0; i < 4; ++i) {
+            code.push_back(static_cast<uint8_t>(v >> (8 * i)));
+        }
+    }
+    void prologue() {
+        bailouts.clear();
+        bytes({0x49, 0x89, 0xE0}); // mov r8, rsp
+    }
+    void movEaxImm(int v) {
+        bytes({0xB8}); // mov eax, imm32
+        imm32(static_cast<uint32_t>(v));
+    }
+    void loadOperand(size_t idx) {
+        bytes({0x48, 0x8B, 0x8F}); // mov rcx, [rdi + disp32]
+        imm32(static_cast<uint32_t>(idx * sizeof(int*)));
+        bytes({0x8B, 0x01}); // mov eax, [rcx]
+    }
+    void pushEax() {
+        bytes({0x50}); // push rax
+    }
+    // 右操作数在eax: ecx = 右, eax = 左
+    void popLeft() {
+        bytes({0x89, 0xC1, 0x58}); // mov ecx, eax; pop rax
+    }
+    void neg() {
+        bytes({0xF7, 0xD8}); // neg eax
+    }
+    void bailIf(uint8_t jcc) {
+        bytes({0x0F, jcc});
+        bailouts.push_back(code.size());
+        imm32(0);
+    }
+    // 和tryBinOp<int>一致
+    void binOp(TokenType op) {
+        switch(op) {
+        case TokenType::OP_ADD:
+            bytes({0x01, 0xC8}); // add eax, ecx
+            return;
+        case TokenType::OP_SUB:
+            bytes({0x29, 0xC8}); // sub eax, ecx
+            return;
+        case TokenType::OP_MUL:
+            bytes({0x0F, 0xAF, 0xC1}); // imul eax, ecx
+            return;
+        case TokenType::OP_DIV:
+        case TokenType::OP_MOD:
+            bytes({0x85, 0xC9}); // test ecx, ecx
+            bailIf(0x84);        // jz: 除零, 由树解释器报错
+            bytes({0x83, 0xF9, 0xFF}); // cmp ecx, -1
+            bailIf(0x84);        // je: INT_MIN / -1 会触发#DE
+            bytes({0x99, 0xF7, 0xF9}); // cdq; idiv ecx
+            if(op == TokenType::OP_MOD) {
+                // BASIC: 结果的符号和除数相同
+                bytes({0x89, 0xD0}); // mov eax, edx
+                bytes({0x85, 0xC0, 0x74, 0x06}); // test eax, eax; jz done
+                bytes({0x31, 0xCA, 0x79, 0x02}); // xor edx, ecx; jns done
+                bytes({0x01, 0xC8}); // add eax, ecx
+                // done:
+            }
+            return;
+        default:
+            break;
+        }
+        uint8_t setcc = 0;
+        switch(op) {
+        case TokenType::OP_LT: setcc = 0x9C; break;
+        case TokenType::OP_GT: setcc = 0x9F; break;
+        case TokenType::OP_LE: setcc = 0x9E; break;
+        case TokenType::OP_GE: setcc = 0x9D; break;
+        case TokenType::OP_EQ: setcc = 0x94; break;
+        default: setcc = 0x95; break; // OP_NE
+        }
+        bytes({0x39, 0xC8});       // cmp eax, ecx
+        bytes({0x0F, setcc, 0xC0}); // setcc al
+        bytes({0x0F, 0xB6, 0xC0}); // movzx eax, al
+    }
+    void epilogue() {
+        bytes({0x89, 0x06}); // mov [rsi], eax
+        movEaxImm(1);
+        bytes({0xC3});
+        if(bailouts.empty()) {
+            return;
+        }
+        const auto exit = code.size();
+        for(const auto at: bailouts) {
+            const auto rel = static_cast<int32_t>(exit - (at + 4));
+            std::memcpy(code.data() + at, &rel, sizeof(rel));
+        }
+        bytes({0x4C, 0x89, 0xC4}); // mov rsp, r8
+        bytes({0x31, 0xC0, 0xC3}); // xor eax, eax; ret
+    }
+};
+
+void writePerfMap(const Program& program, const std::map<int, size_t>& offsets, const std::map<int, size_t>& sizes) {
+    if(program.getCode() == nullptr) {
+        return;
+    }
+    std::ofstream ofs(fmt::format("/tmp/perf-{}.map", getpid()), std::ios::app);
+    if(!ofs) {
+        return;
+    }
+    const auto base = reinterpret_cast<uintptr_t>(program.getCode()->data());
+    for(const auto& [line, offset]: offsets) {
+        ofs << fmt::format("{:x} {:x} qbasic_jit_line_{}\n", base + offset, sizes.at(line), line);
+    }
+}
+
+} // namespace
+
+class Compiler {
+    Program& program;
+    std::map<string, size_t, std::less<>> var_ids;
+    std::vector<uint8_t> code;
+    Assembler as{code};
+    Stmt* current = nullptr;
+
+    size_t operand(const string& name) {
+        auto it = var_ids.find(name);
+        if(it == var_ids.end()) {
+            it = var_ids.emplace(name, program.vars.size()).first;
+            program.vars.push_back(closure::VarSlot{name});
+        }
+        auto& ops = current->operands;
+        for(size_t i = 0; i < ops.size(); ++i) {
+            if(ops[i] == it->second) {
+                return i;
+            }
+        }
+        ops.push_back(it->second);
+        return ops.size() - 1;
+    }
+    // 先序计数, 和树解释器访问节点的次数一致
+    void count(ASTNode* node) {
+        countNode(node->type());
+        switch(node->type()) {
+        case ASTNodeType::Var:
+            current->var_reads++;
+            return;
+        case ASTNodeType::UnaryOp:
+            count(static_cast<UnaryOpNode*>(node)->getExpr());
+            return;
+        case ASTNodeType::BinOp:
+            count(static_cast<BinOpNode*>(node)->getLeft());
+            count(static_cast<BinOpNode*>(node)->getRight());
+            return;
+        default:
+            return;
+        }
+    }
+    void countNode(ASTNodeType type) {
+        auto& nodes = current->nodes;
+        auto it = std::find_if(nodes.begin(), nodes.end(), [type](const auto& n) { return n.first == type; });
+        if(it == nodes.end()) {
+            nodes.emplace_back(type, 1);
+        } else {
+            it->second++;
+        }
+    }
+    void expr(ASTNode* node) {
+        switch(node->type()) {
+        case ASTNodeType::Num:
+            as.movEaxImm(std::any_cast<int>(node->getValRef()));
+            return;
+        case ASTNodeType::Var:
+            as.loadOperand(operand(static_cast<VarNode*>(node)->getName()));
+            return;
+        case ASTNodeType::UnaryOp: {
+            auto unary = static_cast<UnaryOpNode*>(node);
+            expr(unary->getExpr());
+            if(unary->getOp() == TokenType::OP_SUB) {
+                as.neg();
+            }
+            return;
+        }
+        default: {
+            auto bin = static_cast<BinOpNode*>(node);
+            expr(bin->getLeft());
+            as.pushEax();
+            expr(bin->getRight());
+            as.popLeft();
+            as.binOp(bin->getOp());
+            return;
+        }
+        }
+    }
+    // 返回编译的表达式, 不支持时返回nullptr
+    ASTNode* stmt(ASTNode* node, Stmt& out) {
+        if(node->type() == ASTNodeType::FusedStmt) {
+            node = static_cast<FusedStmtNode*>(node)->getOriginal();
+        }
+        ASTNode* e = nullptr;
+        if(node->type() == ASTNodeType::AssignStmt) {
+            auto assign = static_cast<AssignStmtNode*>(node);
+            out.is_assign = true;
+            out.target = assign->getLeft()->getName();
+            e = assign->getRight();
+        } else if(node->type() == ASTNodeType::IFStmt) {
+            auto branch = static_cast<IFStmtNode*>(node);
+            out.next = branch->getNext();
+            e = branch->getCond();
+        }
+        return e != nullptr && isIntExpr(e) ? e : nullptr;
+    }
+public:
+    explicit Compiler(Program& program): program(program) {}
+    void run(const std::map<int, ASTNode*>& ast) {
+        std::map<int, size_t> offsets;
+        std::map<int, size_t> sizes;
+        for(const auto& [line, node]: ast) {
+            Stmt s;
+            s.node = node;
+            auto e = QBASIC_JIT_X86_64 ? stmt(node, s) : nullptr;
+            if(e != nullptr) {
+                current = &s;
+                const auto begin = code.size();
+                as.prologue();
+                expr(e);
+                as.epilogue();
+                if(s.operands.size() <= MAX_OPERANDS) {
+                    countNode(s.is_assign ? ASTNodeType::AssignStmt : ASTNodeType::IFStmt);
+                    count(e);
+                    offsets[line] = begin;
+                    sizes[line] = code.size() - begin;
+                } else {
+                    code.resize(begin);
+                }
+                current = nullptr;
+            }
+            program.stmts.emplace(line, std::move(s));
+        }
+        if(offsets.empty()) {
+            return;
+        }
+        try {
+            program.code = std::make_unique<CodeBuffer>(code);
+        } catch (std::exception& e) {
+            // 不能映射可执行内存(比如W^X策略): 全部回退
+            fmt::print(stderr, "[Warning]: {}, falling back to the tree-walker\n", e.what());
+            return;
+        }
+        for(const auto& [line, offset]: offsets) {
+            program.stmts.at(line).fn = reinterpret_cast<NativeFn>(program.code->data() + offset);
+        }
+        writePerfMap(program, offsets, sizes);
+    }
+};
+
+std::shared_ptr<Program> compile(const std::map<int, ASTNode*>& ast) {
+    auto program = std::make_shared<Program>();
+    Compiler(*program).run(ast);
+    return program;
+}
+
+} // namespace jit
@@ -0,0 +1,100 @@
+//
+// Created by ayanami on 12/27/24.
+//
+// x86-64 JIT: 加载时把只涉及int的表达式编译成本机代码, 放在mmap出来的可执行内存里
+// - 覆盖int常数, 变量, + - * / MOD, 比较和一元+-; LET/IF的整个表达式是一个本机函数
+// - 变量按VarSlot绑定到SymbolTable里的值, 运行时不是int就回退; 除零和INT_MIN / -1也回退
+// - PRINT/INPUT/GOTO/END/REM, 字符串和double交给树解释器(运行时)执行
+// - 语句之间的跳转, 断点和DEV模式的输出仍由Interpreter逐条处理, 和其他引擎一致
+// - 生成的代码写入/tmp/perf-<pid>.map, perf可以把样本归到qbasic_jit_line_<n>
+// 不是x86-64 Linux时compile只生成回退的语句
+//
+#pragma once
+#ifndef JIT_H
+#define JIT_H
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "closure_engine.h"
+#include "parser.h"
+
+class Interpreter;
+
+namespace jit {
+
+// operands[i]指向语句第i个变量的int值, 结果写到*out
+// 返回false表示需要回退(除零等), 这时没有任何副作用
+using NativeFn = bool (*)(int* const* operands, int* out);
+constexpr size_t MAX_OPERANDS = 16;
+
+// mmap出来的代码, 写完以后改成只读可执行
+class CodeBuffer {
+    void* base = nullptr;
+    size_t mapped = 0;
+    size_t used = 0;
+public:
+    // throws: std::runtime_error mmap/mprotect失败
+    explicit CodeBuffer(const std::vector<uint8_t>& code);
+    ~CodeBuffer();
+    CodeBuffer(const CodeBuffer&) = delete;
+    CodeBuffer& operator=(const CodeBuffer&) = delete;
+    [[nodiscard]] const uint8_t* data() const {
+        return static_cast<const uint8_t*>(base);
+    }
+    [[nodiscard]] size_t size() const {
+        return used;
+    }
+};
+
+using Stmt = struct Stmt {
+    ASTNode* node = nullptr;       // parser中的语句, 回退时由树解释器执行
+    NativeFn fn = nullptr;         // nullptr: 总是回退
+    bool is_assign = false;
+    string target;                 // LET
+    int next = -1;                 // IF
+    std::vector<size_t> operands;  // Program::vars的下标
+    // 本机代码执行一次对应的计数, 和树解释器执行同一条语句一致: (ASTNodeType, 个数)
+    std::vector<std::pair<ASTNodeType, uint32_t>> nodes;
+    uint32_t var_reads = 0;
+};
+
+class Program {
+    std::map<int, Stmt> stmts;
+    std::vector<closure::VarSlot> vars;
+    std::unique_ptr<CodeBuffer> code;
+    uint64_t bailout_count = 0;
+    friend class Compiler;
+    bool runNative(Interpreter& interpreter, Stmt& stmt);
+public:
+    // 执行line_no对应的语句, 行不存在时返回false
+    bool run(Interpreter& interpreter, int line_no);
+    // 只执行本机代码: 行不存在, 没有本机代码或者需要回退时返回false, 这时没有任何副作用
+    bool runNative(Interpreter& interpreter, int line_no);
+    // 有本机代码却回退的次数(操作数不存在或不是int, 除零, INT_MIN / -1)
+    [[nodiscard]] uint64_t bailouts() const {
+        return bailout_count;
+    }
+    [[nodiscard]] size_t size() const {
+        return stmts.size();
+    }
+    // 生成了本机代码的语句数
+    [[nodiscard]] size_t nativeCount() const;
+    [[nodiscard]] const CodeBuffer* getCode() const {
+        return code.get();
+    }
+};
+
+class Compiler;
+
+// 当前平台能否生成本机代码
+bool available();
+std::shared_ptr<Program> compile(const std::map<int, ASTNode*>& ast);
+
+} // namespace jit
+
+#endif // JIT_H
@@ -0,0 +1,148 @@
+//
+// Created by ayanami on 12/27/24.
+//
+
+#include "jit_test.h"
+#include <fstream>
+#include <unistd.h>
+#include "tokenizer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "jit.h"
+#include "workload_gen.h"
+#include "engine_test_util.h"
+using std::vector;
+using std::string;
+using fmt::format;
+using namespace engine_test;
+
+void jit_test::initTestCase() {
+    qDebug() <<"Init test case\n";
+}
+
+// programs/下的所有程序
+void jit_test::testMatchesTreeWalker() {
+    const std::map<string, string> inputs = {
+        {"sum_of_1ton.bas", "10\n"},
+        {"sum_of_two.bas", "7\n5\n"},
+        {"factorial.bas", "6\n"},
+        {"even_or_odd.bas", "7\n"},
+        {"is_prime.bas", "67\n"},
+        {"hard1.bas", "100\n"},
+        {"hard2.bas", "100\n"},
+    };
+    size_t checked = 0;
+    for(const auto& entry: std::filesystem::directory_iterator("./programs")) {
+        if(entry.path().extension() != ".bas") {
+            continue;
+        }
+        auto file = entry.path().string();
+        auto input_it = inputs.find(entry.path().filename().string());
+        auto input = input_it == inputs.end() ? string{} : input_it->second;
+        auto tree = newInterpreter();
+        auto native = newInterpreter();
+        string tree_load_err;
+        string native_load_err;
+        try {
+            CoutCapture capture;
+            tree->loadFile(file);
+        } catch (std::exception& e) {
+            tree_load_err = e.what();
+        }
+        try {
+            CoutCapture capture;
+            native->loadFile(file);
+            native->setEngine(EngineKind::Jit);
+        } catch (std::exception& e) {
+            native_load_err = e.what();
+        }
+        QVERIFY2(tree_load_err == native_load_err, file.c_str());
+        if(!tree_load_err.empty()) {
+            continue;
+        }
+        QVERIFY(native->getEngine() == EngineKind::Jit);
+        auto expected = run(*tree, input);
+        auto actual = run(*native, input);
+        QVERIFY2(same(expected, actual), format("{}:\n  tree {}\n  jit {}", file,
+            describe(expected), describe(actual)).c_str());
+        checked++;
+    }
+    QVERIFY(checked >= 14);
+
+    vector<workload::GenOptions> cases = {
+        {.seed = 41, .lines = 200, .vars = 20},
+        {.seed = 42, .lines = 200, .expr_depth = 6, .vars = 5},
+        {.seed = 43, .lines = 300, .goto_density = 0.3},
+        {.seed = 44, .lines = 200, .loop_density = 0.2, .loop_trips = 15},
+    };
+    for(const auto& opt: cases) {
+        auto program = workload::generate(opt);
+        auto expected = runLines(program.lines, EngineKind::TreeWalker);
+        auto actual = runLines(program.lines, EngineKind::Jit);
+        QVERIFY2(expected.err.empty(), expected.err.c_str());
+        QVERIFY2(same(expected, actual), format("seed {}:\n  tree {}\n  jit {}", opt.seed,
+            describe(expected), describe(actual)).c_str());
+    }
+}
+
+// 本机代码不处理的情况由树解释器执行, 结果(包括错误)和计数器不变
+void jit_test::testFallback() {
+    vector<vector<string>> programs = {
+        {"10 LET A = 1 / 0"},
+        {"10 LET A = 0", "20 LET B = 7 MOD A"},
+        {"10 LET A = -7", "20 LET B = A / -1", "30 LET C = A MOD -1"},
+        {"10 LET A = -7", "20 LET B = A MOD 3", "30 LET C = 7 MOD -3", "40 LET D = -7 MOD -3", "50 LET E = A / 2"},
+        {"10 LET A = 2", "20 LET B = A ** 3"},
+        {"10 PRINT UNKNOWN + 1"},
+        {"10 LET A = B + 1"},
+        {"10 LET S = \"a\"", "20 LET T = S + 1"},
+        {"10 LET S = \"a\"", "20 IF S THEN 40", "30 END", "40 LET S = 3", "50 IF S > 2 THEN 70", "60 END", "70 PRINT S"},
+        {"10 LET A = 1", "20 LET A = \"s\"", "30 LET B = A + 1"},
+        {"10 LET A = 2", "20 LET A = A * -A + (A - 3) * 4 >= A", "30 IF A != 1 THEN 50", "40 PRINT A", "50 END"},
+        {"10 LET A = 2", "20 2 * A", "30 2 + UNKNOWN", "40 END"},
+        {"10 LET A = 1", "20 GOTO 100"},
+    };
+    for(const auto& lines: programs) {
+        auto expected = runLines(lines, EngineKind::TreeWalker);
+        auto actual = runLines(lines, EngineKind::Jit);
+        QVERIFY2(same(expected, actual), format("{}:\n  tree {}\n  jit {}", lines.back(),
+            describe(expected), describe(actual)).c_str());
+    }
+}
+
+void jit_test::testNativeCode() {
+    if(!jit::available()) {
+        QSKIP("no native code generation on this platform");
+    }
+    const vector<string> lines = {
+        "10 LET I = 0", "15 LET S = 0", "20 LET S = S + I * I MOD 7", "30 LET I = I + 1", "40 IF I < 50 THEN 20",
+        "50 PRINT S", "60 LET X = 2 ** 3",
+    };
+    auto expected = runLines(lines, EngineKind::TreeWalker);
+    QVERIFY2(expected.err.empty(), expected.err.c_str());
+    auto interpreter = newInterpreter();
+    interpreter->loadProgram(Token::programFromlines(lines));
+    interpreter->setEngine(EngineKind::Jit);
+    QVERIFY(interpreter->getJit()->nativeCount() == 5);
+    QVERIFY(same(expected, run(*interpreter, "")));
+
+    auto path = format("/tmp/perf-{}.map", getpid());
+    std::ifstream ifs(path);
+    QVERIFY2(ifs.good(), path.c_str());
+    string content((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    for(const int line: {10, 20, 30, 40}) {
+        QVERIFY2(content.find(format("qbasic_jit_line_{}\n", line)) != string::npos, format("line {}", line).c_str());
+    }
+
+    // 融合和JIT一起打开: 回退时执行新的语句节点
+    interpreter->setFusion(true);
+    QVERIFY(interpreter->getEngine() == EngineKind::Jit);
+    interpreter->reset(true);
+    QVERIFY(same(expected, run(*interpreter, "")));
+    interpreter->setFusion(false);
+    interpreter->reset(true);
+    QVERIFY(same(expected, run(*interpreter, "")));
+}
+
+void jit_test::cleanupTestCase() {
+}
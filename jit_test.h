@@ -0,0 +1,24 @@
+//
+// Created by ayanami on 12/27/24.
+//
+#pragma once
+#ifndef JIT_TEST_H
+#define JIT_TEST_H
+
+#include <QTest>
+#include <QObject>
+
+class jit_test: public QObject{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void testMatchesTreeWalker();
+    void testFallback();
+    void testNativeCode();
+    void cleanupTestCase();
+};
+
+
+
+#endif //JIT_TEST_H
@@ -9,12 +9,42 @@
 #include "parser_test.h"
 #include "tokenizer_test.h"
 #include "interpret_test.h"
+#include "image_test.h"
+#include "alloc_test.h"
+#include "closure_test.h"
+#include "fusion_test.h"
+#include "jit_test.h"
+#include "aot_test.h"
+#include "tiered_test.h"
+#include "type_infer_test.h"
+#include "cfg_test.h"
+#include "opt_test.h"
 
 int main(int argc, char *argv[]) {
     tokenizer_test test_lexer;
     parser_test test_parser;
     interpret_test test_interpret;
+    image_test test_image;
+    alloc_test test_alloc;
+    closure_test test_closure;
+    fusion_test test_fusion;
+    jit_test test_jit;
+    aot_test test_aot;
+    tiered_test test_tiered;
+    type_infer_test test_type_infer;
+    cfg_test test_cfg;
+    opt_test test_opt;
     // QTest::qExec(&test_lexer, argc, argv);
     // QTest::qExec(&test_parser, argc, argv);
     QTest::qExec(&test_interpret, argc, argv);
+    QTest::qExec(&test_image, argc, argv);
+    QTest::qExec(&test_alloc, argc, argv);
+    QTest::qExec(&test_closure, argc, argv);
+    QTest::qExec(&test_fusion, argc, argv);
+    QTest::qExec(&test_jit, argc, argv);
+    QTest::qExec(&test_aot, argc, argv);
+    QTest::qExec(&test_tiered, argc, argv);
+    QTest::qExec(&test_type_infer, argc, argv);
+    QTest::qExec(&test_cfg, argc, argv);
+    QTest::qExec(&test_opt, argc, argv);
 }
@@ -0,0 +1,478 @@
+//
+// Created by ayanami on 12/21/24.
+//
+// qbasic_microbench: 组件级benchmark, 单独测量
+// - Tokenizer::read_line 按token类别的吞吐
+// - Parser::expr 在深/宽表达式上的开销
+// - doBinOp<int/double> 和 evalBinWithAny 的分派开销
+// - SymbolTable::get/set (10 ~ 10^6 个变量) 和 SymbolTable::copy
+// - AST节点的分派: 旧的type() + dynamic_cast 和 accept双分派对比, 以及visit_Expr每个节点的开销
+// - 同一个数值循环在TreeWalker(以及语句融合)/Flat/Closure/Jit/Tiered/Optimized引擎上每条语句的开销
+// 每项都按输入规模参数化, 结果可以用 --out 写成JSON
+//
+// usage: qbasic_microbench [--iterations N] [--warmup N] [--filter STR] [--max-vars N] [--out FILE]
+//
+#include <fstream>
+#include <random>
+#include <tuple>
+#include "bench.h"
+#include "interpreter.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+using Options = struct Options {
+    size_t iterations = 10;
+    size_t warmup = 2;
+    string filter;
+    size_t max_vars = 1000000;
+    string out;
+};
+
+class Suite {
+    const Options& opt;
+    vector<bench::Result> results;
+public:
+    explicit Suite(const Options& o): opt(o) {}
+    template<typename F>
+    void run(const string& name, size_t items, F&& f) {
+        if(!opt.filter.empty() && name.find(opt.filter) == string::npos) {
+            return;
+        }
+        bench::Stats stats;
+        {
+            bench::StdoutSilencer silence;
+            stats = bench::measure(opt.warmup, opt.iterations, f);
+        }
+        results.push_back({name, stats, items});
+        fmt::print("{:<48} {:>12.2f} {:>12.2f} {:>12.2f}\n", name, stats.median_us, stats.p99_us,
+                   items ? stats.median_us * 1000 / static_cast<double>(items) : 0.0);
+    }
+    [[nodiscard]] const vector<bench::Result>& getResults() const {
+        return results;
+    }
+};
+
+string repeatToken(const string& token, size_t n) {
+    string line;
+    for(size_t i = 0; i < n; ++i) {
+        line += token;
+        line += ' ';
+    }
+    return line;
+}
+
+void benchTokenizer(Suite& suite) {
+    // 每个类别一个代表token, REM会吞掉整行所以不测
+    const vector<std::pair<string, string>> classes = {
+        {"NUM", "12345"},
+        {"VAR", "counter_1"},
+        {"OP", "+"},
+        {"CMP", ">="},
+        {"POW", "**"},
+        {"KEYWORD", "GOTO"},
+        {"LITERAL", "\"hello\""},
+        {"PAREN", "("},
+    };
+    Token::Tokenizer tokenizer;
+    for(const auto& [cls, token]: classes) {
+        for(size_t n: {10, 100, 1000}) {
+            const string line = repeatToken(token, n);
+            suite.run(fmt::format("tokenizer/read_line/{}/{}", cls, n), n, [&] {
+                auto tokens = tokenizer.read_line(line);
+                bench::doNotOptimize(tokens.size());
+            });
+        }
+    }
+    // read_line对每个候选token从当前位置往后regex_search, 长行上是平方复杂度, MIXED只测到100项
+    for(size_t n: {10, 100}) {
+        string line = "LET x = 1";
+        for(size_t i = 1; i < n; ++i) {
+            line += fmt::format(" + (y{} * {} - z)", i % 7, i);
+        }
+        suite.run(fmt::format("tokenizer/read_line/MIXED/{}", n), n * 8, [&] {
+            auto tokens = tokenizer.read_line(line);
+            bench::doNotOptimize(tokens.size());
+        });
+    }
+}
+
+// depth层括号嵌套: 1+(1+(1+(...)))
+string deepExpr(size_t depth) {
+    string s;
+    for(size_t i = 0; i < depth; ++i) {
+        s += "1+(";
+    }
+    s += "1";
+    s += string(depth, ')');
+    return s;
+}
+// width个操作数, 混合不同优先级: 1+2*3-4 MOD 5+...
+string wideExpr(size_t width) {
+    static const vector<string> ops = {"+", "*", "-", "MOD", "/", "**"};
+    string s = "1";
+    for(size_t i = 1; i < width; ++i) {
+        s += fmt::format(" {} {}", ops[i % ops.size()], i + 1);
+    }
+    return s;
+}
+
+void benchParser(Suite& suite) {
+    auto run = [&](const string& kind, size_t n, const string& expr_src) {
+        auto tokenizer = std::make_shared<Token::Tokenizer>();
+        {
+            bench::StdoutSilencer silence;
+            tokenizer->reload(vector<string>{"10 " + expr_src});
+        }
+        Parser parser(tokenizer);
+        suite.run(fmt::format("parser/expr/{}/{}", kind, n), n, [&] {
+            tokenizer->resetOff();
+            ASTNode* node = parser.expr();
+            bench::doNotOptimize(node);
+            delete node;
+        });
+    };
+    for(size_t n: {10, 100, 1000}) {
+        run("deep", n, deepExpr(n));
+    }
+    for(size_t n: {10, 100, 1000, 10000}) {
+        run("wide", n, wideExpr(n));
+    }
+}
+
+ASTNode* parseExpr(const string& expr_src) {
+    auto tokenizer = std::make_shared<Token::Tokenizer>();
+    {
+        bench::StdoutSilencer silence;
+        tokenizer->reload(vector<string>{"10 " + expr_src});
+    }
+    Parser parser(tokenizer);
+    return parser.expr();
+}
+
+// 改成accept之前Interpreter::visit的分派方式: 虚函数type()分支, 再dynamic_cast到具体节点
+size_t legacyDispatch(ASTNode* node) {
+    switch(node->type()) {
+    case ASTNodeType::BinOp: {
+        auto bin = dynamic_cast<BinOpNode*>(node);
+        return 1 + legacyDispatch(bin->getLeft()) + legacyDispatch(bin->getRight());
+    }
+    case ASTNodeType::UnaryOp:
+        return 1 + legacyDispatch(dynamic_cast<UnaryOpNode*>(node)->getExpr());
+    case ASTNodeType::Var:
+        return dynamic_cast<VarNode*>(node) != nullptr;
+    case ASTNodeType::Num:
+        return dynamic_cast<NumNode*>(node) != nullptr;
+    case ASTNodeType::String:
+        return dynamic_cast<StringNode*>(node) != nullptr;
+    default:
+        return 1;
+    }
+}
+
+// 和Interpreter相同的双分派, 只数节点
+class CountingVisitor: public NodeVisitor {
+public:
+    size_t nodes = 0;
+    void visit(ASTNode* node) override {
+        node->accept(*this);
+    }
+    void visit_NumNode(NumNode*) override {
+        nodes++;
+    }
+    void visit_StringNode(StringNode*) override {
+        nodes++;
+    }
+    void visit_DataNode(DataNode*) override {
+        nodes++;
+    }
+    void visit_VarNode(VarNode*) override {
+        nodes++;
+    }
+    void visit_BinOp(BinOpNode* node) override {
+        nodes++;
+        visit(node->getLeft());
+        visit(node->getRight());
+    }
+    void visit_UnaryOp(UnaryOpNode* node) override {
+        nodes++;
+        visit(node->getExpr());
+    }
+    void visit_AssignStmtNode(AssignStmtNode*) override {}
+    void visit_GOTOStmtNode(GOTOStmtNode*) override {}
+    void visit_EndStmtNode(EndStmtNode*) override {}
+    void visit_PrintStmtNode(PrintStmtNode*) override {}
+    void visit_InputStmtNode(InputStmtNode*) override {}
+    void visit_IFStmtNode(IFStmtNode*) override {}
+    void visit_RemStmtNode(RemStmtNode*) override {}
+};
+
+void benchDispatch(Suite& suite) {
+    auto run = [&](const string& kind, size_t n, const string& expr_src) {
+        std::unique_ptr<ASTNode> root(parseExpr(expr_src));
+        const size_t nodes = legacyDispatch(root.get());
+        suite.run(fmt::format("dispatch/legacy/{}/{}", kind, n), nodes, [&] {
+            bench::doNotOptimize(legacyDispatch(root.get()));
+        });
+        suite.run(fmt::format("dispatch/accept/{}/{}", kind, n), nodes, [&] {
+            CountingVisitor visitor;
+            visitor.visit(root.get());
+            bench::doNotOptimize(visitor.nodes);
+        });
+        // 完整求值: 分派 + std::any装箱 + 运算
+        auto env = std::make_shared<Env>(std::make_shared<SymbolTable>());
+        Interpreter interpreter(std::make_shared<Parser>(std::make_shared<Token::Tokenizer>()), env,
+                                ProgramMode::NORMAL);
+        env->symbol_table->set<int>("x", 3); // 构造Interpreter会清空符号表
+        suite.run(fmt::format("dispatch/visit_Expr/{}/{}", kind, n), nodes, [&] {
+            interpreter.visit_Expr(root.get());
+            bench::doNotOptimize(root->getVal());
+        });
+        if(interpreter.failed()) {
+            throw std::runtime_error(fmt::format("dispatch/{}/{}: {}", kind, n, interpreter.getEvalError()->message));
+        }
+    };
+    for(size_t n: {10, 100, 1000}) {
+        run("deep", n, deepExpr(n));
+    }
+    for(size_t n: {10, 100, 1000}) {
+        run("wide", n, wideExpr(n));
+    }
+    // 变量和一元运算: -x*(x+1)-x*(x+1)..., tokenizer是平方复杂度, 只到100项
+    for(size_t n: {10, 100}) {
+        string expr = "-x*(x+1)";
+        for(size_t i = 1; i < n; ++i) {
+            expr += "-x*(x+1)";
+        }
+        run("vars", n, expr);
+    }
+}
+
+const vector<Token::TokenType> arith_ops = {
+    Token::TokenType::OP_ADD, Token::TokenType::OP_SUB, Token::TokenType::OP_MUL,
+    Token::TokenType::OP_DIV, Token::TokenType::OP_MOD, Token::TokenType::OP_POW,
+    Token::TokenType::OP_LT, Token::TokenType::OP_EQ,
+};
+
+// NORMAL模式, 关掉AST输出, 只剩下引擎本身和interpret()的调试打印
+void benchEngines(Suite& suite) {
+    // fused: 树解释器 + 语句融合(40, 50行是融合的形状); untyped: 树解释器关掉类型推导
+    const vector<std::tuple<string, EngineKind, bool, bool>> engines = {
+        {"tree", EngineKind::TreeWalker, false, true},
+        {"untyped", EngineKind::TreeWalker, false, false},
+        {"fused", EngineKind::TreeWalker, true, true},
+        {"flat", EngineKind::Flat, false, true},
+        {"closure", EngineKind::Closure, false, true},
+        {"jit", EngineKind::Jit, false, true},
+        {"tiered", EngineKind::Tiered, false, true},
+        {"optimized", EngineKind::Optimized, false, true},
+    };
+    for(size_t trips: {100, 10000}) {
+        vector<string> lines = {
+            "10 LET I = 0",
+            "20 LET S = 0",
+            "30 LET S = S + I * I MOD 7 - (I + 3) / 2",
+            "40 LET I = I + 1",
+            fmt::format("50 IF I < {} THEN 30", trips),
+            "60 END",
+        };
+        const size_t statements = 2 + 3 * trips + 1;
+        for(const auto& [name, kind, fused, typed]: engines) {
+            auto env = std::make_shared<Env>(std::make_shared<SymbolTable>());
+            Interpreter interpreter(std::make_shared<Parser>(std::make_shared<Token::Tokenizer>()), env,
+                                    ProgramMode::NORMAL);
+            {
+                bench::StdoutSilencer silence;
+                interpreter.reload(lines);
+            }
+            interpreter.setEngine(kind);
+            interpreter.setFusion(fused);
+            interpreter.setTypeInference(typed);
+            interpreter.setASTOutput(false);
+            suite.run(fmt::format("engine/{}/loop/{}", name, trips), statements, [&] {
+                interpreter.reset(true);
+                interpreter.interpret();
+            });
+            // 优化引擎把计数循环快进到最后一次测试(opt_indvar.cpp), 执行的步数更少; 时间仍然按源码语句数平均
+            const auto executed = interpreter.getCounters().statements;
+            if(kind == EngineKind::Optimized ? executed > statements : executed != statements) {
+                throw std::runtime_error(fmt::format("engine/{}/loop/{}: executed {} statements", name, trips,
+                                                     executed));
+            }
+        }
+    }
+}
+
+template<typename T>
+void benchDoBinOp(Suite& suite, const string& type_name, size_t n) {
+    for(const auto op: arith_ops) {
+        if(op == Token::TokenType::OP_MOD && !std::is_integral_v<T>) {
+            continue;
+        }
+        suite.run(fmt::format("ops/doBinOp<{}>/{}/{}", type_name, std::string(NAMEOF_ENUM(op)), n), n, [&] {
+            T acc = 0;
+            for(size_t i = 0; i < n; ++i) {
+                acc += doBinOp<T>(static_cast<T>(i % 97 + 3), static_cast<T>(i % 5 + 1), op);
+            }
+            bench::doNotOptimize(acc);
+        });
+    }
+}
+
+template<typename T>
+void benchEvalBinWithAny(Suite& suite, const string& type_name, size_t n, T l, T r) {
+    std::any left = l;
+    std::any right = r;
+    suite.run(fmt::format("ops/evalBinWithAny<{}>/{}", type_name, n), n, [&] {
+        size_t ok = 0;
+        for(size_t i = 0; i < n; ++i) {
+            try {
+                auto v = evalBinWithAny<T>(left, right, Token::TokenType::OP_ADD);
+                bench::doNotOptimize(v);
+                ok++;
+            } catch (std::exception&) {
+                // string operands are rejected by evalBinWithAny today, the cost of the rejection is measured
+            }
+        }
+        bench::doNotOptimize(ok);
+    });
+}
+
+// Interpreter::visit_BinOp 的类型分派: 先比较type(), 再逐个尝试ConvAny
+void benchAnyDispatch(Suite& suite, size_t n) {
+    const vector<std::pair<string, std::any>> operands = {
+        {"int", std::any(7)},
+        {"double", std::any(7.5)},
+        {"string", std::any(string("seven"))},
+    };
+    for(const auto& [type_name, operand]: operands) {
+        suite.run(fmt::format("ops/anyDispatch/{}/{}", type_name, n), n, [&] {
+            int kind = 0;
+            for(size_t i = 0; i < n; ++i) {
+                const std::any& v = operand;
+                if(util::ConvAny<int>(v)) {
+                    kind += 1;
+                } else if(util::ConvAny<double>(v)) {
+                    kind += 2;
+                } else if(util::ConvAny<string>(v)) {
+                    kind += 3;
+                }
+            }
+            bench::doNotOptimize(kind);
+        });
+    }
+}
+
+void benchOps(Suite& suite) {
+    for(size_t n: {1000, 100000}) {
+        benchDoBinOp<int>(suite, "int", n);
+        benchDoBinOp<double>(suite, "double", n);
+        benchEvalBinWithAny<int>(suite, "int", n, 40, 2);
+        benchEvalBinWithAny<double>(suite, "double", n, 40.5, 2.5);
+        benchEvalBinWithAny<string>(suite, "string", n, string("4"), string("2"));
+        benchAnyDispatch(suite, n);
+    }
+}
+
+void benchSymbolTable(Suite& suite, size_t max_vars) {
+    constexpr size_t ops = 100000;
+    for(size_t n = 10; n <= max_vars; n *= 10) {
+        SymbolTable table;
+        vector<string> names;
+        names.reserve(n);
+        for(size_t i = 0; i < n; ++i) {
+            names.push_back(fmt::format("var_{}", i));
+            table.set<int>(names.back(), static_cast<int>(i));
+        }
+        // 固定种子的访问序列, 避免顺序访问的缓存效应
+        std::mt19937 rng(42);
+        vector<size_t> order(ops);
+        for(auto& idx: order) {
+            idx = rng() % n;
+        }
+        suite.run(fmt::format("symtab/get/{}", n), ops, [&] {
+            long long sum = 0;
+            for(const auto idx: order) {
+                sum += table.get<int>(names[idx]).value();
+            }
+            bench::doNotOptimize(sum);
+        });
+        suite.run(fmt::format("symtab/get_any/{}", n), ops, [&] {
+            size_t found = 0;
+            for(const auto idx: order) {
+                found += table.get<std::any>(names[idx]).has_value();
+            }
+            bench::doNotOptimize(found);
+        });
+        suite.run(fmt::format("symtab/set/{}", n), ops, [&] {
+            int v = 0;
+            for(const auto idx: order) {
+                table.set<int>(names[idx], v++);
+            }
+        });
+        suite.run(fmt::format("symtab/copy/{}", n), n, [&] {
+            auto copied = table.copy();
+            bench::doNotOptimize(copied);
+        });
+    }
+}
+
+void usage() {
+    fmt::print(stderr, "usage: qbasic_microbench [--iterations N] [--warmup N] [--filter STR] "
+                       "[--max-vars N] [--out FILE]\n");
+}
+
+bool parseArgs(int argc, char* argv[], Options& opt) {
+    for(int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        auto next = [&]() -> string {
+            if(i + 1 >= argc) {
+                throw std::runtime_error("missing value for " + arg);
+            }
+            return argv[++i];
+        };
+        if(arg == "--iterations") {
+            opt.iterations = std::stoul(next());
+        } else if(arg == "--warmup") {
+            opt.warmup = std::stoul(next());
+        } else if(arg == "--filter") {
+            opt.filter = next();
+        } else if(arg == "--max-vars") {
+            opt.max_vars = std::stoul(next());
+        } else if(arg == "--out") {
+            opt.out = next();
+        } else {
+            return false;
+        }
+    }
+    return opt.iterations > 0;
+}
+} // namespace
+
+int main(int argc, char* argv[]) {
+    Options opt;
+    try {
+        if(!parseArgs(argc, argv, opt)) {
+            usage();
+            return 2;
+        }
+    } catch (std::exception& e) {
+        fmt::print(stderr, "{}\n", e.what());
+        usage();
+        return 2;
+    }
+    fmt::print("{:<48} {:>12} {:>12} {:>12}\n", "benchmark", "median(us)", "p99(us)", "ns/item");
+    Suite suite(opt);
+    benchTokenizer(suite);
+    benchParser(suite);
+    benchOps(suite);
+    benchDispatch(suite);
+    benchEngines(suite);
+    benchSymbolTable(suite, opt.max_vars);
+    if(!opt.out.empty()) {
+        std::ofstream ofs(opt.out);
+        bench::writeJson(ofs, suite.getResults(), opt.iterations);
+    }
+    return 0;
+}
@@ -0,0 +1,196 @@
+//
+// Created by ayanami on 1/3/25.
+//
+// 公共子表达式消除: 同一条语句里, 或者同一个基本块(顺序执行的一段语句)里的几条语句中重复的表达式只算一次
+// - 表达式按exprString编号; 从第一次出现到它读的某个变量被LET/INPUT重新赋值为止是一个窗口,
+//   窗口里出现两次以上的表达式存到临时变量, 在第一次出现的语句之前由pass生成的语句计算
+// - 只处理一定不会出错的表达式(cannotFail), 提前到语句之前计算不改变报错的时机
+// - 每次处理每个块里最大的一个重复表达式, 然后重新建图, 直到没有重复
+//
+
+#include "optimizer.h"
+#include "cfg.h"
+
+namespace opt {
+
+namespace {
+using Window = struct Window {
+    string key;
+    ASTNode* first = nullptr;     // 第一次出现的节点, 复制到临时变量的赋值
+    std::vector<size_t> stmts;    // 出现的语句, 升序不重复
+    std::set<string> reads;
+    size_t count = 0;
+    size_t size = 0;              // 节点数, 优先处理大的表达式
+};
+
+size_t nodeCount(ASTNode* node) {
+    switch(node->type()) {
+    case ASTNodeType::BinOp: {
+        auto bin = static_cast<BinOpNode*>(node);
+        return 1 + nodeCount(bin->getLeft()) + nodeCount(bin->getRight());
+    }
+    case ASTNodeType::UnaryOp:
+        return 1 + nodeCount(static_cast<UnaryOpNode*>(node)->getExpr());
+    default:
+        return 1;
+    }
+}
+
+class Scanner {
+    const std::set<string>& defined;
+    size_t index;
+    std::map<string, Window>& open;
+public:
+    Scanner(const std::set<string>& defined, size_t index, std::map<string, Window>& open):
+        defined(defined), index(index), open(open) {}
+
+    void visit(ASTNode* node) {
+        switch(node->type()) {
+        case ASTNodeType::UnaryOp:
+            visit(static_cast<UnaryOpNode*>(node)->getExpr());
+            return;
+        case ASTNodeType::BinOp:
+            break;
+        default:
+            return;
+        }
+        auto bin = static_cast<BinOpNode*>(node);
+        if(cannotFail(node, defined)) {
+            auto key = exprString(node);
+            auto& window = open[key];
+            if(window.count == 0) {
+                window.key = std::move(key);
+                window.first = node;
+                window.size = nodeCount(node);
+                readVars(node, window.reads);
+            }
+            if(window.stmts.empty() || window.stmts.back() != index) {
+                window.stmts.push_back(index);
+            }
+            window.count++;
+        }
+        visit(bin->getLeft());
+        visit(bin->getRight());
+    }
+};
+
+// 把key换成临时变量
+ASTNode* replace(ASTNode* node, const string& key, const string& temp) {
+    if(node->type() == ASTNodeType::UnaryOp) {
+        auto unary = static_cast<UnaryOpNode*>(node);
+        unary->setExpr(replace(unary->getExpr(), key, temp));
+        return node;
+    }
+    if(node->type() != ASTNodeType::BinOp) {
+        return node;
+    }
+    if(exprString(node) == key) {
+        auto var = new VarNode(temp);
+        var->setStaticType(node->getStaticType());
+        delete node;
+        return var;
+    }
+    auto bin = static_cast<BinOpNode*>(node);
+    bin->setLeft(replace(bin->getLeft(), key, temp));
+    bin->setRight(replace(bin->getRight(), key, temp));
+    return node;
+}
+
+// 块里最值得消除的重复表达式, 没有时count == 0
+Window best(const Program& program, const cfg::Block& block, const std::vector<std::set<string>>& defined) {
+    const auto& stmts = program.getStmts();
+    std::map<string, Window> open;
+    Window res;
+    auto close = [&res](Window& window) {
+        if(window.count >= 2 && window.size > res.size) {
+            res = std::move(window);
+        }
+    };
+    for(const auto line: block.lines) {
+        const auto i = static_cast<size_t>(line);
+        auto node = stmts[i].node.get();
+        if(auto expr = stmtExpr(node)) {
+            Scanner(defined[i], i, open).visit(expr);
+        }
+        // 赋值在右边求值之后, 之后的语句看到新的值
+        if(auto name = assignedVar(node)) {
+            for(auto it = open.begin(); it != open.end();) {
+                if(it->second.reads.contains(*name)) {
+                    close(it->second);
+                    it = open.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+    }
+    for(auto& [key, window]: open) {
+        close(window);
+    }
+    if(res.count < 2) {
+        res.count = 0;
+    }
+    return res;
+}
+
+void apply(Program& program, const Window& window) {
+    auto& stmts = program.getStmts();
+    const auto at = window.stmts.front();
+    const auto temp = program.newTemp();
+    auto var = new VarNode(temp);
+    var->setStaticType(window.first->getStaticType());
+    Stmt computed{.line = stmts[at].line, .node = std::unique_ptr<ASTNode>(new AssignStmtNode(var, clone(window.first))),
+                  .synthetic = true};
+    for(const auto i: window.stmts) {
+        auto node = stmts[i].node.get();
+        setStmtExpr(node, replace(stmtExpr(node), window.key, temp));
+    }
+    std::vector<Stmt> added;
+    added.push_back(std::move(computed));
+    program.insert(at, std::move(added));
+    // 原来到at的边都先经过临时变量的赋值
+    for(size_t i = 0; i < stmts.size(); ++i) {
+        if(i == at) {
+            continue;
+        }
+        if(stmts[i].next == at + 1) {
+            stmts[i].next = at;
+        }
+        if(stmts[i].jump == at + 1) {
+            stmts[i].jump = at;
+        }
+    }
+    if(program.getEntry() == at + 1) {
+        program.setEntry(at);
+    }
+}
+} // namespace
+
+size_t eliminateCommonSubexpressions(Program& program) {
+    size_t total = 0;
+    for(bool changed = true; changed;) {
+        changed = false;
+        const auto graph = cfg::Graph::build(program);
+        const auto defined = definitelyAssigned(program);
+        std::vector<Window> found;
+        for(const auto& block: graph.getBlocks()) {
+            if(block.reachable && !block.lines.empty()) {
+                if(auto window = best(program, block, defined); window.count != 0) {
+                    found.push_back(std::move(window));
+                }
+            }
+        }
+        // 从后往前插入, 前面的下标不变
+        std::ranges::sort(found, [](const Window& a, const Window& b) {
+            return a.stmts.front() > b.stmts.front();
+        });
+        for(const auto& window: found) {
+            apply(program, window);
+            total++;
+            changed = true;
+        }
+    }
+    return total;
+}
+
+} // namespace opt
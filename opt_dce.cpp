@@ -0,0 +1,62 @@
+//
+// Created by ayanami on 1/2/25.
+//
+// 死代码删除: REM不做任何事, 从入口到不了的语句永远不会执行, 两者都从执行序列中删掉
+// - 跳到被删掉的REM的GOTO/IF改成跳到它之后第一条仍然执行的语句
+// - 源码(Parser)不变, 被删掉的行上的断点由Program::breakAt映射到后面的行
+//
+
+#include "optimizer.h"
+
+namespace opt {
+
+size_t eliminateDeadCode(Program& program) {
+    auto& stmts = program.getStmts();
+    const auto n = stmts.size();
+    std::vector<bool> keep(n, true);
+    for(size_t i = 0; i < n; ++i) {
+        keep[i] = stmts[i].node->type() != ASTNodeType::RemStmt;
+    }
+    // 连续的REM: 一直找到第一条保留的语句
+    auto resolve = [&](size_t i) {
+        while(i != NO_STMT && !keep[i]) {
+            i = stmts[i].next;
+        }
+        return i;
+    };
+    for(auto& stmt: stmts) {
+        stmt.next = resolve(stmt.next);
+        stmt.jump = resolve(stmt.jump);
+    }
+    program.setEntry(resolve(program.getEntry()));
+
+    std::vector<bool> reachable(n, false);
+    std::vector<size_t> work;
+    if(program.getEntry() != NO_STMT) {
+        work.push_back(program.getEntry());
+    }
+    while(!work.empty()) {
+        const auto i = work.back();
+        work.pop_back();
+        if(reachable[i]) {
+            continue;
+        }
+        reachable[i] = true;
+        for(const auto s: {stmts[i].next, stmts[i].jump}) {
+            if(s != NO_STMT && !reachable[s]) {
+                work.push_back(s);
+            }
+        }
+    }
+    size_t removed = 0;
+    for(size_t i = 0; i < n; ++i) {
+        keep[i] = keep[i] && reachable[i];
+        removed += keep[i] ? 0 : 1;
+    }
+    if(removed != 0) {
+        program.erase(keep);
+    }
+    return removed;
+}
+
+} // namespace opt
@@ -0,0 +1,131 @@
+//
+// Created by ayanami on 1/3/25.
+//
+// 死存储: 赋的值在被读到或者被看到之前一定会被覆盖的LET, 执行时跳过
+// - 值会被看到的地方: 程序结束和可能出错的语句(停下后Env显示所有变量), INPUT(等待输入时暂停,
+//   包括临时变量: 暂停时可能加断点, 之后不再跳过, 所有变量都要是正确的值)
+// - 只标记右边一定不会出错的赋值; 跳过的语句里读的变量不算被使用, 反复计算直到不再变化
+// - 有断点或者DEBUG模式(调试器)时不跳过(Interpreter::interpretOptimized_SingleStep), 断点只能在
+//   暂停时加, 而暂停的地方所有变量都是活的, 所以加断点之后看到的值都和没有优化时一样
+//
+
+#include "optimizer.h"
+
+namespace opt {
+
+namespace {
+// 可能出错: 出错时程序停下, 这时的变量可以看到
+bool mayFail(const Stmt& stmt, const std::set<string>& defined) {
+    if(stmt.invalid_jump) {
+        return true;
+    }
+    auto expr = stmtExpr(stmt.node.get());
+    if(expr == nullptr || expr->type() == ASTNodeType::String) {
+        return false;
+    }
+    return !cannotFail(expr, defined);
+}
+
+// 执行以后程序可能结束, 和cfg::Graph::build的出口一致
+bool mayEnd(const Stmt& stmt) {
+    switch(stmt.node->type()) {
+    case ASTNodeType::EndStmt:
+        return true;
+    case ASTNodeType::GOTOStmt:
+        return stmt.jump == NO_STMT && !stmt.invalid_jump;
+    case ASTNodeType::IFStmt:
+        return stmt.next == NO_STMT || (stmt.jump == NO_STMT && !stmt.invalid_jump);
+    default:
+        return stmt.next == NO_STMT;
+    }
+}
+} // namespace
+
+size_t markDeadStores(Program& program) {
+    auto& stmts = program.getStmts();
+    const auto n = stmts.size();
+    const auto defined = definitelyAssigned(program);
+    std::set<string> all;
+    std::set<string> user; // Env显示的变量
+    for(const auto& stmt: stmts) {
+        if(auto expr = stmtExpr(stmt.node.get())) {
+            readVars(expr, all);
+        }
+        if(auto name = assignedVar(stmt.node.get())) {
+            all.insert(*name);
+        }
+    }
+    for(const auto& name: all) {
+        if(!name.starts_with(SymbolTable::HIDDEN_PREFIX)) {
+            user.insert(name);
+        }
+    }
+    std::vector<std::set<string>> uses(n);
+    std::vector<bool> fails(n);
+    for(size_t i = 0; i < n; ++i) {
+        if(auto expr = stmtExpr(stmts[i].node.get())) {
+            readVars(expr, uses[i]);
+        }
+        fails[i] = mayFail(stmts[i], defined[i]);
+    }
+
+    std::vector<bool> dead(n, false);
+    size_t marked = 0;
+    for(bool changed = true; changed;) {
+        changed = false;
+        // 活跃变量: 从后往前迭代到不动点
+        std::vector<std::set<string>> live_in(n);
+        std::vector<std::set<string>> live_out(n);
+        for(bool stable = false; !stable;) {
+            stable = true;
+            for(size_t k = n; k-- > 0;) {
+                const auto& stmt = stmts[k];
+                std::set<string> out;
+                if(mayEnd(stmt)) {
+                    out = user;
+                }
+                for(const auto s: {stmt.next, stmt.jump}) {
+                    if(s != NO_STMT) {
+                        out.insert(live_in[s].begin(), live_in[s].end());
+                    }
+                }
+                std::set<string> in;
+                if(stmt.node->type() == ASTNodeType::InputStmt) {
+                    in = all;
+                } else if(!dead[k]) {
+                    in = out;
+                    if(auto name = assignedVar(stmt.node.get())) {
+                        in.erase(*name);
+                    }
+                    in.insert(uses[k].begin(), uses[k].end());
+                    if(fails[k]) {
+                        in.insert(user.begin(), user.end());
+                    }
+                } else {
+                    in = out; // 跳过的语句什么也不做
+                }
+                if(in != live_in[k] || out != live_out[k]) {
+                    live_in[k] = std::move(in);
+                    live_out[k] = std::move(out);
+                    stable = false;
+                }
+            }
+        }
+        for(size_t i = 0; i < n; ++i) {
+            if(dead[i] || fails[i] || stmts[i].node->type() != ASTNodeType::AssignStmt) {
+                continue;
+            }
+            if(!live_out[i].contains(*assignedVar(stmts[i].node.get()))) {
+                dead[i] = true;
+                marked++;
+                changed = true;
+            }
+        }
+    }
+    for(size_t i = 0; i < n; ++i) {
+        stmts[i].dead_store = dead[i];
+    }
+    return marked;
+}
+
+} // namespace opt
@@ -0,0 +1,401 @@
+//
+// Created by ayanami on 1/3/25.
+//
+// 归纳变量: 识别IF/GOTO计数循环, 到达出口测试时快进到最后一次测试(Stmt::counted)
+// - 出口测试: 条件是 I 比较 常数或不变变量 的IF, 一条边沿着只有LET/GOTO的路径回到它自己,
+//   另一条离开循环, 所以路径上没有PRINT/INPUT; 路径上I只被LET I = I ± c赋值一次, 不变变量不被赋值
+// - 圈数在运行时按变量现在的值算(tripCount): 变量都是int, 循环会结束, I不会溢出时才快进, 否则照常执行
+// - 路径上其它的LET都是累加(S = S ± 项, 项是I, 常数, 不变变量或者c * I, S在路径上只出现在这里)时
+//   用等差数列求和的封闭形式(applyClosedForm), 每个项和每个部分和都在int范围内才用;
+//   否则逐圈执行路径上的闭包(Interpreter::runCounted), 省去测试, 跳转和每一步的调度
+// - 有断点或者DEBUG模式时不快进, 逐行执行
+//
+
+#include "optimizer.h"
+#include <algorithm>
+#include <climits>
+
+namespace opt {
+
+namespace {
+using Token::TokenType;
+
+std::optional<int> intConst(ASTNode* node) {
+    if(node->type() == ASTNodeType::Num) {
+        if(auto v = std::any_cast<int>(&node->getValRef())) {
+            return *v;
+        }
+    }
+    if(node->type() == ASTNodeType::UnaryOp) {
+        auto unary = static_cast<UnaryOpNode*>(node);
+        auto v = intConst(unary->getExpr());
+        if(v && unary->getOp() == TokenType::OP_SUB && *v != INT_MIN) {
+            return -*v;
+        }
+    }
+    return std::nullopt;
+}
+
+const std::string* varName(ASTNode* node) {
+    return node->type() == ASTNodeType::Var ? &static_cast<VarNode*>(node)->getName() : nullptr;
+}
+
+// iv cmp b 和 b swapped(cmp) iv 一样
+TokenType swapped(TokenType cmp) {
+    switch(cmp) {
+    case TokenType::OP_LT:
+        return TokenType::OP_GT;
+    case TokenType::OP_GT:
+        return TokenType::OP_LT;
+    case TokenType::OP_LE:
+        return TokenType::OP_GE;
+    case TokenType::OP_GE:
+        return TokenType::OP_LE;
+    default:
+        return cmp;
+    }
+}
+
+TokenType negated(TokenType cmp) {
+    switch(cmp) {
+    case TokenType::OP_LT:
+        return TokenType::OP_GE;
+    case TokenType::OP_GE:
+        return TokenType::OP_LT;
+    case TokenType::OP_GT:
+        return TokenType::OP_LE;
+    case TokenType::OP_LE:
+        return TokenType::OP_GT;
+    case TokenType::OP_EQ:
+        return TokenType::OP_NE;
+    default:
+        return TokenType::OP_EQ;
+    }
+}
+
+bool comparison(TokenType op) {
+    switch(op) {
+    case TokenType::OP_LT:
+    case TokenType::OP_LE:
+    case TokenType::OP_GT:
+    case TokenType::OP_GE:
+    case TokenType::OP_EQ:
+    case TokenType::OP_NE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+// LET iv = iv + c, iv = c + iv, iv = iv - c: 返回每圈加的数, 不是时返回0
+int stepOf(const std::string& iv, ASTNode* rhs) {
+    if(rhs->type() != ASTNodeType::BinOp) {
+        return 0;
+    }
+    auto bin = static_cast<BinOpNode*>(rhs);
+    auto is_iv = [&iv](ASTNode* node) {
+        auto name = varName(node);
+        return name != nullptr && *name == iv;
+    };
+    std::optional<int> c;
+    if(bin->getOp() == TokenType::OP_ADD) {
+        c = is_iv(bin->getLeft()) ? intConst(bin->getRight()) : is_iv(bin->getRight()) ? intConst(bin->getLeft())
+                                                                                       : std::nullopt;
+    } else if(bin->getOp() == TokenType::OP_SUB && is_iv(bin->getLeft())) {
+        c = intConst(bin->getRight());
+        if(c) {
+            c = *c == INT_MIN ? 0 : -*c;
+        }
+    }
+    return c.value_or(0);
+}
+
+// 沿着from只经过LET和GOTO回到at, 返回经过的LET; 遇到其它语句, 程序结束或者不经过at的环时返回nullopt
+std::optional<std::vector<size_t>> cycle(const std::vector<Stmt>& stmts, size_t at, size_t from) {
+    std::vector<size_t> body;
+    std::set<size_t> seen;
+    for(auto s = from; s != at;) {
+        if(s == NO_STMT || !seen.insert(s).second) {
+            return std::nullopt;
+        }
+        const auto& stmt = stmts[s];
+        if(stmt.node->type() == ASTNodeType::GOTOStmt && !stmt.invalid_jump) {
+            s = stmt.jump;
+            continue;
+        }
+        if(stmt.node->type() != ASTNodeType::AssignStmt) {
+            return std::nullopt;
+        }
+        body.push_back(s);
+        s = stmt.next;
+    }
+    return body;
+}
+
+// 累加S = S ± 项, S = 项 + S
+std::optional<Counted::Sum> sumOf(const Counted& loop, const std::string& var, ASTNode* rhs,
+                                  const std::map<std::string, int>& assigned) {
+    if(rhs->type() != ASTNodeType::BinOp) {
+        return std::nullopt;
+    }
+    auto bin = static_cast<BinOpNode*>(rhs);
+    auto is_var = [&var](ASTNode* node) {
+        auto name = varName(node);
+        return name != nullptr && *name == var;
+    };
+    Counted::Sum sum{.var = var};
+    ASTNode* term = nullptr;
+    if(bin->getOp() == TokenType::OP_ADD) {
+        term = is_var(bin->getLeft()) ? bin->getRight() : is_var(bin->getRight()) ? bin->getLeft() : nullptr;
+    } else if(bin->getOp() == TokenType::OP_SUB && is_var(bin->getLeft())) {
+        term = bin->getRight();
+        sum.sign = -1;
+    }
+    if(term == nullptr) {
+        return std::nullopt;
+    }
+    if(auto c = intConst(term)) {
+        sum.constant = *c;
+        return sum;
+    }
+    if(auto name = varName(term)) {
+        if(*name == loop.iv) {
+            sum.scale = 1;
+            return sum;
+        }
+        if(!assigned.contains(*name)) {
+            sum.invariant = *name;
+            return sum;
+        }
+        return std::nullopt;
+    }
+    if(term->type() == ASTNodeType::BinOp && static_cast<BinOpNode*>(term)->getOp() == TokenType::OP_MUL) {
+        auto mul = static_cast<BinOpNode*>(term);
+        auto c = intConst(mul->getLeft());
+        auto name = varName(mul->getRight());
+        if(!c) {
+            c = intConst(mul->getRight());
+            name = varName(mul->getLeft());
+        }
+        if(c && name != nullptr && *name == loop.iv) {
+            sum.scale = *c;
+            return sum;
+        }
+    }
+    return std::nullopt;
+}
+
+std::unique_ptr<Counted> recognize(const std::vector<Stmt>& stmts, size_t at) {
+    const auto& test = stmts[at];
+    if(test.synthetic || test.node->type() != ASTNodeType::IFStmt || test.invalid_jump) {
+        return nullptr;
+    }
+    auto by_jump = cycle(stmts, at, test.jump);
+    auto by_next = cycle(stmts, at, test.next);
+    if(by_jump.has_value() == by_next.has_value()) {
+        return nullptr;
+    }
+    auto loop = std::make_unique<Counted>();
+    loop->on_jump = by_jump.has_value();
+    const auto& body = loop->on_jump ? *by_jump : *by_next;
+
+    auto cond = static_cast<IFStmtNode*>(test.node.get())->getCond();
+    if(cond->type() != ASTNodeType::BinOp || !comparison(static_cast<BinOpNode*>(cond)->getOp())) {
+        return nullptr;
+    }
+    auto bin = static_cast<BinOpNode*>(cond);
+    std::map<std::string, int> assigned;
+    for(const auto s: body) {
+        assigned[*assignedVar(stmts[s].node.get())]++;
+    }
+    // 条件的一边是归纳变量, 另一边是常数或者不变变量
+    auto bind = [&](ASTNode* iv_side, ASTNode* bound_side, TokenType cmp) {
+        auto iv = varName(iv_side);
+        if(iv == nullptr || !assigned.contains(*iv) || assigned.at(*iv) != 1) {
+            return false;
+        }
+        if(auto c = intConst(bound_side)) {
+            loop->bound = *c;
+        } else if(auto name = varName(bound_side); name != nullptr && !assigned.contains(*name)) {
+            loop->bound_var = *name;
+        } else {
+            return false;
+        }
+        loop->iv = *iv;
+        loop->cmp = loop->on_jump ? cmp : negated(cmp);
+        return true;
+    };
+    if(!bind(bin->getLeft(), bin->getRight(), bin->getOp()) &&
+       !bind(bin->getRight(), bin->getLeft(), swapped(bin->getOp()))) {
+        return nullptr;
+    }
+
+    size_t step_at = NO_STMT;
+    for(size_t k = 0; k < body.size(); ++k) {
+        auto assign = static_cast<AssignStmtNode*>(stmts[body[k]].node.get());
+        if(assign->getLeft()->getName() == loop->iv) {
+            loop->step = stepOf(loop->iv, assign->getRight());
+            step_at = k;
+        }
+    }
+    if(loop->step == 0) {
+        return nullptr;
+    }
+
+    // 封闭形式: 其它LET都是源码里的累加, 累加的变量在路径上只被自己读
+    loop->closed = true;
+    for(size_t k = 0; k < body.size() && loop->closed; ++k) {
+        const auto& stmt = stmts[body[k]];
+        auto assign = static_cast<AssignStmtNode*>(stmt.node.get());
+        const auto& var = assign->getLeft()->getName();
+        if(k == step_at) {
+            continue;
+        }
+        auto sum = sumOf(*loop, var, assign->getRight(), assigned);
+        bool read_elsewhere = assigned.at(var) != 1;
+        for(size_t j = 0; j < body.size() && !read_elsewhere; ++j) {
+            std::set<std::string> reads;
+            readVars(stmtExpr(stmts[body[j]].node.get()), reads);
+            read_elsewhere = j != k && reads.contains(var);
+        }
+        if(stmt.synthetic || !sum || read_elsewhere) {
+            loop->closed = false;
+            loop->sums.clear();
+            break;
+        }
+        sum->after_step = k > step_at;
+        loop->sums.push_back(std::move(*sum));
+    }
+    return loop;
+}
+
+std::optional<int> intVar(const SymbolTable& table, const std::string& name) {
+    auto value = table.find(name);
+    if(value == nullptr) {
+        return std::nullopt;
+    }
+    if(auto i = std::any_cast<int>(value)) {
+        return *i;
+    }
+    return std::nullopt;
+}
+
+bool fitsInt(int64_t v) {
+    return v >= INT_MIN && v <= INT_MAX;
+}
+
+int64_t floorDiv(int64_t a, int64_t b) {
+    auto q = a / b;
+    return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+} // namespace
+
+std::optional<int64_t> tripCount(const Counted& loop, const SymbolTable& table) {
+    auto i = intVar(table, loop.iv);
+    auto b = loop.bound_var.empty() ? std::optional<int>(loop.bound) : intVar(table, loop.bound_var);
+    if(!i || !b) {
+        return std::nullopt;
+    }
+    // 化成step > 0: -I ? -B
+    int64_t x = *i;
+    int64_t y = *b;
+    int64_t s = loop.step;
+    auto cmp = loop.cmp;
+    if(s < 0) {
+        x = -x;
+        y = -y;
+        s = -s;
+        cmp = swapped(cmp);
+    }
+    int64_t trips = 0;
+    switch(cmp) {
+    case TokenType::OP_LT:
+        trips = x < y ? (y - x + s - 1) / s : 0;
+        break;
+    case TokenType::OP_LE:
+        trips = x <= y ? (y - x) / s + 1 : 0;
+        break;
+    case TokenType::OP_GT:
+    case TokenType::OP_GE:
+        // I一直变大, 继续一次就不会结束(直到溢出)
+        if(cmp == TokenType::OP_GT ? x > y : x >= y) {
+            return std::nullopt;
+        }
+        break;
+    case TokenType::OP_EQ:
+        trips = x == y ? 1 : 0;
+        break;
+    case TokenType::OP_NE:
+        if(x != y) {
+            if(y < x || (y - x) % s != 0) {
+                return std::nullopt;
+            }
+            trips = (y - x) / s;
+        }
+        break;
+    default:
+        return std::nullopt;
+    }
+    if(!fitsInt(*i + trips * loop.step)) {
+        return std::nullopt;
+    }
+    return trips;
+}
+
+bool applyClosedForm(const Counted& loop, SymbolTable& table, int64_t trips) {
+    auto i = intVar(table, loop.iv);
+    // 部分和的中间结果不超过int64: 项在int范围内, 圈数不超过2^30
+    if(!i || trips > (int64_t{1} << 30)) {
+        return false;
+    }
+    if(trips == 0) {
+        return true;
+    }
+    std::vector<std::pair<const std::string*, int>> results;
+    for(const auto& sum: loop.sums) {
+        auto s0 = intVar(table, sum.var);
+        auto inv = sum.invariant.empty() ? std::optional<int>(0) : intVar(table, sum.invariant);
+        if(!s0 || !inv) {
+            return false;
+        }
+        // 第k圈的项是a + b * k
+        const int64_t iv0 = *i + (sum.after_step ? loop.step : 0);
+        const int64_t a = int64_t{sum.scale} * iv0 + sum.constant + *inv;
+        const int64_t b = int64_t{sum.scale} * loop.step;
+        if(!fitsInt(a) || !fitsInt(a + b * (trips - 1))) {
+            return false;
+        }
+        // 前m圈以后的值, 是m的二次函数, 极值在两端或者顶点附近
+        auto after = [&](int64_t m) {
+            const auto tri = m % 2 == 0 ? (m / 2) * (b * (m - 1)) : m * (b * ((m - 1) / 2));
+            return *s0 + sum.sign * (m * a + tri);
+        };
+        std::vector<int64_t> points = {1, trips};
+        if(b != 0) {
+            const auto v = floorDiv(b - 2 * a, 2 * b);
+            points.push_back(std::clamp<int64_t>(v, 1, trips));
+            points.push_back(std::clamp<int64_t>(v + 1, 1, trips));
+        }
+        if(!std::ranges::all_of(points, [&](int64_t m) { return fitsInt(after(m)); })) {
+            return false;
+        }
+        results.emplace_back(&sum.var, static_cast<int>(after(trips)));
+    }
+    for(const auto& [var, value]: results) {
+        table.set(*var, value);
+    }
+    table.set(loop.iv, static_cast<int>(*i + trips * loop.step));
+    return true;
+}
+
+size_t recognizeCountedLoops(Program& program) {
+    auto& stmts = program.getStmts();
+    size_t found = 0;
+    for(size_t i = 0; i < stmts.size(); ++i) {
+        stmts[i].counted = recognize(stmts, i);
+        found += stmts[i].counted ? 1 : 0;
+    }
+    return found;
+}
+
+} // namespace opt
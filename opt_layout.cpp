@@ -0,0 +1,50 @@
+//
+// Created by ayanami on 1/3/25.
+//
+// 语句布局: 按执行最可能走的边把语句排成一条条链, 让热路径在数组里连续(Program::reorder)
+// - 静态启发: GOTO的目标接在GOTO后面; IF按不跳转处理(向前的跳转多是少见的分支,
+//   向后的跳转是循环的回边, 目标在前面已经排好); 链断了以后从原来顺序中第一条没有排的语句继续
+// - 入口仍然是第0条; 源码行号不变, 断点, 错误和DEBUG输出不受影响
+//
+
+#include "optimizer.h"
+
+namespace opt {
+
+size_t layoutHotPath(Program& program) {
+    const auto& stmts = program.getStmts();
+    const auto n = stmts.size();
+    if(program.getEntry() == NO_STMT) {
+        return 0;
+    }
+    std::vector<bool> placed(n, false);
+    std::vector<size_t> order;
+    order.reserve(n);
+    auto free = [&](size_t i) {
+        return i != NO_STMT && !placed[i];
+    };
+    auto chain = [&](size_t i) {
+        while(free(i)) {
+            placed[i] = true;
+            order.push_back(i);
+            const auto& stmt = stmts[i];
+            const auto likely = stmt.node->type() == ASTNodeType::GOTOStmt ? stmt.jump : stmt.next;
+            const auto other = stmt.node->type() == ASTNodeType::IFStmt ? stmt.jump : NO_STMT;
+            i = free(likely) ? likely : other;
+        }
+    };
+    chain(program.getEntry());
+    for(size_t i = 0; i < n; ++i) {
+        chain(i);
+    }
+    size_t moved = 0;
+    for(size_t k = 0; k < n; ++k) {
+        moved += order[k] != k ? 1 : 0;
+    }
+    if(moved != 0) {
+        program.reorder(order);
+    }
+    return moved;
+}
+
+} // namespace opt
@@ -0,0 +1,203 @@
+//
+// Created by ayanami on 1/3/25.
+//
+// 循环不变表达式外提: IF/GOTO形成的循环(cfg::Graph的自然循环)里, 操作数在循环中不变的表达式
+// 在进入循环前算一次, 存到临时变量里
+// - 前置块是插在header之前的pass生成的语句, 所有从循环外到header的边改到前置块, 回边不变
+// - 只外提一定不会出错的表达式, 这样报错的时机, 行号和信息都不变(包括没有执行到的分支):
+//   类型推导为Int/Double, 变量在支配header的块里赋过值, 除数是非零(也不是-1)的常数
+// - 内层循环先处理; 外层循环可以继续外提内层前置块里的表达式
+//
+
+#include "optimizer.h"
+#include <algorithm>
+#include <set>
+#include "cfg.h"
+
+namespace opt {
+
+namespace {
+// node读取written里的变量
+bool reads(ASTNode* node, const std::set<string>& written) {
+    switch(node->type()) {
+    case ASTNodeType::Var:
+        return written.contains(static_cast<VarNode*>(node)->getName());
+    case ASTNodeType::UnaryOp:
+        return reads(static_cast<UnaryOpNode*>(node)->getExpr(), written);
+    case ASTNodeType::BinOp: {
+        auto bin = static_cast<BinOpNode*>(node);
+        return reads(bin->getLeft(), written) || reads(bin->getRight(), written);
+    }
+    default:
+        return false;
+    }
+}
+
+bool hasBinOp(ASTNode* node) {
+    switch(node->type()) {
+    case ASTNodeType::BinOp:
+        return true;
+    case ASTNodeType::UnaryOp:
+        return hasBinOp(static_cast<UnaryOpNode*>(node)->getExpr());
+    default:
+        return false;
+    }
+}
+
+class Hoister {
+    const std::set<string>& written; // 循环里被赋值的变量
+    const std::set<string>& defined; // 进入循环时一定已经赋值的变量
+    Program& program;
+    std::map<string, string> temp_of; // 表达式 -> 临时变量, 同一个表达式只算一次
+public:
+    std::vector<std::pair<string, ASTNode*>> hoisted;
+
+    Hoister(const std::set<string>& written, const std::set<string>& defined, Program& program):
+        written(written), defined(defined), program(program) {}
+
+    bool invariant(ASTNode* node) const {
+        return cannotFail(node, defined) && !reads(node, written);
+    }
+
+    // 把node里最大的不变子表达式换成临时变量, 返回替换后的节点(调用方负责接到父节点上)
+    ASTNode* rewrite(ASTNode* node) {
+        if(hasBinOp(node) && invariant(node)) {
+            const auto type = node->getStaticType();
+            auto [it, inserted] = temp_of.try_emplace(exprString(node));
+            if(inserted) {
+                it->second = program.newTemp();
+                hoisted.emplace_back(it->second, node);
+            } else {
+                delete node;
+            }
+            auto temp = new VarNode(it->second);
+            temp->setStaticType(type);
+            return temp;
+        }
+        if(node->type() == ASTNodeType::BinOp) {
+            auto bin = static_cast<BinOpNode*>(node);
+            bin->setLeft(rewrite(bin->getLeft()));
+            bin->setRight(rewrite(bin->getRight()));
+        } else if(node->type() == ASTNodeType::UnaryOp) {
+            auto unary = static_cast<UnaryOpNode*>(node);
+            unary->setExpr(rewrite(unary->getExpr()));
+        }
+        return node;
+    }
+
+    void rewriteStmt(ASTNode* node) {
+        switch(node->type()) {
+        case ASTNodeType::AssignStmt: {
+            auto assign = static_cast<AssignStmtNode*>(node);
+            assign->setRight(rewrite(assign->getRight()));
+            break;
+        }
+        case ASTNodeType::PrintStmt: {
+            auto print = static_cast<PrintStmtNode*>(node);
+            print->setExpr(rewrite(print->getExpr()));
+            break;
+        }
+        case ASTNodeType::IFStmt: {
+            auto if_stmt = static_cast<IFStmtNode*>(node);
+            if_stmt->setCond(rewrite(if_stmt->getCond()));
+            break;
+        }
+        default:
+            break; // 单独的表达式行的结果不被使用, 保持原样
+        }
+    }
+};
+
+// 返回外提的表达式数量
+size_t hoist(Program& program, const cfg::Graph& graph, const cfg::Loop& loop) {
+    auto& stmts = program.getStmts();
+    const auto& blocks = graph.getBlocks();
+    std::set<size_t> body;
+    std::set<string> written;
+    for(const auto b: loop.blocks) {
+        for(const auto i: blocks[b].lines) {
+            body.insert(static_cast<size_t>(i));
+            if(auto name = assignedVar(stmts[i].node.get())) {
+                written.insert(*name);
+            }
+        }
+    }
+    std::set<string> defined;
+    for(size_t b = 0; b < blocks.size(); ++b) {
+        if(b == loop.header || !graph.dominates(b, loop.header)) {
+            continue;
+        }
+        for(const auto i: blocks[b].lines) {
+            if(auto name = assignedVar(stmts[i].node.get())) {
+                defined.insert(*name);
+            }
+        }
+    }
+    Hoister hoister(written, defined, program);
+    for(const auto i: body) {
+        hoister.rewriteStmt(stmts[i].node.get());
+    }
+    if(hoister.hoisted.empty()) {
+        return 0;
+    }
+    const auto header = static_cast<size_t>(blocks[loop.header].lines.front());
+    const int line = stmts[header].line;
+    std::vector<Stmt> preheader;
+    for(const auto& [temp, expr]: hoister.hoisted) {
+        auto var = new VarNode(temp);
+        var->setStaticType(expr->getStaticType());
+        preheader.push_back(Stmt{.line = line, .node = std::unique_ptr<ASTNode>(new AssignStmtNode(var, expr)),
+                                 .synthetic = true});
+    }
+    const auto k = preheader.size();
+    const auto at = program.insert(header, std::move(preheader));
+    const auto moved_header = header + k;
+    auto outside = [&](size_t i) {
+        if(i >= at && i < at + k) {
+            return false; // 前置块本身
+        }
+        return !body.contains(i >= at + k ? i - k : i);
+    };
+    for(size_t i = 0; i < stmts.size(); ++i) {
+        if(!outside(i)) {
+            continue;
+        }
+        if(stmts[i].next == moved_header) {
+            stmts[i].next = at;
+        }
+        if(stmts[i].jump == moved_header) {
+            stmts[i].jump = at;
+        }
+    }
+    if(program.getEntry() == moved_header) {
+        program.setEntry(at);
+    }
+    return k;
+}
+} // namespace
+
+size_t hoistLoopInvariants(Program& program) {
+    size_t total = 0;
+    // 每次外提都会插入语句, 重新建图
+    for(bool changed = true; changed;) {
+        changed = false;
+        auto graph = cfg::Graph::build(program);
+        std::vector<const cfg::Loop*> loops;
+        for(const auto& loop: graph.getLoops()) {
+            loops.push_back(&loop);
+        }
+        std::ranges::stable_sort(loops, [](const cfg::Loop* a, const cfg::Loop* b) {
+            return a->depth > b->depth;
+        });
+        for(const auto loop: loops) {
+            if(auto n = hoist(program, graph, *loop); n != 0) {
+                total += n;
+                changed = true;
+                break;
+            }
+        }
+    }
+    return total;
+}
+
+} // namespace opt
@@ -0,0 +1,520 @@
+//
+// Created by ayanami on 1/3/25.
+//
+// 值域分析: 在语句的控制流图上对Int变量做区间分析, 证明除数不为零, MOD的操作数非负, 常数的幂不溢出,
+// 编译闭包时(closure::Facts)去掉对应的检查
+// - 不在状态里的变量可以是任何值: 入口, INPUT, 不是Int的赋值, 以及两条路径只有一边有的变量
+// - 运算可能超出int时结果是整个int范围(回绕以后什么值都可能)
+// - IF的两个分支按比较条件收窄变量的区间, 比如IF I < 100 THEN 40跳转时I <= 99, 循环计数器因此有界
+// - 循环头的区间变化两次以后扩大到程序里出现的常数(加减1)作为界, 保证结束; 再迭代两遍收窄
+// - 闭包仍然检查操作数是不是int, 分析只依赖类型推导为Int的节点
+//
+
+#include "optimizer.h"
+#include <climits>
+#include <cmath>
+#include <optional>
+#include "interpreter.h"
+
+namespace opt {
+
+namespace {
+using Token::TokenType;
+
+using Interval = struct Interval {
+    int64_t lo = INT_MIN;
+    int64_t hi = INT_MAX;
+
+    [[nodiscard]] bool top() const {
+        return lo == INT_MIN && hi == INT_MAX;
+    }
+    [[nodiscard]] bool contains(int64_t v) const {
+        return lo <= v && v <= hi;
+    }
+    bool operator==(const Interval&) const = default;
+};
+
+// 不在表里的变量是TOP
+using State = std::map<string, Interval>;
+
+constexpr int WIDEN_AFTER = 2;
+constexpr int NARROW_PASSES = 2;
+constexpr int MAX_POW = 64; // 和closure_engine.cpp里乘法链的上限一致
+
+// 超出int就可能回绕
+Interval make(int64_t lo, int64_t hi) {
+    if(lo < INT_MIN || hi > INT_MAX) {
+        return {};
+    }
+    return {lo, hi};
+}
+
+std::string show(const Interval& v) {
+    return fmt::format("[{}, {}]", v.lo, v.hi);
+}
+
+const int* intConst(ASTNode* node) {
+    if(node->type() != ASTNodeType::Num) {
+        return nullptr;
+    }
+    return std::any_cast<int>(&node->getValRef());
+}
+
+// x ** c, c >= 0, 超出int时返回nullopt
+std::optional<Interval> power(const Interval& x, int c) {
+    auto at = [c](int64_t v) {
+        return std::pow(static_cast<long double>(v), c);
+    };
+    long double lo = std::min(at(x.lo), at(x.hi));
+    long double hi = std::max(at(x.lo), at(x.hi));
+    if(c % 2 == 0 && x.contains(0)) {
+        lo = 0;
+    }
+    if(c == 0) {
+        lo = hi = 1;
+    }
+    if(lo < INT_MIN || hi > INT_MAX) {
+        return std::nullopt;
+    }
+    return Interval{static_cast<int64_t>(lo), static_cast<int64_t>(hi)};
+}
+
+Interval eval(ASTNode* node, const State& state) {
+    if(node->getStaticType() != StaticType::Int) {
+        return {};
+    }
+    switch(node->type()) {
+    case ASTNodeType::Num: {
+        auto c = intConst(node);
+        return c == nullptr ? Interval{} : Interval{*c, *c};
+    }
+    case ASTNodeType::Var: {
+        auto it = state.find(static_cast<VarNode*>(node)->getName());
+        return it == state.end() ? Interval{} : it->second;
+    }
+    case ASTNodeType::UnaryOp: {
+        auto unary = static_cast<UnaryOpNode*>(node);
+        auto v = eval(unary->getExpr(), state);
+        return unary->getOp() == TokenType::OP_SUB ? make(-v.hi, -v.lo) : v;
+    }
+    case ASTNodeType::BinOp:
+        break;
+    default:
+        return {};
+    }
+    auto bin = static_cast<BinOpNode*>(node);
+    const auto a = eval(bin->getLeft(), state);
+    const auto b = eval(bin->getRight(), state);
+    switch(bin->getOp()) {
+    case TokenType::OP_ADD:
+        return make(a.lo + b.lo, a.hi + b.hi);
+    case TokenType::OP_SUB:
+        return make(a.lo - b.hi, a.hi - b.lo);
+    case TokenType::OP_MUL: {
+        const auto corners = {a.lo * b.lo, a.lo * b.hi, a.hi * b.lo, a.hi * b.hi};
+        return make(std::min(corners), std::max(corners));
+    }
+    case TokenType::OP_DIV: {
+        if(b.lo > 0 || b.hi < 0) {
+            // 除数符号确定时商在四个角上取到极值
+            const auto corners = {a.lo / b.lo, a.lo / b.hi, a.hi / b.lo, a.hi / b.hi};
+            return make(std::min(corners), std::max(corners));
+        }
+        // 除数为零时已经报错, 否则|商| <= |被除数|
+        const auto m = std::max(-a.lo, a.hi);
+        return make(-m, m);
+    }
+    case TokenType::OP_MOD: {
+        // 结果的符号和除数一样, 绝对值小于除数
+        if(b.lo > 0) {
+            return {0, a.lo >= 0 ? std::min(a.hi, b.hi - 1) : b.hi - 1};
+        }
+        if(b.hi < 0) {
+            return {b.lo + 1, 0};
+        }
+        const auto m = std::max(-b.lo, b.hi) - 1;
+        return make(-m, m);
+    }
+    case TokenType::OP_POW: {
+        auto c = intConst(bin->getRight());
+        if(c == nullptr || *c < 0 || *c > MAX_POW) {
+            return {};
+        }
+        return power(a, *c).value_or(Interval{});
+    }
+    case TokenType::OP_GT:
+    case TokenType::OP_LT:
+    case TokenType::OP_GE:
+    case TokenType::OP_LE:
+    case TokenType::OP_EQ:
+    case TokenType::OP_NE:
+        return {0, 1};
+    default:
+        return {};
+    }
+}
+
+TokenType negate(TokenType op) {
+    switch(op) {
+    case TokenType::OP_LT:
+        return TokenType::OP_GE;
+    case TokenType::OP_GE:
+        return TokenType::OP_LT;
+    case TokenType::OP_GT:
+        return TokenType::OP_LE;
+    case TokenType::OP_LE:
+        return TokenType::OP_GT;
+    case TokenType::OP_EQ:
+        return TokenType::OP_NE;
+    default:
+        return TokenType::OP_EQ;
+    }
+}
+
+// a op b <=> b flip(op) a
+TokenType flip(TokenType op) {
+    switch(op) {
+    case TokenType::OP_LT:
+        return TokenType::OP_GT;
+    case TokenType::OP_GT:
+        return TokenType::OP_LT;
+    case TokenType::OP_LE:
+        return TokenType::OP_GE;
+    case TokenType::OP_GE:
+        return TokenType::OP_LE;
+    default:
+        return op;
+    }
+}
+
+// v op o成立时v的区间, 不可能成立时返回nullopt
+std::optional<Interval> refine(Interval v, TokenType op, const Interval& o) {
+    switch(op) {
+    case TokenType::OP_LT:
+        v.hi = std::min(v.hi, o.hi - 1);
+        break;
+    case TokenType::OP_LE:
+        v.hi = std::min(v.hi, o.hi);
+        break;
+    case TokenType::OP_GT:
+        v.lo = std::max(v.lo, o.lo + 1);
+        break;
+    case TokenType::OP_GE:
+        v.lo = std::max(v.lo, o.lo);
+        break;
+    case TokenType::OP_EQ:
+        v.lo = std::max(v.lo, o.lo);
+        v.hi = std::min(v.hi, o.hi);
+        break;
+    case TokenType::OP_NE:
+        if(o.lo == o.hi && v.lo == o.lo) {
+            v.lo++;
+        } else if(o.lo == o.hi && v.hi == o.lo) {
+            v.hi--;
+        }
+        break;
+    default:
+        break;
+    }
+    if(v.lo > v.hi) {
+        return std::nullopt;
+    }
+    return v;
+}
+
+bool isComparison(TokenType op) {
+    return op == TokenType::OP_LT || op == TokenType::OP_LE || op == TokenType::OP_GT || op == TokenType::OP_GE ||
+           op == TokenType::OP_EQ || op == TokenType::OP_NE;
+}
+
+// IF的条件为truth时的状态, 不可能时返回nullopt
+std::optional<State> branch(ASTNode* cond, const State& state, bool truth) {
+    if(cond->type() != ASTNodeType::BinOp) {
+        return state;
+    }
+    auto bin = static_cast<BinOpNode*>(cond);
+    if(!isComparison(bin->getOp()) || bin->getLeft()->getStaticType() != StaticType::Int ||
+       bin->getRight()->getStaticType() != StaticType::Int) {
+        return state;
+    }
+    const auto op = truth ? bin->getOp() : negate(bin->getOp());
+    const auto a = eval(bin->getLeft(), state);
+    const auto b = eval(bin->getRight(), state);
+    auto res = state;
+    auto narrow = [&](ASTNode* side, TokenType side_op, const Interval& self, const Interval& other) {
+        auto v = refine(self, side_op, other);
+        if(!v) {
+            return false;
+        }
+        if(side->type() == ASTNodeType::Var && !v->top()) {
+            res[static_cast<VarNode*>(side)->getName()] = *v;
+        }
+        return true;
+    };
+    if(!narrow(bin->getLeft(), op, a, b) || !narrow(bin->getRight(), flip(op), b, a)) {
+        return std::nullopt;
+    }
+    return res;
+}
+
+State join(const State& a, const State& b) {
+    State res;
+    for(const auto& [name, v]: a) {
+        if(auto it = b.find(name); it != b.end()) {
+            Interval hull{std::min(v.lo, it->second.lo), std::max(v.hi, it->second.hi)};
+            if(!hull.top()) {
+                res.emplace(name, hull);
+            }
+        }
+    }
+    return res;
+}
+
+class Analysis {
+    const Program& program;
+    std::set<int64_t> thresholds{INT_MIN, INT_MAX};
+public:
+    std::vector<std::optional<State>> in; // 语句执行前的状态, nullopt表示到不了
+
+    explicit Analysis(const Program& program): program(program), in(program.getStmts().size()) {
+        for(const auto& stmt: program.getStmts()) {
+            collectConstants(stmt.node.get());
+        }
+    }
+
+    void run() {
+        const auto& stmts = program.getStmts();
+        if(program.getEntry() == NO_STMT) {
+            return;
+        }
+        std::vector<int> changes(stmts.size(), 0);
+        std::set<size_t> work;
+        in[program.getEntry()] = State{};
+        work.insert(program.getEntry());
+        while(!work.empty()) {
+            const auto i = *work.begin();
+            work.erase(work.begin());
+            for(auto& [s, out]: successors(i)) {
+                if(!in[s]) {
+                    in[s] = std::move(out);
+                    work.insert(s);
+                    continue;
+                }
+                auto merged = join(*in[s], out);
+                if(merged == *in[s]) {
+                    continue;
+                }
+                if(++changes[s] > WIDEN_AFTER) {
+                    merged = widen(*in[s], merged);
+                }
+                in[s] = std::move(merged);
+                work.insert(s);
+            }
+        }
+        for(int pass = 0; pass < NARROW_PASSES; ++pass) {
+            narrow();
+        }
+    }
+
+    // i执行以后到达的语句和状态
+    [[nodiscard]] std::vector<std::pair<size_t, State>> successors(size_t i) const {
+        const auto& stmt = program.getStmts()[i];
+        std::vector<std::pair<size_t, State>> res;
+        auto node = stmt.node.get();
+        if(node->type() == ASTNodeType::IFStmt) {
+            auto cond = static_cast<IFStmtNode*>(node)->getCond();
+            if(stmt.jump != NO_STMT) {
+                if(auto taken = branch(cond, *in[i], true)) {
+                    res.emplace_back(stmt.jump, std::move(*taken));
+                }
+            }
+            if(stmt.next != NO_STMT) {
+                if(auto not_taken = branch(cond, *in[i], false)) {
+                    res.emplace_back(stmt.next, std::move(*not_taken));
+                }
+            }
+            return res;
+        }
+        auto out = *in[i];
+        if(auto name = assignedVar(node)) {
+            auto value = Interval{};
+            if(node->type() == ASTNodeType::AssignStmt) {
+                value = eval(static_cast<AssignStmtNode*>(node)->getRight(), out);
+            }
+            if(value.top()) {
+                out.erase(*name);
+            } else {
+                out[*name] = value;
+            }
+        }
+        for(const auto s: {stmt.next, stmt.jump}) {
+            if(s != NO_STMT) {
+                res.emplace_back(s, out);
+            }
+        }
+        return res;
+    }
+
+private:
+    void collectConstants(ASTNode* node) {
+        if(auto c = intConst(node)) {
+            for(const auto t: {int64_t{*c} - 1, int64_t{*c}, int64_t{*c} + 1}) {
+                if(t >= INT_MIN && t <= INT_MAX) {
+                    thresholds.insert(t);
+                }
+            }
+            return;
+        }
+        switch(node->type()) {
+        case ASTNodeType::BinOp:
+            collectConstants(static_cast<BinOpNode*>(node)->getLeft());
+            collectConstants(static_cast<BinOpNode*>(node)->getRight());
+            break;
+        case ASTNodeType::UnaryOp:
+            collectConstants(static_cast<UnaryOpNode*>(node)->getExpr());
+            break;
+        case ASTNodeType::AssignStmt:
+            collectConstants(static_cast<AssignStmtNode*>(node)->getRight());
+            break;
+        case ASTNodeType::PrintStmt:
+            collectConstants(static_cast<PrintStmtNode*>(node)->getExpr());
+            break;
+        case ASTNodeType::IFStmt:
+            collectConstants(static_cast<IFStmtNode*>(node)->getCond());
+            break;
+        default:
+            break;
+        }
+    }
+
+    // 变大的界扩大到下一个常数
+    State widen(const State& old, const State& merged) const {
+        State res;
+        for(auto [name, v]: merged) {
+            const auto& before = old.at(name); // join的结果只含两边都有的变量
+            if(v.lo < before.lo) {
+                v.lo = *std::prev(thresholds.upper_bound(v.lo));
+            }
+            if(v.hi > before.hi) {
+                v.hi = *thresholds.lower_bound(v.hi);
+            }
+            if(!v.top()) {
+                res.emplace(name, v);
+            }
+        }
+        return res;
+    }
+
+    // 从已经稳定(可能过大)的状态重新算一遍每条语句的输入, 仍然是安全的
+    void narrow() {
+        const auto& stmts = program.getStmts();
+        std::vector<std::optional<State>> next(stmts.size());
+        next[program.getEntry()] = State{};
+        for(size_t i = 0; i < stmts.size(); ++i) {
+            if(!in[i]) {
+                continue;
+            }
+            for(auto& [s, out]: successors(i)) {
+                next[s] = next[s] ? join(*next[s], out) : std::move(out);
+            }
+        }
+        in = std::move(next);
+    }
+};
+
+class Checker {
+    Program& program;
+    size_t index;
+    const State& state;
+public:
+    size_t removed = 0;
+
+    Checker(Program& program, size_t index, const State& state): program(program), index(index), state(state) {}
+
+    void visit(ASTNode* node) {
+        switch(node->type()) {
+        case ASTNodeType::UnaryOp:
+            visit(static_cast<UnaryOpNode*>(node)->getExpr());
+            return;
+        case ASTNodeType::BinOp:
+            break;
+        default:
+            return;
+        }
+        auto bin = static_cast<BinOpNode*>(node);
+        visit(bin->getLeft());
+        visit(bin->getRight());
+        if(node->getStaticType() != StaticType::Int) {
+            return;
+        }
+        const auto a = eval(bin->getLeft(), state);
+        const auto b = eval(bin->getRight(), state);
+        const auto c = intConst(bin->getRight());
+        switch(bin->getOp()) {
+        case TokenType::OP_DIV:
+        case TokenType::OP_MOD:
+            // 常数除数已经在编译时特化
+            if(c != nullptr || b.contains(0)) {
+                return;
+            }
+            program.addFact(&closure::Facts::nonzero_divisor, node);
+            if(bin->getOp() == TokenType::OP_MOD && a.lo >= 0 && b.lo > 0) {
+                program.addFact(&closure::Facts::non_negative, node);
+                note(node, "zero check, sign fix-up", a, b);
+            } else {
+                note(node, "zero check", a, b);
+            }
+            break;
+        case TokenType::OP_POW:
+            if(c == nullptr || *c < 2 || *c > MAX_POW || !power(a, *c)) {
+                return;
+            }
+            program.addFact(&closure::Facts::no_overflow, node);
+            note(node, "overflow check", a, b);
+            break;
+        default:
+            return;
+        }
+        removed++;
+    }
+
+    void visitStmt(ASTNode* node) {
+        switch(node->type()) {
+        case ASTNodeType::AssignStmt:
+            visit(static_cast<AssignStmtNode*>(node)->getRight());
+            break;
+        case ASTNodeType::PrintStmt:
+            visit(static_cast<PrintStmtNode*>(node)->getExpr());
+            break;
+        case ASTNodeType::IFStmt:
+            visit(static_cast<IFStmtNode*>(node)->getCond());
+            break;
+        default:
+            break;
+        }
+    }
+
+private:
+    void note(ASTNode* node, std::string_view checks, const Interval& a, const Interval& b) {
+        program.addRemovedCheck(fmt::format("@{} {} {}: {}; left {}, right {}", index,
+                                            program.getStmts()[index].line, exprString(node), checks, show(a), show(b)));
+    }
+};
+} // namespace
+
+size_t eliminateChecks(Program& program) {
+    Analysis analysis(program);
+    analysis.run();
+    size_t total = 0;
+    for(size_t i = 0; i < program.getStmts().size(); ++i) {
+        if(!analysis.in[i]) {
+            continue;
+        }
+        Checker checker(program, i, *analysis.in[i]);
+        checker.visitStmt(program.getStmts()[i].node.get());
+        total += checker.removed;
+    }
+    return total;
+}
+
+} // namespace opt
@@ -0,0 +1,179 @@
+//
+// Created by ayanami on 1/3/25.
+//
+// 常数折叠和代数化简: 只做对所有输入结果都完全一样的改写, 包括int溢出的回绕和报错
+// - 两边都是int常数的运算在编译时用tryBinOp/tryUnaryOp算出来, 会报错的(除零)保持原样
+// - x + 0, x - 0, x * 1, x / 1, x ** 1 -> x: 只在x推导为Int时做, 否则原来的运算可能报类型错误
+// - x - x, x * 0, x MOD 1 -> 0, x ** 0 -> 1: 另外要求x的求值一定成功(cannotFail)
+// - x ** c, x / c, x MOD c的乘法链, 移位/掩码和乘法代替除法在编译闭包时做(closure_engine.cpp),
+//   x ** 2不能直接改成x * x: 溢出时std::pow转换成int和乘法回绕的结果不同
+//
+
+#include "optimizer.h"
+#include "interpreter.h"
+
+namespace opt {
+
+namespace {
+using Token::TokenType;
+
+const int* intConst(ASTNode* node) {
+    if(node->type() != ASTNodeType::Num) {
+        return nullptr;
+    }
+    return std::any_cast<int>(&node->getValRef());
+}
+
+ASTNode* newInt(int value) {
+    auto num = new NumNode(value);
+    num->setStaticType(StaticType::Int);
+    return num;
+}
+
+class Simplifier {
+    const std::set<string>& defined; // 语句执行前一定已经赋值的变量
+public:
+    size_t changes = 0;
+
+    explicit Simplifier(const std::set<string>& defined): defined(defined) {}
+
+    // 返回化简后的节点, 被丢掉的节点在这里delete
+    ASTNode* rewrite(ASTNode* node) {
+        if(node->type() == ASTNodeType::UnaryOp) {
+            auto unary = static_cast<UnaryOpNode*>(node);
+            unary->setExpr(rewrite(unary->getExpr()));
+            int out = 0;
+            auto v = intConst(unary->getExpr());
+            if(v != nullptr && tryUnaryOp<int>(*v, unary->getOp(), out) == ErrorKind::Ok) {
+                return replace(node, newInt(out));
+            }
+            return node;
+        }
+        if(node->type() != ASTNodeType::BinOp) {
+            return node;
+        }
+        auto bin = static_cast<BinOpNode*>(node);
+        bin->setLeft(rewrite(bin->getLeft()));
+        bin->setRight(rewrite(bin->getRight()));
+        const auto l = intConst(bin->getLeft());
+        const auto r = intConst(bin->getRight());
+        int out = 0;
+        if(l != nullptr && r != nullptr && tryBinOp<int>(*l, *r, bin->getOp(), out) == ErrorKind::Ok) {
+            return replace(node, newInt(out));
+        }
+        // 两边都是Int时整个运算才推导为Int
+        if(node->getStaticType() != StaticType::Int) {
+            return node;
+        }
+        auto is = [](const int* c, int value) {
+            return c != nullptr && *c == value;
+        };
+        auto safe = [&](ASTNode* x) {
+            return cannotFail(x, defined);
+        };
+        switch(bin->getOp()) {
+        case TokenType::OP_ADD:
+            if(is(r, 0)) {
+                return keepLeft(bin);
+            }
+            if(is(l, 0)) {
+                return keepRight(bin);
+            }
+            break;
+        case TokenType::OP_SUB:
+            if(is(r, 0)) {
+                return keepLeft(bin);
+            }
+            if(safe(bin->getLeft()) && exprString(bin->getLeft()) == exprString(bin->getRight())) {
+                return replace(node, newInt(0));
+            }
+            break;
+        case TokenType::OP_MUL:
+            if(is(r, 1)) {
+                return keepLeft(bin);
+            }
+            if(is(l, 1)) {
+                return keepRight(bin);
+            }
+            if((is(r, 0) && safe(bin->getLeft())) || (is(l, 0) && safe(bin->getRight()))) {
+                return replace(node, newInt(0));
+            }
+            break;
+        case TokenType::OP_DIV:
+            if(is(r, 1)) {
+                return keepLeft(bin);
+            }
+            break;
+        case TokenType::OP_MOD:
+            if(is(r, 1) && safe(bin->getLeft())) {
+                return replace(node, newInt(0));
+            }
+            break;
+        case TokenType::OP_POW:
+            if(is(r, 1)) {
+                return keepLeft(bin);
+            }
+            if(is(r, 0) && safe(bin->getLeft())) {
+                return replace(node, newInt(1));
+            }
+            break;
+        default:
+            break;
+        }
+        return node;
+    }
+
+    void rewriteStmt(ASTNode* node) {
+        switch(node->type()) {
+        case ASTNodeType::AssignStmt: {
+            auto assign = static_cast<AssignStmtNode*>(node);
+            assign->setRight(rewrite(assign->getRight()));
+            break;
+        }
+        case ASTNodeType::PrintStmt: {
+            auto print = static_cast<PrintStmtNode*>(node);
+            print->setExpr(rewrite(print->getExpr()));
+            break;
+        }
+        case ASTNodeType::IFStmt: {
+            auto if_stmt = static_cast<IFStmtNode*>(node);
+            if_stmt->setCond(rewrite(if_stmt->getCond()));
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+private:
+    ASTNode* replace(ASTNode* old, ASTNode* node) {
+        delete old;
+        changes++;
+        return node;
+    }
+    ASTNode* keepLeft(BinOpNode* bin) {
+        auto kept = bin->getLeft();
+        bin->setLeft(nullptr);
+        return replace(bin, kept);
+    }
+    ASTNode* keepRight(BinOpNode* bin) {
+        auto kept = bin->getRight();
+        bin->setRight(nullptr);
+        return replace(bin, kept);
+    }
+};
+} // namespace
+
+size_t simplifyArithmetic(Program& program) {
+    const auto defined = definitelyAssigned(program);
+    auto& stmts = program.getStmts();
+    size_t total = 0;
+    for(size_t i = 0; i < stmts.size(); ++i) {
+        Simplifier simplifier(defined[i]);
+        simplifier.rewriteStmt(stmts[i].node.get());
+        total += simplifier.changes;
+    }
+    return total;
+}
+
+} // namespace opt
@@ -0,0 +1,753 @@
+//
+// Created by ayanami on 1/2/25.
+//
+
+#include "opt_test.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "optimizer.h"
+#include "engine_test_util.h"
+using std::vector;
+using std::string;
+using fmt::format;
+using namespace engine_test;
+
+namespace {
+// 优化会删除/合并语句, 计数器和每一步的AST输出不一样, 只比较输出, 错误和变量
+bool sameResult(const RunResult& a, const RunResult& b) {
+    return a.err == b.err && a.output == b.output && a.vars == b.vars;
+}
+
+std::shared_ptr<Interpreter> newOptimized(const vector<string>& lines, const opt::Options& options = {}) {
+    auto interpreter = newInterpreter();
+    interpreter->setASTOutput(false);
+    interpreter->loadProgram(Token::programFromlines(lines));
+    interpreter->setOptOptions(options);
+    interpreter->setEngine(EngineKind::Optimized);
+    return interpreter;
+}
+
+// 只打开一个pass
+opt::Options only(bool opt::Options::* pass) {
+    auto options = opt::levelOptions(0);
+    options.*pass = true;
+    return options;
+}
+
+string joined(const vector<string>& lines) {
+    return fmt::format("{}", fmt::join(lines.begin(), lines.end(), "\n"));
+}
+}
+
+void opt_test::initTestCase() {
+    qDebug() <<"Init test case\n";
+}
+
+void opt_test::testMatchesTreeWalker() {
+    const std::map<string, string> inputs = {
+        {"sum_of_1ton.bas", "10\n"},
+        {"sum_of_two.bas", "7\n5\n"},
+        {"factorial.bas", "6\n"},
+        {"even_or_odd.bas", "7\n"},
+        {"is_prime.bas", "67\n"},
+        {"hard1.bas", "100\n"},
+        {"hard2.bas", "100\n"},
+    };
+    size_t checked = 0;
+    for(const auto& entry: std::filesystem::directory_iterator("./programs")) {
+        if(entry.path().extension() != ".bas") {
+            continue;
+        }
+        auto file = entry.path().string();
+        auto input_it = inputs.find(entry.path().filename().string());
+        auto input = input_it == inputs.end() ? string{} : input_it->second;
+        auto tree = newInterpreter();
+        auto optimized = newInterpreter();
+        tree->setASTOutput(false);
+        optimized->setASTOutput(false);
+        try {
+            CoutCapture capture;
+            tree->loadFile(file);
+            optimized->loadFile(file);
+            optimized->setEngine(EngineKind::Optimized);
+        } catch (std::exception&) {
+            continue;
+        }
+        QVERIFY(optimized->getEngine() == EngineKind::Optimized);
+        auto expected = run(*tree, input);
+        auto actual = run(*optimized, input);
+        QVERIFY2(sameResult(expected, actual), format("{}:\n  tree {}\n  optimized {}\n{}", file,
+            describe(expected), describe(actual), joined(optimized->getOptimized()->dump())).c_str());
+        checked++;
+    }
+    QVERIFY(checked >= 14);
+}
+
+void opt_test::testDeadCode() {
+    Parser parser(std::make_shared<Token::Tokenizer>());
+    {
+        CoutCapture capture;
+        parser.reload(std::filesystem::path("./programs/hard1.bas"));
+    }
+    auto program = opt::optimize(parser.getStmts(), only(&opt::Options::dead_code));
+    // 3和2019的REM不再执行, 18跳到2019后面的2020
+    const vector<string> expected = {
+        "@0 9 INPUT N",
+        "@1 16 LET X = 1",
+        "@2 17 LET SUM = ((2 ** X) - 1)",
+        "@3 18 IF (SUM < 0) THEN @9",
+        "@4 20 IF (SUM > N) THEN @11",
+        "@5 22 IF (SUM = N) THEN @11",
+        "@6 25 LET X = (X + 1)",
+        "@7 44 LET SUM = ((2 ** X) - 1)",
+        "@8 50 GOTO @2",
+        "@9 2020 PRINT ((2020 + -2) + 3)",
+        "@10 2021 END",
+        "@11 11199 PRINT ((((X * 2) + 2) / 2) - 1)",
+    };
+    QVERIFY2(program->dump() == expected, joined(program->dump()).c_str());
+    QCOMPARE(program->executableLines().size(), size_t{12});
+
+    // 不可达的语句, 跳到末尾的REM等于结束
+    parser.reload(vector<string>{
+        "10 GOTO 40",
+        "20 PRINT 1",
+        "30 REM skipped",
+        "40 IF 1 THEN 70",
+        "50 PRINT 2",
+        "60 END",
+        "70 PRINT 3",
+        "80 GOTO 100",
+        "90 PRINT 4",
+        "100 REM done",
+    });
+    program = opt::optimize(parser.getStmts(), only(&opt::Options::dead_code));
+    QCOMPARE(program->executableLines(), (vector<int>{10, 40, 50, 60, 70, 80}));
+    QCOMPARE(program->dump().back(), string("@5 80 GOTO END"));
+    auto interpreter = newOptimized({"10 GOTO 40", "20 PRINT 1", "30 REM skipped", "40 IF 1 THEN 70", "50 PRINT 2",
+                                     "60 END", "70 PRINT 3", "80 GOTO 100", "90 PRINT 4", "100 REM done"},
+                                    only(&opt::Options::dead_code));
+    auto res = run(*interpreter, "");
+    QCOMPARE(res.output, string("3"));
+    QCOMPARE(res.err, string{});
+    // 每一步是一条仍然执行的语句
+    QCOMPARE(interpreter->getCounters().statements, uint64_t{4});
+
+    // 跳到不存在的行仍然在运行到那里时报错
+    interpreter = newOptimized({"10 REM x", "20 GOTO 25"});
+    res = run(*interpreter, "");
+    QVERIFY2(res.err.find("line 25 no exist") != string::npos, res.err.c_str());
+    QCOMPARE(interpreter->getStatus().error->line_no, 20);
+}
+
+void opt_test::testDeadCodeBreakpoints() {
+    const vector<string> lines = {
+        "10 LET A = 1",
+        "20 REM first",
+        "30 REM second",
+        "40 LET A = A + 1",
+        "50 GOTO 70",
+        "60 LET A = 100",
+        "70 PRINT A",
+    };
+    auto tree = newInterpreter();
+    tree->loadProgram(Token::programFromlines(lines));
+    tree->addBreakpoint(30);
+    tree->addBreakpoint(60);
+    // 树解释器执行完REM 30以后停下
+    auto expected = run(*tree, "");
+    QCOMPARE(tree->getStatus().current_line, 30);
+
+    auto interpreter = newOptimized(lines);
+    interpreter->addBreakpoint(30);
+    interpreter->addBreakpoint(60);
+    QCOMPARE(interpreter->getOptimized()->executableLines(), (vector<int>{10, 40, 50, 70}));
+    // 30被删掉了, 由后面的40代表: 执行完40以后停下
+    auto res = run(*interpreter, "");
+    QCOMPARE(interpreter->getStatus().current_line, 40);
+    QCOMPARE(res.vars, (vector<string>{"key: A, value: 2"}));
+    // 60不可达也被删掉了, 由70代表; 继续执行时在70停下, 这时已经输出
+    res = run(*interpreter, "");
+    QCOMPARE(interpreter->getStatus().current_line, 70);
+    QCOMPARE(res.output, string("2"));
+    res = run(*interpreter, "");
+    QCOMPARE(res.err, string{});
+    QCOMPARE(interpreter->getStatus().running, false);
+}
+
+void opt_test::testLoopInvariant() {
+    const vector<string> lines = {
+        "10 LET N = 7",
+        "20 LET I = 0",
+        "30 LET S = 0",
+        "40 LET S = S + N * N + I",
+        "50 LET I = I + 1",
+        "60 IF I < N * 2 THEN 40",
+        "70 PRINT S",
+    };
+    Parser parser(std::make_shared<Token::Tokenizer>());
+    parser.reload(lines);
+    auto program = opt::optimize(parser.getStmts(), only(&opt::Options::licm));
+    // 前置块只从循环外进入, 60的回边仍然到40
+    const vector<string> expected = {
+        "@0 10 LET N = 7",
+        "@1 20 LET I = 0",
+        "@2 30 LET S = 0",
+        "@3 (40) LET %t0 = (N * N)",
+        "@4 (40) LET %t1 = (N * 2)",
+        "@5 40 LET S = ((S + %t0) + I)",
+        "@6 50 LET I = (I + 1)",
+        "@7 60 IF (I < %t1) THEN @5",
+        "@8 70 PRINT S",
+    };
+    QVERIFY2(program->dump() == expected, joined(program->dump()).c_str());
+
+    auto tree = newInterpreter();
+    tree->setASTOutput(false);
+    tree->loadProgram(Token::programFromlines(lines));
+    auto interpreter = newOptimized(lines, only(&opt::Options::licm));
+    auto expected_res = run(*tree, "");
+    auto res = run(*interpreter, "");
+    QVERIFY2(sameResult(expected_res, res), describe(res).c_str());
+    // 临时变量不出现在Env里; 前置块和40算作一步
+    QCOMPARE(res.vars, (vector<string>{"key: I, value: 14", "key: N, value: 7", "key: S, value: 777"}));
+    QCOMPARE(interpreter->getCounters().statements, tree->getCounters().statements);
+
+    // 嵌套循环: 内层外提的表达式在外层仍然不变, 继续外提到外层的前置块
+    parser.reload(vector<string>{
+        "10 LET N = 3",
+        "15 LET S = 0",
+        "20 LET I = 0",
+        "30 LET J = 0",
+        "40 LET S = S + N * 10",
+        "50 LET J = J + 1",
+        "60 IF J < 4 THEN 40",
+        "70 LET I = I + 1",
+        "80 IF I < 5 THEN 30",
+    });
+    program = opt::optimize(parser.getStmts(), only(&opt::Options::licm));
+    const vector<string> nested = {
+        "@0 10 LET N = 3",
+        "@1 15 LET S = 0",
+        "@2 20 LET I = 0",
+        "@3 (30) LET %t1 = (N * 10)",
+        "@4 30 LET J = 0",
+        "@5 (40) LET %t0 = %t1",
+        "@6 40 LET S = (S + %t0)",
+        "@7 50 LET J = (J + 1)",
+        "@8 60 IF (J < 4) THEN @6",
+        "@9 70 LET I = (I + 1)",
+        "@10 80 IF (I < 5) THEN @4",
+    };
+    QVERIFY2(program->dump() == nested, joined(program->dump()).c_str());
+}
+
+void opt_test::testLoopInvariantErrors() {
+    // 40只在I >= 100时执行: 100 / D会除零, Y在循环之后才赋值, 都不能外提
+    const vector<string> guarded = {
+        "10 LET D = 0",
+        "20 LET I = 0",
+        "30 IF I < 100 THEN 50",
+        "40 PRINT 100 / D + Y * 2",
+        "50 LET I = I + 1",
+        "60 IF I < 10 THEN 30",
+        "70 PRINT I",
+        "80 LET Y = 1",
+    };
+    Parser parser(std::make_shared<Token::Tokenizer>());
+    parser.reload(guarded);
+    auto program = opt::optimize(parser.getStmts(), only(&opt::Options::licm));
+    QVERIFY2(program->dump().size() == guarded.size(), joined(program->dump()).c_str());
+    auto res = run(*newOptimized(guarded), "");
+    QCOMPARE(res.output, string("10"));
+    QCOMPARE(res.err, string{});
+
+    // 循环里的除零仍然在原来的行, 原来的时机报错
+    const vector<string> failing = {
+        "10 LET D = 0",
+        "20 LET I = 0",
+        "30 PRINT I * 2",
+        "40 LET Q = 100 / D",
+        "50 LET I = I + 1",
+        "60 IF I < 3 THEN 30",
+    };
+    auto interpreter = newOptimized(failing);
+    res = run(*interpreter, "");
+    QCOMPARE(res.output, string("0"));
+    QVERIFY2(res.err.find("Division by zero") != string::npos, res.err.c_str());
+    QCOMPARE(interpreter->getStatus().error->line_no, 40);
+}
+
+void opt_test::testStrengthReduction() {
+    const vector<string> lines = {
+        "10 LET A = 2 * 3 + -1",
+        "20 LET B = A * 1 + 0",
+        "30 LET C = B - B + A ** 0",
+        "40 PRINT 1 * (A ** 1 - 0) / 1",
+        "50 PRINT Y - Y",
+        "60 PRINT 10 / 0",
+    };
+    Parser parser(std::make_shared<Token::Tokenizer>());
+    parser.reload(lines);
+    auto program = opt::optimize(parser.getStmts(), only(&opt::Options::strength));
+    // Y没有赋值过, Y - Y仍然报错; 除零保持原样
+    const vector<string> expected = {
+        "@0 10 LET A = 5",
+        "@1 20 LET B = A",
+        "@2 30 LET C = 1",
+        "@3 40 PRINT A",
+        "@4 50 PRINT (Y - Y)",
+        "@5 60 PRINT (10 / 0)",
+    };
+    QVERIFY2(program->dump() == expected, joined(program->dump()).c_str());
+    auto tree = newInterpreter();
+    tree->setASTOutput(false);
+    tree->loadProgram(Token::programFromlines(lines));
+    auto expected_res = run(*tree, "");
+    auto res = run(*newOptimized(lines, only(&opt::Options::strength)), "");
+    QVERIFY2(sameResult(expected_res, res), describe(res).c_str());
+    QVERIFY2(res.err.find("var Y not found") != string::npos, res.err.c_str());
+
+    // 闭包里常数的幂, 除法和MOD的特化: X经过回绕覆盖负数, INT_MIN附近和会溢出的幂
+    const vector<string> sweep = {
+        "10 LET X = 0 - 2147483647 - 1",
+        "20 LET S = 0",
+        "30 LET I = 0",
+        "40 LET S = S + X / 7 + X MOD 7 + X / 8 + X MOD 8 + X / 1000 + X MOD 1000",
+        "50 LET S = S + X / 641 + X MOD 641 + X / 1 + X MOD 1 + X ** 2 + X ** 3 + X ** 0",
+        "60 LET S = S + (X / 65536) ** 2 + (X MOD 100) ** 5",
+        "70 LET X = X + 123456791",
+        "80 LET I = I + 1",
+        "90 IF I < 200 THEN 40",
+        "100 PRINT S",
+        "110 INPUT X",
+        "120 PRINT X MOD 8",
+    };
+    tree = newInterpreter();
+    tree->setASTOutput(false);
+    tree->loadProgram(Token::programFromlines(sweep));
+    expected_res = run(*tree, "2.5\n");
+    QVERIFY2(expected_res.err.find("type unmatched") != string::npos, expected_res.err.c_str());
+    for(auto kind: {EngineKind::Closure, EngineKind::Optimized}) {
+        auto interpreter = newInterpreter();
+        interpreter->setASTOutput(false);
+        interpreter->loadProgram(Token::programFromlines(sweep));
+        interpreter->setEngine(kind);
+        res = run(*interpreter, "2.5\n");
+        QVERIFY2(sameResult(expected_res, res), format("tree {}\n  {}", describe(expected_res), describe(res)).c_str());
+    }
+}
+
+void opt_test::testValueRanges() {
+    const vector<string> lines = {
+        "10 LET N = 50",
+        "20 LET I = 1",
+        "30 LET S = 0",
+        "40 LET S = S + 1000 / I + N MOD I + I ** 2",
+        "50 LET I = I + 1",
+        "60 IF I <= N THEN 40",
+        "70 PRINT S",
+        "80 PRINT S / I",
+    };
+    Parser parser(std::make_shared<Token::Tokenizer>());
+    parser.reload(lines);
+    auto program = opt::optimize(parser.getStmts(), only(&opt::Options::ranges));
+    // 循环里I在[1, 50], 循环结束时I > N
+    const vector<string> expected = {
+        "@3 40 (1000 / I): zero check; left [1000, 1000], right [1, 50]",
+        "@3 40 (N MOD I): zero check, sign fix-up; left [50, 50], right [1, 50]",
+        "@3 40 (I ** 2): overflow check; left [1, 50], right [2, 2]",
+        "@7 80 (S / I): zero check; left [-2147483648, 2147483647], right [51, 51]",
+    };
+    QVERIFY2(program->removedChecks() == expected, joined(program->removedChecks()).c_str());
+    auto tree = newInterpreter();
+    tree->setASTOutput(false);
+    tree->loadProgram(Token::programFromlines(lines));
+    auto expected_res = run(*tree, "");
+    auto interpreter = newOptimized(lines, only(&opt::Options::ranges));
+    auto res = run(*interpreter, "");
+    QVERIFY2(sameResult(expected_res, res), describe(res).c_str());
+    QCOMPARE(interpreter->getCounters().statements, tree->getCounters().statements);
+
+    // I经过0, 除零检查不能去掉
+    const vector<string> crossing = {
+        "10 LET I = 0 - 5",
+        "20 IF I = 0 THEN 40",
+        "30 PRINT 100 / I",
+        "40 LET I = I + 1",
+        "50 IF I < 5 THEN 20",
+        "60 PRINT 1 / (I - 5)",
+    };
+    parser.reload(crossing);
+    program = opt::optimize(parser.getStmts(), only(&opt::Options::ranges));
+    QVERIFY2(program->removedChecks().empty(), joined(program->removedChecks()).c_str());
+    interpreter = newOptimized(crossing, only(&opt::Options::ranges));
+    res = run(*interpreter, "");
+    QCOMPARE(res.output, string("-20-25-33-50-100100503325"));
+    QVERIFY2(res.err.find("Division by zero") != string::npos, res.err.c_str());
+    QCOMPARE(interpreter->getStatus().error->line_no, 60);
+}
+
+void opt_test::testCommonSubexpressions() {
+    const vector<string> lines = {
+        "10 LET X = 3",
+        "20 LET A = (X * 2 + 2) * (X * 2 + 2)",
+        "30 PRINT (X * 2 + 2) / 2 - 1",
+        "40 LET X = X + 1",
+        "50 PRINT X * 2 + 2",
+        "60 PRINT (X * 2 + 2) * 3 + A",
+        "70 INPUT A",
+        "80 IF X * 2 > 0 THEN 100",
+        "90 PRINT Q * 2 + Q * 2",
+        "100 PRINT X * 2",
+    };
+    Parser parser(std::make_shared<Token::Tokenizer>());
+    parser.reload(lines);
+    auto program = opt::optimize(parser.getStmts(), only(&opt::Options::cse));
+    // 40重新给X赋值以后是新的表达式; INPUT A不影响X; Q没有赋值, Q * 2可能出错;
+    // IF结束基本块, 100的X * 2在另一个块里
+    const vector<string> expected = {
+        "@0 10 LET X = 3",
+        "@1 (20) LET %t0 = ((X * 2) + 2)",
+        "@2 20 LET A = (%t0 * %t0)",
+        "@3 30 PRINT ((%t0 / 2) - 1)",
+        "@4 40 LET X = (X + 1)",
+        "@5 (50) LET %t2 = (X * 2)",
+        "@6 (50) LET %t1 = (%t2 + 2)",
+        "@7 50 PRINT %t1",
+        "@8 60 PRINT ((%t1 * 3) + A)",
+        "@9 70 INPUT A",
+        "@10 80 IF (%t2 > 0) THEN @12",
+        "@11 90 PRINT ((Q * 2) + (Q * 2))",
+        "@12 100 PRINT (X * 2)",
+    };
+    QVERIFY2(program->dump() == expected, joined(program->dump()).c_str());
+
+    auto tree = newInterpreter();
+    tree->setASTOutput(false);
+    tree->loadProgram(Token::programFromlines(lines));
+    auto expected_res = run(*tree, "5\n");
+    auto interpreter = newOptimized(lines, only(&opt::Options::cse));
+    auto res = run(*interpreter, "5\n");
+    QVERIFY2(sameResult(expected_res, res), describe(res).c_str());
+    QCOMPARE(interpreter->getCounters().statements, tree->getCounters().statements);
+
+    // 跳到第一次出现的语句的边也先经过临时变量
+    const vector<string> loop = {
+        "10 LET I = 0",
+        "20 LET S = 0",
+        "30 LET S = S + (I * I + 1) * (I * I + 1)",
+        "40 LET I = I + 1",
+        "50 IF I < 4 THEN 30",
+        "60 PRINT S",
+    };
+    interpreter = newOptimized(loop, only(&opt::Options::cse));
+    QCOMPARE(interpreter->getOptimized()->dump()[4], string("@4 40 LET I = (I + 1)"));
+    QCOMPARE(interpreter->getOptimized()->dump()[5], string("@5 50 IF (I < 4) THEN @2"));
+    res = run(*interpreter, "");
+    QCOMPARE(res.output, string("130"));
+}
+
+void opt_test::testDeadStores() {
+    const vector<string> lines = {
+        "10 LET A = 1",
+        "20 LET A = 2",
+        "25 LET Q = A",
+        "30 LET B = Q * 3",
+        "35 LET Q = 0",
+        "40 LET T = A + 1",
+        "50 LET B = 7",
+        "60 PRINT B",
+        "70 LET C = 5",
+        "80 INPUT D",
+        "90 LET C = 6",
+        "100 LET E = 1",
+        "110 PRINT 10 / D",
+        "120 LET E = 2",
+    };
+    Parser parser(std::make_shared<Token::Tokenizer>());
+    parser.reload(lines);
+    auto program = opt::optimize(parser.getStmts(), only(&opt::Options::dead_stores));
+    // 25只被跳过的30读; T没有被读, 但结束时可以看到; INPUT暂停和可能出错的110之前的值都能看到
+    const vector<string> expected = {
+        "@0 10 LET A = 1; dead store",
+        "@1 20 LET A = 2",
+        "@2 25 LET Q = A; dead store",
+        "@3 30 LET B = (Q * 3); dead store",
+        "@4 35 LET Q = 0",
+        "@5 40 LET T = (A + 1)",
+        "@6 50 LET B = 7",
+        "@7 60 PRINT B",
+        "@8 70 LET C = 5",
+        "@9 80 INPUT D",
+        "@10 90 LET C = 6",
+        "@11 100 LET E = 1",
+        "@12 110 PRINT (10 / D)",
+        "@13 120 LET E = 2",
+    };
+    QVERIFY2(program->dump() == expected, joined(program->dump()).c_str());
+
+    auto tree = newInterpreter();
+    tree->setASTOutput(false);
+    tree->loadProgram(Token::programFromlines(lines));
+    auto expected_res = run(*tree, "5\n");
+    auto interpreter = newOptimized(lines, only(&opt::Options::dead_stores));
+    auto res = run(*interpreter, "5\n");
+    QVERIFY2(sameResult(expected_res, res), describe(res).c_str());
+    QCOMPARE(interpreter->getCounters().statements, tree->getCounters().statements);
+    QCOMPARE(interpreter->getCounters().var_writes, tree->getCounters().var_writes - 3);
+
+    // 有断点时不跳过: 在40停下时B是30赋的值
+    interpreter = newOptimized(lines, only(&opt::Options::dead_stores));
+    interpreter->addBreakpoint(40);
+    res = run(*interpreter, "");
+    QCOMPARE(interpreter->getStatus().current_line, 40);
+    QCOMPARE(res.vars, (vector<string>{"key: A, value: 2", "key: B, value: 6", "key: Q, value: 0",
+                                       "key: T, value: 3"}));
+}
+
+void opt_test::testJumpThreading() {
+    const vector<string> lines = {
+        "10 LET I = 0",
+        "20 GOTO 60",
+        "30 PRINT I",
+        "40 LET I = I + 1",
+        "50 GOTO 70",
+        "60 GOTO 30",
+        "70 IF I < 3 THEN 90",
+        "80 END",
+        "90 GOTO 100",
+        "100 GOTO 30",
+    };
+    Parser parser(std::make_shared<Token::Tokenizer>());
+    parser.reload(lines);
+    auto program = opt::optimize(parser.getStmts(), only(&opt::Options::threading));
+    // 落在GOTO上的边直接到GOTO串的终点
+    const vector<string> threaded = {
+        "@0 10 LET I = 0; next @2",
+        "@1 20 GOTO @2",
+        "@2 30 PRINT I",
+        "@3 40 LET I = (I + 1); next @6",
+        "@4 50 GOTO @6",
+        "@5 60 GOTO @2",
+        "@6 70 IF (I < 3) THEN @2",
+        "@7 80 END",
+        "@8 90 GOTO @2",
+        "@9 100 GOTO @2",
+    };
+    QVERIFY2(program->dump() == threaded, joined(program->dump()).c_str());
+
+    // 只重排: GOTO的目标接在GOTO后面
+    program = opt::optimize(parser.getStmts(), only(&opt::Options::layout));
+    const vector<string> laid_out = {
+        "@0 10 LET I = 0",
+        "@1 20 GOTO @2",
+        "@2 60 GOTO @3",
+        "@3 30 PRINT I",
+        "@4 40 LET I = (I + 1)",
+        "@5 50 GOTO @6",
+        "@6 70 IF (I < 3) THEN @8",
+        "@7 80 END",
+        "@8 90 GOTO @9",
+        "@9 100 GOTO @3",
+    };
+    QVERIFY2(program->dump() == laid_out, joined(program->dump()).c_str());
+
+    // 两个一起: 循环体连续, 越过的GOTO排在后面
+    auto options = only(&opt::Options::threading);
+    options.layout = true;
+    program = opt::optimize(parser.getStmts(), options);
+    const vector<string> both = {
+        "@0 10 LET I = 0",
+        "@1 30 PRINT I",
+        "@2 40 LET I = (I + 1)",
+        "@3 70 IF (I < 3) THEN @1",
+        "@4 80 END",
+        "@5 20 GOTO @1",
+        "@6 50 GOTO @3",
+        "@7 60 GOTO @1",
+        "@8 90 GOTO @1",
+        "@9 100 GOTO @1",
+    };
+    QVERIFY2(program->dump() == both, joined(program->dump()).c_str());
+
+    auto tree = newInterpreter();
+    tree->setASTOutput(false);
+    tree->loadProgram(Token::programFromlines(lines));
+    auto expected_res = run(*tree, "");
+    auto interpreter = newOptimized(lines, options);
+    auto res = run(*interpreter, "");
+    QVERIFY2(sameResult(expected_res, res), describe(res).c_str());
+    QCOMPARE(res.output, string("012"));
+    // 每次循环少执行50, 90, 100, 开始时少执行20, 60
+    QCOMPARE(interpreter->getCounters().statements, tree->getCounters().statements - 9);
+
+    // 被越过的GOTO上的断点仍然生效
+    interpreter = newOptimized(lines, options);
+    interpreter->addBreakpoint(60);
+    res = run(*interpreter, "");
+    QCOMPARE(interpreter->getStatus().current_line, 60);
+    QCOMPARE(res.vars, (vector<string>{"key: I, value: 0"}));
+}
+
+void opt_test::testInductionVariables() {
+    const vector<string> sum_lines = {
+        "110 INPUT N",
+        "120 LET SUM = 0",
+        "130 LET I = 1",
+        "140 IF I > N THEN 170",
+        "150 LET SUM = SUM + I",
+        "160 LET I = I + 1",
+        "165 GOTO 140",
+        "170 PRINT SUM",
+        "180 END",
+    };
+    Parser parser(std::make_shared<Token::Tokenizer>());
+    parser.reload(sum_lines);
+    auto program = opt::optimize(parser.getStmts(), only(&opt::Options::induction));
+    QCOMPARE(program->dump()[3], string("@3 140 IF (I > N) THEN @7; counted I += 1 while I <= N, closed"));
+
+    auto compare = [](const vector<string>& lines, const string& input, const opt::Options& options) {
+        auto tree = newInterpreter();
+        tree->setASTOutput(false);
+        tree->loadProgram(Token::programFromlines(lines));
+        auto expected = run(*tree, input);
+        auto interpreter = newOptimized(lines, options);
+        auto res = run(*interpreter, input);
+        return std::make_tuple(sameResult(expected, res), describe(expected), describe(res),
+                               interpreter->getCounters().statements);
+    };
+    // 封闭形式: 循环整个在140一步完成
+    auto [same, expected, actual, statements] = compare(sum_lines, "1000\n", only(&opt::Options::induction));
+    QVERIFY2(same, format("{}\n{}", expected, actual).c_str());
+    QVERIFY2(expected.find("500500") != string::npos, expected.c_str());
+    QCOMPARE(statements, uint64_t{6});
+    // 和会超出int: 不用封闭形式, 逐圈执行的结果和树解释器一样(包括回绕)
+    std::tie(same, expected, actual, statements) = compare(sum_lines, "100000\n", only(&opt::Options::induction));
+    QVERIFY2(same, format("{}\n{}", expected, actual).c_str());
+    QCOMPARE(statements, uint64_t{6});
+    // N不是int: 照常执行, 在140报错
+    std::tie(same, expected, actual, statements) = compare(sum_lines, "2.5\n", only(&opt::Options::induction));
+    QVERIFY2(same, format("{}\n{}", expected, actual).c_str());
+
+    // 向下计数, !=, c * I, 在I加步长之后的累加; 所有pass一起
+    const vector<string> down = {
+        "10 LET I = 10",
+        "20 LET S = 0",
+        "30 LET T = 5",
+        "40 LET S = S - 3 * I",
+        "50 LET I = I - 1",
+        "60 LET T = T + I",
+        "70 IF 0 != I THEN 40",
+        "80 PRINT S",
+        "90 PRINT T",
+    };
+    parser.reload(down);
+    program = opt::optimize(parser.getStmts(), only(&opt::Options::induction));
+    QCOMPARE(program->dump()[6], string("@6 70 IF (0 != I) THEN @3; counted I -= 1 while I != 0, closed"));
+    std::tie(same, expected, actual, statements) = compare(down, "", opt::Options{});
+    QVERIFY2(same, format("{}\n{}", expected, actual).c_str());
+    QCOMPARE(statements, uint64_t{9});
+
+    // 循环体不是累加: 逐圈执行; 循环体出错时在同一行停下, 变量和树解释器一样
+    const vector<string> fixed = {
+        "10 LET I = 0",
+        "20 LET P = 1",
+        "30 IF I >= 8 THEN 70",
+        "40 LET P = P * 3 MOD 1000 + 10 / (6 - I)",
+        "50 LET I = I + 1",
+        "60 GOTO 30",
+        "70 PRINT P",
+    };
+    parser.reload(fixed);
+    program = opt::optimize(parser.getStmts(), only(&opt::Options::induction));
+    QCOMPARE(program->dump()[2], string("@2 30 IF (I >= 8) THEN @6; counted I += 1 while I < 8"));
+    std::tie(same, expected, actual, statements) = compare(fixed, "", opt::Options{});
+    QVERIFY2(same, format("{}\n{}", expected, actual).c_str());
+    QVERIFY2(expected.find("Division by zero") != string::npos, expected.c_str());
+    auto interpreter = newOptimized(fixed);
+    run(*interpreter, "");
+    QCOMPARE(interpreter->getStatus().error->line_no, 40);
+
+    // 循环里有PRINT的不是计数循环
+    parser.reload(vector<string>{"10 LET I = 0", "20 PRINT I", "30 LET I = I + 1", "40 IF I < 3 THEN 20"});
+    program = opt::optimize(parser.getStmts(), only(&opt::Options::induction));
+    QCOMPARE(program->dump()[3], string("@3 40 IF (I < 3) THEN @1"));
+
+    // 有断点时逐行执行
+    interpreter = newOptimized(sum_lines, only(&opt::Options::induction));
+    interpreter->addBreakpoint(150);
+    auto res = run(*interpreter, "1000\n");
+    QCOMPARE(interpreter->getStatus().current_line, 150);
+    QCOMPARE(res.vars, (vector<string>{"key: I, value: 1", "key: N, value: 1000", "key: SUM, value: 1"}));
+}
+
+void opt_test::testPassManager() {
+    vector<string> names;
+    for(const auto& pass: opt::passes()) {
+        names.push_back(pass.name);
+    }
+    QCOMPARE(names, (vector<string>{"dead_code", "strength", "licm", "cse", "dead_stores", "induction", "threading",
+                                    "layout", "ranges"}));
+    QCOMPARE(opt::parseLevel("-O1"), std::optional<int>(1));
+    QCOMPARE(opt::parseLevel("O2"), std::optional<int>(2));
+    QCOMPARE(opt::parseLevel("O3"), std::optional<int>());
+    QCOMPARE(opt::parseLevel("DEV"), std::optional<int>());
+    auto enabled = [](const opt::Options& options) {
+        vector<string> res;
+        for(const auto& pass: opt::passes()) {
+            if(options.*pass.enabled) {
+                res.push_back(pass.name);
+            }
+        }
+        return res;
+    };
+    QCOMPARE(enabled(opt::levelOptions(0)), vector<string>{});
+    QCOMPARE(enabled(opt::levelOptions(1)), (vector<string>{"dead_code", "strength", "threading"}));
+    QCOMPARE(enabled(opt::levelOptions(2)), names);
+    QCOMPARE(enabled(opt::passOptions("licm,dead_code")), (vector<string>{"dead_code", "licm"}));
+    QVERIFY_EXCEPTION_THROWN(opt::passOptions("licm,unrolling"), std::runtime_error);
+    QVERIFY_EXCEPTION_THROWN(opt::parseDumpAfter("build,bogus"), std::runtime_error);
+    QVERIFY_EXCEPTION_THROWN(opt::levelOptions(3), std::runtime_error);
+
+    // 每个执行的pass的改动数量, 要求的中间表示
+    const vector<string> lines = {
+        "10 REM start",
+        "20 LET A = 2 * 1",
+        "30 GOTO 50",
+        "40 PRINT 0",
+        "50 PRINT A",
+    };
+    Parser parser(std::make_shared<Token::Tokenizer>());
+    parser.reload(lines);
+    auto options = opt::levelOptions(1);
+    options.dump_after = opt::parseDumpAfter("build,strength");
+    auto program = opt::optimize(parser.getStmts(), options);
+    vector<string> runs;
+    for(const auto& run: program->passRuns()) {
+        QVERIFY(run.us >= 0);
+        runs.push_back(format("{} {}", run.name, run.changes));
+    }
+    // REM和40被删掉; 2 * 1化简成2; 30 GOTO 50被跳过
+    QVERIFY2(runs == (vector<string>{"dead_code 2", "strength 1", "threading 1"}), joined(runs).c_str());
+    const auto& dumps = program->passDumps();
+    QCOMPARE(dumps.size(), size_t{2});
+    QCOMPARE(dumps[0].after, string("build"));
+    QCOMPARE(dumps[0].lines, opt::optimize(parser.getStmts(), opt::levelOptions(0))->dump());
+    QCOMPARE(dumps[1].after, string("strength"));
+    QCOMPARE(dumps[1].lines, (vector<string>{"@0 20 LET A = 2", "@1 30 GOTO @2", "@2 50 PRINT A"}));
+    options.dump_after = {"all"};
+    QCOMPARE(opt::optimize(parser.getStmts(), options)->passDumps().size(), size_t{4});
+
+    auto tree = newInterpreter();
+    tree->setASTOutput(false);
+    tree->loadProgram(Token::programFromlines(lines));
+    auto expected = run(*tree, "");
+    auto interpreter = newOptimized(lines, opt::levelOptions(1));
+    auto res = run(*interpreter, "");
+    QVERIFY2(sameResult(expected, res), describe(res).c_str());
+}
+
+void opt_test::cleanupTestCase() {
+}
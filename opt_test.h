@@ -0,0 +1,33 @@
+//
+// Created by ayanami on 1/2/25.
+//
+#pragma once
+#ifndef OPT_TEST_H
+#define OPT_TEST_H
+
+#include <QTest>
+#include <QObject>
+
+class opt_test: public QObject{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void testMatchesTreeWalker();
+    void testDeadCode();
+    void testDeadCodeBreakpoints();
+    void testLoopInvariant();
+    void testLoopInvariantErrors();
+    void testStrengthReduction();
+    void testValueRanges();
+    void testCommonSubexpressions();
+    void testDeadStores();
+    void testJumpThreading();
+    void testInductionVariables();
+    void testPassManager();
+    void cleanupTestCase();
+};
+
+
+
+#endif //OPT_TEST_H
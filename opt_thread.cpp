@@ -0,0 +1,58 @@
+//
+// Created by ayanami on 1/3/25.
+//
+// 跳转串接: 落在GOTO上的边(顺序执行的next, GOTO/IF的jump)直接改到GOTO串最后的目标, 少执行几步
+// - 目标行不存在的GOTO要在执行到它时报错, 不越过
+// - pass生成的语句和入口不变: 它们和后面的源码语句在同一步执行
+// - 被越过的GOTO行上的断点仍然要生效: 原来的边留在step_next/step_jump里,
+//   有断点或者DEBUG模式时解释器按原来的边逐行执行(Stmt::nextFor/jumpFor)
+//
+
+#include "optimizer.h"
+
+namespace opt {
+
+namespace {
+bool plainGoto(const Stmt& stmt) {
+    return stmt.node->type() == ASTNodeType::GOTOStmt && !stmt.invalid_jump && !stmt.synthetic;
+}
+} // namespace
+
+size_t threadJumps(Program& program) {
+    auto& stmts = program.getStmts();
+    // GOTO串的终点; 只有GOTO的环(死循环)停在环里
+    auto resolve = [&](size_t t) {
+        std::set<size_t> seen;
+        while(t != NO_STMT && plainGoto(stmts[t]) && seen.insert(t).second) {
+            t = stmts[t].jump;
+        }
+        return t;
+    };
+    size_t threaded = 0;
+    for(auto& stmt: stmts) {
+        if(stmt.synthetic) {
+            continue;
+        }
+        const auto type = stmt.node->type();
+        auto next = stmt.next;
+        auto jump = stmt.jump;
+        if(type != ASTNodeType::GOTOStmt && type != ASTNodeType::EndStmt) {
+            next = resolve(next);
+        }
+        if((type == ASTNodeType::GOTOStmt || type == ASTNodeType::IFStmt) && !stmt.invalid_jump) {
+            jump = resolve(jump);
+        }
+        if(next == stmt.next && jump == stmt.jump) {
+            continue;
+        }
+        stmt.threaded = true;
+        stmt.step_next = stmt.next;
+        stmt.step_jump = stmt.jump;
+        threaded += (next != stmt.next ? 1 : 0) + (jump != stmt.jump ? 1 : 0);
+        stmt.next = next;
+        stmt.jump = jump;
+    }
+    return threaded;
+}
+
+} // namespace opt
@@ -0,0 +1,568 @@
+//
+// Created by ayanami on 1/2/25.
+//
+
+#include "optimizer.h"
+#include <algorithm>
+#include <chrono>
+#include <iterator>
+#include <optional>
+#include <fmt/format.h>
+
+namespace opt {
+using Token::TokenType;
+
+namespace {
+template<typename T>
+T* typed(T* node, ASTNode* from) {
+    node->setStaticType(from->getStaticType());
+    return node;
+}
+
+std::string opString(TokenType op) {
+    switch(op) {
+    case TokenType::OP_MOD:
+        return "MOD";
+    case TokenType::OP_EQ:
+        return "=";
+    default:
+        return Token::tk2Str(op);
+    }
+}
+} // namespace
+
+ASTNode* clone(ASTNode* node) {
+    switch(node->type()) {
+    case ASTNodeType::Num: {
+        const auto& v = node->getValRef();
+        if(auto i = std::any_cast<int>(&v)) {
+            return typed(new NumNode(*i), node);
+        }
+        return typed(new NumNode(std::any_cast<double>(v)), node);
+    }
+    case ASTNodeType::String:
+        return typed(new StringNode(static_cast<StringNode*>(node)->getString()), node);
+    case ASTNodeType::Var:
+        return typed(new VarNode(static_cast<VarNode*>(node)->getName()), node);
+    case ASTNodeType::BinOp: {
+        auto bin = static_cast<BinOpNode*>(node);
+        return typed(new BinOpNode(clone(bin->getLeft()), clone(bin->getRight()), bin->getOp()), node);
+    }
+    case ASTNodeType::UnaryOp: {
+        auto unary = static_cast<UnaryOpNode*>(node);
+        return typed(new UnaryOpNode(clone(unary->getExpr()), unary->getOp()), node);
+    }
+    case ASTNodeType::AssignStmt: {
+        auto assign = static_cast<AssignStmtNode*>(node);
+        return typed(new AssignStmtNode(static_cast<VarNode*>(clone(assign->getLeft())), clone(assign->getRight())),
+                     node);
+    }
+    case ASTNodeType::GOTOStmt:
+        return typed(new GOTOStmtNode(static_cast<GOTOStmtNode*>(node)->getLineNo()), node);
+    case ASTNodeType::EndStmt:
+        return typed(new EndStmtNode(), node);
+    case ASTNodeType::PrintStmt:
+        return typed(new PrintStmtNode(clone(static_cast<PrintStmtNode*>(node)->getExpr())), node);
+    case ASTNodeType::InputStmt:
+        return typed(new InputStmtNode(static_cast<VarNode*>(clone(static_cast<InputStmtNode*>(node)->getVar()))),
+                     node);
+    case ASTNodeType::IFStmt: {
+        auto if_stmt = static_cast<IFStmtNode*>(node);
+        return typed(new IFStmtNode(clone(if_stmt->getCond()), if_stmt->getNext()), node);
+    }
+    case ASTNodeType::RemStmt:
+        return typed(new RemStmtNode(static_cast<RemStmtNode*>(node)->getComment()), node);
+    case ASTNodeType::FusedStmt:
+        return clone(static_cast<FusedStmtNode*>(node)->getOriginal());
+    default:
+        throw std::runtime_error(fmt::format("clone: unsupported node {}", ast2Str(node->type())));
+    }
+}
+
+std::string exprString(ASTNode* node) {
+    switch(node->type()) {
+    case ASTNodeType::Num: {
+        const auto& v = node->getValRef();
+        if(auto i = std::any_cast<int>(&v)) {
+            return fmt::format("{}", *i);
+        }
+        return fmt::format("{}", std::any_cast<double>(v));
+    }
+    case ASTNodeType::String:
+        return fmt::format("\"{}\"", static_cast<StringNode*>(node)->getString());
+    case ASTNodeType::Var:
+        return static_cast<VarNode*>(node)->getName();
+    case ASTNodeType::BinOp: {
+        auto bin = static_cast<BinOpNode*>(node);
+        return fmt::format("({} {} {})", exprString(bin->getLeft()), opString(bin->getOp()),
+                           exprString(bin->getRight()));
+    }
+    case ASTNodeType::UnaryOp: {
+        auto unary = static_cast<UnaryOpNode*>(node);
+        return fmt::format("{}{}", opString(unary->getOp()), exprString(unary->getExpr()));
+    }
+    default:
+        return node->toString();
+    }
+}
+
+ASTNode* stmtExpr(ASTNode* stmt) {
+    switch(stmt->type()) {
+    case ASTNodeType::AssignStmt:
+        return static_cast<AssignStmtNode*>(stmt)->getRight();
+    case ASTNodeType::PrintStmt:
+        return static_cast<PrintStmtNode*>(stmt)->getExpr();
+    case ASTNodeType::IFStmt:
+        return static_cast<IFStmtNode*>(stmt)->getCond();
+    default:
+        return nullptr;
+    }
+}
+
+void setStmtExpr(ASTNode* stmt, ASTNode* expr) {
+    switch(stmt->type()) {
+    case ASTNodeType::AssignStmt:
+        static_cast<AssignStmtNode*>(stmt)->setRight(expr);
+        break;
+    case ASTNodeType::PrintStmt:
+        static_cast<PrintStmtNode*>(stmt)->setExpr(expr);
+        break;
+    case ASTNodeType::IFStmt:
+        static_cast<IFStmtNode*>(stmt)->setCond(expr);
+        break;
+    default:
+        break;
+    }
+}
+
+void readVars(ASTNode* expr, std::set<std::string>& vars) {
+    switch(expr->type()) {
+    case ASTNodeType::Var:
+        vars.insert(static_cast<VarNode*>(expr)->getName());
+        break;
+    case ASTNodeType::BinOp:
+        readVars(static_cast<BinOpNode*>(expr)->getLeft(), vars);
+        readVars(static_cast<BinOpNode*>(expr)->getRight(), vars);
+        break;
+    case ASTNodeType::UnaryOp:
+        readVars(static_cast<UnaryOpNode*>(expr)->getExpr(), vars);
+        break;
+    default:
+        break;
+    }
+}
+
+const std::string* assignedVar(ASTNode* stmt) {
+    if(stmt->type() == ASTNodeType::AssignStmt) {
+        return &static_cast<AssignStmtNode*>(stmt)->getLeft()->getName();
+    }
+    if(stmt->type() == ASTNodeType::InputStmt) {
+        return &static_cast<InputStmtNode*>(stmt)->getVar()->getName();
+    }
+    return nullptr;
+}
+
+std::vector<std::set<std::string>> definitelyAssigned(const Program& program) {
+    const auto& stmts = program.getStmts();
+    // nullopt: 还没有到达(全集)
+    std::vector<std::optional<std::set<std::string>>> in(stmts.size());
+    std::vector<size_t> work;
+    if(program.getEntry() != NO_STMT) {
+        in[program.getEntry()] = std::set<std::string>{};
+        work.push_back(program.getEntry());
+    }
+    while(!work.empty()) {
+        const auto i = work.back();
+        work.pop_back();
+        auto out = *in[i];
+        if(auto name = assignedVar(stmts[i].node.get())) {
+            out.insert(*name);
+        }
+        for(const auto s: {stmts[i].next, stmts[i].jump}) {
+            if(s == NO_STMT) {
+                continue;
+            }
+            if(!in[s]) {
+                in[s] = out;
+            } else {
+                std::set<std::string> meet;
+                std::ranges::set_intersection(*in[s], out, std::inserter(meet, meet.end()));
+                if(meet == *in[s]) {
+                    continue;
+                }
+                in[s] = std::move(meet);
+            }
+            work.push_back(s);
+        }
+    }
+    std::vector<std::set<std::string>> res(stmts.size());
+    for(size_t i = 0; i < stmts.size(); ++i) {
+        if(in[i]) {
+            res[i] = std::move(*in[i]);
+        }
+    }
+    return res;
+}
+
+bool cannotFail(ASTNode* node, const std::set<std::string>& defined) {
+    const auto type = node->getStaticType();
+    const bool numeric = type == StaticType::Int || type == StaticType::Double;
+    switch(node->type()) {
+    case ASTNodeType::Num:
+        return true;
+    case ASTNodeType::Var:
+        return numeric && defined.contains(static_cast<VarNode*>(node)->getName());
+    case ASTNodeType::UnaryOp:
+        return numeric && cannotFail(static_cast<UnaryOpNode*>(node)->getExpr(), defined);
+    case ASTNodeType::BinOp: {
+        auto bin = static_cast<BinOpNode*>(node);
+        if(!numeric || !cannotFail(bin->getLeft(), defined) || !cannotFail(bin->getRight(), defined)) {
+            return false;
+        }
+        if(bin->getOp() != TokenType::OP_DIV && bin->getOp() != TokenType::OP_MOD) {
+            return true;
+        }
+        // double的除数不会是常数; 整数: 除零报错, INT_MIN / -1溢出
+        auto divisor = bin->getRight();
+        if(type != StaticType::Int || divisor->type() != ASTNodeType::Num) {
+            return false;
+        }
+        auto i = std::any_cast<int>(&divisor->getValRef());
+        return i != nullptr && *i != 0 && *i != -1;
+    }
+    default:
+        return false;
+    }
+}
+
+std::unique_ptr<Program> Program::build(const std::map<int, ASTNode*>& ast) {
+    auto program = std::make_unique<Program>();
+    std::map<int, size_t> index;
+    for(const auto& [line, node]: ast) {
+        if(node == nullptr) {
+            throw std::runtime_error(fmt::format("optimize: line {} has no statement", line));
+        }
+        index[line] = program->stmts.size();
+        program->source_lines.push_back(line);
+        program->stmts.push_back(Stmt{.line = line, .node = std::unique_ptr<ASTNode>(clone(node))});
+    }
+    auto& stmts = program->stmts;
+    for(size_t i = 0; i < stmts.size(); ++i) {
+        auto& stmt = stmts[i];
+        const size_t following = i + 1 < stmts.size() ? i + 1 : NO_STMT;
+        const auto type = stmt.node->type();
+        if(type == ASTNodeType::GOTOStmt || type == ASTNodeType::IFStmt) {
+            stmt.target = type == ASTNodeType::GOTOStmt ? static_cast<GOTOStmtNode*>(stmt.node.get())->getLineNo()
+                                                        : static_cast<IFStmtNode*>(stmt.node.get())->getNext();
+            if(stmt.target == stmt.line) {
+                stmt.jump = following; // 和interpret_SingleStep一致, 跳到自己等于没有跳转
+            } else if(auto it = index.find(stmt.target); it != index.end()) {
+                stmt.jump = it->second;
+            } else {
+                stmt.invalid_jump = true;
+            }
+        }
+        if(type != ASTNodeType::GOTOStmt && type != ASTNodeType::EndStmt) {
+            stmt.next = following;
+        }
+    }
+    program->entry = stmts.empty() ? NO_STMT : 0;
+    return program;
+}
+
+void Program::erase(const std::vector<bool>& keep) {
+    std::vector<size_t> moved(stmts.size(), NO_STMT);
+    size_t n = 0;
+    for(size_t i = 0; i < stmts.size(); ++i) {
+        if(keep[i]) {
+            moved[i] = n++;
+        }
+    }
+    auto remap = [&](size_t i) {
+        return i == NO_STMT ? NO_STMT : moved[i];
+    };
+    std::vector<Stmt> kept;
+    kept.reserve(n);
+    for(size_t i = 0; i < stmts.size(); ++i) {
+        if(!keep[i]) {
+            continue;
+        }
+        auto& stmt = kept.emplace_back(std::move(stmts[i]));
+        stmt.next = remap(stmt.next);
+        stmt.jump = remap(stmt.jump);
+        stmt.step_next = remap(stmt.step_next);
+        stmt.step_jump = remap(stmt.step_jump);
+    }
+    entry = remap(entry);
+    stmts = std::move(kept);
+}
+
+void Program::reorder(const std::vector<size_t>& order) {
+    std::vector<size_t> moved(stmts.size(), NO_STMT);
+    for(size_t k = 0; k < order.size(); ++k) {
+        moved[order[k]] = k;
+    }
+    auto remap = [&](size_t i) {
+        return i == NO_STMT ? NO_STMT : moved[i];
+    };
+    std::vector<Stmt> placed;
+    placed.reserve(stmts.size());
+    for(const auto i: order) {
+        auto& stmt = placed.emplace_back(std::move(stmts[i]));
+        stmt.next = remap(stmt.next);
+        stmt.jump = remap(stmt.jump);
+        stmt.step_next = remap(stmt.step_next);
+        stmt.step_jump = remap(stmt.step_jump);
+    }
+    entry = remap(entry);
+    stmts = std::move(placed);
+}
+
+size_t Program::insert(size_t at, std::vector<Stmt> added) {
+    const auto k = added.size();
+    auto shift = [&](size_t i) {
+        return i != NO_STMT && i >= at ? i + k : i;
+    };
+    for(auto& stmt: stmts) {
+        stmt.next = shift(stmt.next);
+        stmt.jump = shift(stmt.jump);
+        stmt.step_next = shift(stmt.step_next);
+        stmt.step_jump = shift(stmt.step_jump);
+    }
+    entry = shift(entry);
+    for(size_t j = 0; j < k; ++j) {
+        added[j].next = at + j + 1;
+    }
+    stmts.insert(stmts.begin() + static_cast<std::ptrdiff_t>(at), std::make_move_iterator(added.begin()),
+                 std::make_move_iterator(added.end()));
+    return at;
+}
+
+std::string Program::newTemp() {
+    return fmt::format("{}t{}", SymbolTable::HIDDEN_PREFIX, temps++);
+}
+
+void Program::addFact(std::set<const ASTNode*> closure::Facts::* kind, const ASTNode* node) {
+    (facts.*kind).insert(node);
+}
+
+void Program::addRemovedCheck(std::string note) {
+    removed_checks.push_back(std::move(note));
+}
+
+void Program::finish() {
+    std::map<int, ASTNode*> by_index;
+    for(size_t i = 0; i < stmts.size(); ++i) {
+        by_index.emplace(static_cast<int>(i), stmts[i].node.get());
+    }
+    code = closure::compile(by_index, facts);
+    represented.clear();
+    auto executable = executableLines();
+    for(const auto line: source_lines) {
+        // 被删掉的行由后面第一个仍然执行的行代表
+        auto it = std::ranges::lower_bound(executable, line);
+        if(it != executable.end() && *it != line) {
+            represented[*it].push_back(line);
+        }
+    }
+}
+
+bool Program::breakAt(const std::set<int>& breakpoints, int line) const {
+    if(breakpoints.contains(line)) {
+        return true;
+    }
+    auto it = represented.find(line);
+    return it != represented.end() && std::ranges::any_of(it->second, [&](int l) {
+        return breakpoints.contains(l);
+    });
+}
+
+std::vector<int> Program::executableLines() const {
+    std::set<int> lines;
+    for(const auto& stmt: stmts) {
+        lines.insert(stmt.line);
+    }
+    return {lines.begin(), lines.end()};
+}
+
+std::vector<std::string> Program::dump() const {
+    std::vector<std::string> res;
+    for(size_t i = 0; i < stmts.size(); ++i) {
+        const auto& stmt = stmts[i];
+        auto node = stmt.node.get();
+        auto target = stmt.invalid_jump ? fmt::format("{}?", stmt.target)
+                    : stmt.jump == NO_STMT ? std::string("END") : fmt::format("@{}", stmt.jump);
+        std::string text;
+        switch(node->type()) {
+        case ASTNodeType::AssignStmt: {
+            auto assign = static_cast<AssignStmtNode*>(node);
+            text = fmt::format("LET {} = {}", assign->getLeft()->getName(), exprString(assign->getRight()));
+            break;
+        }
+        case ASTNodeType::GOTOStmt:
+            text = "GOTO " + target;
+            break;
+        case ASTNodeType::EndStmt:
+            text = "END";
+            break;
+        case ASTNodeType::PrintStmt:
+            text = "PRINT " + exprString(static_cast<PrintStmtNode*>(node)->getExpr());
+            break;
+        case ASTNodeType::InputStmt:
+            text = "INPUT " + static_cast<InputStmtNode*>(node)->getVar()->getName();
+            break;
+        case ASTNodeType::IFStmt:
+            text = fmt::format("IF {} THEN {}", exprString(static_cast<IFStmtNode*>(node)->getCond()), target);
+            break;
+        case ASTNodeType::RemStmt:
+            text = "REM " + static_cast<RemStmtNode*>(node)->getComment();
+            break;
+        default:
+            text = exprString(node);
+            break;
+        }
+        auto line = stmt.synthetic ? fmt::format("@{} ({}) {}", i, stmt.line, text)
+                                   : fmt::format("@{} {} {}", i, stmt.line, text);
+        const auto following = i + 1 < stmts.size() ? i + 1 : NO_STMT;
+        const auto type = node->type();
+        if(type != ASTNodeType::GOTOStmt && type != ASTNodeType::EndStmt && stmt.next != following) {
+            line += stmt.next == NO_STMT ? "; next END" : fmt::format("; next @{}", stmt.next);
+        }
+        if(stmt.dead_store) {
+            line += "; dead store";
+        }
+        if(const auto& loop = stmt.counted) {
+            line += fmt::format("; counted {} {}= {} while {} {} {}{}", loop->iv, loop->step < 0 ? '-' : '+',
+                                std::abs(static_cast<int64_t>(loop->step)), loop->iv, opString(loop->cmp),
+                                loop->bound_var.empty() ? std::to_string(loop->bound) : loop->bound_var,
+                                loop->closed ? ", closed" : "");
+        }
+        res.push_back(line);
+    }
+    return res;
+}
+
+const std::vector<Pass>& passes() {
+    static const std::vector<Pass> all = {
+        {"dead_code", &Options::dead_code, eliminateDeadCode},
+        {"strength", &Options::strength, simplifyArithmetic},
+        {"licm", &Options::licm, hoistLoopInvariants},
+        {"cse", &Options::cse, eliminateCommonSubexpressions},
+        {"dead_stores", &Options::dead_stores, markDeadStores},
+        {"induction", &Options::induction, recognizeCountedLoops},
+        {"threading", &Options::threading, threadJumps},
+        {"layout", &Options::layout, layoutHotPath},
+        {"ranges", &Options::ranges, eliminateChecks},
+    };
+    return all;
+}
+
+Options levelOptions(int level) {
+    if(level < 0 || level > MAX_LEVEL) {
+        throw std::runtime_error(fmt::format("Invalid optimization level {}", level));
+    }
+    if(level == MAX_LEVEL) {
+        return {};
+    }
+    Options options;
+    for(const auto& pass: passes()) {
+        options.*pass.enabled = false;
+    }
+    if(level == 1) {
+        options.dead_code = true;
+        options.strength = true;
+        options.threading = true;
+    }
+    return options;
+}
+
+std::optional<int> parseLevel(std::string_view text) {
+    if(text.starts_with('-')) {
+        text.remove_prefix(1);
+    }
+    if(text.size() != 2 || (text[0] != 'O' && text[0] != 'o') || text[1] < '0' || text[1] > '0' + MAX_LEVEL) {
+        return std::nullopt;
+    }
+    return text[1] - '0';
+}
+
+namespace {
+std::vector<std::string> splitList(std::string_view list) {
+    std::vector<std::string> names;
+    while(!list.empty()) {
+        const auto comma = list.find(',');
+        auto name = list.substr(0, comma);
+        if(!name.empty()) {
+            names.emplace_back(name);
+        }
+        list = comma == std::string_view::npos ? std::string_view{} : list.substr(comma + 1);
+    }
+    return names;
+}
+
+const Pass& findPass(const std::string& name) {
+    auto it = std::ranges::find(passes(), name, &Pass::name);
+    if(it == passes().end()) {
+        throw std::runtime_error(fmt::format("Unknown pass {}", name));
+    }
+    return *it;
+}
+} // namespace
+
+Options passOptions(std::string_view list) {
+    auto options = levelOptions(0);
+    for(const auto& name: splitList(list)) {
+        if(name != "none") {
+            options.*findPass(name).enabled = true;
+        }
+    }
+    return options;
+}
+
+std::set<std::string> parseDumpAfter(std::string_view list) {
+    std::set<std::string> names;
+    for(const auto& name: splitList(list)) {
+        if(name == "none") {
+            continue;
+        }
+        if(name != "all" && name != "build") {
+            findPass(name);
+        }
+        names.insert(name);
+    }
+    return names;
+}
+
+void Program::addPassRun(PassRun run) {
+    pass_runs.push_back(std::move(run));
+}
+
+void Program::addPassDump(std::string after) {
+    pass_dumps.push_back({std::move(after), dump()});
+}
+
+std::unique_ptr<Program> optimize(const std::map<int, ASTNode*>& ast, const Options& options) {
+    auto program = Program::build(ast);
+    auto dumped = [&options](const std::string& name) {
+        return options.dump_after.contains(name) || options.dump_after.contains("all");
+    };
+    if(dumped("build")) {
+        program->addPassDump("build");
+    }
+    for(const auto& pass: passes()) {
+        if(!(options.*pass.enabled)) {
+            continue;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        const auto changes = pass.run(*program);
+        const std::chrono::duration<double, std::micro> spent = std::chrono::steady_clock::now() - start;
+        program->addPassRun({pass.name, changes, spent.count()});
+        if(dumped(pass.name)) {
+            program->addPassDump(pass.name);
+        }
+    }
+    program->finish();
+    return program;
+}
+
+} // namespace opt
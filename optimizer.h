@@ -0,0 +1,232 @@
+//
+// Created by ayanami on 1/2/25.
+//
+// 优化引擎(EngineKind::Optimized)使用的程序表示和优化pass
+// - 加载时把parser的AST复制成按执行顺序排列的语句数组, 每条语句记录源码行号,
+//   顺序执行的下一条(next)和跳转目标(jump)都是数组下标, pass可以自由删除, 插入, 重排语句
+// - 源码视图(Parser, 源码行号)不变: DEBUG输出, 断点, 错误信息都按源码行号
+// - 语句编译成闭包(closure_engine.h)执行, 按下标调度, 不再按行号查找
+// - 程序重新加载时丢弃, 和Closure/JIT一样
+//
+#pragma once
+#ifndef OPTIMIZER_H
+#define OPTIMIZER_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <optional>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "closure_engine.h"
+#include "parser.h"
+
+namespace opt {
+
+constexpr size_t NO_STMT = SIZE_MAX; // 作为next/jump时表示程序结束
+
+// 计数循环(opt_indvar.cpp), 挂在循环的出口测试IF上: 到达时快进到最后一次测试
+using Counted = struct Counted {
+    // 累加: var = var + sign * 项, 项是scale * iv, constant或者invariant中的一个
+    using Sum = struct Sum {
+        std::string var;
+        int sign = 1;
+        int scale = 0;
+        int constant = 0;
+        std::string invariant;
+        bool after_step = false;     // 在iv加step之后执行, 读到的iv多一个step
+    };
+    std::string iv;                  // 归纳变量, 每圈只被LET iv = iv + step赋值一次
+    int step = 0;
+    Token::TokenType cmp = Token::TokenType::OP_LT; // 继续循环的条件: iv cmp bound
+    std::string bound_var;           // 循环里不赋值的变量, 为空时是常数bound
+    int bound = 0;
+    bool on_jump = false;            // IF跳转时继续循环, 否则不跳转时继续
+    bool closed = false;             // 循环里其它的LET都是累加, 用封闭形式; 否则逐圈执行循环体
+    std::vector<Sum> sums;
+};
+
+using Stmt = struct Stmt {
+    int line = 0;                    // 源码行号
+    std::unique_ptr<ASTNode> node;   // 复制的AST, GOTO/IF节点里的目标行只用于显示
+    size_t next = NO_STMT;           // 不跳转时的下一条; GOTO和END没有
+    size_t jump = NO_STMT;           // GOTO/IF跳转的目标
+    bool invalid_jump = false;       // 目标行不存在: 跳转时报错"line N no exist", 和树解释器一致
+    int target = 0;                  // 跳转的源码目标行
+    bool synthetic = false;          // pass生成的语句(比如循环前置块), 不跳转, 和后面的源码语句在同一步执行
+    bool dead_store = false;         // 赋的值不会被观察到: 没有断点也不是DEBUG模式时跳过
+    // 跳转串接(opt_thread.cpp)越过了GOTO: 有断点或者DEBUG模式时按原来的边逐行执行
+    bool threaded = false;
+    size_t step_next = NO_STMT;
+    size_t step_jump = NO_STMT;
+    std::unique_ptr<Counted> counted; // 没有断点也不是DEBUG模式时快进
+
+    [[nodiscard]] size_t nextFor(bool stepwise) const {
+        return stepwise && threaded ? step_next : next;
+    }
+    [[nodiscard]] size_t jumpFor(bool stepwise) const {
+        return stepwise && threaded ? step_jump : jump;
+    }
+};
+
+using Options = struct Options {
+    bool dead_code = true;           // 删除REM和不可达的语句(opt_dce.cpp)
+    bool licm = true;                // 循环不变表达式外提(opt_licm.cpp)
+    bool strength = true;            // 常数折叠, 代数化简(opt_strength.cpp)
+    bool cse = true;                 // 公共子表达式消除(opt_cse.cpp)
+    bool dead_stores = true;         // 标记值不会被观察到的赋值(opt_dse.cpp)
+    bool induction = true;           // 识别计数循环, 快进到最后一次测试(opt_indvar.cpp)
+    bool threading = true;           // 跳过GOTO串(opt_thread.cpp)
+    bool layout = true;              // 按顺序执行的路径重排语句(opt_layout.cpp)
+    bool ranges = true;              // 值域分析, 去掉证明不需要的运行时检查(opt_range.cpp)
+    // 执行完这些pass以后把dump()记到Program::passDumps(): pass的名字(passes()), "build"是还没有执行pass时,
+    // "all"是build和每个执行的pass
+    std::set<std::string> dump_after;
+};
+
+// pass管理: optimize按passes()的顺序执行options里打开的pass, 记录每个pass的耗时和改动数量
+using PassRun = struct PassRun {
+    std::string name;
+    size_t changes = 0;              // pass的返回值
+    double us = 0;                   // 墙钟时间
+};
+using PassDump = struct PassDump {
+    std::string after;               // pass的名字或者"build"
+    std::vector<std::string> lines;  // Program::dump()
+};
+
+class Program {
+    std::vector<Stmt> stmts;
+    size_t entry = NO_STMT;
+    std::vector<int> source_lines;
+    std::map<int, std::vector<int>> represented; // 执行的源码行 -> 它之前被删掉的源码行
+    std::shared_ptr<closure::Program> code;
+    size_t temps = 0;
+    closure::Facts facts;                 // 按AST节点的地址记录, 所以值域分析是最后一个pass
+    std::vector<std::string> removed_checks;
+    std::vector<PassRun> pass_runs;
+    std::vector<PassDump> pass_dumps;
+public:
+    // 按行号顺序复制AST(融合节点复制原来的语句); 跳到自己所在的行等于执行下一行
+    // throws: std::runtime_error 遇到不支持的节点
+    static std::unique_ptr<Program> build(const std::map<int, ASTNode*>& ast);
+    [[nodiscard]] std::vector<Stmt>& getStmts() {
+        return stmts;
+    }
+    [[nodiscard]] const std::vector<Stmt>& getStmts() const {
+        return stmts;
+    }
+    [[nodiscard]] size_t getEntry() const {
+        return entry;
+    }
+    void setEntry(size_t e) {
+        entry = e;
+    }
+    // 删除keep[i] == false的语句, 保留的语句和entry不能再指向它们
+    void erase(const std::vector<bool>& keep);
+    // 重新排列语句: 新的第k条是原来的order[k], order是一个排列
+    void reorder(const std::vector<size_t>& order);
+    // 在at之前插入依次顺序执行, 最后到达at的语句, 返回第一条的下标(就是at);
+    // 原来指向at的next/jump/entry仍然指向at原来的语句, 由调用方决定是否改到插入的语句
+    size_t insert(size_t at, std::vector<Stmt> added);
+    // 新的临时变量名, 以SymbolTable::HIDDEN_PREFIX开头
+    std::string newTemp();
+    // 编译闭包时去掉node的一种检查
+    void addFact(std::set<const ASTNode*> closure::Facts::* kind, const ASTNode* node);
+    void addRemovedCheck(std::string note);
+    // 值域分析去掉的运行时检查, 每个一行: "@5 40 (S / I): zero check; I in [1, 99]"
+    [[nodiscard]] const std::vector<std::string>& removedChecks() const {
+        return removed_checks;
+    }
+    void addPassRun(PassRun run);
+    // 记录现在的dump()
+    void addPassDump(std::string after);
+    // 按执行顺序
+    [[nodiscard]] const std::vector<PassRun>& passRuns() const {
+        return pass_runs;
+    }
+    // Options::dump_after要求的中间表示, 按执行顺序
+    [[nodiscard]] const std::vector<PassDump>& passDumps() const {
+        return pass_dumps;
+    }
+    // pass都执行完以后调用: 编译闭包, 计算断点的映射
+    void finish();
+    [[nodiscard]] const closure::Program& getCode() const {
+        return *code;
+    }
+    // 执行line时是否在断点停下: line本身, 或者line之前被删掉, 由line代表的行上有断点
+    [[nodiscard]] bool breakAt(const std::set<int>& breakpoints, int line) const;
+    // 仍然被执行的源码行, 升序
+    [[nodiscard]] std::vector<int> executableLines() const;
+    // 每条语句一行: "@3 20 IF SUM > N THEN @9", 顺序执行的下一条不是紧跟着的语句时加上"; next @N",
+    // pass生成的语句的行号加括号: "@2 (17) LET %t0 = (N * N)", 跳过的赋值加上"; dead store",
+    // 计数循环的出口测试加上"; counted I += 1 while I <= N"(封闭形式再加上", closed")
+    [[nodiscard]] std::vector<std::string> dump() const;
+};
+
+// 复制表达式或语句, 调用方拥有返回的节点
+// throws: std::runtime_error 遇到不支持的节点
+ASTNode* clone(ASTNode* node);
+// BASIC语法的表达式, 二元运算都加括号
+std::string exprString(ASTNode* node);
+
+// LET的右边, PRINT的表达式, IF的条件; 其它语句返回nullptr
+ASTNode* stmtExpr(ASTNode* stmt);
+// 把stmtExpr换成expr, 不释放原来的表达式
+void setStmtExpr(ASTNode* stmt, ASTNode* expr);
+// 表达式读的变量加到vars里
+void readVars(ASTNode* expr, std::set<std::string>& vars);
+// 语句赋值的变量(LET, INPUT), 没有时返回nullptr
+const std::string* assignedVar(ASTNode* stmt);
+// 每条语句执行之前, 从入口来的所有路径上都已经赋过值的变量; 到不了的语句是空集
+std::vector<std::set<std::string>> definitelyAssigned(const Program& program);
+// 求值一定成功: 类型推导为Int/Double, 变量都在defined里, 整数除法和MOD的除数是非零(也不是-1)的常数
+bool cannotFail(ASTNode* node, const std::set<std::string>& defined);
+
+// 计数循环还要继续的圈数, 按table里变量现在的值算; 变量不都是int, 循环不会结束或者iv会溢出时返回nullopt
+std::optional<int64_t> tripCount(const Counted& loop, const SymbolTable& table);
+// 用封闭形式把trips圈之后的值写到table; 中间的项或者部分和会超出int时返回false, 不改变table
+bool applyClosedForm(const Counted& loop, SymbolTable& table, int64_t trips);
+
+// 每个pass返回改动的数量
+size_t eliminateDeadCode(Program& program);
+size_t hoistLoopInvariants(Program& program);
+size_t eliminateCommonSubexpressions(Program& program);
+size_t markDeadStores(Program& program);
+size_t recognizeCountedLoops(Program& program);
+size_t threadJumps(Program& program);
+size_t layoutHotPath(Program& program);
+size_t simplifyArithmetic(Program& program);
+size_t eliminateChecks(Program& program);
+
+using Pass = struct Pass {
+    std::string name;                // Options里开关的字段名
+    bool Options::* enabled;
+    size_t (*run)(Program&);
+};
+// 所有pass, 按执行顺序; 值域分析在最后: 它记录的事实按AST节点的地址, 之后不能再改表达式
+const std::vector<Pass>& passes();
+
+// 优化级别: O0是树解释器(不用优化引擎), O1只做不需要数据流分析的pass(死代码, 代数化简, 跳转串接),
+// O2是全部pass(Options的默认值)
+constexpr int MAX_LEVEL = 2;
+// O0对应的Options关掉所有pass, 由调用方改用树解释器
+// throws: std::runtime_error 级别不在0..MAX_LEVEL
+Options levelOptions(int level);
+// "O2", "-O2" -> 2; 不是级别时返回nullopt
+std::optional<int> parseLevel(std::string_view text);
+// 逗号分隔的pass名: 只打开这些pass; "none"是都不打开
+// throws: std::runtime_error 未知的pass名
+Options passOptions(std::string_view list);
+// 逗号分隔的pass名, "build"或者"all", 用作Options::dump_after; "none"是空集
+// throws: std::runtime_error 未知的名字
+std::set<std::string> parseDumpAfter(std::string_view list);
+
+// 按options执行pass, 然后finish()
+std::unique_ptr<Program> optimize(const std::map<int, ASTNode*>& ast, const Options& options);
+
+} // namespace opt
+
+#endif // OPTIMIZER_H
@@ -3,6 +3,9 @@
 //
 
 #include "parser.h"
+#include "fusion.h"
+#include "type_infer.h"
+#include "cfg.h"
 NumNode* Parser::parseNum() {
     auto token = tokenizer->peek();
     if(token.type != Token::TokenType::NUM) {
@@ -236,6 +239,50 @@ void Parser::parseProgram() {
             throw std::runtime_error("Failed to parse line: " + std::to_string(line_no));
         }
     }
+    if(jump_check) {
+        checkJumps();
+    }
+    if(type_inference) {
+        type_infer::annotate(stmts);
+    }
+    if(fusion) {
+        fuseStmts();
+    }
+}
+void Parser::checkJumps() const {
+    const auto graph = cfg::Graph::build(stmts);
+    const auto& invalid = graph.invalidJumps();
+    if(invalid.empty()) {
+        return;
+    }
+    for(const auto& [line, target]: invalid) {
+        print("Invalid jump at line {}: line {} no exist\n", line, target);
+    }
+    throw std::runtime_error(fmt::format("Invalid jump at line {}: line {} no exist", invalid.front().line,
+                                         invalid.front().target));
+}
+void Parser::fuseStmts() {
+    for(auto& [line_no, stmt]: stmts) {
+        stmt = fusion::fuse(stmt);
+    }
+}
+void Parser::setTypeInference(bool enable) {
+    type_inference = enable;
+    if(enable) {
+        type_infer::annotate(stmts);
+    } else {
+        type_infer::clear(stmts);
+    }
+}
+void Parser::setFusion(bool enable) {
+    fusion = enable;
+    if(enable) {
+        fuseStmts();
+        return;
+    }
+    for(auto& [line_no, stmt]: stmts) {
+        stmt = fusion::unfuse(stmt);
+    }
 }
 using fmt::print;
 using fmt::format;
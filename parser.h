@@ -5,15 +5,21 @@
 
 #ifndef PARSER_H
 #define PARSER_H
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 #include <fmt/core.h>
 #include <map>
 #include <unordered_map>
 #include <any>
+#include <atomic>
 #include <optional>
 #include <variant>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
 #include <iostream>
 #include "tokenizer.h"
 using std::string;
@@ -25,11 +31,40 @@ using std::unordered_map;
 // QBasic 不支持函数所以暂时没有stack frame
 class SymbolTable {
 private:
-    unordered_map<string, std::any> symbols;
+    // 透明hash: 可以直接用string_view(比如.qbc里的变量名)查找, 不用先构造string
+    using StringHash = struct StringHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const {
+            return std::hash<std::string_view>{}(s);
+        }
+    };
+    unordered_map<string, std::any, StringHash, std::equal_to<>> symbols;
+    // 每个表实例和每次clear()都是新的generation, 缓存了值地址的一方(闭包引擎)据此判断地址是否还有效
+    uint64_t generation = nextGeneration();
+    static uint64_t nextGeneration() {
+        static std::atomic<uint64_t> counter{0};
+        return ++counter;
+    }
 public:
+    // 以它开头的名字不是合法的BASIC变量名, 留给优化生成的临时变量, 不出现在printSymbols/getRepl里
+    static constexpr char HIDDEN_PREFIX = '%';
+    SymbolTable() = default;
+    SymbolTable(const SymbolTable& other): symbols(other.symbols) {}
+    SymbolTable& operator=(const SymbolTable& other) {
+        symbols = other.symbols;
+        generation = nextGeneration();
+        return *this;
+    }
+    // returns true if key is newly inserted
+    // 变量已经存在时原地赋值, 对int/double不会分配内存
     template<typename T>
-    void set(const string& key, const T& value) {
-        symbols[key] = value;
+    bool set(std::string_view key, const T& value) {
+        if(auto it = symbols.find(key); it != symbols.end()) {
+            it->second = value;
+            return false;
+        }
+        symbols.emplace(string(key), value);
+        return true;
     }
     template<typename T>
     bool setIfExist(const string& key, const T& value) {
@@ -50,6 +85,19 @@ public:
         }
         return std::any_cast<T>(it->second);
     }
+    // 借用表中的值, 不存在时返回nullptr
+    // 节点地址在插入时不变, 指针在clear()(generation变化)之前有效, 值可能被set改写
+    [[nodiscard]] const std::any* find(std::string_view key) const {
+        auto it = symbols.find(key);
+        return it == symbols.end() ? nullptr : &it->second;
+    }
+    [[nodiscard]] std::any* find(std::string_view key) {
+        auto it = symbols.find(key);
+        return it == symbols.end() ? nullptr : &it->second;
+    }
+    [[nodiscard]] uint64_t getGeneration() const {
+        return generation;
+    }
     SymbolTable copy() {
         SymbolTable new_table;
         for(const auto [key, value]: symbols) {
@@ -57,11 +105,12 @@ public:
         }
         return new_table;
     }
-    bool contains(const string& key) const {
+    bool contains(std::string_view key) const {
         return symbols.contains(key);
     }
     void clear() {
         symbols.clear();
+        generation = nextGeneration();
     }
     // TODO: support types
     // 没有反射的丑态, 只能自己做个简易版本
@@ -69,6 +118,9 @@ public:
     void printSymbols() {
 
         for(const auto& [key, value]: symbols) {
+            if(key.starts_with(HIDDEN_PREFIX)) {
+                continue;
+            }
             if(util::ConvAny<int>(value)) {
                 print("key: {}, value: {}\n", key, std::any_cast<int>(value));
             } else if (util::ConvAny<string>(value)) {
@@ -83,6 +135,9 @@ public:
     vector<string> getRepl() const {
         vector<string> res;
         for(const auto& [key, value]: symbols) {
+            if(key.starts_with(HIDDEN_PREFIX)) {
+                continue;
+            }
             string s;
             if(util::ConvAny<int>(value)) {
                 s = fmt::format("key: {}, value: {}", key, std::any_cast<int>(value));
@@ -115,8 +170,10 @@ enum class ASTNodeType {
     InputStmt,
     IFStmt,
     RemStmt,
+    FusedStmt,
     NoOp,
 };
+constexpr size_t AST_NODE_TYPE_COUNT = static_cast<size_t>(ASTNodeType::NoOp) + 1;
 inline string ast2Str(ASTNodeType type) {
     return std::string(NAMEOF_ENUM(type));
 }
@@ -152,8 +209,54 @@ inline string ast2Str(ASTNodeType type) {
 //             throw std::runtime_error("ast2Str: Invalid ASTNodeType");
 //     }
 // }
+class ASTNode;
+class NumNode;
+class StringNode;
+class DataNode;
+class BinOpNode;
+class UnaryOpNode;
+class VarNode;
+class AssignStmtNode;
+class GOTOStmtNode;
+class EndStmtNode;
+class PrintStmtNode;
+class InputStmtNode;
+class IFStmtNode;
+class RemStmtNode;
+class FusedStmtNode;
+// 双分派: ASTNode::accept 直接调用对应的visit_XXX, 求值时不需要type()分支和dynamic_cast
+class NodeVisitor {
+public:
+    virtual ~NodeVisitor() = default;
+    virtual void visit(ASTNode* node) = 0;
+    virtual void visit_NumNode(NumNode* node) = 0;
+    virtual void visit_StringNode(StringNode* node) = 0;
+    virtual void visit_DataNode(DataNode* node) = 0;
+    virtual void visit_VarNode(VarNode* node) = 0;
+    virtual void visit_BinOp(BinOpNode* node) = 0;
+    virtual void visit_UnaryOp(UnaryOpNode* node) = 0;
+    virtual void visit_AssignStmtNode(AssignStmtNode* node) = 0;
+    virtual void visit_GOTOStmtNode(GOTOStmtNode* node) = 0;
+    virtual void visit_EndStmtNode(EndStmtNode* node) = 0;
+    virtual void visit_PrintStmtNode(PrintStmtNode* node) = 0;
+    virtual void visit_InputStmtNode(InputStmtNode* node) = 0;
+    virtual void visit_IFStmtNode(IFStmtNode* node) = 0;
+    virtual void visit_RemStmtNode(RemStmtNode* node) = 0;
+    // 默认按原来的语句执行, 只有Interpreter实现了融合后的快速路径
+    virtual void visit_FusedStmtNode(FusedStmtNode* node);
+};
+// 类型推导(type_infer.h)的结果: Unknown表示求值一定失败(变量从未被赋值, 类型不匹配)
+// Dynamic表示运行时才知道; 默认是Dynamic, 执行通用的路径
+enum class StaticType: uint8_t {
+    Unknown,
+    Int,
+    Double,
+    String,
+    Dynamic,
+};
 class ASTNode {
     std::any value {};
+    StaticType static_type = StaticType::Dynamic;
 public:
     virtual ~ASTNode() = default;
     ASTNode() = default;
@@ -163,32 +266,49 @@ public:
     [[nodiscard]] virtual std::any getVal() const {
         return value;
     }
+    // 不复制地读取节点上的值(VarNode的值在Env里, 不能用这个)
+    [[nodiscard]] const std::any& getValRef() const {
+        return value;
+    }
+    [[nodiscard]] StaticType getStaticType() const {
+        return static_type;
+    }
+    void setStaticType(StaticType t) {
+        static_type = t;
+    }
     virtual ASTNodeType type() = 0;
+    virtual void accept(NodeVisitor& visitor) = 0;
     virtual string toString() = 0;
     virtual vector<string> toTabbedString() = 0;
 
 };
 using NumType = std::variant<int, double>;
-// throws std::runtime_error
-inline NumType str2Number(const std::string& str) {
-    try {
-        size_t pos;
-        int intValue = std::stoi(str, &pos);
-        if (pos == str.size()) {
-            return intValue;
+// 和std::stoi/std::stod的接受范围一致(前导空白, 正负号, 科学计数法), 但不抛异常:
+// 先按int解析, 不是完整的int再按double解析; 不合法或者超出范围时返回nullopt
+inline std::optional<NumType> tryStr2Number(const std::string& str) {
+    const char* begin = str.c_str();
+    char* end = nullptr;
+    errno = 0;
+    const long l = std::strtol(begin, &end, 10);
+    if(end != begin) {
+        if(errno == ERANGE || l < INT_MIN || l > INT_MAX) {
+            return std::nullopt;
         }
-    } catch (const std::invalid_argument&) {
-        // Ignore and try to parse as double
-    }
-
-    try {
-        size_t pos;
-        double doubleValue = std::stod(str, &pos);
-        if (pos == str.size()) {
-            return doubleValue;
+        if(end == begin + str.size()) {
+            return static_cast<int>(l);
         }
-    } catch (const std::invalid_argument&) {
-        // Ignore and throw error
+    }
+    errno = 0;
+    const double d = std::strtod(begin, &end);
+    if(end == begin || errno == ERANGE || end != begin + str.size()) {
+        return std::nullopt;
+    }
+    return d;
+}
+// throws std::runtime_error
+inline NumType str2Number(const std::string& str) {
+    if(auto num = tryStr2Number(str)) {
+        return num.value();
     }
     throw std::runtime_error("Invalid number format: " + str);
 }
@@ -212,6 +332,9 @@ public:
     ASTNodeType type() override {
         return ASTNodeType::Num;
     }
+    void accept(NodeVisitor& visitor) override {
+        visitor.visit_NumNode(this);
+    }
     string toString() override {
         auto num = getVal();
         if(util::ConvAny<int>(num)) {
@@ -245,6 +368,9 @@ public:
     ASTNodeType type() override {
             return ASTNodeType::String;
     }
+    void accept(NodeVisitor& visitor) override {
+        visitor.visit_StringNode(this);
+    }
     string toString() override {
             return std::any_cast<string>(getVal());
     }
@@ -264,6 +390,9 @@ public:
     ASTNodeType type() override {
         return ASTNodeType::Data;
     }
+    void accept(NodeVisitor& visitor) override {
+        visitor.visit_DataNode(this);
+    }
     string toString() override {
             return "Data";
     }
@@ -311,6 +440,9 @@ public:
     ASTNodeType type() override {
         return ASTNodeType::BinOp;
     }
+    void accept(NodeVisitor& visitor) override {
+        visitor.visit_BinOp(this);
+    }
     string toString() override {
         return fmt::format("BinOpNode: {} {} {}", left->toString(),  tk2Str(op), right->toString());
     }
@@ -347,6 +479,9 @@ public:
     ASTNodeType type() override {
             return ASTNodeType::UnaryOp;
     }
+    void accept(NodeVisitor& visitor) override {
+        visitor.visit_UnaryOp(this);
+    }
     // getter setter
     ASTNode* getExpr() {
             return expr;
@@ -379,7 +514,10 @@ public:
     ASTNodeType type() override {
             return ASTNodeType::Var;
     }
-    [[nodiscard]] string getName() const {
+    void accept(NodeVisitor& visitor) override {
+        visitor.visit_VarNode(this);
+    }
+    [[nodiscard]] const string& getName() const {
             return name;
     }
     string toString() override {
@@ -412,6 +550,9 @@ public:
     ASTNodeType type() override {
         return ASTNodeType::AssignStmt;
     }
+    void accept(NodeVisitor& visitor) override {
+        visitor.visit_AssignStmtNode(this);
+    }
     string toString() override {
             return fmt::format("AssignStmtNode: {} = {}", left->toString(), right->toString());
     }
@@ -454,6 +595,9 @@ public:
     ASTNodeType type() override {
         return ASTNodeType::GOTOStmt;
     }
+    void accept(NodeVisitor& visitor) override {
+        visitor.visit_GOTOStmtNode(this);
+    }
     string toString() override {
             return fmt::format("GOTOStmtNode: GOTO {}", line_no);
     }
@@ -475,6 +619,9 @@ public:
     ASTNodeType type() override {
         return ASTNodeType::EndStmt;
     }
+    void accept(NodeVisitor& visitor) override {
+        visitor.visit_EndStmtNode(this);
+    }
     string toString() override {
             return "EndStmtNode";
     }
@@ -494,6 +641,9 @@ public:
     ASTNodeType type() override {
         return ASTNodeType::PrintStmt;
     }
+    void accept(NodeVisitor& visitor) override {
+        visitor.visit_PrintStmtNode(this);
+    }
     string toString() override {
             return fmt::format("PrintStmtNode: PRINT {}", expr->toString());
     }
@@ -530,6 +680,9 @@ public:
     ASTNodeType type() override {
             return ASTNodeType::InputStmt;
     }
+    void accept(NodeVisitor& visitor) override {
+        visitor.visit_InputStmtNode(this);
+    }
     VarNode* getVar() {
         return var;
     }
@@ -566,9 +719,15 @@ public:
     ASTNode* setCond() {
         return cond;
     }
+    void setCond(ASTNode* c) {
+        cond = c;
+    }
     ASTNodeType type() override {
             return ASTNodeType::IFStmt;
     }
+    void accept(NodeVisitor& visitor) override {
+        visitor.visit_IFStmtNode(this);
+    }
 
     [[nodiscard]] int getNext() const {
         return next_if_match;
@@ -595,29 +754,111 @@ public:
     ASTNodeType type() override {
         return ASTNodeType::RemStmt;
     }
+    void accept(NodeVisitor& visitor) override {
+        visitor.visit_RemStmtNode(this);
+    }
     string toString() override {
             return fmt::format("REM: {}", comment);
     }
+    [[nodiscard]] const string& getComment() const {
+        return comment;
+    }
     vector<string> toTabbedString() override {
         vector<string> res{"REM", "\t"+comment};
         return res;
     }
 };
 
+// 融合语句: parse之后由fusion::fuse把常见形状的语句替换成它, 一次分派执行完整条语句, 不产生中间值
+// - Assign: LET X = Y op Z / LET X = Y op c   (op: + - *)
+// - Branch: IF Y cmp Z THEN n / IF Y cmp c THEN n
+// 持有原来的语句: 显示(toString/toTabbedString)和操作数不是int时的回退都用它
+enum class FusedKind {
+    Assign,
+    Branch,
+};
+class FusedStmtNode: public ASTNode {
+    ASTNode* original;
+    FusedKind kind;
+    Token::TokenType op;
+    string target;  // Assign: 被赋值的变量
+    int next = -1;  // Branch: 条件成立时跳转的行
+    string left;
+    string right;   // 为空时右操作数是constant
+    int constant = 0;
+public:
+    FusedStmtNode(AssignStmtNode* assign, Token::TokenType op, string left, string right, int constant):
+    original(assign), kind(FusedKind::Assign), op(op), target(assign->getLeft()->getName()),
+    left(std::move(left)), right(std::move(right)), constant(constant) {}
+    FusedStmtNode(IFStmtNode* branch, Token::TokenType op, string left, string right, int constant):
+    original(branch), kind(FusedKind::Branch), op(op), next(branch->getNext()),
+    left(std::move(left)), right(std::move(right)), constant(constant) {}
+    ~FusedStmtNode() override {
+        delete original;
+    }
+    ASTNodeType type() override {
+        return ASTNodeType::FusedStmt;
+    }
+    void accept(NodeVisitor& visitor) override {
+        visitor.visit_FusedStmtNode(this);
+    }
+    string toString() override {
+        return original->toString();
+    }
+    vector<string> toTabbedString() override {
+        return original->toTabbedString();
+    }
+    [[nodiscard]] ASTNode* getOriginal() const {
+        return original;
+    }
+    // 交出原来的语句, 之后只能delete这个节点
+    ASTNode* release() {
+        auto o = original;
+        original = nullptr;
+        return o;
+    }
+    [[nodiscard]] FusedKind getKind() const {
+        return kind;
+    }
+    [[nodiscard]] Token::TokenType getOp() const {
+        return op;
+    }
+    [[nodiscard]] const string& getTarget() const {
+        return target;
+    }
+    [[nodiscard]] int getNext() const {
+        return next;
+    }
+    [[nodiscard]] const string& getLeftVar() const {
+        return left;
+    }
+    [[nodiscard]] bool rightIsVar() const {
+        return !right.empty();
+    }
+    [[nodiscard]] const string& getRightVar() const {
+        return right;
+    }
+    [[nodiscard]] int getConstant() const {
+        return constant;
+    }
+};
+inline void NodeVisitor::visit_FusedStmtNode(FusedStmtNode* node) {
+    visit(node->getOriginal());
+}
+
 inline bool belongsDataNode(ASTNodeType type) {
     return type == ASTNodeType::Num || type == ASTNodeType::String |
         type == ASTNodeType::Var | type == ASTNodeType::Data;
 }
-class NodeVisitor {
-public:
-    virtual ~NodeVisitor() = default;
-    virtual void visit(ASTNode* node) = 0;
-};
-
 class Parser {
 private:
     std::shared_ptr<Token::Tokenizer> tokenizer;
     std::map<int, ASTNode*> stmts; // based on line_no
+    bool fusion = false;
+    bool type_inference = true;
+    bool jump_check = false;
+    void fuseStmts();
+    void checkJumps() const;
 public:
     explicit Parser(std::shared_ptr<Token::Tokenizer> tokenizer):
     tokenizer(tokenizer) {
@@ -651,11 +892,31 @@ public:
     [[nodiscard]] auto getSortedSrc() const {
         return tokenizer->getSortedSrc();
     }
-    [[nodiscard]] auto getStmts() {
+    [[nodiscard]] const auto& getStmts() const {
         return stmts;
     }
     void printAST(int line_no) const;
     void printAST(ASTNode* root) const;
+    /**
+     * 打开/关闭语句融合(fusion.h): 立即作用于已经解析的语句, 打开时之后每次parse完也会融合
+     */
+    void setFusion(bool enable);
+    [[nodiscard]] bool getFusion() const {
+        return fusion;
+    }
+    // 解析后的类型推导(type_infer.h), 关闭时所有表达式都是Dynamic
+    void setTypeInference(bool enable);
+    [[nodiscard]] bool getTypeInference() const {
+        return type_inference;
+    }
+    // 开启后parseProgram用控制流图(cfg.h)检查跳转目标, 目标行不存在时抛出std::runtime_error,
+    // 而不是运行到这一行才报错
+    void setJumpCheck(bool enable) {
+        jump_check = enable;
+    }
+    [[nodiscard]] bool getJumpCheck() const {
+        return jump_check;
+    }
 
     /**
      * 重新加载程序, 重新解析
@@ -680,6 +941,11 @@ public:
         tokenizer->reload(std::move(program));
         this->parseProgram();
     }
+    // 只保留源码用于显示, 不解析
+    void setSource(Token::BasicProgram&& program) {
+        stmts.clear();
+        tokenizer->setSource(std::move(program));
+    }
     [[nodiscard]] vector<string> getTabbedAST(int line_no) const {
         return stmts.at(line_no)->toTabbedString();
     }
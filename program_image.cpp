@@ -0,0 +1,130 @@
+//
+// Created by ayanami on 12/23/24.
+//
+
+#include "program_image.h"
+
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fmt/core.h>
+
+namespace qbc {
+
+uint64_t hashSource(std::string_view text) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for(const auto c: text) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+std::string readSource(const std::filesystem::path& path) {
+    std::ifstream ifs(path, std::ios::binary);
+    if(!ifs.is_open()) {
+        throw std::runtime_error(fmt::format("Failed to open file: {}", path.string()));
+    }
+    std::stringstream ss;
+    ss << ifs.rdbuf();
+    return ss.str();
+}
+
+std::vector<std::string> splitLines(std::string_view text) {
+    std::vector<std::string> lines;
+    size_t begin = 0;
+    while(begin < text.size()) {
+        auto end = text.find('\n', begin);
+        if(end == std::string_view::npos) {
+            end = text.size();
+        }
+        lines.emplace_back(text.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    return lines;
+}
+
+std::filesystem::path imagePathFor(const std::filesystem::path& source) {
+    auto p = source;
+    p += ".qbc";
+    return p;
+}
+
+CompiledProgram::~CompiledProgram() {
+    if(mapped) {
+        munmap(mapped, mapped_size);
+    }
+}
+
+std::shared_ptr<const CompiledProgram> CompiledProgram::fromBuffer(std::vector<std::byte>&& bytes) {
+    if(auto err = ProgramView::validate(bytes.data(), bytes.size())) {
+        throw std::runtime_error(fmt::format("Invalid compiled program: {}", err.value()));
+    }
+    std::shared_ptr<CompiledProgram> program(new CompiledProgram());
+    program->owned = std::move(bytes);
+    program->program_view = ProgramView(program->owned.data(), program->owned.size());
+    return program;
+}
+
+std::shared_ptr<const CompiledProgram> CompiledProgram::mapFile(const std::filesystem::path& path,
+                                                                uint64_t source_hash) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+        return nullptr;
+    }
+    struct stat st{};
+    if(fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(Header))) {
+        close(fd);
+        return nullptr;
+    }
+    auto size = static_cast<size_t>(st.st_size);
+    void* addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED) {
+        return nullptr;
+    }
+    std::shared_ptr<CompiledProgram> program(new CompiledProgram());
+    program->mapped = addr;
+    program->mapped_size = size;
+    if(auto err = ProgramView::validate(addr, size)) {
+        fmt::print("[image] {}: {}, recompile\n", path.string(), err.value());
+        return nullptr;
+    }
+    program->program_view = ProgramView(addr, size);
+    if(program->program_view.header().source_hash != source_hash) {
+        fmt::print("[image] {}: source changed, recompile\n", path.string());
+        return nullptr;
+    }
+    return program;
+}
+
+bool writeImage(const std::filesystem::path& path, const ProgramView& view) {
+    auto tmp = path;
+    tmp += fmt::format(".tmp{}", getpid());
+    {
+        std::ofstream ofs(tmp, std::ios::binary | std::ios::trunc);
+        if(!ofs.is_open()) {
+            return false;
+        }
+        auto bytes = view.bytes();
+        ofs.write(reinterpret_cast<const char*>(bytes.data()), static_cast<std::streamsize>(bytes.size()));
+        if(!ofs.good()) {
+            ofs.close();
+            std::error_code ec;
+            std::filesystem::remove(tmp, ec);
+            return false;
+        }
+    }
+    std::error_code ec;
+    std::filesystem::rename(tmp, path, ec);
+    if(ec) {
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+    return true;
+}
+
+} // namespace qbc
@@ -0,0 +1,61 @@
+//
+// Created by ayanami on 12/23/24.
+//
+// .qbc 镜像文件: 编译后的程序写在源文件旁边(fib.bas -> fib.bas.qbc), 以源码内容的hash为key
+// 加载时只读mmap, 通过校验后直接在映射的内存上执行; hash/版本不匹配或者文件损坏时重新编译
+//
+#pragma once
+#ifndef PROGRAM_IMAGE_H
+#define PROGRAM_IMAGE_H
+
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "compiled_program.h"
+
+namespace qbc {
+
+// FNV-1a 64
+uint64_t hashSource(std::string_view text);
+
+// 整个文件读成字符串; throws: std::runtime_error
+std::string readSource(const std::filesystem::path& path);
+
+// 按行切分, 和std::getline的行为一致
+std::vector<std::string> splitLines(std::string_view text);
+
+std::filesystem::path imagePathFor(const std::filesystem::path& source);
+
+// 编译结果的所有者: 堆上的buffer或者只读mmap的文件, 对外只提供ProgramView
+class CompiledProgram {
+    std::vector<std::byte> owned;
+    void* mapped = nullptr;
+    size_t mapped_size = 0;
+    ProgramView program_view;
+    CompiledProgram() = default;
+public:
+    ~CompiledProgram();
+    CompiledProgram(const CompiledProgram&) = delete;
+    CompiledProgram& operator=(const CompiledProgram&) = delete;
+
+    // throws: std::runtime_error 镜像不合法
+    static std::shared_ptr<const CompiledProgram> fromBuffer(std::vector<std::byte>&& bytes);
+    // 文件不存在, 校验失败, 或者source_hash不匹配时返回nullptr
+    static std::shared_ptr<const CompiledProgram> mapFile(const std::filesystem::path& path, uint64_t source_hash);
+
+    [[nodiscard]] const ProgramView& view() const {
+        return program_view;
+    }
+    [[nodiscard]] bool isMapped() const {
+        return mapped != nullptr;
+    }
+};
+
+// 先写临时文件再rename, 不会留下写了一半的镜像; 失败返回false(比如目录只读), 不影响运行
+bool writeImage(const std::filesystem::path& path, const ProgramView& view);
+
+} // namespace qbc
+
+#endif // PROGRAM_IMAGE_H
@@ -0,0 +1,118 @@
+//
+// Created by ayanami on 12/29/24.
+//
+
+#include "tiered.h"
+#include "interpreter.h"
+
+namespace tier {
+
+Region* Manager::regionOf(int line_no) {
+    auto it = regions.upper_bound(line_no);
+    if(it == regions.begin()) {
+        return nullptr;
+    }
+    --it;
+    return it->second.last >= line_no ? &it->second : nullptr;
+}
+
+Tier Manager::tierOf(int line_no) const {
+    auto it = regions.upper_bound(line_no);
+    if(it == regions.begin() || (--it)->second.last < line_no) {
+        return Tier::Interpreted;
+    }
+    return it->second.native ? Tier::Native : Tier::Closure;
+}
+
+void Manager::step(Interpreter& interpreter, int line_no) {
+    auto* region = regionOf(line_no);
+    if(region == nullptr) {
+        interpreter.visit(interpreter.parser->getStmts().at(line_no));
+        profile(interpreter, line_no, true);
+        return;
+    }
+    stats.compiled_steps++;
+    // 持有一份引用: INPUT等待时区域可能被丢掉
+    auto native = region->native;
+    auto closures = region->closures;
+    if(!native || !native->runNative(interpreter, line_no)) {
+        closure::Frame frame{interpreter, *interpreter.env->symbol_table};
+        closures->run(frame, line_no);
+    }
+    if(native && region == regionOf(line_no) && native->bailouts() >= thresholds.bailouts) {
+        region->native.reset();
+        region->speculate = false;
+        stats.type_deopts++;
+        print("[tier] lines {}-{}: native code bailed out {} times, use closures\n", region->first, region->last,
+              native->bailouts());
+    }
+    profile(interpreter, line_no, false);
+}
+
+void Manager::profile(Interpreter& interpreter, int line_no, bool interpreted) {
+    const int next = interpreter.status.next_line;
+    if(next != line_no && next > 0 && next < line_no) {
+        auto* region = regionOf(line_no);
+        if(region == nullptr || next < region->first) {
+            if(++backedges[{line_no, next}] >= thresholds.backedge) {
+                promote(interpreter, next, line_no);
+                return;
+            }
+        }
+    }
+    if(interpreted && ++line_counts[line_no] >= thresholds.line) {
+        promote(interpreter, line_no, line_no);
+    }
+}
+
+void Manager::promote(Interpreter& interpreter, int first, int last) {
+    // 和已有的区域重叠时合并成一个区域
+    bool speculate = true;
+    auto it = regions.upper_bound(last);
+    auto begin = it;
+    while(begin != regions.begin() && std::prev(begin)->second.last >= first) {
+        --begin;
+        first = std::min(first, begin->second.first);
+        last = std::max(last, begin->second.last);
+        speculate = speculate && begin->second.speculate;
+    }
+    const auto& breakpoints = interpreter.status.breakpoints;
+    if(auto bp = breakpoints.lower_bound(first); bp != breakpoints.end() && *bp <= last) {
+        return; // 删除断点以后再编译
+    }
+    const auto& stmts = interpreter.parser->getStmts();
+    const std::map<int, ASTNode*> lines(stmts.lower_bound(first), stmts.upper_bound(last));
+    if(lines.empty()) {
+        return;
+    }
+    Region region{first, last, closure::compile(lines), nullptr, speculate};
+    if(speculate && jit::available()) {
+        region.native = jit::compile(lines);
+        if(region.native->nativeCount() == 0) {
+            region.native.reset();
+        }
+    }
+    regions.erase(begin, it);
+    print("[tier] promote lines {}-{} ({})\n", first, last, region.native ? "native" : "closure");
+    regions.emplace(first, std::move(region));
+    stats.promotions++;
+}
+
+void Manager::deoptimize(int line_no) {
+    auto it = regions.upper_bound(line_no);
+    if(it == regions.begin() || std::prev(it)->second.last < line_no) {
+        return;
+    }
+    --it;
+    print("[tier] deoptimize lines {}-{}\n", it->second.first, it->second.last);
+    regions.erase(it);
+    stats.breakpoint_deopts++;
+}
+
+void Manager::clear() {
+    line_counts.clear();
+    backedges.clear();
+    regions.clear();
+}
+
+} // namespace tier
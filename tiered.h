@@ -0,0 +1,93 @@
+//
+// Created by ayanami on 12/29/24.
+//
+// 分层执行: 程序先由树解释器执行(没有编译开销), 同时统计每行的执行次数和向后跳转
+// - 一行执行超过Thresholds::line次, 这一行成为热区域
+// - 一条向后跳转(source -> target, target < source)执行超过Thresholds::backedge次, [target, source]成为热区域
+// - 热区域编译成闭包(closure_engine.h)和本机代码(jit.h): int表达式执行本机代码, 其余语句执行闭包
+// - 本机代码回退(操作数不是int等)超过Thresholds::bailouts次后放弃类型假设, 区域只用闭包
+// - 区域内设置断点时整个区域退回树解释器, 有断点的区域不会被编译
+// 语句之间的状态(ProgramStatus, 当前行, Env)由Interpreter维护, 换层不影响它们;
+// 每一层的输出, 错误和PerfCounters都和树解释器一致
+//
+#pragma once
+#ifndef TIERED_H
+#define TIERED_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include "closure_engine.h"
+#include "jit.h"
+#include "parser.h"
+
+class Interpreter;
+
+namespace tier {
+
+using Thresholds = struct Thresholds {
+    uint32_t line = 1000;
+    uint32_t backedge = 100;
+    uint32_t bailouts = 16;
+};
+
+enum class Tier {
+    Interpreted,
+    Closure,
+    Native, // 本机代码 + 闭包
+};
+
+// [first, last]之间的所有语句
+using Region = struct Region {
+    int first = 0;
+    int last = 0;
+    std::shared_ptr<const closure::Program> closures;
+    std::shared_ptr<jit::Program> native; // nullptr: 没有int表达式或者已经放弃类型假设
+    bool speculate = true;                // false: 类型假设失败过, 重新编译时也不生成本机代码
+};
+
+using Stats = struct Stats {
+    uint64_t promotions = 0;        // 编译的区域数(包括合并后重新编译)
+    uint64_t breakpoint_deopts = 0; // 因为断点退回树解释器的区域数
+    uint64_t type_deopts = 0;       // 放弃类型假设的区域数
+    uint64_t compiled_steps = 0;    // 在编译好的区域里执行的语句数
+};
+
+class Manager {
+    Thresholds thresholds;
+    std::unordered_map<int, uint32_t> line_counts;
+    std::map<std::pair<int, int>, uint32_t> backedges; // (source, target)
+    std::map<int, Region> regions;                     // first -> region, 互不重叠
+    Stats stats;
+    Region* regionOf(int line_no);
+    void profile(Interpreter& interpreter, int line_no, bool interpreted);
+    void promote(Interpreter& interpreter, int first, int last);
+public:
+    explicit Manager(Thresholds t = {}): thresholds(t) {}
+    // 执行line_no(必须存在于parser中), 并更新统计; 可能在执行之后编译新的区域
+    void step(Interpreter& interpreter, int line_no);
+    // line_no所在的区域退回树解释器
+    void deoptimize(int line_no);
+    // 程序改变: 丢掉所有区域和统计
+    void clear();
+    void setThresholds(Thresholds t) {
+        thresholds = t;
+    }
+    [[nodiscard]] const Thresholds& getThresholds() const {
+        return thresholds;
+    }
+    [[nodiscard]] Tier tierOf(int line_no) const;
+    [[nodiscard]] const std::map<int, Region>& getRegions() const {
+        return regions;
+    }
+    [[nodiscard]] const Stats& getStats() const {
+        return stats;
+    }
+};
+
+} // namespace tier
+
+#endif // TIERED_H
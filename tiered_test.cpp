@@ -0,0 +1,202 @@
+//
+// Created by ayanami on 12/29/24.
+//
+
+#include "tiered_test.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "tiered.h"
+#include "workload_gen.h"
+#include "engine_test_util.h"
+using std::vector;
+using std::string;
+using fmt::format;
+using namespace engine_test;
+
+namespace {
+// 阈值很低, 几次循环以后就会编译
+constexpr tier::Thresholds eager{.line = 3, .backedge = 2, .bailouts = 2};
+
+std::shared_ptr<Interpreter> newTiered(const vector<string>& lines, tier::Thresholds t = {}) {
+    auto interpreter = newInterpreter();
+    interpreter->loadProgram(Token::programFromlines(lines));
+    interpreter->setEngine(EngineKind::Tiered);
+    interpreter->setTierThresholds(t);
+    return interpreter;
+}
+
+const vector<string> loop = {
+    "10 LET I = 0",
+    "20 LET S = 0",
+    "30 LET S = S + I * I MOD 7",
+    "40 LET I = I + 1",
+    "50 IF I < 200 THEN 30",
+    "60 PRINT S",
+};
+}
+
+void tiered_test::initTestCase() {
+    qDebug() <<"Init test case\n";
+}
+
+void tiered_test::testMatchesTreeWalker() {
+    const std::map<string, string> inputs = {
+        {"sum_of_1ton.bas", "10\n"},
+        {"sum_of_two.bas", "7\n5\n"},
+        {"factorial.bas", "6\n"},
+        {"even_or_odd.bas", "7\n"},
+        {"is_prime.bas", "67\n"},
+        {"hard1.bas", "100\n"},
+        {"hard2.bas", "100\n"},
+    };
+    size_t checked = 0;
+    for(const auto& entry: std::filesystem::directory_iterator("./programs")) {
+        if(entry.path().extension() != ".bas") {
+            continue;
+        }
+        auto file = entry.path().string();
+        auto input_it = inputs.find(entry.path().filename().string());
+        auto input = input_it == inputs.end() ? string{} : input_it->second;
+        auto tree = newInterpreter();
+        auto tiered = newInterpreter();
+        try {
+            CoutCapture capture;
+            tree->loadFile(file);
+            tiered->setEngine(EngineKind::Tiered);
+            tiered->setTierThresholds(eager);
+            tiered->loadFile(file);
+        } catch (std::exception&) {
+            continue;
+        }
+        // 重新加载不会换回树解释器
+        QVERIFY(tiered->getEngine() == EngineKind::Tiered);
+        auto expected = run(*tree, input);
+        auto actual = run(*tiered, input);
+        QVERIFY2(same(expected, actual), format("{}:\n  tree {}\n  tiered {}", file,
+            describe(expected), describe(actual)).c_str());
+        checked++;
+    }
+    QVERIFY(checked >= 14);
+
+    vector<workload::GenOptions> cases = {
+        {.seed = 51, .lines = 200, .vars = 20},
+        {.seed = 52, .lines = 300, .goto_density = 0.3},
+        {.seed = 53, .lines = 200, .loop_density = 0.2, .loop_trips = 15},
+        {.seed = 54, .lines = 200, .vars = 4, .loop_density = 0.3, .loop_trips = 40},
+    };
+    for(const auto& opt: cases) {
+        auto program = workload::generate(opt);
+        auto expected = runLines(program.lines, EngineKind::TreeWalker);
+        auto tiered = newTiered(program.lines, eager);
+        auto actual = run(*tiered, "");
+        QVERIFY2(same(expected, actual), format("seed {}:\n  tree {}\n  tiered {}", opt.seed,
+            describe(expected), describe(actual)).c_str());
+    }
+}
+
+void tiered_test::testPromotion() {
+    // 只执行一次的程序不编译
+    auto once = newTiered({"10 LET A = 1", "20 LET B = A + 2", "30 PRINT B"});
+    run(*once, "");
+    QCOMPARE(once->getTiers()->getStats().promotions, uint64_t{0});
+    QVERIFY(once->getTiers()->getRegions().empty());
+
+    // 向后跳转100次以后循环体[30, 50]被编译, 之后的循环都不经过树解释器
+    auto hot = newTiered(loop);
+    auto expected = runLines(loop, EngineKind::TreeWalker);
+    auto actual = run(*hot, "");
+    QVERIFY2(same(expected, actual), describe(actual).c_str());
+    const auto& tiers = *hot->getTiers();
+    QCOMPARE(tiers.getStats().promotions, uint64_t{1});
+    QCOMPARE(tiers.getRegions().size(), size_t{1});
+    QCOMPARE(tiers.getRegions().begin()->second.first, 30);
+    QCOMPARE(tiers.getRegions().begin()->second.last, 50);
+    QVERIFY(tiers.tierOf(40) == (jit::available() ? tier::Tier::Native : tier::Tier::Closure));
+    QVERIFY(tiers.tierOf(20) == tier::Tier::Interpreted);
+    QCOMPARE(tiers.getStats().compiled_steps, uint64_t{3 * (200 - 100)});
+
+    // 同一个程序再次运行时直接使用编译好的区域
+    hot->reset(true);
+    actual = run(*hot, "");
+    QVERIFY2(same(expected, actual), describe(actual).c_str());
+    QCOMPARE(tiers.getStats().promotions, uint64_t{1});
+    QCOMPARE(tiers.getStats().compiled_steps, uint64_t{3 * (200 - 100) + 3 * 200});
+
+    // 没有循环的行按执行次数编译
+    auto lines = newTiered({"10 LET A = 1", "20 LET B = A + 2", "30 PRINT B"}, {.line = 2, .backedge = 2});
+    for(int i = 0; i < 3; ++i) {
+        lines->reset(true);
+        run(*lines, "");
+    }
+    QCOMPARE(lines->getTiers()->getRegions().size(), size_t{3});
+    QVERIFY(lines->getTiers()->tierOf(30) == tier::Tier::Closure);
+
+    // 重新加载程序以后重新统计
+    hot->reload(loop);
+    QVERIFY(hot->getEngine() == EngineKind::Tiered);
+    QVERIFY(hot->getTiers()->getRegions().empty());
+}
+
+void tiered_test::testBreakpointDeopt() {
+    auto expected = runLines(loop, EngineKind::TreeWalker);
+    auto interpreter = newTiered(loop, eager);
+    run(*interpreter, "");
+    QVERIFY(interpreter->getTiers()->tierOf(40) != tier::Tier::Interpreted);
+
+    // 在编译好的区域里设置断点: 区域退回树解释器, 断点照常暂停
+    interpreter->reset(true);
+    interpreter->addBreakpoint(40);
+    QVERIFY(interpreter->getTiers()->tierOf(40) == tier::Tier::Interpreted);
+    QCOMPARE(interpreter->getTiers()->getStats().breakpoint_deopts, uint64_t{1});
+    for(int i = 1; i <= 5; ++i) {
+        run(*interpreter, "");
+        auto status = interpreter->getStatus();
+        QCOMPARE(status.current_line, 40);
+        QVERIFY(!status.err_msg.has_value());
+        auto vars = interpreter->getEnv()->getRepl();
+        QVERIFY(std::ranges::find(vars, format("key: I, value: {}", i)) != vars.end());
+        // 断点还在, 热循环也不会再被编译
+        QVERIFY(interpreter->getTiers()->tierOf(40) == tier::Tier::Interpreted);
+    }
+    interpreter->deleteBreakpoint(40);
+    auto actual = run(*interpreter, "");
+    QCOMPARE(actual.vars, expected.vars);
+    QCOMPARE(actual.err, expected.err);
+    // 删除断点以后再次变热
+    QVERIFY(interpreter->getTiers()->tierOf(40) != tier::Tier::Interpreted);
+}
+
+void tiered_test::testTypeDeopt() {
+    // S在第10次循环后变成double, 40行的本机代码从此回退
+    const vector<string> lines = {
+        "10 INPUT D",
+        "20 LET I = 0",
+        "30 LET S = 1",
+        "40 LET S = S + S",
+        "50 LET I = I + 1",
+        "60 IF I = 10 THEN 80",
+        "70 GOTO 90",
+        "80 LET S = D",
+        "90 IF I < 40 THEN 40",
+        "100 PRINT S",
+    };
+    auto expected = runLines(lines, EngineKind::TreeWalker, "0.5\n");
+    auto interpreter = newTiered(lines, eager);
+    auto actual = run(*interpreter, "0.5\n");
+    QVERIFY2(same(expected, actual), format("\n  tree {}\n  tiered {}", describe(expected),
+        describe(actual)).c_str());
+    const auto& tiers = *interpreter->getTiers();
+    QVERIFY(tiers.tierOf(40) == tier::Tier::Closure);
+    if(jit::available()) {
+        QCOMPARE(tiers.getStats().type_deopts, uint64_t{1});
+    }
+    // 再次运行时不再尝试本机代码
+    interpreter->reset(true);
+    actual = run(*interpreter, "0.5\n");
+    QVERIFY2(same(expected, actual), describe(actual).c_str());
+    QVERIFY(tiers.tierOf(40) == tier::Tier::Closure);
+}
+
+void tiered_test::cleanupTestCase() {
+}
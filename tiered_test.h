@@ -0,0 +1,25 @@
+//
+// Created by ayanami on 12/29/24.
+//
+#pragma once
+#ifndef TIERED_TEST_H
+#define TIERED_TEST_H
+
+#include <QTest>
+#include <QObject>
+
+class tiered_test: public QObject{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void testMatchesTreeWalker();
+    void testPromotion();
+    void testBreakpointDeopt();
+    void testTypeDeopt();
+    void cleanupTestCase();
+};
+
+
+
+#endif //TIERED_TEST_H
@@ -247,7 +247,6 @@ private:
     std::vector<TokenLine> token_lines;
     const std::map<TokenType, std::regex> regex_table;
     BasicProgram src_program;
-    [[nodiscard]] std::vector<Token> read_line(const std::string& line) const;
     int line_offset; // multi line 的 offset
     int inline_offset; // single line 的 offset
 public:
@@ -277,7 +276,13 @@ public:
         resetAll();
         tokenize(std::move(p));
     }
-    // for test
+    // 只记录源码, 不做tokenize(程序由编译好的镜像提供)
+    void setSource(BasicProgram&& p) {
+        resetAll();
+        src_program = std::move(p);
+    }
+    // for test & benchmark
+    [[nodiscard]] std::vector<Token> read_line(const std::string& line) const;
     [[nodiscard]] std::vector<TokenLine> read_lines(const std::vector<std::string>& lines);
     [[nodiscard]] auto get_token_lines() const { return token_lines; }
     [[nodiscard]] auto get_single_line() const { return token_lines[line_offset]; }
@@ -0,0 +1,171 @@
+//
+// Created by ayanami on 12/30/24.
+//
+
+#include "type_infer.h"
+
+namespace type_infer {
+using Token::TokenType;
+
+namespace {
+
+ASTNode* unwrap(ASTNode* stmt) {
+    if(stmt != nullptr && stmt->type() == ASTNodeType::FusedStmt) {
+        return static_cast<FusedStmtNode*>(stmt)->getOriginal();
+    }
+    return stmt;
+}
+
+// 语句里的表达式(LET的右边, IF的条件, PRINT的参数, 单独一行的表达式)
+ASTNode* exprOf(ASTNode* stmt) {
+    switch(stmt->type()) {
+    case ASTNodeType::AssignStmt:
+        return static_cast<AssignStmtNode*>(stmt)->getRight();
+    case ASTNodeType::IFStmt:
+        return static_cast<IFStmtNode*>(stmt)->getCond();
+    case ASTNodeType::PrintStmt:
+        return static_cast<PrintStmtNode*>(stmt)->getExpr();
+    case ASTNodeType::BinOp:
+    case ASTNodeType::UnaryOp:
+    case ASTNodeType::Num:
+    case ASTNodeType::String:
+    case ASTNodeType::Var:
+        return stmt;
+    default:
+        return nullptr;
+    }
+}
+
+StaticType binOpType(StaticType left, StaticType right, TokenType op) {
+    if(left == StaticType::Unknown || right == StaticType::Unknown) {
+        return StaticType::Unknown;
+    }
+    if(left == StaticType::Dynamic || right == StaticType::Dynamic) {
+        return StaticType::Dynamic;
+    }
+    if(left != right || left == StaticType::String) {
+        return StaticType::Unknown; // type unmatched / 字符串不支持运算
+    }
+    if(left == StaticType::Double && op == TokenType::OP_MOD) {
+        return StaticType::Unknown;
+    }
+    return left;
+}
+
+StaticType unaryOpType(StaticType expr) {
+    return expr == StaticType::String ? StaticType::Unknown : expr;
+}
+
+// 标注node为根的表达式, 返回它的类型
+StaticType annotateExpr(ASTNode* node, const VarTypes& vars) {
+    auto type = StaticType::Dynamic;
+    switch(node->type()) {
+    case ASTNodeType::BinOp: {
+        auto bin = static_cast<BinOpNode*>(node);
+        auto left = annotateExpr(bin->getLeft(), vars);
+        auto right = annotateExpr(bin->getRight(), vars);
+        type = binOpType(left, right, bin->getOp());
+        break;
+    }
+    case ASTNodeType::UnaryOp:
+        type = unaryOpType(annotateExpr(static_cast<UnaryOpNode*>(node)->getExpr(), vars));
+        break;
+    default:
+        type = exprType(node, vars);
+        break;
+    }
+    node->setStaticType(type);
+    return type;
+}
+
+void clearExpr(ASTNode* node) {
+    node->setStaticType(StaticType::Dynamic);
+    if(node->type() == ASTNodeType::BinOp) {
+        clearExpr(static_cast<BinOpNode*>(node)->getLeft());
+        clearExpr(static_cast<BinOpNode*>(node)->getRight());
+    } else if(node->type() == ASTNodeType::UnaryOp) {
+        clearExpr(static_cast<UnaryOpNode*>(node)->getExpr());
+    }
+}
+
+} // namespace
+
+StaticType join(StaticType a, StaticType b) {
+    if(a == StaticType::Unknown) {
+        return b;
+    }
+    if(b == StaticType::Unknown || a == b) {
+        return a;
+    }
+    return StaticType::Dynamic;
+}
+
+StaticType exprType(ASTNode* node, const VarTypes& vars) {
+    switch(node->type()) {
+    case ASTNodeType::Num:
+        return node->getValRef().type() == typeid(int) ? StaticType::Int : StaticType::Double;
+    case ASTNodeType::String:
+        return StaticType::String;
+    case ASTNodeType::Var: {
+        auto it = vars.find(static_cast<VarNode*>(node)->getName());
+        return it == vars.end() ? StaticType::Unknown : it->second;
+    }
+    case ASTNodeType::BinOp: {
+        auto bin = static_cast<BinOpNode*>(node);
+        return binOpType(exprType(bin->getLeft(), vars), exprType(bin->getRight(), vars), bin->getOp());
+    }
+    case ASTNodeType::UnaryOp:
+        return unaryOpType(exprType(static_cast<UnaryOpNode*>(node)->getExpr(), vars));
+    default:
+        return StaticType::Dynamic;
+    }
+}
+
+VarTypes inferVars(const std::map<int, ASTNode*>& stmts) {
+    VarTypes vars;
+    // 从Unknown开始单调上升, 格的高度是3, 最多迭代几轮
+    bool changed = true;
+    while(changed) {
+        changed = false;
+        for(const auto& [line, s]: stmts) {
+            auto stmt = unwrap(s);
+            string name;
+            auto type = StaticType::Unknown;
+            if(stmt->type() == ASTNodeType::AssignStmt) {
+                auto assign = static_cast<AssignStmtNode*>(stmt);
+                name = assign->getLeft()->getName();
+                type = exprType(assign->getRight(), vars);
+            } else if(stmt->type() == ASTNodeType::InputStmt) {
+                name = static_cast<InputStmtNode*>(stmt)->getVar()->getName();
+                type = StaticType::Dynamic;
+            } else {
+                continue;
+            }
+            auto& var = vars[name];
+            if(auto joined = join(var, type); joined != var) {
+                var = joined;
+                changed = true;
+            }
+        }
+    }
+    return vars;
+}
+
+void annotate(const std::map<int, ASTNode*>& stmts) {
+    const auto vars = inferVars(stmts);
+    for(const auto& [line, s]: stmts) {
+        if(auto expr = exprOf(unwrap(s))) {
+            annotateExpr(expr, vars);
+        }
+    }
+}
+
+void clear(const std::map<int, ASTNode*>& stmts) {
+    for(const auto& [line, s]: stmts) {
+        if(auto expr = exprOf(unwrap(s))) {
+            clearExpr(expr);
+        }
+    }
+}
+
+} // namespace type_infer
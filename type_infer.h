@@ -0,0 +1,37 @@
+//
+// Created by ayanami on 12/30/24.
+//
+// 类型推导: 不考虑控制流, 一个变量的类型是所有给它赋值的表达式的类型的并
+// - 字面量: 整数是Int, 字符串是String
+// - LET X = e: X至少是e的类型; INPUT X: 可能得到int/double/string, X是Dynamic
+// - 二元/一元运算: 操作数都是Int(Double)时是Int(Double), 比较也一样; 其余组合在运行时报错, 是Unknown
+// 结果写到每个表达式节点上(ASTNode::setStaticType), 树解释器对Int的表达式走不检查类型的路径
+// 环境只会被程序自己的LET/INPUT修改, 所以推导出的类型在运行时成立;
+// 从外部换进来的Env(Interpreter::setEnv)由读变量时的检查兜底
+//
+#pragma once
+#ifndef TYPE_INFER_H
+#define TYPE_INFER_H
+
+#include <map>
+#include <string>
+#include "parser.h"
+
+namespace type_infer {
+
+using VarTypes = std::map<string, StaticType>;
+
+// Unknown是最小元, Dynamic是最大元, 两个不同的具体类型的并是Dynamic
+StaticType join(StaticType a, StaticType b);
+// 程序中出现过的每个变量的类型; 只被读过的变量是Unknown
+VarTypes inferVars(const std::map<int, ASTNode*>& stmts);
+// 给定变量类型时表达式的类型
+StaticType exprType(ASTNode* node, const VarTypes& vars);
+// 推导并标注每条语句里的表达式节点
+void annotate(const std::map<int, ASTNode*>& stmts);
+// 所有表达式节点恢复成Dynamic
+void clear(const std::map<int, ASTNode*>& stmts);
+
+} // namespace type_infer
+
+#endif // TYPE_INFER_H
@@ -0,0 +1,143 @@
+//
+// Created by ayanami on 12/30/24.
+//
+
+#include "type_infer_test.h"
+#include "tokenizer.h"
+#include "parser.h"
+#include "interpreter.h"
+#include "type_infer.h"
+#include "workload_gen.h"
+#include "engine_test_util.h"
+using std::vector;
+using std::string;
+using fmt::format;
+using namespace engine_test;
+
+namespace {
+RunResult runTyped(const vector<string>& lines, bool typed, const string& input = "") {
+    auto interpreter = newInterpreter();
+    interpreter->setTypeInference(typed);
+    interpreter->loadProgram(Token::programFromlines(lines));
+    return run(*interpreter, input);
+}
+}
+
+void type_infer_test::initTestCase() {
+    qDebug() <<"Init test case\n";
+}
+
+void type_infer_test::testInference() {
+    auto tokenizer = std::make_shared<Token::Tokenizer>();
+    Parser parser(tokenizer);
+    parser.reload(vector<string>{
+        "10 LET I = 0",
+        "20 LET S = \"s\"",
+        "30 INPUT N",
+        "40 LET J = I * 2 - -I",
+        "50 LET K = J + N",
+        "60 LET M = S + 1",
+        "70 LET J = J MOD 3",
+        "80 IF I < 10 THEN 40",
+        "90 PRINT U + 1",
+    });
+    auto vars = type_infer::inferVars(parser.getStmts());
+    QVERIFY(vars.at("I") == StaticType::Int);
+    QVERIFY(vars.at("J") == StaticType::Int);
+    QVERIFY(vars.at("S") == StaticType::String);
+    QVERIFY(vars.at("N") == StaticType::Dynamic);
+    QVERIFY(vars.at("K") == StaticType::Dynamic);
+    // 一定会失败的表达式(字符串运算)不给变量带来类型
+    QVERIFY(vars.at("M") == StaticType::Unknown);
+    QVERIFY(!vars.contains("U"));
+    QVERIFY(type_infer::join(StaticType::Int, StaticType::String) == StaticType::Dynamic);
+    QVERIFY(type_infer::join(StaticType::Unknown, StaticType::Int) == StaticType::Int);
+
+    // 每个表达式节点都有标注
+    const auto& stmts = parser.getStmts();
+    auto j = static_cast<AssignStmtNode*>(stmts.at(40))->getRight();
+    QVERIFY(j->getStaticType() == StaticType::Int);
+    QVERIFY(static_cast<BinOpNode*>(j)->getRight()->getStaticType() == StaticType::Int);
+    QVERIFY(static_cast<AssignStmtNode*>(stmts.at(50))->getRight()->getStaticType() == StaticType::Dynamic);
+    QVERIFY(static_cast<IFStmtNode*>(stmts.at(80))->getCond()->getStaticType() == StaticType::Int);
+    QVERIFY(static_cast<PrintStmtNode*>(stmts.at(90))->getExpr()->getStaticType() == StaticType::Unknown);
+
+    // 关闭后全部回到通用路径; 融合不影响标注
+    parser.setFusion(true);
+    parser.setTypeInference(false);
+    QVERIFY(j->getStaticType() == StaticType::Dynamic);
+    parser.setTypeInference(true);
+    QVERIFY(j->getStaticType() == StaticType::Int);
+    parser.setFusion(false);
+}
+
+// 特化路径的输出, 错误和计数器和通用路径一致
+void type_infer_test::testMatchesUntyped() {
+    for(const auto& entry: std::filesystem::directory_iterator("./programs")) {
+        if(entry.path().extension() != ".bas") {
+            continue;
+        }
+        auto typed = newInterpreter();
+        auto untyped = newInterpreter();
+        untyped->setTypeInference(false);
+        try {
+            CoutCapture capture;
+            typed->loadFile(entry.path());
+            untyped->loadFile(entry.path());
+        } catch (std::exception&) {
+            continue;
+        }
+        auto expected = run(*untyped, "10\n7\n");
+        auto actual = run(*typed, "10\n7\n");
+        QVERIFY2(same(expected, actual), format("{}:\n  untyped {}\n  typed {}", entry.path().string(),
+            describe(expected), describe(actual)).c_str());
+    }
+    vector<workload::GenOptions> cases = {
+        {.seed = 61, .lines = 200, .vars = 20},
+        {.seed = 62, .lines = 200, .expr_depth = 6, .vars = 5},
+        {.seed = 63, .lines = 300, .goto_density = 0.3},
+        {.seed = 64, .lines = 200, .loop_density = 0.2, .loop_trips = 15},
+    };
+    for(const auto& opt: cases) {
+        auto program = workload::generate(opt);
+        auto expected = runTyped(program.lines, false);
+        auto actual = runTyped(program.lines, true);
+        QVERIFY2(same(expected, actual), format("seed {}:\n  untyped {}\n  typed {}", opt.seed,
+            describe(expected), describe(actual)).c_str());
+    }
+}
+
+// 特化路径失败时按通用路径重新求值, 报告同样的错误
+void type_infer_test::testFallback() {
+    const vector<vector<string>> programs = {
+        {"10 LET A = 5", "20 LET B = 0", "30 LET C = A + A / B"},
+        {"10 LET A = 5", "20 LET B = 0", "30 IF A MOD B THEN 10"},
+        {"10 LET A = 5", "20 PRINT A * UNDEFINED + 1"},
+        {"10 LET A = 2", "20 LET B = UNDEFINED ** (A / 0)"},
+        {"10 LET A = 5", "20 GOTO 40", "30 LET B = 1", "40 PRINT A + B"},
+    };
+    for(const auto& lines: programs) {
+        auto expected = runTyped(lines, false);
+        auto actual = runTyped(lines, true);
+        QVERIFY2(!actual.err.empty(), describe(actual).c_str());
+        QVERIFY2(same(expected, actual), format("\n  untyped {}\n  typed {}", describe(expected),
+            describe(actual)).c_str());
+    }
+
+    // 从外部换进来的Env里变量的类型和推导的不一样: 读变量时发现, 按通用路径报告类型不匹配
+    const vector<string> lines = {"10 LET B = A + 1", "20 LET A = 1"};
+    vector<RunResult> results;
+    for(const bool typed: {false, true}) {
+        auto interpreter = newInterpreter();
+        interpreter->setTypeInference(typed);
+        interpreter->loadProgram(Token::programFromlines(lines));
+        interpreter->getEnv()->symbol_table->set("A", 1.5);
+        results.push_back(run(*interpreter, ""));
+    }
+    QVERIFY2(results[0].err.find("type unmatched") != string::npos, describe(results[0]).c_str());
+    QVERIFY2(same(results[0], results[1]), format("\n  untyped {}\n  typed {}", describe(results[0]),
+        describe(results[1])).c_str());
+}
+
+void type_infer_test::cleanupTestCase() {
+}
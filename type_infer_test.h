@@ -0,0 +1,24 @@
+//
+// Created by ayanami on 12/30/24.
+//
+#pragma once
+#ifndef TYPE_INFER_TEST_H
+#define TYPE_INFER_TEST_H
+
+#include <QTest>
+#include <QObject>
+
+class type_infer_test: public QObject{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+    void testInference();
+    void testMatchesUntyped();
+    void testFallback();
+    void cleanupTestCase();
+};
+
+
+
+#endif //TYPE_INFER_TEST_H
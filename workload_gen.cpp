@@ -0,0 +1,415 @@
+//
+// Created by ayanami on 12/22/24.
+//
+
+#include "workload_gen.h"
+
+#include <cmath>
+#include <stdexcept>
+#include <fmt/core.h>
+
+namespace workload {
+namespace {
+using Token::TokenType;
+
+// splitmix64: 输出只由seed决定, std::uniform_int_distribution 在不同标准库上结果不同
+class Rng {
+    uint64_t state;
+public:
+    explicit Rng(uint64_t seed): state(seed) {}
+    uint64_t next() {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    // [0, n)
+    size_t below(size_t n) {
+        return n == 0 ? 0 : static_cast<size_t>(next() % n);
+    }
+    // [lo, hi]
+    int between(int lo, int hi) {
+        return lo + static_cast<int>(below(static_cast<size_t>(hi - lo) + 1));
+    }
+    bool chance(double p) {
+        return static_cast<double>(next() >> 11) * 0x1.0p-53 < p;
+    }
+};
+
+// 表达式按后缀序保存, 既用来生成源码, 也用来模拟执行
+using ExprItem = struct ExprItem {
+    enum class Kind { Num, Var, Neg, Bin } kind;
+    int value = 0; // Num: 常量, Var: 变量下标
+    TokenType op = TokenType::UNKNOWN;
+};
+using Expr = std::vector<ExprItem>;
+
+enum class StmtKind { Let, Print, Goto, If, Rem, End };
+using Stmt = struct Stmt {
+    StmtKind kind;
+    int var = -1;          // Let
+    Expr expr;             // Let / Print / If 左侧
+    TokenType cmp = TokenType::UNKNOWN;
+    Expr rhs;              // If 右侧
+    size_t target = 0;     // Goto / If: 目标语句下标
+    size_t span = 0;       // 向前跳转的距离, 解析目标之前暂存
+    size_t region = 0;     // 0: 顶层, k: 第k个循环
+    std::string comment;   // Rem
+};
+
+// tk2Str 是给调试看的(== / OP_MOD), 这里要能被tokenizer读回去
+std::string opText(TokenType op) {
+    switch(op) {
+    case TokenType::OP_EQ: return "=";
+    case TokenType::OP_MOD: return "MOD";
+    default: return Token::tk2Str(op);
+    }
+}
+
+// 所有非计数器的值都在(-1000, 1000)内, 乘法结果不超过1e6
+constexpr int WRAP = 997;
+
+Expr num(int v) {
+    return {{ExprItem::Kind::Num, v}};
+}
+Expr var(int idx) {
+    return {{ExprItem::Kind::Var, idx}};
+}
+void append(Expr& dst, const Expr& src) {
+    dst.insert(dst.end(), src.begin(), src.end());
+}
+void pushBin(Expr& e, TokenType op) {
+    e.push_back({ExprItem::Kind::Bin, 0, op});
+}
+
+class Generator {
+    const GenOptions& opt;
+    Rng rng;
+    std::vector<std::string> names;
+    std::vector<Stmt> stmts;
+    std::vector<size_t> region_end; // 每个区域内向前跳转的最远目标
+public:
+    explicit Generator(const GenOptions& o): opt(o), rng(o.seed) {}
+
+    GeneratedProgram run() {
+        if(opt.vars == 0) {
+            throw std::runtime_error("generate: vars must be positive");
+        }
+        if(opt.lines < opt.vars + 1) {
+            throw std::runtime_error(fmt::format("generate: {} lines can't hold {} vars and END",
+                                                 opt.lines, opt.vars));
+        }
+        for(size_t i = 0; i < opt.vars; ++i) {
+            names.push_back(fmt::format("v{}", i));
+            stmts.push_back({.kind = StmtKind::Let, .var = static_cast<int>(i), .expr = num(rng.between(0, 99))});
+        }
+        region_end.push_back(0);
+        size_t remaining = opt.lines - opt.vars - 1;
+        size_t loops = 0;
+        while(remaining > 0) {
+            // 循环至少要: 计数器清零, 1条循环体, 自增, 回跳
+            if(remaining >= 4 && opt.loop_trips > 0 && rng.chance(opt.loop_density)) {
+                size_t body = 1 + rng.below(std::min(std::max<size_t>(opt.loop_body, 1), remaining - 3));
+                emitLoop(loops++, body);
+                remaining -= body + 3;
+            } else {
+                emitSimple(0);
+                remaining--;
+            }
+        }
+        stmts.push_back({.kind = StmtKind::End});
+        region_end[0] = stmts.size() - 1;
+        resolveJumps();
+
+        GeneratedProgram program;
+        auto line_nos = assignLineNos();
+        for(size_t i = 0; i < stmts.size(); ++i) {
+            program.lines.push_back(fmt::format("{} {}", line_nos[i], render(stmts[i], line_nos)));
+        }
+        simulate(program);
+        return program;
+    }
+
+private:
+    Expr leaf() {
+        auto v = static_cast<int>(rng.below(opt.vars));
+        auto roll = rng.below(20);
+        if(roll < 14) {
+            return var(v);
+        }
+        if(roll < 19) {
+            return num(rng.between(0, 99));
+        }
+        Expr e = var(v);
+        e.push_back({ExprItem::Kind::Neg});
+        return e;
+    }
+
+    // 左子树一定是depth - 1层, 保证整个表达式正好depth层
+    Expr genExpr(size_t depth) {
+        if(depth == 0) {
+            return leaf();
+        }
+        Expr e = genExpr(depth - 1);
+        switch(rng.below(8)) {
+        case 0:
+        case 1:
+            append(e, genExpr(rng.below(depth)));
+            pushBin(e, TokenType::OP_ADD);
+            break;
+        case 2:
+            append(e, genExpr(rng.below(depth)));
+            pushBin(e, TokenType::OP_SUB);
+            break;
+        case 3:
+        case 4:
+            append(e, genExpr(rng.below(depth)));
+            pushBin(e, TokenType::OP_MUL);
+            break;
+        case 5:
+            append(e, num(rng.between(1, 9)));
+            pushBin(e, TokenType::OP_DIV);
+            return e;
+        case 6:
+            append(e, num(rng.between(2, 97)));
+            pushBin(e, TokenType::OP_MOD);
+            return e;
+        default:
+            append(e, num(31));
+            pushBin(e, TokenType::OP_MOD);
+            append(e, num(2));
+            pushBin(e, TokenType::OP_POW);
+            return e;
+        }
+        // + - * 的结果取模, 防止逐层放大
+        append(e, num(WRAP));
+        pushBin(e, TokenType::OP_MOD);
+        return e;
+    }
+
+    TokenType randomCmp() {
+        static const TokenType cmps[] = {
+            TokenType::OP_LT, TokenType::OP_GT, TokenType::OP_EQ, TokenType::OP_LE, TokenType::OP_GE,
+        };
+        return cmps[rng.below(std::size(cmps))];
+    }
+
+    void emitSimple(size_t region) {
+        if(rng.chance(opt.goto_density)) {
+            size_t span = 1 + rng.below(8);
+            if(rng.chance(0.5)) {
+                stmts.push_back({.kind = StmtKind::Goto, .span = span, .region = region});
+            } else {
+                size_t depth = std::min<size_t>(opt.expr_depth, 2);
+                stmts.push_back({.kind = StmtKind::If, .expr = genExpr(depth), .cmp = randomCmp(),
+                                 .rhs = genExpr(rng.below(depth + 1)), .span = span, .region = region});
+            }
+            return;
+        }
+        if(rng.chance(opt.rem_density)) {
+            stmts.push_back({.kind = StmtKind::Rem, .region = region,
+                             .comment = fmt::format("block {}", stmts.size())});
+            return;
+        }
+        if(rng.chance(opt.print_density)) {
+            stmts.push_back({.kind = StmtKind::Print, .expr = genExpr(std::min<size_t>(opt.expr_depth, 2)),
+                             .region = region});
+            return;
+        }
+        stmts.push_back({.kind = StmtKind::Let, .var = static_cast<int>(rng.below(opt.vars)),
+                         .expr = genExpr(opt.expr_depth), .region = region});
+    }
+
+    // LET i = 0 (顶层) / body... / LET i = i + 1 / IF i < trips THEN body
+    void emitLoop(size_t loop_id, size_t body) {
+        auto counter = static_cast<int>(names.size());
+        names.push_back(fmt::format("i{}", loop_id));
+        stmts.push_back({.kind = StmtKind::Let, .var = counter, .expr = num(0)});
+        size_t region = region_end.size();
+        region_end.push_back(0);
+        size_t head = stmts.size();
+        for(size_t i = 0; i < body; ++i) {
+            emitSimple(region);
+        }
+        Expr inc = var(counter);
+        append(inc, num(1));
+        pushBin(inc, TokenType::OP_ADD);
+        region_end[region] = stmts.size();
+        stmts.push_back({.kind = StmtKind::Let, .var = counter, .expr = inc, .region = region});
+        stmts.push_back({.kind = StmtKind::If, .expr = var(counter), .cmp = TokenType::OP_LT,
+                         .rhs = num(opt.loop_trips), .target = head, .region = region});
+    }
+
+    // 顶层的跳转不能跳进循环体(会跳过计数器清零), 循环体内的跳转最远跳到自增语句
+    void resolveJumps() {
+        for(size_t i = 0; i < stmts.size(); ++i) {
+            auto& s = stmts[i];
+            if(s.span == 0) {
+                continue;
+            }
+            size_t target = std::min(i + s.span, region_end[s.region]);
+            if(s.region == 0) {
+                while(stmts[target].region != 0) {
+                    target++;
+                }
+            }
+            s.target = target;
+        }
+    }
+
+    std::vector<int> assignLineNos() {
+        const size_t n = stmts.size();
+        int max_line_no = opt.max_line_no > 0 ? opt.max_line_no : static_cast<int>(std::min<size_t>(
+            n * 10, Token::MAX_LINE_NO - 1));
+        max_line_no = std::min(max_line_no, Token::MAX_LINE_NO - 1);
+        if(static_cast<size_t>(max_line_no) < n) {
+            throw std::runtime_error(fmt::format("generate: {} lines don't fit in line numbers up to {}",
+                                                 n, max_line_no));
+        }
+        // 每条语句占一个等宽的区间, 在区间内随机取行号
+        const auto step = static_cast<size_t>(max_line_no) / n;
+        std::vector<int> line_nos(n);
+        for(size_t i = 0; i < n; ++i) {
+            line_nos[i] = static_cast<int>(i * step + 1 + rng.below(step));
+        }
+        return line_nos;
+    }
+
+    std::string render(const Expr& e) const {
+        std::vector<std::string> st;
+        for(const auto& item: e) {
+            switch(item.kind) {
+            case ExprItem::Kind::Num:
+                st.push_back(std::to_string(item.value));
+                break;
+            case ExprItem::Kind::Var:
+                st.push_back(names[item.value]);
+                break;
+            case ExprItem::Kind::Neg:
+                st.back() = "(-" + st.back() + ")";
+                break;
+            case ExprItem::Kind::Bin: {
+                auto r = std::move(st.back());
+                st.pop_back();
+                st.back() = fmt::format("({} {} {})", st.back(), opText(item.op), r);
+                break;
+            }
+            }
+        }
+        return st.back();
+    }
+
+    std::string render(const Stmt& s, const std::vector<int>& line_nos) const {
+        switch(s.kind) {
+        case StmtKind::Let:
+            return fmt::format("LET {} = {}", names[s.var], render(s.expr));
+        case StmtKind::Print:
+            return fmt::format("PRINT {}", render(s.expr));
+        case StmtKind::Goto:
+            return fmt::format("GOTO {}", line_nos[s.target]);
+        case StmtKind::If:
+            return fmt::format("IF {} {} {} THEN {}", render(s.expr), opText(s.cmp), render(s.rhs),
+                               line_nos[s.target]);
+        case StmtKind::Rem:
+            return fmt::format("REM {}", s.comment);
+        case StmtKind::End:
+            return "END";
+        }
+        throw std::runtime_error("generate: Should not reach here");
+    }
+
+    // 和解释器的int语义一致: 除法截断, MOD的符号跟随除数, 乘方经过double
+    static int apply(TokenType op, int l, int r) {
+        switch(op) {
+        case TokenType::OP_ADD: return l + r;
+        case TokenType::OP_SUB: return l - r;
+        case TokenType::OP_MUL: return l * r;
+        case TokenType::OP_DIV: return l / r;
+        case TokenType::OP_MOD: {
+            int m = l % r;
+            if((m > 0 && r < 0) || (m < 0 && r > 0)) {
+                m += r;
+            }
+            return m;
+        }
+        case TokenType::OP_POW: return static_cast<int>(std::pow(l, r));
+        case TokenType::OP_LT: return l < r;
+        case TokenType::OP_GT: return l > r;
+        case TokenType::OP_EQ: return l == r;
+        case TokenType::OP_LE: return l <= r;
+        case TokenType::OP_GE: return l >= r;
+        default:
+            throw std::runtime_error("generate: unexpected operator");
+        }
+    }
+
+    static int eval(const Expr& e, const std::vector<int>& values) {
+        std::vector<int> st;
+        for(const auto& item: e) {
+            switch(item.kind) {
+            case ExprItem::Kind::Num:
+                st.push_back(item.value);
+                break;
+            case ExprItem::Kind::Var:
+                st.push_back(values[item.value]);
+                break;
+            case ExprItem::Kind::Neg:
+                st.back() = -st.back();
+                break;
+            case ExprItem::Kind::Bin: {
+                int r = st.back();
+                st.pop_back();
+                st.back() = apply(item.op, st.back(), r);
+                break;
+            }
+            }
+        }
+        return st.back();
+    }
+
+    void simulate(GeneratedProgram& program) const {
+        std::vector<int> values(names.size(), 0);
+        std::vector<bool> defined(names.size(), false);
+        size_t pc = 0;
+        while(pc < stmts.size()) {
+            const auto& s = stmts[pc];
+            program.executed_statements++;
+            size_t next = pc + 1;
+            switch(s.kind) {
+            case StmtKind::Let:
+                values[s.var] = eval(s.expr, values);
+                defined[s.var] = true;
+                break;
+            case StmtKind::Print:
+                program.expected_output.push_back(std::to_string(eval(s.expr, values)));
+                break;
+            case StmtKind::Goto:
+                next = s.target;
+                break;
+            case StmtKind::If:
+                if(apply(s.cmp, eval(s.expr, values), eval(s.rhs, values))) {
+                    next = s.target;
+                }
+                break;
+            case StmtKind::Rem:
+                break;
+            case StmtKind::End:
+                next = stmts.size();
+                break;
+            }
+            pc = next;
+        }
+        for(size_t i = 0; i < names.size(); ++i) {
+            if(defined[i]) {
+                program.expected_vars[names[i]] = values[i];
+            }
+        }
+    }
+};
+} // namespace
+
+GeneratedProgram generate(const GenOptions& opt) {
+    return Generator(opt).run();
+}
+
+} // namespace workload
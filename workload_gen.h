@@ -0,0 +1,50 @@
+//
+// Created by ayanami on 12/22/24.
+//
+// 合成BASIC程序生成器, 用于放大规模的benchmark和压力测试
+// programs/下的样例都不到30行, 暴露不出statement存储, tokenizer和符号表的规模问题
+// 生成的程序:
+// - 同一个seed在任何平台上生成完全相同的程序(不依赖std的分布实现)
+// - 一定能正常结束: GOTO/IF只向前跳, 循环由计数器控制
+// - 只用int, 中间结果限制在1e6以内, 除数都是非零常量, 不会溢出或者除零
+// 生成时同时模拟执行, 给出期望的输出, 变量终值和执行的语句数, 作为测试的参照
+//
+#pragma once
+#ifndef WORKLOAD_GEN_H
+#define WORKLOAD_GEN_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include "tokenizer.h"
+
+namespace workload {
+
+using GenOptions = struct GenOptions {
+    uint64_t seed = 1;
+    size_t lines = 100;          // 总行数, 包括变量初始化和最后的END
+    int max_line_no = 0;         // 行号分布在[1, max_line_no], 0表示10 * lines; 最大MAX_LINE_NO - 1
+    size_t expr_depth = 3;       // LET右侧表达式的运算符嵌套深度
+    size_t vars = 10;            // 普通变量个数(v0, v1, ...), 循环计数器(i0, i1, ...)另算
+    double goto_density = 0.05;  // 每条语句是向前GOTO/IF的概率
+    double loop_density = 0.05;  // 每个位置开始一个循环的概率, 循环不嵌套
+    size_t loop_body = 8;        // 循环体的最大语句数
+    int loop_trips = 10;         // 每个循环的迭代次数
+    double print_density = 0.1;  // 每条语句是PRINT的概率
+    double rem_density = 0.02;   // 每条语句是REM的概率
+};
+
+using GeneratedProgram = struct GeneratedProgram {
+    std::vector<std::string> lines;            // "<line_no> <stmt>", 按行号排序
+    std::vector<std::string> expected_output;  // 每条执行到的PRINT的输出
+    std::map<std::string, int> expected_vars;  // 程序结束时已定义的变量
+    uint64_t executed_statements = 0;          // 包括END
+};
+
+// throws: std::runtime_error 参数不合法(行数太少, 行号放不下等)
+GeneratedProgram generate(const GenOptions& opt);
+
+} // namespace workload
+
+#endif // WORKLOAD_GEN_H